@@ -0,0 +1,903 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_CO_HPP
+#define MB_CO_HPP
+
+extern "C"
+{
+#include "mb_tcp_client.h"
+#include "mb_rtu_master.h"
+#include "mb_pdu.h"
+}
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*  C++20 coroutine front end
+ *
+ *  A reactor resumes its tasks on one thread as their exchanges
+ *  complete, RTU exchanges run on a worker thread per bus.
+ */
+
+namespace mb
+{
+
+namespace detail
+{
+
+struct promise_base
+{
+    std::coroutine_handle<> cont;                       /* resumed when the task completes */
+    std::exception_ptr err;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            if (h.promise().cont)
+                return h.promise().cont;
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { err = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base
+{
+    std::optional<T> value;
+
+    void return_value(T v) { value.emplace(std::move(v)); }
+
+    T result()
+    {
+        if (err)
+            std::rethrow_exception(err);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base
+{
+    void return_void() {}
+
+    void result()
+    {
+        if (err)
+            std::rethrow_exception(err);
+    }
+};
+
+}
+
+/* a coroutine that starts when it is awaited */
+template <typename T = void>
+class task
+{
+public:
+    struct promise_type : detail::promise<T>
+    {
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+    {
+        h_.promise().cont = cont;
+        return h_;
+    }
+
+    T await_resume() { return h_.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> h_;
+};
+
+/* a value read from a device, status is the result of the exchange */
+template <typename T>
+struct result
+{
+    ssize_t status = 0;
+    std::span<const T> values;
+
+    bool ok() const { return status >= 0; }
+    explicit operator bool() const { return ok(); }
+};
+
+using clock = std::chrono::steady_clock;
+
+class reactor
+{
+public:
+    using timer_id = std::pair<clock::time_point, unsigned long>;
+    using deadline_fn = std::function<bool(clock::time_point &)>;
+
+    reactor() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), call_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        watch(call_fd_, [this] { run_calls(); });
+    }
+
+    reactor(const reactor &) = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    ~reactor()
+    {
+        close(call_fd_);
+        close(epoll_fd_);
+    }
+
+    /* run a task to completion on the reactor, the reactor owns it */
+    void spawn(task<> t)
+    {
+        num_task_++;
+        start(std::move(t));
+    }
+
+    int num_task() const { return num_task_; }
+
+    /* call on_ready when fd is readable, or by the time deadline returns */
+    int watch(int fd, std::function<void()> on_ready, deadline_fn deadline = {})
+    {
+        struct epoll_event ev = {};
+
+        ev.events = EPOLLIN;
+        ev.data.u64 = source_.size();
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -errno;
+        source_.push_back({fd, std::move(on_ready), std::move(deadline)});
+        return 0;
+    }
+
+    void unwatch(int fd)
+    {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        for (auto &s : source_)
+        {
+            if (s.fd == fd)
+                s = source{-1, {}, {}};
+        }
+    }
+
+    timer_id add_timer(clock::time_point when, std::function<void()> fn)
+    {
+        timer_id id(when, next_timer_++);
+
+        timer_.emplace(id, std::move(fn));
+        return id;
+    }
+
+    void cancel_timer(const timer_id &id) { timer_.erase(id); }
+
+    /* resume a coroutine from the reactor loop */
+    void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+    /* run fn on the reactor thread, may be called from any thread */
+    void call(std::function<void()> fn)
+    {
+        std::lock_guard<std::mutex> lock(call_lock_);
+        uint64_t val = 1;
+
+        call_.push_back(std::move(fn));
+        if (write(call_fd_, &val, sizeof(val)) < 0)
+            return;  /* the counter is already set */
+    }
+
+    int run_once(int timeout_msec)
+    {
+        struct epoll_event ev[16] = {};
+        clock::time_point next = {};
+        clock::time_point when = {};
+        bool found = false;
+        int wait = timeout_msec;
+        int ret = 0;
+
+        if (!ready_.empty())
+            wait = 0;
+        if (!timer_.empty())
+        {
+            next = timer_.begin()->first.first;
+            found = true;
+        }
+        for (auto &s : source_)
+        {
+            if ((s.deadline) && (s.deadline(when)) && ((!found) || (when < next)))
+            {
+                next = when;
+                found = true;
+            }
+        }
+        if (found)
+        {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(next - clock::now()).count();
+            if (left < 0)
+                left = 0;
+            if ((wait < 0) || (wait > left))
+                wait = left;
+        }
+        ret = epoll_wait(epoll_fd_, ev, 16, wait);
+        if ((ret < 0) && (errno != EINTR))
+            return -errno;
+        for (int i = 0; i < ret; i++)
+        {
+            if ((ev[i].data.u64 < source_.size()) && (source_[ev[i].data.u64].on_ready))
+                source_[ev[i].data.u64].on_ready();
+        }
+        for (auto &s : source_)
+        {
+            if ((s.deadline) && (s.deadline(when)) && (when <= clock::now()))
+                s.on_ready();
+        }
+        while ((!timer_.empty()) && (timer_.begin()->first.first <= clock::now()))
+        {
+            auto fn = std::move(timer_.begin()->second);
+
+            timer_.erase(timer_.begin());
+            fn();
+        }
+        while (!ready_.empty())
+        {
+            auto h = ready_.front();
+
+            ready_.pop_front();
+            h.resume();
+        }
+        return 0;
+    }
+
+    /* run until every spawned task has completed */
+    int run()
+    {
+        int ret = 0;
+
+        while (num_task_ > 0)
+        {
+            ret = run_once(-1);
+            if (ret < 0)
+                return ret;
+        }
+        return 0;
+    }
+
+    class sleep_op
+    {
+    public:
+        sleep_op(reactor &r, clock::duration d) : r_(r), d_(d) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            waiter_ = h;
+            timer_ = r_.add_timer(clock::now() + d_, [this] { fired_ = true; r_.post(waiter_); });
+            return true;
+        }
+
+        int await_resume() { return status_; }
+
+        void cancel(int err)
+        {
+            if ((!waiter_) || (fired_) || (status_ != 0))
+                return;
+            r_.cancel_timer(timer_);
+            status_ = err;
+            r_.post(waiter_);
+        }
+
+    private:
+        reactor &r_;
+        clock::duration d_;
+        std::coroutine_handle<> waiter_;
+        timer_id timer_;
+        bool fired_ = false;                            /* the timer has posted the waiter */
+        int status_ = 0;
+    };
+
+    sleep_op sleep_for(clock::duration d) { return sleep_op(*this, d); }
+
+private:
+    struct source
+    {
+        int fd;
+        std::function<void()> on_ready;
+        deadline_fn deadline;
+    };
+
+    struct detached
+    {
+        struct promise_type
+        {
+            detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    detached start(task<> t)
+    {
+        co_await std::move(t);
+        num_task_--;
+    }
+
+    void run_calls()
+    {
+        std::deque<std::function<void()>> call;
+        uint64_t val = 0;
+
+        if (read(call_fd_, &val, sizeof(val)) < 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(call_lock_);
+
+            call.swap(call_);
+        }
+        for (auto &fn : call)
+            fn();
+    }
+
+    int epoll_fd_;
+    int call_fd_;                                       /* signalled when call_ is not empty */
+    std::mutex call_lock_;
+    std::deque<std::function<void()>> call_;            /* functions passed in from other threads */
+    int num_task_ = 0;
+    unsigned long next_timer_ = 0;
+    std::vector<source> source_;
+    std::map<timer_id, std::function<void()>> timer_;
+    std::deque<std::coroutine_handle<>> ready_;
+};
+
+class tcp_client
+{
+public:
+    class exchange_op
+    {
+    public:
+        exchange_op(tcp_client &c, int endpoint, const mb_pdu_t &pdu, uint8_t unit_id, mb_tcp_adu_t &resp) : c_(c), endpoint_(endpoint), resp_(resp)
+        {
+            mb_tcp_adu_set_header(&req_, 0, 0, unit_id);
+            std::memcpy(&req_.pdu, &pdu, sizeof(mb_pdu_t));
+        }
+
+        exchange_op(exchange_op &&other) : c_(other.c_), endpoint_(other.endpoint_), resp_(other.resp_)
+        {
+            std::memcpy(&req_, &other.req_, sizeof(mb_tcp_adu_t));
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            waiter_ = h;
+            return c_.submit(this);
+        }
+
+        ssize_t await_resume() { return status_; }
+
+        void cancel(int err)
+        {
+            if ((!waiter_) || (done_))
+                return;
+            if (handle_ >= 0)
+                mb_tcp_client_cancel(c_.client_, handle_);
+            else
+                c_.queue_.erase(std::find(c_.queue_.begin(), c_.queue_.end(), this));
+            complete(err);
+        }
+
+    protected:
+        friend class tcp_client;
+
+        void complete(ssize_t status)
+        {
+            handle_ = -1;
+            done_ = true;
+            status_ = status;
+            c_.r_.post(waiter_);
+        }
+
+        tcp_client &c_;
+        int endpoint_;
+        mb_tcp_adu_t req_ = {};
+        mb_tcp_adu_t &resp_;
+        std::coroutine_handle<> waiter_;
+        int handle_ = -1;
+        bool done_ = false;
+        ssize_t status_ = 0;
+    };
+
+    /* an exchange whose response is returned as a span of values */
+    template <typename T>
+    class read_op : public exchange_op
+    {
+    public:
+        using exchange_op::exchange_op;
+
+        result<T> await_resume()
+        {
+            result<T> res;
+            const mb_pdu_t *pdu = &resp_.pdu;
+
+            res.status = status_;
+            if (status_ < 0)
+                return res;
+            if (pdu->type != MB_PDU_RESP)
+            {
+                res.status = -EBADMSG;  /* exception response */
+                return res;
+            }
+            if constexpr (sizeof(T) == sizeof(uint16_t))
+                res.values = std::span<const T>(pdu->rd_hold_regs_resp.reg_val, pdu->rd_hold_regs_resp.byte_count / 2);
+            else
+                res.values = std::span<const T>(pdu->rd_coils_resp.coil_stat, pdu->rd_coils_resp.byte_count);
+            return res;
+        }
+    };
+
+    tcp_client(reactor &r, mb_tcp_client_t *client) : r_(r), client_(client)
+    {
+        r_.watch(mb_tcp_client_get_fd(client_), [this] { poll(); }, [this](clock::time_point &when) { return next_deadline(when); });
+    }
+
+    tcp_client(const tcp_client &) = delete;
+    tcp_client &operator=(const tcp_client &) = delete;
+
+    ~tcp_client()
+    {
+        r_.unwatch(mb_tcp_client_get_fd(client_));
+    }
+
+    exchange_op exchange(int endpoint, const mb_pdu_t &pdu, uint8_t unit_id, mb_tcp_adu_t &resp)
+    {
+        return exchange_op(*this, endpoint, pdu, unit_id, resp);
+    }
+
+    /* the holding and input register spans are over resp.pdu */
+    read_op<uint16_t> read_holding(int endpoint, uint8_t unit_id, uint16_t start_addr, uint16_t quant, mb_tcp_adu_t &resp)
+    {
+        mb_pdu_t pdu = {};
+
+        mb_pdu_set_rd_hold_regs_req(&pdu, start_addr, quant);
+        return read_op<uint16_t>(*this, endpoint, pdu, unit_id, resp);
+    }
+
+    read_op<uint16_t> read_input(int endpoint, uint8_t unit_id, uint16_t start_addr, uint16_t quant, mb_tcp_adu_t &resp)
+    {
+        mb_pdu_t pdu = {};
+
+        mb_pdu_set_rd_ip_regs_req(&pdu, start_addr, quant);
+        return read_op<uint16_t>(*this, endpoint, pdu, unit_id, resp);
+    }
+
+    /* the coil span holds the packed coil status bytes */
+    read_op<uint8_t> read_coils(int endpoint, uint8_t unit_id, uint16_t start_addr, uint16_t quant, mb_tcp_adu_t &resp)
+    {
+        mb_pdu_t pdu = {};
+
+        mb_pdu_set_rd_coils_req(&pdu, start_addr, quant);
+        return read_op<uint8_t>(*this, endpoint, pdu, unit_id, resp);
+    }
+
+    mb_tcp_client_t *get() const { return client_; }
+
+private:
+    static void done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp, void *arg)
+    {
+        exchange_op *op = static_cast<exchange_op *>(arg);
+
+        if (resp != nullptr)
+            std::memcpy(&op->resp_, resp, sizeof(mb_tcp_adu_t));
+        op->complete(result);
+    }
+
+    /* returns false if the exchange completed without suspending */
+    bool submit(exchange_op *op)
+    {
+        int ret = 0;
+
+        if (!queue_.empty())
+        {
+            queue_.push_back(op);
+            return true;
+        }
+        ret = mb_tcp_client_submit_endpoint(client_, op->endpoint_, &op->req_, nullptr, done, op);
+        if (ret == -EBUSY)
+        {
+            queue_.push_back(op);  /* wait for a request to complete */
+            return true;
+        }
+        if (ret < 0)
+        {
+            op->done_ = true;
+            op->status_ = ret;
+            return false;
+        }
+        op->handle_ = ret;
+        return true;
+    }
+
+    /* the client clock is CLOCK_MONOTONIC, as is steady_clock */
+    bool next_deadline(clock::time_point &when)
+    {
+        struct timespec ts = {};
+
+        if (!mb_tcp_client_next_deadline(client_, &ts))
+            return false;
+        when = clock::time_point(std::chrono::duration_cast<clock::duration>(std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+        return true;
+    }
+
+    void poll()
+    {
+        struct timeval zero = {};
+        exchange_op *op = nullptr;
+        int ret = 0;
+
+        mb_tcp_client_poll(client_, &zero);
+        while (!queue_.empty())
+        {
+            op = queue_.front();
+            ret = mb_tcp_client_submit_endpoint(client_, op->endpoint_, &op->req_, nullptr, done, op);
+            if (ret == -EBUSY)
+                break;
+            queue_.pop_front();
+            if (ret < 0)
+                op->complete(ret);
+            else
+                op->handle_ = ret;
+        }
+    }
+
+    reactor &r_;
+    mb_tcp_client_t *client_;
+    std::deque<exchange_op *> queue_;                   /* exchanges waiting for the client to have room */
+};
+
+class rtu_master
+{
+public:
+    class exchange_op
+    {
+    public:
+        exchange_op(rtu_master &m, uint8_t addr, const mb_pdu_t &pdu, mb_rtu_adu_t &resp) : m_(m), resp_(resp)
+        {
+            mb_rtu_adu_set_header(&req_, addr);
+            std::memcpy(&req_.pdu, &pdu, sizeof(mb_pdu_t));
+        }
+
+        exchange_op(exchange_op &&other) : m_(other.m_), resp_(other.resp_)
+        {
+            std::memcpy(&req_, &other.req_, sizeof(mb_rtu_adu_t));
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            std::lock_guard<std::mutex> lock(m_.lock_);
+
+            waiter_ = h;
+            m_.queue_.push_back(this);
+            m_.cond_.notify_one();
+            return true;
+        }
+
+        ssize_t await_resume() { return status_; }
+
+        void cancel(int err)
+        {
+            std::lock_guard<std::mutex> lock(m_.lock_);
+
+            if ((!waiter_) || (done_) || (cancel_ != 0))
+                return;
+            cancel_ = err;
+            for (auto it = m_.queue_.begin(); it != m_.queue_.end(); ++it)
+            {
+                if (*it == this)
+                {
+                    /* not started yet */
+                    m_.queue_.erase(it);
+                    done_ = true;
+                    status_ = err;
+                    m_.r_.post(waiter_);
+                    return;
+                }
+            }
+        }
+
+    protected:
+        friend class rtu_master;
+
+        rtu_master &m_;
+        mb_rtu_adu_t req_ = {};
+        mb_rtu_adu_t &resp_;
+        std::coroutine_handle<> waiter_;
+        bool done_ = false;
+        int cancel_ = 0;
+        ssize_t status_ = 0;
+    };
+
+    template <typename T>
+    class read_op : public exchange_op
+    {
+    public:
+        using exchange_op::exchange_op;
+
+        result<T> await_resume()
+        {
+            result<T> res;
+            const mb_pdu_t *pdu = &resp_.pdu;
+
+            res.status = status_;
+            if (status_ < 0)
+                return res;
+            if (pdu->type != MB_PDU_RESP)
+            {
+                res.status = -EBADMSG;  /* exception response */
+                return res;
+            }
+            if constexpr (sizeof(T) == sizeof(uint16_t))
+                res.values = std::span<const T>(pdu->rd_hold_regs_resp.reg_val, pdu->rd_hold_regs_resp.byte_count / 2);
+            else
+                res.values = std::span<const T>(pdu->rd_coils_resp.coil_stat, pdu->rd_coils_resp.byte_count);
+            return res;
+        }
+    };
+
+    rtu_master(reactor &r, mb_rtu_master_t *master) : r_(r), master_(master), efd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        r_.watch(efd_, [this] { collect(); });
+        thread_ = std::thread([this] { work(); });
+    }
+
+    rtu_master(const rtu_master &) = delete;
+    rtu_master &operator=(const rtu_master &) = delete;
+
+    ~rtu_master()
+    {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+
+            stop_ = true;
+            cond_.notify_one();
+        }
+        thread_.join();
+        r_.unwatch(efd_);
+        close(efd_);
+    }
+
+    exchange_op exchange(uint8_t addr, const mb_pdu_t &pdu, mb_rtu_adu_t &resp)
+    {
+        return exchange_op(*this, addr, pdu, resp);
+    }
+
+    read_op<uint16_t> read_holding(uint8_t addr, uint16_t start_addr, uint16_t quant, mb_rtu_adu_t &resp)
+    {
+        mb_pdu_t pdu = {};
+
+        mb_pdu_set_rd_hold_regs_req(&pdu, start_addr, quant);
+        return read_op<uint16_t>(*this, addr, pdu, resp);
+    }
+
+    read_op<uint16_t> read_input(uint8_t addr, uint16_t start_addr, uint16_t quant, mb_rtu_adu_t &resp)
+    {
+        mb_pdu_t pdu = {};
+
+        mb_pdu_set_rd_ip_regs_req(&pdu, start_addr, quant);
+        return read_op<uint16_t>(*this, addr, pdu, resp);
+    }
+
+    read_op<uint8_t> read_coils(uint8_t addr, uint16_t start_addr, uint16_t quant, mb_rtu_adu_t &resp)
+    {
+        mb_pdu_t pdu = {};
+
+        mb_pdu_set_rd_coils_req(&pdu, start_addr, quant);
+        return read_op<uint8_t>(*this, addr, pdu, resp);
+    }
+
+private:
+    /* worker thread, performs the exchanges of the bus one at a time */
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        exchange_op *op = nullptr;
+        uint64_t val = 1;
+        ssize_t ret = 0;
+
+        while (true)
+        {
+            cond_.wait(lock, [this] { return (stop_) || (!queue_.empty()); });
+            if (stop_)
+                return;
+            op = queue_.front();
+            queue_.pop_front();
+            lock.unlock();
+            ret = mb_rtu_master_exchange(master_, &op->req_, &op->resp_);
+            lock.lock();
+            op->status_ = ret;
+            done_.push_back(op);
+            ret = write(efd_, &val, sizeof(val));
+        }
+    }
+
+    /* reactor side, resume the tasks whose exchanges completed */
+    void collect()
+    {
+        std::deque<exchange_op *> done;
+        uint64_t val = 0;
+
+        if (read(efd_, &val, sizeof(val)) < 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+
+            done.swap(done_);
+            for (auto op : done)
+            {
+                op->done_ = true;
+                if (op->cancel_ != 0)
+                    op->status_ = op->cancel_;
+            }
+        }
+        for (auto op : done)
+            r_.post(op->waiter_);
+    }
+
+    reactor &r_;
+    mb_rtu_master_t *master_;
+    int efd_;
+    std::thread thread_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<exchange_op *> queue_;
+    std::deque<exchange_op *> done_;
+    bool stop_ = false;
+};
+
+/* cancel an operation with -ETIMEDOUT if it has not completed after a delay */
+template <typename Op>
+class timeout_op
+{
+public:
+    timeout_op(reactor &r, clock::duration d, Op &&op) : r_(r), d_(d), op_(std::move(op)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        if (!op_.await_suspend(h))
+            return false;
+        timer_ = r_.add_timer(clock::now() + d_, [this] { op_.cancel(-ETIMEDOUT); });
+        armed_ = true;
+        return true;
+    }
+
+    auto await_resume()
+    {
+        if (armed_)
+            r_.cancel_timer(timer_);
+        return op_.await_resume();
+    }
+
+private:
+    reactor &r_;
+    clock::duration d_;
+    Op op_;
+    reactor::timer_id timer_;
+    bool armed_ = false;
+};
+
+template <typename Op>
+timeout_op<Op> with_timeout(reactor &r, clock::duration d, Op &&op)
+{
+    return timeout_op<Op>(r, d, std::move(op));
+}
+
+/* cancel an operation with -ECANCELED when a stop is requested, the cancel is done on the reactor thread */
+template <typename Op>
+class stop_op
+{
+public:
+    stop_op(reactor &r, std::stop_token token, Op &&op) : r_(r), token_(std::move(token)), op_(std::move(op)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        if (!op_.await_suspend(h))
+            return false;
+        live_ = std::make_shared<bool>(true);
+        cb_.emplace(token_, [this, live = live_] { r_.call([this, live] { if (*live) op_.cancel(-ECANCELED); }); });
+        return true;
+    }
+
+    auto await_resume()
+    {
+        cb_.reset();
+        if (live_)
+            *live_ = false;  /* a call still queued on the reactor finds the operation gone */
+        return op_.await_resume();
+    }
+
+private:
+    reactor &r_;
+    std::stop_token token_;
+    Op op_;
+    std::shared_ptr<bool> live_;
+    std::optional<std::stop_callback<std::function<void()>>> cb_;
+};
+
+template <typename Op>
+stop_op<Op> with_stop(reactor &r, std::stop_token token, Op &&op)
+{
+    return stop_op<Op>(r, std::move(token), std::move(op));
+}
+
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_DELTA_H
+#define MB_DELTA_H
+
+#include <stdint.h>
+#include "mb_pdu.h"
+
+/*  change detection
+ *
+ *  Reports the address ranges that changed since the last response,
+ *  with an optional deadband on typed register values.
+ */
+
+#define MB_DELTA_MIN_BLOCK  16
+
+typedef enum
+{
+    MB_DELTA_U16 = 0,
+    MB_DELTA_S16,
+    MB_DELTA_U32,
+    MB_DELTA_S32,
+    MB_DELTA_F32
+}
+mb_delta_type_t;
+
+typedef struct
+{
+    uint16_t start_addr;
+    uint16_t quant;
+}
+mb_delta_range_t;
+
+typedef struct
+{
+    uint16_t offset;                                    /* first register of the value in the block */
+    mb_delta_type_t type;
+    double deadband;
+}
+mb_delta_band_t;
+
+typedef struct
+{
+    uint8_t func_code;
+    uint16_t start_addr;
+    uint16_t quant;
+    int valid;                                          /* val holds a response */
+    uint16_t *val;                                      /* last value of each register or bit */
+    uint8_t *in_band;                                   /* index + 1 of the deadband covering each register, or 0 */
+    mb_delta_band_t *band;
+    int num_band;
+}
+mb_delta_block_t;
+
+typedef struct
+{
+    mb_delta_block_t *block;
+    int num_block;
+    int max_block;
+}
+mb_delta_t;
+
+void mb_delta_create(mb_delta_t *delta);
+void mb_delta_destroy(mb_delta_t *delta);
+int mb_delta_add_block(mb_delta_t *delta, const mb_pdu_t *req);
+int mb_delta_add_deadband(mb_delta_t *delta, int block, uint16_t addr, mb_delta_type_t type, double deadband);
+void mb_delta_reset(mb_delta_t *delta, int block);
+int mb_delta_update(mb_delta_t *delta, int block, const mb_pdu_t *resp, mb_delta_range_t *range, int max_range);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_DISPATCH_H
+#define MB_DISPATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mb_pdu.h"
+
+/*  address range dispatch
+ *
+ *  Requests that span several handlers are split and the responses merged.
+ */
+
+#define MB_DISPATCH_NUM_ADDR  0x10000
+
+typedef enum
+{
+    MB_DISPATCH_COILS = 0,
+    MB_DISPATCH_DISC_IPS,
+    MB_DISPATCH_HOLD_REGS,
+    MB_DISPATCH_IP_REGS
+}
+mb_dispatch_class_t;
+
+typedef int (*mb_dispatch_handler_t)(void *data, mb_pdu_t *req, mb_pdu_t *resp);
+
+typedef struct
+{
+    mb_dispatch_class_t class;
+    uint32_t start_addr;
+    uint32_t end_addr;                                  /* one past the last address */
+    mb_dispatch_handler_t handler;
+    void *data;
+}
+mb_dispatch_entry_t;
+
+typedef struct
+{
+    mb_dispatch_entry_t *entry;
+    size_t num_entry;
+    size_t max_entry;
+    mb_dispatch_handler_t def_handler;
+    void *def_data;
+}
+mb_dispatch_t;
+
+void mb_dispatch_create(mb_dispatch_t *dispatch);
+void mb_dispatch_destroy(mb_dispatch_t *dispatch);
+int mb_dispatch_add(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint32_t quant, mb_dispatch_handler_t handler, void *data);
+void mb_dispatch_set_default(mb_dispatch_t *dispatch, mb_dispatch_handler_t handler, void *data);
+int mb_dispatch_handle(mb_dispatch_t *dispatch, mb_pdu_t *req, mb_pdu_t *resp);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_FANOUT_H
+#define MB_FANOUT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "mb_pdu.h"
+
+/*  result fan-out
+ *
+ *  One publisher and any number of subscribers, each with its own
+ *  cursor into a shared ring. Overwritten records are counted as lost.
+ */
+
+#define MB_FANOUT_MAX_SUB       16
+#define MB_FANOUT_RESP_LEN      (MB_PDU_MAX_DATA_LEN + 1)
+#define MB_FANOUT_BUSY          UINT64_MAX              /* sequence number of a record being written */
+#define MB_FANOUT_CACHE_LINE    64
+
+struct mb_poller;
+
+typedef struct
+{
+    _Atomic uint64_t seq;                               /* sequence number, MB_FANOUT_BUSY while it is written */
+    struct timespec time;                               /* CLOCK_REALTIME when published */
+    int dev;
+    int group;
+    int req;
+    ssize_t result;                                     /* length of the response or a negative errno value */
+    uint64_t pos;                                       /* position of the response in the slab */
+    uint16_t resp_len;                                  /* formatted response PDU, decode with mb_pdu_parse_resp */
+}
+mb_fanout_rec_t;
+
+typedef struct
+{
+    _Alignas(MB_FANOUT_CACHE_LINE) atomic_int used;     /* subscribers do not share cache lines */
+    uint64_t max_lag;
+    _Atomic uint64_t cursor;                            /* next record to read */
+    atomic_ulong num_read;
+    atomic_ulong num_lost;                              /* overwritten before they were read */
+    atomic_ulong num_stale;                             /* overwritten while they were read */
+}
+mb_fanout_sub_t;
+
+typedef struct
+{
+    uint64_t lag;                                       /* records published but not yet read */
+    unsigned long num_read;
+    unsigned long num_lost;
+    unsigned long num_stale;
+    int slow;                                           /* lag is above the max lag */
+}
+mb_fanout_sub_stats_t;
+
+typedef struct
+{
+    mb_fanout_rec_t *rec;
+    unsigned num_rec;                                   /* power of 2 */
+    char *slab;
+    size_t slab_size;
+    uint64_t slab_pos;                                  /* next free position, publisher only */
+    _Atomic uint64_t slab_end;                          /* end of the response being written */
+    _Atomic uint64_t tail;                              /* next record to publish */
+    atomic_uint wake;                                   /* futex word */
+    atomic_uint num_wait;                               /* consumers asleep on the futex */
+    pthread_mutex_t lock;                               /* serialises subscribe and unsubscribe */
+    mb_fanout_sub_t sub[MB_FANOUT_MAX_SUB];
+}
+mb_fanout_t;
+
+int mb_fanout_create(mb_fanout_t *fanout, unsigned num_rec, size_t slab_size);
+void mb_fanout_destroy(mb_fanout_t *fanout);
+int mb_fanout_publish(mb_fanout_t *fanout, int dev, int group, int req, ssize_t result, const char *resp, size_t resp_len);
+void mb_fanout_poller_func(struct mb_poller *poller, int group, int req, ssize_t result, mb_pdu_t *resp, void *arg);
+int mb_fanout_subscribe(mb_fanout_t *fanout, uint64_t max_lag);
+void mb_fanout_unsubscribe(mb_fanout_t *fanout, int sub);
+int mb_fanout_next(mb_fanout_t *fanout, int sub, const mb_fanout_rec_t **rec);
+const char *mb_fanout_resp(mb_fanout_t *fanout, const mb_fanout_rec_t *rec);
+int mb_fanout_release(mb_fanout_t *fanout, int sub);
+int mb_fanout_wait(mb_fanout_t *fanout, int sub, int timeout_msec);
+void mb_fanout_get_sub_stats(mb_fanout_t *fanout, int sub, mb_fanout_sub_stats_t *stats);
+
+#endif
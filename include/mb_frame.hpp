@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_FRAME_HPP
+#define MB_FRAME_HPP
+
+extern "C"
+{
+#include "mb_pdu.h"
+#include "mb_rtu_adu.h"
+#include "mb_tcp_adu.h"
+}
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/*  compile-time request frames
+ *
+ *  e.g. mb::rtu<17, mb::rd_hold_regs<0x100, 10>>::frame
+ *  parse returns 0, the exception code or -EBADMSG
+ */
+
+namespace mb
+{
+
+namespace detail
+{
+
+/* same result as mb_rtu_adu_calc_crc, computed bit by bit so that no table is read in a constant expression */
+template <size_t N>
+constexpr uint16_t crc(const std::array<uint8_t, N> &buf, size_t len)
+{
+    uint16_t crc = 0xffff;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= buf[i];
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return crc;
+}
+
+}
+
+/* read coils, discrete inputs, holding registers or input registers */
+template <uint8_t FuncCode, uint16_t StartAddr, uint16_t Quant, uint16_t MinQuant, uint16_t MaxQuant, uint32_t MaxAddr, bool Bits>
+struct rd_req
+{
+    /* the same checks as the mb_pdu_set_rd_*_req functions */
+    static_assert((Quant >= MinQuant) && (Quant <= MaxQuant), "quantity out of range");
+    static_assert((uint32_t)StartAddr + (uint32_t)Quant <= MaxAddr, "address range past the end of the table");
+
+    static constexpr uint8_t func_code = FuncCode;
+    static constexpr uint16_t start_addr = StartAddr;
+    static constexpr uint16_t quant = Quant;
+    static constexpr size_t byte_count = Bits ? (Quant + 7) / 8 : 2 * Quant;
+    static constexpr size_t resp_len = 2 + byte_count;
+
+    /* bits stay packed, registers are in host byte order */
+    using value_type = std::conditional_t<Bits, uint8_t, uint16_t>;
+    using values_t = std::array<value_type, Bits ? byte_count : Quant>;
+
+    static constexpr std::array<uint8_t, 5> pdu = {FuncCode, StartAddr >> 8, StartAddr & 0xff, Quant >> 8, Quant & 0xff};
+
+    static int parse(const uint8_t *buf, size_t len, values_t &val)
+    {
+        if ((len == 2) && (buf[0] == (FuncCode | 0x80)))
+            return buf[1];
+        if ((len != resp_len) || (buf[0] != FuncCode) || (buf[1] != byte_count))
+            return -EBADMSG;
+        if constexpr (Bits)
+        {
+            std::memcpy(val.data(), buf + 2, byte_count);
+        }
+        else
+        {
+            for (size_t i = 0; i < Quant; i++)
+                val[i] = ((uint16_t)buf[2 + 2 * i] << 8) | buf[3 + 2 * i];
+        }
+        return 0;
+    }
+};
+
+template <uint16_t StartAddr, uint16_t Quant>
+using rd_coils = rd_req<MB_PDU_RD_COILS, StartAddr, Quant, MB_PDU_RD_COILS_MIN_QUANT_COILS, MB_PDU_RD_COILS_MAX_QUANT_COILS, MB_PDU_RD_COILS_MAX_ADDR, true>;
+
+template <uint16_t StartAddr, uint16_t Quant>
+using rd_disc_ips = rd_req<MB_PDU_RD_DISC_IPS, StartAddr, Quant, MB_PDU_RD_DISC_IPS_MIN_QUANT_IPS, MB_PDU_RD_DISC_IPS_MAX_QUANT_IPS, MB_PDU_RD_DISC_IPS_MAX_ADDR, true>;
+
+template <uint16_t StartAddr, uint16_t Quant>
+using rd_hold_regs = rd_req<MB_PDU_RD_HOLD_REGS, StartAddr, Quant, MB_PDU_RD_HOLD_REGS_MIN_QUANT_REGS, MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS, MB_PDU_RD_HOLD_REGS_MAX_ADDR, false>;
+
+template <uint16_t StartAddr, uint16_t Quant>
+using rd_ip_regs = rd_req<MB_PDU_RD_IP_REGS, StartAddr, Quant, MB_PDU_RD_IP_REGS_MIN_QUANT_IP_REGS, MB_PDU_RD_IP_REGS_MAX_QUANT_IP_REGS, MB_PDU_RD_IP_REGS_MAX_ADDR, false>;
+
+/* write a single coil or register, the response echoes the request */
+template <uint8_t FuncCode, uint16_t Addr, uint16_t Val>
+struct wr_sing_req
+{
+    static constexpr uint8_t func_code = FuncCode;
+    static constexpr size_t resp_len = 5;
+
+    using values_t = std::array<uint16_t, 0>;
+
+    static constexpr std::array<uint8_t, 5> pdu = {FuncCode, Addr >> 8, Addr & 0xff, Val >> 8, Val & 0xff};
+
+    static int parse(const uint8_t *buf, size_t len, values_t &)
+    {
+        if ((len == 2) && (buf[0] == (FuncCode | 0x80)))
+            return buf[1];
+        if ((len != resp_len) || (std::memcmp(buf, pdu.data(), resp_len) != 0))
+            return -EBADMSG;
+        return 0;
+    }
+};
+
+template <uint16_t Addr, bool On>
+using wr_sing_coil = wr_sing_req<MB_PDU_WR_SING_COIL, Addr, On ? MB_PDU_WR_SING_COIL_ON_VAL : MB_PDU_WR_SING_COIL_OFF_VAL>;
+
+template <uint16_t Addr, uint16_t Val>
+using wr_sing_reg = wr_sing_req<MB_PDU_WR_SING_REG, Addr, Val>;
+
+/* RTU frame: address, PDU, CRC low byte first */
+template <uint8_t Addr, typename Req>
+struct rtu
+{
+    static_assert((Addr >= MB_RTU_ADU_MIN_UNICAST_ADDR) && (Addr <= MB_RTU_ADU_MAX_UNICAST_ADDR), "slave address out of range");
+
+    using values_t = typename Req::values_t;
+
+    static constexpr size_t resp_len = Req::resp_len + 3;
+
+    static constexpr std::array<uint8_t, Req::pdu.size() + 3> make()
+    {
+        std::array<uint8_t, Req::pdu.size() + 3> buf = {};
+        uint16_t crc = 0;
+
+        buf[0] = Addr;
+        for (size_t i = 0; i < Req::pdu.size(); i++)
+            buf[1 + i] = Req::pdu[i];
+        crc = detail::crc(buf, Req::pdu.size() + 1);
+        buf[Req::pdu.size() + 1] = (uint8_t)crc;
+        buf[Req::pdu.size() + 2] = (uint8_t)(crc >> 8);
+        return buf;
+    }
+
+    static constexpr std::array<uint8_t, Req::pdu.size() + 3> frame = make();
+
+    static int parse(const uint8_t *buf, size_t len, values_t &val)
+    {
+        if ((len < 5) || (buf[0] != Addr) || (!mb_rtu_adu_check_crc(buf, len)))
+            return -EBADMSG;
+        return Req::parse(buf + 1, len - 3, val);
+    }
+};
+
+/* TCP frame: MBAP header with a transaction id of zero, then the PDU */
+template <uint8_t UnitId, typename Req>
+struct tcp
+{
+    using values_t = typename Req::values_t;
+    using frame_t = std::array<uint8_t, MB_TCP_ADU_HEADER_LEN + Req::pdu.size()>;
+
+    static constexpr size_t resp_len = MB_TCP_ADU_HEADER_LEN + Req::resp_len;
+
+    static constexpr frame_t make()
+    {
+        frame_t buf = {};
+
+        buf[MB_TCP_ADU_LEN_OFF] = (Req::pdu.size() + 1) >> 8;
+        buf[MB_TCP_ADU_LEN_OFF + 1] = (Req::pdu.size() + 1) & 0xff;
+        buf[MB_TCP_ADU_HEADER_LEN - 1] = UnitId;
+        for (size_t i = 0; i < Req::pdu.size(); i++)
+            buf[MB_TCP_ADU_HEADER_LEN + i] = Req::pdu[i];
+        return buf;
+    }
+
+    static constexpr frame_t frame = make();
+
+    static void set_trans_id(frame_t &buf, uint16_t trans_id)
+    {
+        buf[0] = trans_id >> 8;
+        buf[1] = trans_id & 0xff;
+    }
+
+    static int parse(const uint8_t *buf, size_t len, uint16_t trans_id, values_t &val)
+    {
+        if ((len < MB_TCP_ADU_HEADER_LEN + 2)
+         || (buf[0] != (trans_id >> 8)) || (buf[1] != (trans_id & 0xff))
+         || (buf[2] != 0) || (buf[3] != 0)
+         || ((((size_t)buf[MB_TCP_ADU_LEN_OFF] << 8) | buf[MB_TCP_ADU_LEN_OFF + 1]) != len - MB_TCP_ADU_LEN_OFF - 2)
+         || (buf[MB_TCP_ADU_HEADER_LEN - 1] != UnitId))
+            return -EBADMSG;
+        return Req::parse(buf + MB_TCP_ADU_HEADER_LEN, len - MB_TCP_ADU_HEADER_LEN, val);
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_GATEWAY_H
+#define MB_GATEWAY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "mb_tcp_server.h"
+#include "mb_rtu_master.h"
+
+/*  TCP to RTU gateway
+ *
+ *  One worker thread per bus, queued reads to a slave are coalesced.
+ */
+
+#define MB_GATEWAY_MAX_BUS    8
+#define MB_GATEWAY_MAX_QUEUE  64                        /* requests queued per bus */
+#define MB_GATEWAY_NUM_ROUTE  256
+
+typedef struct mb_gateway_waiter
+{
+    struct mb_gateway_waiter *next;
+    mb_tcp_server_token_t token;
+    uint16_t trans_id;
+    uint16_t proto_id;
+    uint8_t unit_id;
+    mb_pdu_t req;
+    mb_tcp_adu_t resp;
+}
+mb_gateway_waiter_t;
+
+typedef struct mb_gateway_trans
+{
+    struct mb_gateway_trans *next;
+    mb_rtu_adu_t req;
+    int merge;                                          /* read that others may be coalesced into */
+    uint16_t start_addr;
+    uint16_t quant;
+    mb_gateway_waiter_t *waiter;
+    int num_waiter;
+}
+mb_gateway_trans_t;
+
+typedef struct
+{
+    struct mb_gateway *gateway;
+    mb_rtu_master_t master;
+    pthread_t thread;
+    pthread_mutex_t lock;                               /* protects the queue and the active transaction */
+    pthread_cond_t cond;
+    mb_gateway_trans_t *head;
+    mb_gateway_trans_t *tail;
+    mb_gateway_trans_t *active;                         /* transaction on the bus */
+    int num_queued;
+    int stop;
+    int trans_count;                                    /* bus transactions performed */
+    int coalesce_count;                                 /* requests served by another request's transaction */
+}
+mb_gateway_bus_t;
+
+typedef struct
+{
+    int bus;
+    int addr;                                           /* 0 if the unit id is not routed */
+}
+mb_gateway_route_t;
+
+typedef struct mb_gateway
+{
+    mb_tcp_server_t *server;
+    mb_gateway_bus_t bus[MB_GATEWAY_MAX_BUS];
+    int num_bus;
+    mb_gateway_route_t route[MB_GATEWAY_NUM_ROUTE];
+    pthread_mutex_t lock;                               /* protects the completed requests */
+    mb_gateway_waiter_t *done_head;
+    mb_gateway_waiter_t *done_tail;
+    int efd;                                            /* signalled when requests complete */
+}
+mb_gateway_t;
+
+int mb_gateway_create(mb_gateway_t *gateway, mb_tcp_server_t *server);
+void mb_gateway_destroy(mb_gateway_t *gateway);
+int mb_gateway_add_bus(mb_gateway_t *gateway, const char *dev);
+int mb_gateway_add_route(mb_gateway_t *gateway, uint8_t unit_id, int bus, int addr);
+void mb_gateway_get_stats(mb_gateway_t *gateway, int bus, int *trans_count, int *coalesce_count);
+
+#endif
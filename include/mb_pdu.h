@@ -102,6 +102,10 @@
 #define MB_PDU_RD_FIFO_Q_MAX_FIFO_COUNT           31
 #define MB_PDU_RD_FIFO_Q_MAX_BYTE_COUNT           64      /* (MAX_FIFO_COUNT + 1) * 2 */
 #define MB_PDU_ENC_IF_TRANS_MAX_MEI_DATA_LEN      251     /* MAX_DATA_LEN - 1 */
+#define MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES   5
+#define MB_PDU_RD_MULT_RANGES_MAX_NUM_SUB_REQ     50      /* MAX_REQ_BYTE_COUNT / SUB_REQ_NUM_BYTES */
+#define MB_PDU_RD_MULT_RANGES_MAX_REQ_BYTE_COUNT  250
+#define MB_PDU_RD_MULT_RANGES_MAX_BYTE_COUNT      251     /* MAX_DATA_LEN - 1 */
 
 typedef enum
 {
@@ -147,10 +151,18 @@ typedef enum
     MB_PDU_MASK_WR_REG = 0x16,                /* Mask Write Register */
     MB_PDU_RD_WR_MULT_REGS = 0x17,            /* Read/Write Multiple Registers */
     MB_PDU_RD_FIFO_Q = 0x18,                  /* Read FIFO queue */
-    MB_PDU_ENC_IF_TRANS = 0x2b                /* Encapsulated Interface Transport */
+    MB_PDU_ENC_IF_TRANS = 0x2b,               /* Encapsulated Interface Transport */
+    MB_PDU_RD_MULT_RANGES = 0x41              /* Read Multiple Ranges (user defined) */
 }
 mb_pdu_func_code_t;
 
+/*  read multiple ranges (user defined function code)
+ *
+ *  +-----------+------------+-----------+------------+-------+-----
+ *  | func_code | byte_count | func_code | start_addr | quant | ...
+ *  +-----------+------------+-----------+------------+-------+-----
+ */
+
 /* Modbus over Serial Line Specification and Implementation Guide V1.02 */
 /* Modbus Application Protocol Specification V1.1b3 */
 typedef enum
@@ -435,6 +447,28 @@ typedef struct
 }
 mb_pdu_enc_if_trans_t;
 
+typedef struct
+{
+    uint8_t func_code;                        /* read that covers the range */
+    uint16_t start_addr;
+    uint16_t quant;
+}
+mb_pdu_rd_mult_ranges_sub_req_t;
+
+typedef struct
+{
+    uint8_t byte_count;
+    mb_pdu_rd_mult_ranges_sub_req_t sub_req[MB_PDU_RD_MULT_RANGES_MAX_NUM_SUB_REQ];
+}
+mb_pdu_rd_mult_ranges_req_t;
+
+typedef struct
+{
+    uint8_t byte_count;
+    uint8_t data[MB_PDU_RD_MULT_RANGES_MAX_BYTE_COUNT];  /* in network byte order */
+}
+mb_pdu_rd_mult_ranges_resp_t;
+
 typedef struct
 {
     uint8_t except_code;
@@ -486,6 +520,8 @@ typedef struct
         mb_pdu_rd_fifo_q_resp_t rd_fifo_q_resp;
         mb_pdu_enc_if_trans_t enc_if_trans_req;
         mb_pdu_enc_if_trans_t enc_if_trans_resp;
+        mb_pdu_rd_mult_ranges_req_t rd_mult_ranges_req;
+        mb_pdu_rd_mult_ranges_resp_t rd_mult_ranges_resp;
         mb_pdu_err_t err;
     };
     uint16_t data_len;
@@ -531,7 +567,11 @@ void mb_pdu_set_rd_fifo_q_req(mb_pdu_t *pdu, uint16_t fifo_ptr_addr);
 int mb_pdu_set_rd_fifo_q_resp(mb_pdu_t *pdu, uint16_t fifo_count, const uint16_t *fifo_val_reg);
 int mb_pdu_set_enc_if_trans_req(mb_pdu_t *pdu, uint8_t mei_type, const uint8_t *mei_data, uint8_t mei_data_len);
 int mb_pdu_set_enc_if_trans_resp(mb_pdu_t *pdu, uint8_t mei_type, const uint8_t *mei_data, uint8_t mei_data_len);
+int mb_pdu_set_rd_mult_ranges_req(mb_pdu_t *pdu, const mb_pdu_rd_mult_ranges_sub_req_t *sub_req, size_t num_sub_req);
+int mb_pdu_set_rd_mult_ranges_resp(mb_pdu_t *pdu, uint8_t byte_count, const uint8_t *data);
 int mb_pdu_set_err_resp(mb_pdu_t *pdu, uint8_t func_code, uint8_t except_code);
+size_t mb_pdu_rd_mult_ranges_val_len(const mb_pdu_rd_mult_ranges_sub_req_t *sub_req);
+int mb_pdu_get_rd_mult_ranges_val(const mb_pdu_t *req, const mb_pdu_t *resp, size_t index, uint16_t *val);
 
 ssize_t mb_pdu_format_req(mb_pdu_t *pdu, char *buf, size_t len);
 ssize_t mb_pdu_format_resp(mb_pdu_t *pdu, char *buf, size_t len);
@@ -539,4 +579,6 @@ ssize_t mb_pdu_format_resp(mb_pdu_t *pdu, char *buf, size_t len);
 ssize_t mb_pdu_parse_req(mb_pdu_t *pdu, const char *buf, size_t len);
 ssize_t mb_pdu_parse_resp(mb_pdu_t *pdu, const char *buf, size_t len);
 
+size_t mb_pdu_resp_len(const mb_pdu_t *req);
+
 #endif
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_POLL_POOL_H
+#define MB_POLL_POOL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "mb_poller.h"
+
+/*  poll pool
+ *
+ *  Devices are shared out between shards, each with its own poller
+ *  thread, and the results of all the shards are queued for one consumer.
+ */
+
+#define MB_POLL_POOL_MAX_SHARD     16
+#define MB_POLL_POOL_QUEUE_LEN     4096                 /* must be a power of 2 */
+#define MB_POLL_POOL_MIN_DEV       16
+#define MB_POLL_POOL_MIN_GROUP     16
+#define MB_POLL_POOL_WAKE_MSEC     50                   /* longest time a shard sleeps before checking for work */
+#define MB_POLL_POOL_WINDOW_MSEC   1000
+#define MB_POLL_POOL_BEHIND_USEC   20000
+#define MB_POLL_POOL_IDLE_USEC     2000
+#define MB_POLL_POOL_NONE          -1
+#define MB_POLL_POOL_CLAIMED       -2                   /* thief while a migration sets the device wanted */
+#define MB_POLL_POOL_RESP_LEN      (MB_PDU_MAX_DATA_LEN + 1)
+
+typedef struct
+{
+    int dev;
+    int group;
+    int req;
+    ssize_t result;                                     /* length of the response or a negative errno value */
+    size_t resp_len;
+    char resp[MB_POLL_POOL_RESP_LEN];                   /* formatted response PDU, decode with mb_pdu_parse_resp */
+}
+mb_poll_pool_result_t;
+
+typedef struct
+{
+    atomic_size_t seq;
+    mb_poll_pool_result_t result;
+}
+mb_poll_pool_cell_t;
+
+typedef struct
+{
+    mb_poller_dev_type_t type;
+    char host[INET_ADDRSTRLEN];
+    in_port_t port;
+    mb_rtu_master_t *master;
+    uint8_t unit_id;                                    /* unit id or slave address */
+    int max_in_flight;
+    atomic_int shard;                                   /* shard polling the device */
+}
+mb_poll_pool_dev_t;
+
+typedef struct
+{
+    int dev;
+    mb_pdu_t *req;
+    int num_req;
+    struct timeval period;
+    struct timeval deadline;
+    int priority;
+}
+mb_poll_pool_group_t;
+
+struct mb_poll_pool;
+
+typedef struct
+{
+    struct mb_poll_pool *pool;
+    int index;
+    pthread_t thread;
+    mb_poller_t poller;
+    mb_tcp_client_t client;
+    int *global_dev;                                    /* pool device of each poller device */
+    int num_local_dev;
+    int *global_group;                                  /* pool group of each poller group */
+    int num_local_group;
+    int num_dev;                                        /* devices currently polled */
+    pthread_mutex_t lock;                               /* protects the inbox */
+    int *inbox;                                         /* devices handed over by other shards */
+    int num_inbox;
+    atomic_long lag_usec;                               /* largest release jitter in the last window */
+    atomic_int thief;                                   /* shard asking for a device, MB_POLL_POOL_NONE if none */
+    atomic_int want_dev;                                /* device asked for, MB_POLL_POOL_NONE for any */
+    int leaving;                                        /* poller device being handed over, MB_POLL_POOL_NONE if none */
+    int leaving_to;
+    int produced;                                       /* results queued since the eventfd was last signalled */
+    struct timespec window_end;
+}
+mb_poll_pool_shard_t;
+
+typedef struct mb_poll_pool
+{
+    mb_poll_pool_shard_t shard[MB_POLL_POOL_MAX_SHARD];
+    int num_shard;
+    mb_poll_pool_dev_t *dev;
+    int num_dev;
+    int max_dev;
+    mb_poll_pool_group_t *group;
+    int num_group;
+    int max_group;
+    int started;
+    atomic_int stop;
+    int efd;                                            /* signalled when results are queued */
+    atomic_size_t tail;                                 /* next cell to fill */
+    size_t head;                                        /* next cell to consume */
+    atomic_ulong num_dropped;
+    atomic_ulong num_migrated;
+    mb_poll_pool_cell_t queue[MB_POLL_POOL_QUEUE_LEN];
+}
+mb_poll_pool_t;
+
+int mb_poll_pool_create(mb_poll_pool_t *pool, int num_shard, struct timeval timeout);
+void mb_poll_pool_destroy(mb_poll_pool_t *pool);
+int mb_poll_pool_authorise_addr(mb_poll_pool_t *pool, const char *str);
+int mb_poll_pool_add_tcp_dev(mb_poll_pool_t *pool, const char *host, in_port_t port, uint8_t unit_id, int max_in_flight);
+int mb_poll_pool_add_rtu_dev(mb_poll_pool_t *pool, mb_rtu_master_t *master, uint8_t addr);
+int mb_poll_pool_add_group(mb_poll_pool_t *pool, int dev, const mb_pdu_t *req, int num_req, struct timeval period, struct timeval deadline, int priority);
+int mb_poll_pool_start(mb_poll_pool_t *pool);
+void mb_poll_pool_stop(mb_poll_pool_t *pool);
+int mb_poll_pool_migrate(mb_poll_pool_t *pool, int dev, int shard);
+int mb_poll_pool_get_shard(mb_poll_pool_t *pool, int dev);
+int mb_poll_pool_get_fd(mb_poll_pool_t *pool);
+int mb_poll_pool_next(mb_poll_pool_t *pool, mb_poll_pool_result_t *result);
+
+#endif
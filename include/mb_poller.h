@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_POLLER_H
+#define MB_POLLER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "mb_tcp_client.h"
+#include "mb_rtu_master.h"
+#include "mb_pdu.h"
+
+/*  poll scheduler
+ *
+ *  Scan groups are released every period and their requests are sent
+ *  to the device in order of deadline.
+ *  RTU exchanges run on a worker thread per bus.
+ *  Requests are prepared when their group is added.
+ *  A held device can be removed and handed over to another poller.
+ *  The circuit of a device that keeps failing is opened for a backoff.
+ *  The scheduler sleeps in epoll until the next release or request deadline
+ *  and only visits the devices that have requests to send.
+ */
+
+#define MB_POLLER_MAX_CLIENT    8
+#define MB_POLLER_MAX_BUS       8                       /* RTU masters per poller */
+#define MB_POLLER_MIN_DEV       16
+#define MB_POLLER_MIN_GROUP     16
+#define MB_POLLER_OVERRUN       -1                      /* request index passed to the callback when a release is skipped */
+#define MB_POLLER_TRIP          3                       /* default consecutive failures that open a circuit */
+#define MB_POLLER_MIN_BACKOFF_SEC  1                    /* default backoff after a circuit first opens */
+#define MB_POLLER_MAX_BACKOFF_SEC  60
+#define MB_POLLER_RTT_SHIFT     3                       /* weight of a new round trip time is 1/8 */
+
+typedef enum
+{
+    MB_POLLER_DEV_TCP = 0,
+    MB_POLLER_DEV_RTU
+}
+mb_poller_dev_type_t;
+
+typedef enum
+{
+    MB_POLLER_CIRCUIT_CLOSED = 0,                       /* requests are sent */
+    MB_POLLER_CIRCUIT_OPEN,                             /* requests fail without being sent */
+    MB_POLLER_CIRCUIT_PROBE                             /* one request is in flight to test the device */
+}
+mb_poller_circuit_t;
+
+struct mb_poller;
+
+typedef void (*mb_poller_func_t)(struct mb_poller *poller, int group, int req, ssize_t result, mb_pdu_t *resp, void *arg);
+
+typedef struct mb_poller_slot
+{
+    struct mb_poller *poller;
+    int used;
+    int group;
+    int req;
+    struct timespec sent;
+    struct mb_poller_slot *next;                        /* next request queued on the bus */
+    const mb_rtu_adu_prep_t *rtu_prep;                  /* RTU request passed to the bus worker */
+    mb_rtu_adu_t rtu_resp;
+    ssize_t result;
+}
+mb_poller_slot_t;
+
+typedef struct
+{
+    mb_rtu_master_t *master;
+    pthread_t thread;
+    pthread_mutex_t lock;                               /* protects the queues */
+    pthread_cond_t cond;
+    int efd;                                            /* signalled when an exchange completes */
+    mb_poller_slot_t *head;                             /* requests waiting for the bus */
+    mb_poller_slot_t *tail;
+    mb_poller_slot_t *done_head;                        /* completed requests */
+    mb_poller_slot_t *done_tail;
+    int stop;
+}
+mb_poller_bus_t;
+
+typedef struct
+{
+    mb_poller_circuit_t circuit;
+    unsigned num_fail_run;                              /* consecutive failures */
+    unsigned long num_ok;                               /* responses, including exception responses */
+    unsigned long num_except;                           /* exception responses */
+    unsigned long num_fail;                             /* timeouts and connection errors */
+    unsigned long num_skip;                             /* requests failed because the circuit was open */
+    unsigned long num_trip;                             /* times the circuit opened */
+    long rtt_usec;                                      /* smoothed round trip time */
+    long rtt_max_usec;
+    struct timespec backoff;                            /* current backoff interval */
+    struct timespec retry;                              /* time of the next probe while open */
+}
+mb_poller_health_t;
+
+typedef struct
+{
+    mb_poller_dev_type_t type;
+    mb_tcp_client_t *client;
+    int endpoint;
+    mb_rtu_master_t *master;
+    int bus;
+    uint8_t unit_id;                                    /* unit id or slave address */
+    int max_in_flight;
+    int num_in_flight;
+    int hold;                                           /* no new cycles are started */
+    int removed;
+    int queued;                                         /* on the dispatch list */
+    mb_poller_health_t health;
+    mb_poller_slot_t *slot;                             /* requests in flight */
+    int *ready;                                         /* heap of groups with requests waiting to be sent */
+    int num_ready;
+    int max_ready;
+}
+mb_poller_dev_t;
+
+typedef struct
+{
+    unsigned long num_release;                          /* releases that started a cycle */
+    unsigned long num_cycle;                            /* completed cycles */
+    unsigned long num_overrun;                          /* skipped releases */
+    unsigned long num_late;                             /* cycles completed after their deadline */
+    unsigned long num_err;                              /* failed requests */
+    long jitter_max_usec;                               /* release later than scheduled */
+    long jitter_sum_usec;                               /* divide by num_release for the mean */
+    long lateness_max_usec;                             /* completion after the deadline */
+}
+mb_poller_stats_t;
+
+typedef struct
+{
+    int dev;
+    mb_pdu_t *req;
+    mb_tcp_adu_prep_t *tcp_prep;                        /* requests formatted for the device */
+    mb_rtu_adu_prep_t *rtu_prep;
+    int num_req;
+    struct timespec period;
+    struct timespec deadline;                           /* relative to the release */
+    int priority;                                       /* lower values are sent first */
+    mb_poller_func_t func;
+    void *arg;
+    struct timespec release;                            /* next release */
+    struct timespec cycle_release;                      /* release of the current cycle */
+    struct timespec cycle_deadline;
+    int active;                                         /* cycle in progress */
+    int removed;
+    int next_req;                                       /* next request to send */
+    int num_done;
+    mb_poller_stats_t stats;
+}
+mb_poller_group_t;
+
+typedef struct mb_poller
+{
+    struct timespec epoch;                              /* groups are released at whole periods from here */
+    int epoll_fd;
+    int timer_fd;
+    struct timespec timer;                              /* time the timer is armed for */
+    mb_tcp_client_t *client[MB_POLLER_MAX_CLIENT];
+    int num_client;
+    mb_poller_bus_t bus[MB_POLLER_MAX_BUS];
+    int num_bus;
+    mb_poller_dev_t *dev;
+    int num_dev;
+    int max_dev;
+    int *dispatch;                                      /* devices with requests to send */
+    int num_dispatch;
+    mb_poller_group_t *group;
+    int num_group;
+    int max_group;
+    int *release;                                       /* heap of groups ordered by next release */
+    int num_release;
+    long lag_usec;                                      /* largest release jitter since last cleared */
+    unsigned trip;                                      /* consecutive failures that open a circuit */
+    struct timespec min_backoff;
+    struct timespec max_backoff;
+}
+mb_poller_t;
+
+int mb_poller_create(mb_poller_t *poller);
+void mb_poller_destroy(mb_poller_t *poller);
+int mb_poller_add_tcp_dev(mb_poller_t *poller, mb_tcp_client_t *client, int endpoint, uint8_t unit_id, int max_in_flight);
+int mb_poller_add_rtu_dev(mb_poller_t *poller, mb_rtu_master_t *master, uint8_t addr);
+int mb_poller_add_group(mb_poller_t *poller, int dev, const mb_pdu_t *req, int num_req, struct timeval period, struct timeval deadline, int priority, mb_poller_func_t func, void *arg);
+void mb_poller_hold_dev(mb_poller_t *poller, int dev);
+int mb_poller_remove_dev(mb_poller_t *poller, int dev);
+void mb_poller_set_circuit(mb_poller_t *poller, unsigned trip, struct timeval min_backoff, struct timeval max_backoff);
+void mb_poller_get_health(mb_poller_t *poller, int dev, mb_poller_health_t *health);
+void mb_poller_get_stats(mb_poller_t *poller, int group, mb_poller_stats_t *stats);
+int mb_poller_run_once(mb_poller_t *poller, int timeout_msec);
+int mb_poller_run(mb_poller_t *poller);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_REG_BANK_H
+#define MB_REG_BANK_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include "mb_pdu.h"
+
+/*  register bank
+ *
+ *  Reads take no lock. Writes are published through a seqlock, bulk
+ *  updates through a spare copy.
+ *  The bank can be kept in a shared file mapping with one writer process.
+ *  Subscribers receive an event for each write to their range.
+ */
+
+#define MB_REG_BANK_NUM_ADDR  0x10000
+#define MB_REG_BANK_MAGIC     0x4d425242                /* "MBRB" */
+#define MB_REG_BANK_VERSION   2
+#define MB_REG_BANK_RDONLY    0x01                      /* open flag */
+#define MB_REG_BANK_MAX_SUB   16
+#define MB_REG_BANK_SUB_NUM_EV  64                      /* events queued per subscriber, must be a power of 2 */
+#define MB_REG_BANK_EV_MAX_QUANT  125                   /* larger writes are split across several events */
+#define MB_REG_BANK_RD_SPIN   1000                      /* reader polls before checking the time */
+#define MB_REG_BANK_RD_TIMEOUT_MSEC  100                /* reader wait for a small write to finish */
+#define MB_REG_BANK_LOCK_TIMEOUT_SEC  1                 /* writer wait for the lock when a bank is opened */
+
+typedef enum
+{
+    MB_REG_BANK_COILS = 0,
+    MB_REG_BANK_DISC_IPS,
+    MB_REG_BANK_HOLD_REGS,
+    MB_REG_BANK_IP_REGS
+}
+mb_reg_bank_table_t;
+
+typedef struct
+{
+    uint8_t coil[MB_REG_BANK_NUM_ADDR];                 /* one byte per coil, 0 or 1 */
+    uint8_t disc_ip[MB_REG_BANK_NUM_ADDR];              /* one byte per discrete input, 0 or 1 */
+    uint16_t hold_reg[MB_REG_BANK_NUM_ADDR];
+    uint16_t ip_reg[MB_REG_BANK_NUM_ADDR];
+}
+mb_reg_bank_data_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                                      /* size of this structure */
+    pthread_mutex_t lock;                               /* robust and process-shared, serialises writers */
+    atomic_uint seq;                                    /* odd while the current data is being modified */
+    atomic_uint cur;                                    /* index of the current data */
+    mb_reg_bank_data_t data[2];
+}
+mb_reg_bank_mem_t;
+
+typedef struct
+{
+    mb_reg_bank_table_t table;
+    uint16_t start_addr;
+    uint16_t quant;
+    uint16_t old_val[MB_REG_BANK_EV_MAX_QUANT];         /* coils and discrete inputs are 0 or 1 */
+    uint16_t new_val[MB_REG_BANK_EV_MAX_QUANT];
+}
+mb_reg_bank_ev_t;
+
+typedef struct
+{
+    mb_reg_bank_table_t table;
+    uint32_t start_addr;
+    uint32_t end_addr;                                  /* one past the last address */
+    int efd;                                            /* eventfd signalled when events are queued */
+    unsigned num_pend;                                  /* events filled in by the current write but not yet queued */
+    atomic_uint head;                                   /* next event to be consumed */
+    atomic_uint tail;                                   /* next free event */
+    atomic_uint overrun;                                /* events dropped because the queue was full */
+    mb_reg_bank_ev_t ev[MB_REG_BANK_SUB_NUM_EV];
+}
+mb_reg_bank_sub_t;
+
+typedef void (*mb_reg_bank_update_t)(mb_reg_bank_data_t *data, void *arg);
+
+typedef struct
+{
+    mb_reg_bank_mem_t *mem;
+    pthread_mutex_t lock;                               /* serialises writers and guards the subscribers in this process */
+    int flags;
+    int shared;                                         /* mem is a shared file mapping */
+    time_t sync_period;                                 /* seconds between asynchronous flushes, 0 to disable */
+    time_t last_sync;
+    mb_reg_bank_sub_t *sub[MB_REG_BANK_MAX_SUB];
+    int num_sub;
+}
+mb_reg_bank_t;
+
+int mb_reg_bank_create(mb_reg_bank_t *bank);
+int mb_reg_bank_open(mb_reg_bank_t *bank, const char *path, int flags);
+int mb_reg_bank_open_fd(mb_reg_bank_t *bank, int fd, int flags);
+void mb_reg_bank_destroy(mb_reg_bank_t *bank);
+void mb_reg_bank_set_sync_period(mb_reg_bank_t *bank, time_t sync_period);
+int mb_reg_bank_sync(mb_reg_bank_t *bank);
+int mb_reg_bank_rd_bits(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, uint8_t *val);
+int mb_reg_bank_wr_bits(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, const uint8_t *val);
+int mb_reg_bank_rd_regs(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, uint16_t *val);
+int mb_reg_bank_wr_regs(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, const uint16_t *val);
+int mb_reg_bank_mask_wr_reg(mb_reg_bank_t *bank, uint16_t addr, uint16_t and_mask, uint16_t or_mask);
+int mb_reg_bank_rd_wr_regs(mb_reg_bank_t *bank, uint16_t rd_start_addr, uint16_t quant_rd, uint16_t *rd_val, uint16_t wr_start_addr, uint16_t quant_wr, const uint16_t *wr_val);
+int mb_reg_bank_update(mb_reg_bank_t *bank, mb_reg_bank_update_t func, void *arg);
+int mb_reg_bank_subscribe(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint32_t quant);
+void mb_reg_bank_unsubscribe(mb_reg_bank_t *bank, int sub);
+int mb_reg_bank_sub_fd(mb_reg_bank_t *bank, int sub);
+int mb_reg_bank_next_ev(mb_reg_bank_t *bank, int sub, mb_reg_bank_ev_t *ev);
+unsigned mb_reg_bank_sub_overrun(mb_reg_bank_t *bank, int sub);
+int mb_reg_bank_handle(mb_reg_bank_t *bank, mb_pdu_t *req, mb_pdu_t *resp);
+
+#endif
@@ -59,6 +59,17 @@ typedef struct
 }
 mb_rtu_adu_t;
 
+/* a request formatted once, CRC included, and sent as it is */
+typedef struct
+{
+    char buf[MB_RTU_ADU_MAX_LEN];
+    size_t len;
+    uint8_t addr;
+    uint8_t func_code;
+    size_t resp_len;                                    /* length of a normal response, 0 if it varies */
+}
+mb_rtu_adu_prep_t;
+
 int mb_rtu_adu_check_crc(const uint8_t *buf, size_t len);
 int mb_rtu_adu_valid_broadcast_req(mb_rtu_adu_t *adu);
 void mb_rtu_adu_set_header(mb_rtu_adu_t *adu, uint8_t addr);
@@ -66,6 +77,8 @@ ssize_t mb_rtu_adu_format_req(mb_rtu_adu_t *adu, char *buf, size_t len);
 ssize_t mb_rtu_adu_format_resp(mb_rtu_adu_t *adu, char *buf, size_t len);
 ssize_t mb_rtu_adu_parse_req(mb_rtu_adu_t *adu, const char *buf, size_t len);
 ssize_t mb_rtu_adu_parse_resp(mb_rtu_adu_t *adu, const char *buf, size_t len);
+int mb_rtu_adu_prepare(mb_rtu_adu_prep_t *prep, mb_rtu_adu_t *adu);
+int mb_rtu_adu_prep_check_resp(const mb_rtu_adu_prep_t *prep, const char *buf, size_t len);
 int mb_rtu_adu_to_str(mb_rtu_adu_t *adu, char *buf, size_t len);
 
 #endif
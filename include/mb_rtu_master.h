@@ -46,6 +46,7 @@ mb_rtu_master_t;
 int mb_rtu_master_create(mb_rtu_master_t *master, const char *dev);
 void mb_rtu_master_destroy(mb_rtu_master_t *master);
 int mb_rtu_master_exchange(mb_rtu_master_t *master, mb_rtu_adu_t *req, mb_rtu_adu_t *resp);
+int mb_rtu_master_exchange_prep(mb_rtu_master_t *master, const mb_rtu_adu_prep_t *prep, mb_rtu_adu_t *resp);
 int mb_rtu_master_broadcast(mb_rtu_master_t *master, mb_rtu_adu_t *req);
 
 #endif
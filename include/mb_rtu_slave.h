@@ -31,10 +31,24 @@
 #include "mb_rtu_con.h"
 #include "mb_rtu_adu.h"
 
+#define MB_RTU_SLAVE_NUM_UNIT  256
+
+/* a slave can answer for several addresses, added with mb_rtu_slave_add_unit */
+
 struct mb_rtu_slave;
 
 typedef int (*mb_rtu_slave_handler_t)(struct mb_rtu_slave *slave, mb_rtu_adu_t *req, mb_rtu_adu_t *resp);
 
+typedef struct
+{
+    mb_rtu_slave_handler_t handler;
+    void *data;
+    int slave_excep_err_count;                          /* Return Slave Exception Error Count */
+    int slave_msg_count;                                /* Return Slave Message Count */
+    int slave_no_resp_count;                            /* Return Slave No Response Count */
+}
+mb_rtu_slave_unit_t;
+
 typedef struct mb_rtu_slave
 {
     int addr;
@@ -42,14 +56,16 @@ typedef struct mb_rtu_slave
     mb_rtu_slave_handler_t handler;
     int bus_msg_count;                                  /* Return Bus Message Count */
     int bus_com_err_count;                              /* Return Bus Communication Error Count */
-    int slave_excep_err_count;                          /* Return Slave Exception Error Count */
-    int slave_msg_count;                                /* Return Slave Message Count */
-    int slave_no_resp_count;                            /* Return Slave No Response Count */
+    mb_rtu_slave_unit_t unit[MB_RTU_SLAVE_NUM_UNIT];
+    int cur_addr;                                       /* unit whose handler is being called */
 }
 mb_rtu_slave_t;
 
 int mb_rtu_slave_create(mb_rtu_slave_t *slave, const char *dev, int addr, mb_rtu_slave_handler_t handler);
 void mb_rtu_slave_destroy(mb_rtu_slave_t *slave);
+int mb_rtu_slave_add_unit(mb_rtu_slave_t *slave, int addr, mb_rtu_slave_handler_t handler, void *data);
+void mb_rtu_slave_remove_unit(mb_rtu_slave_t *slave, int addr);
+void *mb_rtu_slave_get_data(mb_rtu_slave_t *slave);
 int mb_rtu_slave_run(mb_rtu_slave_t *slave);
 
 #endif
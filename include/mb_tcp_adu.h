@@ -59,11 +59,25 @@ typedef struct
 }
 mb_tcp_adu_t;
 
+/* a request formatted once, only the transaction id is patched before each send */
+typedef struct
+{
+    char buf[MB_TCP_ADU_MAX_LEN];
+    size_t len;
+    uint8_t unit_id;
+    uint8_t func_code;
+    size_t resp_len;                                    /* length of a normal response, 0 if it varies */
+}
+mb_tcp_adu_prep_t;
+
 void mb_tcp_adu_set_header(mb_tcp_adu_t *adu, uint16_t trans_id, uint16_t proto_id, uint8_t unit_id);
 ssize_t mb_tcp_adu_format_req(mb_tcp_adu_t *adu, char *buf, size_t len);
 ssize_t mb_tcp_adu_format_resp(mb_tcp_adu_t *adu, char *buf, size_t len);
 ssize_t mb_tcp_adu_parse_req(mb_tcp_adu_t *adu, const char *buf, size_t len);
 ssize_t mb_tcp_adu_parse_resp(mb_tcp_adu_t *adu, const char *buf, size_t len);
+int mb_tcp_adu_prepare(mb_tcp_adu_prep_t *prep, mb_tcp_adu_t *adu);
+void mb_tcp_adu_prep_set_trans_id(mb_tcp_adu_prep_t *prep, uint16_t trans_id);
+int mb_tcp_adu_prep_check_resp(const mb_tcp_adu_prep_t *prep, const char *buf, size_t len);
 int mb_tcp_adu_to_str(mb_tcp_adu_t *adu, char *buf, size_t len);
 
 #endif
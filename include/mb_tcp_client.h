@@ -28,27 +28,324 @@
 #ifndef MB_TCP_CLIENT_H
 #define MB_TCP_CLIENT_H
 
+#include <stdint.h>
 #include <time.h>
 #include <netinet/in.h>
+#include <sys/types.h>
 #include "mb_ip_auth.h"
 #include "mb_tcp_con.h"
 #include "mb_tcp_adu.h"
 
-#define MB_TCP_CLIENT_MAX_CON        4
+#define MB_TCP_CLIENT_MAX_CON        4     /* default number of connections */
 #define MB_TCP_CLIENT_SOCKET_CLOSED  0
 #define MB_TCP_CLIENT_UNIT_ID        0xff  /* unit id used in client requests */
+#define MB_TCP_CLIENT_MAX_PENDING    16    /* default requests in flight per client, must be a power of 2 */
+#define MB_TCP_CLIENT_MIN_ENDPOINT   16
+#define MB_TCP_CLIENT_NONE           -1
+#define MB_TCP_CLIENT_MAX_HEDGE      8     /* endpoint groups per client */
+#define MB_TCP_CLIENT_HEDGE_SAMPLES  32    /* round trip times kept per endpoint in a group */
+#define MB_TCP_CLIENT_HEDGE_MIN_SAMPLES  8 /* reads are not hedged until this many have been seen */
+#define MB_TCP_CLIENT_HEDGE_MIN_USEC 1000  /* shortest hedge delay */
+#define MB_TCP_CLIENT_MAX_AGE_RULE   16    /* ranges with a max-age of their own */
+#define MB_TCP_CLIENT_MAX_WR         64    /* queued writes per client */
+#define MB_TCP_CLIENT_WR_DELAY_USEC  10000 /* default time a write waits on the queue to be merged with others */
+#define MB_TCP_CLIENT_FILE_WINDOW    8     /* file record requests in flight per transfer */
+#define MB_TCP_CLIENT_FILE_NUM_REC   MB_PDU_FILE_REC_MAX_REC_NUM  /* records used in each file by a transfer */
+#define MB_TCP_CLIENT_PROBE_MIN_SEC  1     /* wait after a read multiple ranges probe times out, doubled each time */
+#define MB_TCP_CLIENT_PROBE_MAX_SEC  300
+
+/*  connections
+ *
+ *  Connections are found through a hash table and idle ones are closed
+ *  in least recently used order. Endpoint handles skip the lookup.
+ *  Connects do not block, mb_tcp_client_maintain keeps preconnected
+ *  endpoints connected.
+ */
+
+/*  asynchronous requests
+ *
+ *  Responses are matched to requests by transaction id, in any order.
+ *  mb_tcp_client_create_size sets the number of requests in flight.
+ *  mb_tcp_client_poll completes requests, through a callback or
+ *  mb_tcp_client_result.
+ *  A prepared request must not change while it is in flight.
+ *  A read to a hedge group is sent to the other endpoint too if it is
+ *  not answered within the percentile round trip time.
+ *  mb_tcp_client_exchange returns -EBUSY while requests are in flight.
+ *  A batch has at most max_pending requests in flight and num_con
+ *  endpoints connected at a time.
+ */
+
+/*  response cache
+ *
+ *  Reads are answered from responses no older than their max-age.
+ *  A read waits for a read in flight only if that read covers all of
+ *  it. Every request sent drops the cached ranges it writes.
+ */
+
+/*  write queue
+ *
+ *  Single coil and register writes are collapsed and merged into
+ *  multiple writes. The queue is sent in the order written when its
+ *  oldest write has waited for the write delay, when it is full, or
+ *  before any other request to the same server.
+ */
+
+/*  read multiple ranges
+ *
+ *  Ranges are packed into read multiple ranges requests if the
+ *  endpoint supports them, otherwise read one by one. Support is
+ *  probed again with a backoff after a probe times out.
+ */
+
+/*  file transfer
+ *
+ *  Records move between a server and an array or a file descriptor.
+ *  -EPROTO is returned for an exception response.
+ */
+
+struct mb_tcp_client;
 
 typedef struct
+{
+    int in_progress;                                    /* non-blocking connect in progress */
+    struct timespec deadline;
+    int num_pending;                                    /* asynchronous requests in flight */
+    int stale;                                          /* a request was abandoned, closed once no others are in flight */
+    int wait_out;                                       /* queued requests wait for EPOLLOUT */
+    int idle;                                           /* on the idle list */
+    int prev;                                           /* idle list links */
+    int next;
+}
+mb_tcp_client_con_state_t;
+
+typedef struct
+{
+    struct sockaddr_in sin;
+    int preconnect;
+    struct timespec next_attempt;
+    int rd_ranges;                                      /* read multiple ranges supported: 1 yes, -1 no, 0 not known */
+    unsigned num_probe_timeout;                         /* probes in a row that were not answered */
+    struct timespec next_probe;                         /* no probe is sent before this */
+    int removed;                                        /* slot free for the next endpoint added */
+}
+mb_tcp_client_endpoint_t;
+
+typedef void (*mb_tcp_client_func_t)(struct mb_tcp_client *client, int handle, ssize_t result, mb_tcp_adu_t *resp, void *arg);
+typedef void (*mb_tcp_client_wr_func_t)(struct mb_tcp_client *client, ssize_t result, mb_tcp_adu_t *resp, void *arg);
+
+typedef struct
+{
+    struct sockaddr_in sin;
+    uint8_t unit_id;
+    uint8_t func_code;                                  /* MB_PDU_WR_SING_COIL or MB_PDU_WR_SING_REG */
+    uint16_t addr;
+    uint16_t val;                                       /* 0 or 1 for a coil */
+    mb_tcp_client_wr_func_t func;
+    void *arg;
+    struct timespec deadline;                           /* sent by then */
+}
+mb_tcp_client_wr_t;
+
+typedef struct
+{
+    unsigned long num_queued;                           /* writes queued */
+    unsigned long num_req;                              /* requests sent to carry them */
+    unsigned long num_rd_wr;                            /* requests combined with a read */
+}
+mb_tcp_client_wr_stats_t;
+
+typedef struct
+{
+    struct sockaddr_in sin;
+    uint8_t unit_id;
+    uint8_t func_code;
+    uint16_t start_addr;
+    uint16_t quant;
+}
+mb_tcp_client_cache_key_t;
+
+typedef struct
+{
+    int used;
+    mb_tcp_client_cache_key_t key;
+    struct timespec fetched;
+    union
+    {
+        uint16_t reg[MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS];
+        uint8_t bit[MB_PDU_RD_COILS_MAX_BYTE_COUNT];    /* packed as in the response */
+    };
+}
+mb_tcp_client_cache_entry_t;
+
+typedef struct
+{
+    uint8_t func_code;
+    uint32_t start_addr;
+    uint32_t end_addr;                                  /* one past the last address */
+    struct timespec max_age;
+}
+mb_tcp_client_max_age_t;
+
+typedef struct
+{
+    unsigned long num_hit;                              /* reads answered from the cache */
+    unsigned long num_miss;                             /* reads sent */
+    unsigned long num_merge;                            /* reads that waited for a read in flight */
+    unsigned long num_invalidate;                       /* entries dropped by writes */
+}
+mb_tcp_client_cache_stats_t;
+
+typedef struct
+{
+    int used;
+    int done;
+    int index;                                          /* connection */
+    unsigned gen;                                       /* connection generation */
+    uint16_t trans_id;
+    const mb_tcp_adu_prep_t *prep;                      /* checks the response, NULL if not prepared */
+    int detached;                                       /* no longer in flight on its connection */
+    int hedged;                                         /* sent through an endpoint group */
+    int hedge;                                          /* endpoint group */
+    int which;                                          /* endpoint of the group the request was sent to */
+    int dup;                                            /* copy of another request */
+    int peer;                                           /* the other copy, MB_TCP_CLIENT_NONE if none */
+    int discard;                                        /* copy that lost, its response is dropped when it arrives */
+    struct timespec sent;
+    struct timespec hedge_at;                           /* time to send a copy, zero if none is due */
+    mb_tcp_adu_prep_t hedge_prep;                       /* frame of a hedged request */
+    int cacheable;                                      /* read whose response is cached */
+    mb_tcp_client_cache_key_t key;
+    int follow;                                         /* waits for the response to another read */
+    int leader;                                         /* read being waited for */
+    int ready;                                          /* answered from the cache, completed by the next poll */
+    mb_tcp_client_wr_t *wr;                             /* queued writes carried by the request, NULL if none */
+    int num_wr;
+    int rd_wr;                                          /* read combined with writes */
+    struct timespec deadline;
+    mb_tcp_client_func_t func;
+    void *arg;
+    ssize_t result;
+    mb_tcp_adu_t resp;
+}
+mb_tcp_client_pending_t;
+
+typedef struct
+{
+    int endpoint;
+    mb_tcp_adu_t *req;
+    mb_tcp_adu_t *resp;
+    ssize_t result;                                     /* length of the response or a negative errno value */
+}
+mb_tcp_client_item_t;
+
+typedef struct
+{
+    uint8_t func_code;                                  /* MB_PDU_RD_COILS, MB_PDU_RD_DISC_IPS, MB_PDU_RD_HOLD_REGS or MB_PDU_RD_IP_REGS */
+    uint16_t start_addr;
+    uint16_t quant;
+    uint16_t *val;                                      /* room for quant values, coils and discrete inputs are 0 or 1 */
+    ssize_t result;                                     /* number of values read or a negative errno value */
+    uint8_t except_code;                                /* exception code if result is -EPROTO */
+}
+mb_tcp_client_range_t;
+
+typedef struct
+{
+    int endpoint[2];                                    /* primary and secondary */
+    int active;                                         /* endpoint tried first */
+    unsigned percentile;                                /* of round trip times after which a read is hedged */
+    unsigned fail_over;                                 /* requests in a row lost by the active endpoint before failing over */
+    unsigned num_fail_run;
+    long rtt_usec[2][MB_TCP_CLIENT_HEDGE_SAMPLES];      /* recent round trip times of each endpoint */
+    unsigned num_rtt[2];
+    unsigned next_rtt[2];
+    long delay_usec[2];                                 /* hedge delay of each endpoint, 0 until known */
+    unsigned long num_hedge;                            /* copies sent */
+    unsigned long num_win;                              /* copies answered first */
+    unsigned long num_fail_over;
+}
+mb_tcp_client_hedge_t;
+
+typedef struct mb_tcp_client
 {
     mb_ip_auth_list_t auth;
-    mb_tcp_con_t con[MB_TCP_CLIENT_MAX_CON];
+    int epoll_fd;                                       /* readable when a connection is readable */
+    mb_tcp_con_t *con;
+    mb_tcp_client_con_state_t *state;
+    int num_con;
+    int *hash;                                          /* active connections, MB_TCP_CLIENT_NONE if empty */
+    unsigned hash_mask;
+    int *free_con;                                      /* closed connections */
+    int num_free;
+    int idle_head;                                      /* least recently used idle connection */
+    int idle_tail;                                      /* most recently used idle connection */
     struct timeval timeout;
+    struct timeval connect_timeout;
+    struct timeval reconnect_interval;
+    mb_tcp_client_endpoint_t *endpoint;
+    int num_endpoint;
+    int max_endpoint;
+    unsigned seq;                                       /* upper bits of the next transaction id */
+    mb_tcp_client_pending_t *pending;                   /* indexed by the low bits of the transaction id */
+    int *follower;                                      /* reads waiting for a completed read */
+    int max_pending;
+    int num_pending;
+    int num_discard;                                    /* copies that lost waiting for their responses */
+    mb_tcp_client_hedge_t hedge[MB_TCP_CLIENT_MAX_HEDGE];
+    int num_hedge;
+    mb_tcp_client_cache_entry_t *cache;                 /* NULL if responses are not cached */
+    int num_cache;
+    struct timespec max_age;
+    mb_tcp_client_max_age_t max_age_rule[MB_TCP_CLIENT_MAX_AGE_RULE];
+    int num_max_age_rule;
+    mb_tcp_client_cache_stats_t cache_stats;
+    mb_tcp_client_wr_t wr[MB_TCP_CLIENT_MAX_WR];        /* write queue in the order queued */
+    int num_wr;
+    struct timeval wr_delay;
+    int flushing;                                       /* writes are being sent */
+    mb_tcp_client_wr_stats_t wr_stats;
 }
 mb_tcp_client_t;
 
-void mb_tcp_client_create(mb_tcp_client_t *client, struct timeval timeout);
+int mb_tcp_client_create(mb_tcp_client_t *client, struct timeval timeout);
+int mb_tcp_client_create_size(mb_tcp_client_t *client, struct timeval timeout, int num_con, int max_pending);
 void mb_tcp_client_destroy(mb_tcp_client_t *client);
 int mb_tcp_client_authorise_addr(mb_tcp_client_t *client, const char *str);
+void mb_tcp_client_set_connect_timeout(mb_tcp_client_t *client, struct timeval timeout);
+void mb_tcp_client_set_reconnect_interval(mb_tcp_client_t *client, struct timeval interval);
+int mb_tcp_client_add_endpoint(mb_tcp_client_t *client, const char *host, in_port_t port);
+int mb_tcp_client_remove_endpoint(mb_tcp_client_t *client, int endpoint);
+int mb_tcp_client_preconnect(mb_tcp_client_t *client, const char *host, in_port_t port);
+void mb_tcp_client_maintain(mb_tcp_client_t *client);
+int mb_tcp_client_enable_cache(mb_tcp_client_t *client, int num_entry, struct timeval max_age);
+int mb_tcp_client_set_max_age(mb_tcp_client_t *client, uint8_t func_code, uint16_t start_addr, uint32_t quant, struct timeval max_age);
+void mb_tcp_client_flush_cache(mb_tcp_client_t *client);
+void mb_tcp_client_get_cache_stats(mb_tcp_client_t *client, mb_tcp_client_cache_stats_t *stats);
+int mb_tcp_client_queue_write(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_t *req, mb_tcp_client_wr_func_t func, void *arg);
+int mb_tcp_client_flush_writes(mb_tcp_client_t *client);
+void mb_tcp_client_set_wr_delay(mb_tcp_client_t *client, struct timeval delay);
+void mb_tcp_client_get_wr_stats(mb_tcp_client_t *client, mb_tcp_client_wr_stats_t *stats);
 int mb_tcp_client_exchange(mb_tcp_client_t *client, const char *host, in_port_t port, mb_tcp_adu_t *req, mb_tcp_adu_t *resp);
+int mb_tcp_client_exchange_endpoint(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_t *req, mb_tcp_adu_t *resp);
+int mb_tcp_client_submit(mb_tcp_client_t *client, const char *host, in_port_t port, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg);
+int mb_tcp_client_submit_endpoint(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg);
+int mb_tcp_client_submit_prep(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_prep_t *prep, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg);
+int mb_tcp_client_add_hedge(mb_tcp_client_t *client, int primary, int secondary, unsigned percentile, unsigned fail_over);
+int mb_tcp_client_submit_hedge(mb_tcp_client_t *client, int group, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg);
+void mb_tcp_client_get_hedge(mb_tcp_client_t *client, int group, mb_tcp_client_hedge_t *hedge);
+int mb_tcp_client_exchange_batch(mb_tcp_client_t *client, mb_tcp_client_item_t *item, int num_item, const struct timeval *timeout);
+int mb_tcp_client_set_rd_ranges(mb_tcp_client_t *client, int endpoint, int support);
+int mb_tcp_client_read_ranges(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, mb_tcp_client_range_t *range, int num_range, const struct timeval *timeout);
+ssize_t mb_tcp_client_read_file(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, uint16_t *rec, size_t num_rec, const struct timeval *timeout);
+ssize_t mb_tcp_client_write_file(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, const uint16_t *rec, size_t num_rec, const struct timeval *timeout);
+ssize_t mb_tcp_client_read_file_fd(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, int fd, size_t num_rec, const struct timeval *timeout);
+ssize_t mb_tcp_client_write_file_fd(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, int fd, size_t max_rec, const struct timeval *timeout);
+int mb_tcp_client_poll(mb_tcp_client_t *client, const struct timeval *timeout);
+int mb_tcp_client_next_deadline(mb_tcp_client_t *client, struct timespec *deadline);
+int mb_tcp_client_get_fd(mb_tcp_client_t *client);
+ssize_t mb_tcp_client_result(mb_tcp_client_t *client, int handle, mb_tcp_adu_t *resp);
+void mb_tcp_client_cancel(mb_tcp_client_t *client, int handle);
+int mb_tcp_client_num_pending(mb_tcp_client_t *client);
 
 #endif
@@ -35,26 +35,35 @@
 #include "mb_tcp_adu.h"
 
 #define MB_TCP_CON_SOCKET_CLOSED  0
+#define MB_TCP_CON_TX_BUF_LEN     (16 * MB_TCP_ADU_MAX_LEN)  /* requests waiting for room in the socket */
 
 #define mb_tcp_con_is_active(con)  ((con)->sd != MB_TCP_CON_SOCKET_CLOSED)
+#define mb_tcp_con_tx_pending(con)  ((con)->tx_end > 0)
 
 typedef struct
 {
     int index;
     int sd;
+    unsigned gen;                                       /* incremented each time the connection is opened */
     time_t last_use;
     struct sockaddr_in sin;
     char rx_buf[MB_TCP_ADU_MAX_LEN];
     size_t rx_end;
+    char tx_buf[MB_TCP_CON_TX_BUF_LEN];
+    size_t tx_end;
 }
 mb_tcp_con_t;
 
 int mb_tcp_con_set_non_blocking(int sd);
+int mb_tcp_con_rx_complete(mb_tcp_con_t *con);
 void mb_tcp_con_create(mb_tcp_con_t *con, int index);
 void mb_tcp_con_destroy(mb_tcp_con_t *con);
 void mb_tcp_con_open(mb_tcp_con_t *con, int sd, struct sockaddr_in *sin);
 void mb_tcp_con_close(mb_tcp_con_t *con);
 ssize_t mb_tcp_con_send(mb_tcp_con_t *con, char *buf, size_t len);
+int mb_tcp_con_queue(mb_tcp_con_t *con, const char *buf, size_t len);
+int mb_tcp_con_send_queue(mb_tcp_con_t *con, const char *buf, size_t len);
+int mb_tcp_con_flush(mb_tcp_con_t *con);
 ssize_t mb_tcp_con_recv(mb_tcp_con_t *con);
 void mb_tcp_con_consume(mb_tcp_con_t *con, size_t num);
 
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_TCP_PROXY_H
+#define MB_TCP_PROXY_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "mb_tcp_server.h"
+#include "mb_tcp_con.h"
+
+/*  TCP proxy
+ *
+ *  Requests are forwarded over persistent backend connections with
+ *  rewritten transaction ids.
+ */
+
+#define MB_TCP_PROXY_MAX_BACKEND      8
+#define MB_TCP_PROXY_MAX_BACKEND_CON  4
+#define MB_TCP_PROXY_MAX_PENDING      16                /* requests in flight per backend connection, must be a power of 2 */
+#define MB_TCP_PROXY_MAX_RULE         64
+#define MB_TCP_PROXY_TICK_NSEC        10000000          /* resolution of request timeouts */
+
+typedef enum
+{
+    MB_TCP_PROXY_CON_CLOSED = 0,
+    MB_TCP_PROXY_CON_CONNECTING,
+    MB_TCP_PROXY_CON_OPEN
+}
+mb_tcp_proxy_con_state_t;
+
+typedef struct
+{
+    int used;
+    uint16_t trans_id;                                  /* transaction id on the backend connection */
+    mb_tcp_server_token_t token;
+    uint16_t orig_trans_id;
+    uint16_t orig_proto_id;
+    uint8_t orig_unit_id;
+    uint8_t func_code;
+    struct timespec deadline;
+    int sent;
+    size_t len;
+    char buf[MB_TCP_ADU_MAX_LEN];                       /* formatted request */
+}
+mb_tcp_proxy_pending_t;
+
+typedef struct
+{
+    mb_tcp_con_t con;
+    mb_tcp_proxy_con_state_t state;
+    int wait_out;                                       /* queued requests wait for EPOLLOUT */
+    unsigned seq;                                       /* used to allocate transaction ids */
+    int num_pending;
+    mb_tcp_proxy_pending_t pending[MB_TCP_PROXY_MAX_PENDING];
+}
+mb_tcp_proxy_con_t;
+
+typedef struct
+{
+    struct sockaddr_in sin;
+    int num_con;
+    mb_tcp_proxy_con_t con[MB_TCP_PROXY_MAX_BACKEND_CON];
+}
+mb_tcp_proxy_backend_t;
+
+typedef struct
+{
+    uint8_t unit_id;
+    uint32_t start_addr;
+    uint32_t end_addr;                                  /* one past the last address */
+    int backend;
+    uint8_t backend_unit_id;
+}
+mb_tcp_proxy_rule_t;
+
+typedef struct
+{
+    mb_tcp_server_t *server;
+    struct timeval timeout;                             /* per request */
+    int epoll_fd;
+    int timer_fd;
+    int timer_on;
+    mb_tcp_proxy_backend_t backend[MB_TCP_PROXY_MAX_BACKEND];
+    int num_backend;
+    mb_tcp_proxy_rule_t rule[MB_TCP_PROXY_MAX_RULE];
+    int num_rule;
+}
+mb_tcp_proxy_t;
+
+int mb_tcp_proxy_create(mb_tcp_proxy_t *proxy, mb_tcp_server_t *server, struct timeval timeout);
+void mb_tcp_proxy_destroy(mb_tcp_proxy_t *proxy);
+int mb_tcp_proxy_add_backend(mb_tcp_proxy_t *proxy, const char *host, in_port_t port, int num_con);
+int mb_tcp_proxy_add_rule(mb_tcp_proxy_t *proxy, uint8_t unit_id, uint16_t start_addr, uint32_t quant, int backend, uint8_t backend_unit_id);
+
+#endif
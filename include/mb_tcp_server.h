@@ -36,23 +36,68 @@
 #define MB_TCP_SERVER_MAX_CON        4
 #define MB_TCP_SERVER_SOCKET_CLOSED  0
 #define MB_TCP_SERVER_UNIT_ID        0xff     /* unit id used in server responses */
+#define MB_TCP_SERVER_NUM_UNIT       256
+#define MB_TCP_SERVER_MAX_WATCH      4
+#define MB_TCP_SERVER_DEFERRED       1        /* handler return value, the response will be sent later */
+
+/*  Requests are routed by unit id to the handler added for that unit,
+ *  or to the default handler.
+ *  A handler can return MB_TCP_SERVER_DEFERRED and send the response
+ *  later with mb_tcp_server_send_deferred.
+ */
 
 struct mb_tcp_server;
 
 typedef int (*mb_tcp_server_handler_t)(struct mb_tcp_server *server, mb_tcp_adu_t *req, mb_tcp_adu_t *resp);
+typedef void (*mb_tcp_server_watch_func_t)(struct mb_tcp_server *server, int fd, void *arg);
+
+typedef struct
+{
+    int index;
+    unsigned gen;
+}
+mb_tcp_server_token_t;
+
+typedef struct
+{
+    int fd;
+    mb_tcp_server_watch_func_t func;
+    void *arg;
+}
+mb_tcp_server_watch_t;
+
+typedef struct
+{
+    mb_tcp_server_handler_t handler;
+    void *data;
+    int msg_count;                                      /* requests addressed to this unit */
+    int excep_err_count;                                /* exception responses sent by this unit */
+}
+mb_tcp_server_unit_t;
 
 typedef struct mb_tcp_server
 {
     int sd;
     mb_ip_auth_list_t auth;
     mb_tcp_con_t con[MB_TCP_SERVER_MAX_CON];
-    mb_tcp_server_handler_t handler;
+    mb_tcp_server_handler_t handler;                    /* default handler */
+    mb_tcp_server_unit_t unit[MB_TCP_SERVER_NUM_UNIT];
+    int cur_unit_id;                                    /* unit whose handler is being called */
+    int cur_index;                                      /* connection whose request is being handled */
+    mb_tcp_server_watch_t watch[MB_TCP_SERVER_MAX_WATCH];
 }
 mb_tcp_server_t;
 
 int mb_tcp_server_create(mb_tcp_server_t *server, const char *host, in_port_t port, mb_tcp_server_handler_t handler);
 void mb_tcp_server_destroy(mb_tcp_server_t *server);
 int mb_tcp_server_authorise_addr(mb_tcp_server_t *server, const char *str);
+void mb_tcp_server_add_unit(mb_tcp_server_t *server, uint8_t unit_id, mb_tcp_server_handler_t handler, void *data);
+void mb_tcp_server_remove_unit(mb_tcp_server_t *server, uint8_t unit_id);
+void *mb_tcp_server_get_data(mb_tcp_server_t *server);
+mb_tcp_server_token_t mb_tcp_server_get_token(mb_tcp_server_t *server);
+ssize_t mb_tcp_server_send_deferred(mb_tcp_server_t *server, mb_tcp_server_token_t token, mb_tcp_adu_t *resp);
+int mb_tcp_server_watch_fd(mb_tcp_server_t *server, int fd, mb_tcp_server_watch_func_t func, void *arg);
+void mb_tcp_server_unwatch_fd(mb_tcp_server_t *server, int fd);
 int mb_tcp_server_run(mb_tcp_server_t *server);
 
 #endif
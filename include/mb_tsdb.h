@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_TSDB_H
+#define MB_TSDB_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*  time series store
+ *
+ *  Register values are stored in compressed chunks in memory mapped
+ *  segment files, with one writer process per directory.
+ */
+
+#define MB_TSDB_MAGIC         0x4d425453                /* "MBTS" */
+#define MB_TSDB_CHUNK_MAGIC   0x4d424348                /* "MBCH" */
+#define MB_TSDB_VERSION       1
+#define MB_TSDB_RDONLY        0x01                      /* open flag */
+#define MB_TSDB_CHUNK_LEN     1024                      /* samples per chunk */
+#define MB_TSDB_MAX_QUANT     125                       /* registers per block */
+#define MB_TSDB_SEG_SIZE      (64 * 1024 * 1024)        /* default size of a segment file */
+#define MB_TSDB_MIN_SEG_SIZE  (1024 * 1024)             /* holds the largest chunk */
+#define MB_TSDB_MIN_BLOCK     64
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;                                      /* size of the segment file */
+}
+mb_tsdb_seg_hdr_t;
+
+typedef struct
+{
+    _Atomic uint32_t magic;                             /* written last */
+    uint32_t len;                                       /* bytes in the chunk, a multiple of 8 */
+    uint32_t dev;
+    uint16_t start_addr;
+    uint16_t quant;
+    uint32_t num_sample;
+    uint32_t pad;
+    int64_t first_time;
+    int64_t min_time;
+    int64_t max_time;
+    uint32_t col_off[];                                 /* offset of the timestamp column then of each register column */
+}
+mb_tsdb_chunk_t;
+
+typedef struct
+{
+    uint32_t dev;
+    uint16_t addr;
+    int64_t time;                                       /* milliseconds */
+    uint16_t val;
+}
+mb_tsdb_sample_t;
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t cap;
+    uint64_t num_bit;
+}
+mb_tsdb_bits_t;
+
+typedef struct
+{
+    uint16_t prev;
+    uint32_t run;                                       /* repeats not yet written */
+    mb_tsdb_bits_t bits;
+}
+mb_tsdb_col_t;
+
+typedef struct
+{
+    uint32_t dev;
+    uint16_t start_addr;
+    uint16_t quant;
+    uint32_t num_sample;
+    int64_t first_time;
+    int64_t min_time;
+    int64_t max_time;
+    int64_t prev_time;
+    int64_t prev_delta;
+    uint32_t time_run;                                  /* unchanged intervals not yet written */
+    mb_tsdb_bits_t time_bits;
+    mb_tsdb_col_t *col;
+}
+mb_tsdb_block_t;
+
+typedef struct
+{
+    char *mem;
+    size_t size;
+    size_t end;                                         /* end of the last chunk */
+}
+mb_tsdb_seg_t;
+
+typedef struct
+{
+    unsigned long long num_sample;                      /* samples written to chunks */
+    unsigned long num_chunk;
+    unsigned long long num_byte;                        /* bytes of chunks */
+}
+mb_tsdb_stats_t;
+
+typedef void (*mb_tsdb_func_t)(uint32_t dev, uint16_t addr, int64_t time, uint16_t val, void *arg);
+
+typedef struct
+{
+    char *dir;
+    int flags;
+    size_t seg_size;
+    mb_tsdb_seg_t *seg;
+    int num_seg;
+    int max_seg;
+    int sync_seg;                                       /* first segment written since the last flush */
+    mb_tsdb_block_t *block;
+    int num_block;
+    int max_block;
+    int *hash;                                          /* blocks by device and address range, -1 if empty */
+    int hash_size;
+    mb_tsdb_stats_t stats;
+}
+mb_tsdb_t;
+
+int mb_tsdb_open(mb_tsdb_t *db, const char *dir, size_t seg_size, int flags);
+void mb_tsdb_close(mb_tsdb_t *db);
+int mb_tsdb_write_regs(mb_tsdb_t *db, uint32_t dev, uint16_t start_addr, int64_t time, const uint16_t *val, uint16_t quant);
+int mb_tsdb_write(mb_tsdb_t *db, const mb_tsdb_sample_t *sample, int num);
+int mb_tsdb_flush(mb_tsdb_t *db);
+long long mb_tsdb_scan(mb_tsdb_t *db, uint32_t dev, uint16_t addr, int64_t start_time, int64_t end_time, mb_tsdb_func_t func, void *arg);
+void mb_tsdb_get_stats(mb_tsdb_t *db, mb_tsdb_stats_t *stats);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "mb_delta.h"
+
+void mb_delta_create(mb_delta_t *delta)
+{
+    memset(delta, 0, sizeof(mb_delta_t));
+}
+
+void mb_delta_destroy(mb_delta_t *delta)
+{
+    int i = 0;
+
+    for (i = 0; i < delta->num_block; i++)
+    {
+        free(delta->block[i].val);
+        free(delta->block[i].in_band);
+        free(delta->block[i].band);
+    }
+    free(delta->block);
+    memset(delta, 0, sizeof(mb_delta_t));
+}
+
+int mb_delta_add_block(mb_delta_t *delta, const mb_pdu_t *req)
+{
+    mb_delta_block_t *block = NULL;
+    uint16_t start_addr = 0;
+    uint16_t quant = 0;
+    int max_block = 0;
+
+    switch (req->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        start_addr = req->rd_coils_req.start_addr;
+        quant = req->rd_coils_req.quant_coils;
+        break;
+    case MB_PDU_RD_DISC_IPS:
+        start_addr = req->rd_disc_ips_req.start_addr;
+        quant = req->rd_disc_ips_req.quant_ips;
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        start_addr = req->rd_hold_regs_req.start_addr;
+        quant = req->rd_hold_regs_req.quant_regs;
+        break;
+    case MB_PDU_RD_IP_REGS:
+        start_addr = req->rd_ip_regs_req.start_addr;
+        quant = req->rd_ip_regs_req.quant_ip_regs;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (quant == 0)
+    {
+        return -EINVAL;
+    }
+    if (delta->num_block == delta->max_block)
+    {
+        max_block = delta->max_block ? 2 * delta->max_block : MB_DELTA_MIN_BLOCK;
+        block = realloc(delta->block, max_block * sizeof(mb_delta_block_t));
+        if (block == NULL)
+        {
+            return -ENOMEM;
+        }
+        delta->block = block;
+        delta->max_block = max_block;
+    }
+    block = &delta->block[delta->num_block];
+    memset(block, 0, sizeof(mb_delta_block_t));
+    block->val = calloc(quant, sizeof(uint16_t));
+    block->in_band = calloc(quant, sizeof(uint8_t));
+    if ((block->val == NULL) || (block->in_band == NULL))
+    {
+        free(block->val);
+        free(block->in_band);
+        return -ENOMEM;
+    }
+    block->func_code = req->func_code;
+    block->start_addr = start_addr;
+    block->quant = quant;
+    return delta->num_block++;
+}
+
+int mb_delta_add_deadband(mb_delta_t *delta, int block, uint16_t addr, mb_delta_type_t type, double deadband)
+{
+    mb_delta_band_t *band = NULL;
+    mb_delta_block_t *b = NULL;
+    unsigned offset = 0;
+    unsigned len = 0;
+    unsigned i = 0;
+
+    b = &delta->block[block];
+    if ((b->func_code != MB_PDU_RD_HOLD_REGS) && (b->func_code != MB_PDU_RD_IP_REGS))
+    {
+        return -EINVAL;
+    }
+    len = type >= MB_DELTA_U32 ? 2 : 1;
+    offset = (uint16_t)(addr - b->start_addr);
+    if ((offset + len > b->quant) || (deadband < 0.0))
+    {
+        return -EINVAL;
+    }
+    for (i = offset; i < offset + len; i++)
+    {
+        if (b->in_band[i])
+            return -EEXIST;
+    }
+    band = realloc(b->band, (b->num_band + 1) * sizeof(mb_delta_band_t));
+    if (band == NULL)
+    {
+        return -ENOMEM;
+    }
+    b->band = band;
+    band = &b->band[b->num_band++];
+    band->offset = offset;
+    band->type = type;
+    band->deadband = deadband;
+    for (i = offset; i < offset + len; i++)
+        b->in_band[i] = b->num_band;
+    return 0;
+}
+
+void mb_delta_reset(mb_delta_t *delta, int block)
+{
+    delta->block[block].valid = 0;
+}
+
+static double mb_delta_value(const uint16_t *val, mb_delta_type_t type)
+{
+    uint32_t u = 0;
+    float f = 0.0;
+
+    switch (type)
+    {
+    case MB_DELTA_S16:
+        return (int16_t)val[0];
+    case MB_DELTA_U32:
+        return ((uint32_t)val[0] << 16) | val[1];
+    case MB_DELTA_S32:
+        return (int32_t)(((uint32_t)val[0] << 16) | val[1]);
+    case MB_DELTA_F32:
+        u = ((uint32_t)val[0] << 16) | val[1];
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    default:
+        return val[0];
+    }
+}
+
+/* returns non-zero if the value has moved outside its deadband */
+static int mb_delta_band_changed(const mb_delta_band_t *band, const uint16_t *old, const uint16_t *new)
+{
+    double old_val = 0.0;
+    double new_val = 0.0;
+
+    old_val = mb_delta_value(old, band->type);
+    new_val = mb_delta_value(new, band->type);
+    if (isnan(old_val) || isnan(new_val))
+        return memcmp(old, new, band->type >= MB_DELTA_U32 ? 4 : 2) != 0;
+    return fabs(new_val - old_val) > band->deadband;
+}
+
+/* add a changed range, merging it with the previous one if they touch */
+static int mb_delta_add_range(mb_delta_block_t *block, mb_delta_range_t *range, int max_range, int num, unsigned offset, unsigned len)
+{
+    mb_delta_range_t *last = NULL;
+    uint16_t start_addr = 0;
+
+    start_addr = block->start_addr + offset;
+    if (num > 0)
+    {
+        last = &range[num - 1];
+        if ((uint16_t)(last->start_addr + last->quant) == start_addr)
+        {
+            last->quant += len;
+            return num;
+        }
+        if (num == max_range)
+        {
+            /* out of ranges, stretch the last one to cover this change */
+            last->quant = start_addr + len - last->start_addr;
+            return num;
+        }
+    }
+    if (max_range <= 0)
+    {
+        return num;
+    }
+    range[num].start_addr = start_addr;
+    range[num].quant = len;
+    return num + 1;
+}
+
+int mb_delta_update(mb_delta_t *delta, int block, const mb_pdu_t *resp, mb_delta_range_t *range, int max_range)
+{
+    mb_delta_block_t *b = NULL;
+    mb_delta_band_t *band = NULL;
+    const uint8_t *stat = NULL;
+    const uint16_t *val = NULL;
+    uint16_t bit[MB_PDU_RD_COILS_MAX_QUANT_COILS] = {0};
+    uint64_t old_word = 0;
+    uint64_t new_word = 0;
+    unsigned len = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+    int num = 0;
+
+    b = &delta->block[block];
+    if ((resp->type != MB_PDU_RESP) || (resp->func_code != b->func_code))
+    {
+        return -EBADMSG;
+    }
+    switch (resp->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        if (resp->rd_coils_resp.byte_count != (b->quant + 7) / 8)
+            return -EBADMSG;
+        stat = resp->rd_coils_resp.coil_stat;
+        break;
+    case MB_PDU_RD_DISC_IPS:
+        if (resp->rd_disc_ips_resp.byte_count != (b->quant + 7) / 8)
+            return -EBADMSG;
+        stat = resp->rd_disc_ips_resp.ip_stat;
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        if (resp->rd_hold_regs_resp.byte_count != 2 * b->quant)
+            return -EBADMSG;
+        val = resp->rd_hold_regs_resp.reg_val;
+        break;
+    default:
+        if (resp->rd_ip_regs_resp.byte_count != 2 * b->quant)
+            return -EBADMSG;
+        val = resp->rd_ip_regs_resp.ip_reg;
+        break;
+    }
+    if (stat != NULL)
+    {
+        for (i = 0; i < b->quant; i++)
+            bit[i] = (stat[i / 8] >> (i % 8)) & 1;
+        val = bit;
+    }
+    if (!b->valid)
+    {
+        memcpy(b->val, val, b->quant * sizeof(uint16_t));
+        b->valid = 1;
+        return mb_delta_add_range(b, range, max_range, 0, 0, b->quant);
+    }
+    i = 0;
+    while (i < b->quant)
+    {
+        /* skip unchanged values four at a time */
+        if (i + 4 <= b->quant)
+        {
+            memcpy(&old_word, &b->val[i], sizeof(old_word));
+            memcpy(&new_word, &val[i], sizeof(new_word));
+            if (old_word == new_word)
+            {
+                i += 4;
+                continue;
+            }
+        }
+        if (b->val[i] == val[i])
+        {
+            i++;
+            continue;
+        }
+        if (!b->in_band[i])
+        {
+            b->val[i] = val[i];
+            num = mb_delta_add_range(b, range, max_range, num, i, 1);
+            i++;
+            continue;
+        }
+        band = &b->band[b->in_band[i] - 1];
+        len = band->type >= MB_DELTA_U32 ? 2 : 1;
+        if (mb_delta_band_changed(band, &b->val[band->offset], &val[band->offset]))
+        {
+            for (j = band->offset; j < band->offset + len; j++)
+                b->val[j] = val[j];
+            num = mb_delta_add_range(b, range, max_range, num, band->offset, len);
+        }
+        i = band->offset + len;
+    }
+    return num;
+}
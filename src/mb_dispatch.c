@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mb_dispatch.h"
+
+#define MB_DISPATCH_MIN_ENTRY  8
+
+static int mb_dispatch_entry_le(mb_dispatch_entry_t *entry, mb_dispatch_class_t class, uint32_t addr)
+{
+    if (entry->class != class)
+        return entry->class < class;
+    return entry->start_addr <= addr;
+}
+
+/* return the index of the first entry that starts after (class, addr) */
+static size_t mb_dispatch_upper_bound(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint32_t addr)
+{
+    size_t mid = 0;
+    size_t lo = 0;
+    size_t hi = 0;
+
+    hi = dispatch->num_entry;
+    while (lo < hi)
+    {
+        mid = lo + ((hi - lo) >> 1);
+        if (mb_dispatch_entry_le(&dispatch->entry[mid], class, addr))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static mb_dispatch_entry_t *mb_dispatch_find(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint32_t addr)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    size_t i = 0;
+
+    i = mb_dispatch_upper_bound(dispatch, class, addr);
+    if (i == 0)
+        return NULL;
+    entry = &dispatch->entry[i - 1];
+    if ((entry->class != class) || (addr >= entry->end_addr))
+        return NULL;
+    return entry;
+}
+
+void mb_dispatch_create(mb_dispatch_t *dispatch)
+{
+    memset(dispatch, 0, sizeof(mb_dispatch_t));
+}
+
+void mb_dispatch_destroy(mb_dispatch_t *dispatch)
+{
+    free(dispatch->entry);
+    memset(dispatch, 0, sizeof(mb_dispatch_t));
+}
+
+int mb_dispatch_add(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint32_t quant, mb_dispatch_handler_t handler, void *data)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    uint32_t end_addr = 0;
+    size_t max_entry = 0;
+    size_t i = 0;
+
+    if ((class > MB_DISPATCH_IP_REGS) || (quant == 0) || (handler == NULL))
+    {
+        return -EINVAL;
+    }
+    end_addr = (uint32_t)start_addr + quant;
+    if (end_addr > MB_DISPATCH_NUM_ADDR)
+    {
+        return -EINVAL;
+    }
+    i = mb_dispatch_upper_bound(dispatch, class, start_addr);
+    if ((i > 0)
+     && (dispatch->entry[i - 1].class == class)
+     && (dispatch->entry[i - 1].end_addr > start_addr))
+    {
+        return -EEXIST;  /* overlaps the previous entry */
+    }
+    if ((i < dispatch->num_entry)
+     && (dispatch->entry[i].class == class)
+     && (dispatch->entry[i].start_addr < end_addr))
+    {
+        return -EEXIST;  /* overlaps the next entry */
+    }
+    if (dispatch->num_entry == dispatch->max_entry)
+    {
+        max_entry = dispatch->max_entry ? 2 * dispatch->max_entry : MB_DISPATCH_MIN_ENTRY;
+        entry = realloc(dispatch->entry, max_entry * sizeof(mb_dispatch_entry_t));
+        if (entry == NULL)
+        {
+            return -ENOMEM;
+        }
+        dispatch->entry = entry;
+        dispatch->max_entry = max_entry;
+    }
+    memmove(&dispatch->entry[i + 1], &dispatch->entry[i], (dispatch->num_entry - i) * sizeof(mb_dispatch_entry_t));
+    entry = &dispatch->entry[i];
+    entry->class = class;
+    entry->start_addr = start_addr;
+    entry->end_addr = end_addr;
+    entry->handler = handler;
+    entry->data = data;
+    dispatch->num_entry++;
+    return 0;
+}
+
+void mb_dispatch_set_default(mb_dispatch_t *dispatch, mb_dispatch_handler_t handler, void *data)
+{
+    dispatch->def_handler = handler;
+    dispatch->def_data = data;
+}
+
+/* check that entries cover the whole range so a write is not applied in part */
+static int mb_dispatch_check_range(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint32_t quant)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    uint32_t end_addr = 0;
+    uint32_t addr = 0;
+
+    end_addr = (uint32_t)start_addr + quant;
+    for (addr = start_addr; addr < end_addr; addr = entry->end_addr)
+    {
+        entry = mb_dispatch_find(dispatch, class, addr);
+        if (entry == NULL)
+        {
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        }
+    }
+    return 0;
+}
+
+static int mb_dispatch_rd_bits(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint16_t quant, uint8_t *val)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    mb_pdu_t sub_resp = {0};
+    mb_pdu_t sub_req = {0};
+    uint32_t end_addr = 0;
+    uint32_t addr = 0;
+    unsigned off = 0;
+    unsigned i = 0;
+    uint16_t num = 0;
+    uint8_t *bits = NULL;
+    uint8_t byte_count = 0;
+    int ret = 0;
+
+    memset(val, 0, (quant + 7) >> 3);
+    end_addr = (uint32_t)start_addr + quant;
+    for (addr = start_addr; addr < end_addr; addr += num)
+    {
+        entry = mb_dispatch_find(dispatch, class, addr);
+        if (entry == NULL)
+        {
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        }
+        num = ((entry->end_addr < end_addr) ? entry->end_addr : end_addr) - addr;
+        if (class == MB_DISPATCH_COILS)
+            ret = mb_pdu_set_rd_coils_req(&sub_req, addr, num);
+        else
+            ret = mb_pdu_set_rd_disc_ips_req(&sub_req, addr, num);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        ret = (*entry->handler)(entry->data, &sub_req, &sub_resp);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        if (class == MB_DISPATCH_COILS)
+        {
+            byte_count = sub_resp.rd_coils_resp.byte_count;
+            bits = sub_resp.rd_coils_resp.coil_stat;
+        }
+        else
+        {
+            byte_count = sub_resp.rd_disc_ips_resp.byte_count;
+            bits = sub_resp.rd_disc_ips_resp.ip_stat;
+        }
+        if ((sub_resp.func_code != sub_req.func_code) || (byte_count != ((num + 7) >> 3)))
+        {
+            return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+        }
+        off = addr - start_addr;
+        for (i = 0; i < num; i++)
+        {
+            if ((bits[i >> 3] >> (i & 0x07)) & 0x01)
+                val[(off + i) >> 3] |= 1 << ((off + i) & 0x07);
+        }
+    }
+    return 0;
+}
+
+static int mb_dispatch_rd_regs(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint16_t quant, uint16_t *val)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    mb_pdu_t sub_resp = {0};
+    mb_pdu_t sub_req = {0};
+    uint32_t end_addr = 0;
+    uint32_t addr = 0;
+    uint16_t *regs = NULL;
+    uint16_t num = 0;
+    uint8_t byte_count = 0;
+    int ret = 0;
+
+    end_addr = (uint32_t)start_addr + quant;
+    for (addr = start_addr; addr < end_addr; addr += num)
+    {
+        entry = mb_dispatch_find(dispatch, class, addr);
+        if (entry == NULL)
+        {
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        }
+        num = ((entry->end_addr < end_addr) ? entry->end_addr : end_addr) - addr;
+        if (class == MB_DISPATCH_HOLD_REGS)
+            ret = mb_pdu_set_rd_hold_regs_req(&sub_req, addr, num);
+        else
+            ret = mb_pdu_set_rd_ip_regs_req(&sub_req, addr, num);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        ret = (*entry->handler)(entry->data, &sub_req, &sub_resp);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        if (class == MB_DISPATCH_HOLD_REGS)
+        {
+            byte_count = sub_resp.rd_hold_regs_resp.byte_count;
+            regs = sub_resp.rd_hold_regs_resp.reg_val;
+        }
+        else
+        {
+            byte_count = sub_resp.rd_ip_regs_resp.byte_count;
+            regs = sub_resp.rd_ip_regs_resp.ip_reg;
+        }
+        if ((sub_resp.func_code != sub_req.func_code) || (byte_count != 2 * num))
+        {
+            return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+        }
+        memcpy(val + (addr - start_addr), regs, 2 * num);
+    }
+    return 0;
+}
+
+static int mb_dispatch_wr_coils(mb_dispatch_t *dispatch, uint16_t start_addr, uint16_t quant, const uint8_t *val)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    mb_pdu_t sub_resp = {0};
+    mb_pdu_t sub_req = {0};
+    uint32_t end_addr = 0;
+    uint32_t addr = 0;
+    unsigned off = 0;
+    unsigned i = 0;
+    uint16_t num = 0;
+    uint8_t bits[MB_PDU_WR_MULT_COILS_MAX_BYTE_COUNT] = {0};
+    int ret = 0;
+
+    ret = mb_dispatch_check_range(dispatch, MB_DISPATCH_COILS, start_addr, quant);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    end_addr = (uint32_t)start_addr + quant;
+    for (addr = start_addr; addr < end_addr; addr += num)
+    {
+        entry = mb_dispatch_find(dispatch, MB_DISPATCH_COILS, addr);
+        if (entry == NULL)
+        {
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        }
+        num = ((entry->end_addr < end_addr) ? entry->end_addr : end_addr) - addr;
+        off = addr - start_addr;
+        memset(bits, 0, sizeof(bits));
+        for (i = 0; i < num; i++)
+        {
+            if ((val[(off + i) >> 3] >> ((off + i) & 0x07)) & 0x01)
+                bits[i >> 3] |= 1 << (i & 0x07);
+        }
+        ret = mb_pdu_set_wr_mult_coils_req(&sub_req, addr, num, bits);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        ret = (*entry->handler)(entry->data, &sub_req, &sub_resp);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int mb_dispatch_wr_regs(mb_dispatch_t *dispatch, uint16_t start_addr, uint16_t quant, const uint16_t *val)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    mb_pdu_t sub_resp = {0};
+    mb_pdu_t sub_req = {0};
+    uint32_t end_addr = 0;
+    uint32_t addr = 0;
+    uint16_t num = 0;
+    int ret = 0;
+
+    ret = mb_dispatch_check_range(dispatch, MB_DISPATCH_HOLD_REGS, start_addr, quant);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    end_addr = (uint32_t)start_addr + quant;
+    for (addr = start_addr; addr < end_addr; addr += num)
+    {
+        entry = mb_dispatch_find(dispatch, MB_DISPATCH_HOLD_REGS, addr);
+        if (entry == NULL)
+        {
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        }
+        num = ((entry->end_addr < end_addr) ? entry->end_addr : end_addr) - addr;
+        ret = mb_pdu_set_wr_mult_regs_req(&sub_req, addr, num, 2 * num, val + (addr - start_addr));
+        if (ret < 0)
+        {
+            return ret;
+        }
+        ret = (*entry->handler)(entry->data, &sub_req, &sub_resp);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* pass the request straight to the handler when a single entry covers it */
+static mb_dispatch_entry_t *mb_dispatch_find_range(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint32_t quant)
+{
+    mb_dispatch_entry_t *entry = NULL;
+
+    entry = mb_dispatch_find(dispatch, class, start_addr);
+    if ((entry == NULL) || ((uint32_t)start_addr + quant > entry->end_addr))
+        return NULL;
+    return entry;
+}
+
+static int mb_dispatch_handle_rd_bits(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint16_t quant, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    uint8_t val[MB_PDU_RD_COILS_MAX_BYTE_COUNT] = {0};
+    int ret = 0;
+
+    entry = mb_dispatch_find_range(dispatch, class, start_addr, quant);
+    if (entry != NULL)
+    {
+        return (*entry->handler)(entry->data, req, resp);
+    }
+    ret = mb_dispatch_rd_bits(dispatch, class, start_addr, quant, val);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (class == MB_DISPATCH_COILS)
+        ret = mb_pdu_set_rd_coils_resp(resp, (quant + 7) >> 3, val);
+    else
+        ret = mb_pdu_set_rd_disc_ips_resp(resp, (quant + 7) >> 3, val);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+static int mb_dispatch_handle_rd_regs(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t start_addr, uint16_t quant, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_dispatch_entry_t *entry = NULL;
+    uint16_t val[MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS] = {0};
+    int ret = 0;
+
+    entry = mb_dispatch_find_range(dispatch, class, start_addr, quant);
+    if (entry != NULL)
+    {
+        return (*entry->handler)(entry->data, req, resp);
+    }
+    ret = mb_dispatch_rd_regs(dispatch, class, start_addr, quant, val);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (class == MB_DISPATCH_HOLD_REGS)
+        ret = mb_pdu_set_rd_hold_regs_resp(resp, 2 * quant, val);
+    else
+        ret = mb_pdu_set_rd_ip_regs_resp(resp, 2 * quant, val);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+static int mb_dispatch_handle_single(mb_dispatch_t *dispatch, mb_dispatch_class_t class, uint16_t addr, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_dispatch_entry_t *entry = NULL;
+
+    entry = mb_dispatch_find(dispatch, class, addr);
+    if (entry == NULL)
+    {
+        return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+    }
+    return (*entry->handler)(entry->data, req, resp);
+}
+
+static int mb_dispatch_handle_wr_mult_coils(mb_dispatch_t *dispatch, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_pdu_wr_mult_coils_req_t *wr = NULL;
+    mb_dispatch_entry_t *entry = NULL;
+    int ret = 0;
+
+    wr = &req->wr_mult_coils_req;
+    entry = mb_dispatch_find_range(dispatch, MB_DISPATCH_COILS, wr->start_addr, wr->quant_ops);
+    if (entry != NULL)
+    {
+        return (*entry->handler)(entry->data, req, resp);
+    }
+    ret = mb_dispatch_wr_coils(dispatch, wr->start_addr, wr->quant_ops, wr->op_val);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = mb_pdu_set_wr_mult_coils_resp(resp, wr->start_addr, wr->quant_ops);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+static int mb_dispatch_handle_wr_mult_regs(mb_dispatch_t *dispatch, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_pdu_wr_mult_regs_req_t *wr = NULL;
+    mb_dispatch_entry_t *entry = NULL;
+    int ret = 0;
+
+    wr = &req->wr_mult_regs_req;
+    entry = mb_dispatch_find_range(dispatch, MB_DISPATCH_HOLD_REGS, wr->start_addr, wr->quant_regs);
+    if (entry != NULL)
+    {
+        return (*entry->handler)(entry->data, req, resp);
+    }
+    ret = mb_dispatch_wr_regs(dispatch, wr->start_addr, wr->quant_regs, wr->reg_val);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = mb_pdu_set_wr_mult_regs_resp(resp, wr->start_addr, wr->quant_regs);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+/* a request whose read and write ranges are not covered by one entry
+ * is split into writes followed by reads, which is not atomic, but
+ * nothing is written unless both ranges are covered */
+static int mb_dispatch_handle_rd_wr_mult_regs(mb_dispatch_t *dispatch, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_pdu_rd_wr_mult_regs_req_t *rd_wr = NULL;
+    mb_dispatch_entry_t *entry = NULL;
+    uint16_t val[MB_PDU_RD_WR_MULT_REGS_MAX_QUANT_RD] = {0};
+    int ret = 0;
+
+    rd_wr = &req->rd_wr_mult_regs_req;
+    entry = mb_dispatch_find_range(dispatch, MB_DISPATCH_HOLD_REGS, rd_wr->rd_start_addr, rd_wr->quant_rd);
+    if ((entry != NULL)
+     && (entry == mb_dispatch_find_range(dispatch, MB_DISPATCH_HOLD_REGS, rd_wr->wr_start_addr, rd_wr->quant_wr)))
+    {
+        return (*entry->handler)(entry->data, req, resp);
+    }
+    ret = mb_dispatch_check_range(dispatch, MB_DISPATCH_HOLD_REGS, rd_wr->rd_start_addr, rd_wr->quant_rd);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = mb_dispatch_wr_regs(dispatch, rd_wr->wr_start_addr, rd_wr->quant_wr, rd_wr->wr_reg_val);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = mb_dispatch_rd_regs(dispatch, MB_DISPATCH_HOLD_REGS, rd_wr->rd_start_addr, rd_wr->quant_rd, val);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = mb_pdu_set_rd_wr_mult_regs_resp(resp, 2 * rd_wr->quant_rd, val);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+int mb_dispatch_handle(mb_dispatch_t *dispatch, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    switch (req->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        return mb_dispatch_handle_rd_bits(dispatch, MB_DISPATCH_COILS, req->rd_coils_req.start_addr, req->rd_coils_req.quant_coils, req, resp);
+    case MB_PDU_RD_DISC_IPS:
+        return mb_dispatch_handle_rd_bits(dispatch, MB_DISPATCH_DISC_IPS, req->rd_disc_ips_req.start_addr, req->rd_disc_ips_req.quant_ips, req, resp);
+    case MB_PDU_RD_HOLD_REGS:
+        return mb_dispatch_handle_rd_regs(dispatch, MB_DISPATCH_HOLD_REGS, req->rd_hold_regs_req.start_addr, req->rd_hold_regs_req.quant_regs, req, resp);
+    case MB_PDU_RD_IP_REGS:
+        return mb_dispatch_handle_rd_regs(dispatch, MB_DISPATCH_IP_REGS, req->rd_ip_regs_req.start_addr, req->rd_ip_regs_req.quant_ip_regs, req, resp);
+    case MB_PDU_WR_SING_COIL:
+        return mb_dispatch_handle_single(dispatch, MB_DISPATCH_COILS, req->wr_sing_coil_req.op_addr, req, resp);
+    case MB_PDU_WR_SING_REG:
+        return mb_dispatch_handle_single(dispatch, MB_DISPATCH_HOLD_REGS, req->wr_sing_reg_req.reg_addr, req, resp);
+    case MB_PDU_WR_MULT_COILS:
+        return mb_dispatch_handle_wr_mult_coils(dispatch, req, resp);
+    case MB_PDU_WR_MULT_REGS:
+        return mb_dispatch_handle_wr_mult_regs(dispatch, req, resp);
+    case MB_PDU_MASK_WR_REG:
+        return mb_dispatch_handle_single(dispatch, MB_DISPATCH_HOLD_REGS, req->mask_wr_reg_req.ref_addr, req, resp);
+    case MB_PDU_RD_WR_MULT_REGS:
+        return mb_dispatch_handle_rd_wr_mult_regs(dispatch, req, resp);
+    }
+    if (dispatch->def_handler == NULL)
+    {
+        return -MB_PDU_EXCEPT_ILLEGAL_FUNC;
+    }
+    return (*dispatch->def_handler)(dispatch->def_data, req, resp);
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mb_fanout.h"
+#include "mb_poller.h"
+#include "mb_log.h"
+
+int mb_fanout_create(mb_fanout_t *fanout, unsigned num_rec, size_t slab_size)
+{
+    unsigned i = 0;
+
+    if ((num_rec == 0) || (num_rec & (num_rec - 1)) || (slab_size < MB_FANOUT_RESP_LEN))
+    {
+        return -EINVAL;
+    }
+    memset(fanout, 0, sizeof(mb_fanout_t));
+    fanout->rec = calloc(num_rec, sizeof(mb_fanout_rec_t));
+    if (fanout->rec == NULL)
+    {
+        return -ENOMEM;
+    }
+    fanout->slab = calloc(1, slab_size);
+    if (fanout->slab == NULL)
+    {
+        free(fanout->rec);
+        return -ENOMEM;
+    }
+    for (i = 0; i < num_rec; i++)
+        atomic_init(&fanout->rec[i].seq, MB_FANOUT_BUSY);
+    fanout->num_rec = num_rec;
+    fanout->slab_size = slab_size;
+    atomic_init(&fanout->slab_end, 0);
+    atomic_init(&fanout->tail, 0);
+    atomic_init(&fanout->wake, 0);
+    atomic_init(&fanout->num_wait, 0);
+    pthread_mutex_init(&fanout->lock, NULL);
+    return 0;
+}
+
+void mb_fanout_destroy(mb_fanout_t *fanout)
+{
+    pthread_mutex_destroy(&fanout->lock);
+    free(fanout->slab);
+    free(fanout->rec);
+    memset(fanout, 0, sizeof(mb_fanout_t));
+}
+
+/* must only be called from one thread */
+int mb_fanout_publish(mb_fanout_t *fanout, int dev, int group, int req, ssize_t result, const char *resp, size_t resp_len)
+{
+    mb_fanout_rec_t *rec = NULL;
+    uint64_t seq = 0;
+    size_t off = 0;
+
+    if (resp_len > MB_FANOUT_RESP_LEN)
+    {
+        return -EMSGSIZE;
+    }
+    /* keep each response contiguous in the slab */
+    off = fanout->slab_pos % fanout->slab_size;
+    if (off + resp_len > fanout->slab_size)
+    {
+        fanout->slab_pos += fanout->slab_size - off;
+        off = 0;
+    }
+    seq = atomic_load_explicit(&fanout->tail, memory_order_relaxed);
+    rec = &fanout->rec[seq & (fanout->num_rec - 1)];
+    /* readers of the old record and of the old response see that they were overwritten */
+    atomic_store_explicit(&rec->seq, MB_FANOUT_BUSY, memory_order_relaxed);
+    atomic_store_explicit(&fanout->slab_end, fanout->slab_pos + resp_len, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    rec->dev = dev;
+    rec->group = group;
+    rec->req = req;
+    rec->result = result;
+    rec->pos = fanout->slab_pos;
+    rec->resp_len = resp_len;
+    if (resp_len > 0)
+        memcpy(&fanout->slab[off], resp, resp_len);
+    fanout->slab_pos += resp_len;
+    atomic_store_explicit(&rec->seq, seq, memory_order_release);
+    atomic_store_explicit(&fanout->tail, seq + 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&fanout->num_wait, memory_order_seq_cst) > 0)
+    {
+        atomic_fetch_add_explicit(&fanout->wake, 1, memory_order_seq_cst);
+        syscall(SYS_futex, &fanout->wake, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+/* pass as the function of a poller group with the fan-out as its argument */
+void mb_fanout_poller_func(struct mb_poller *poller, int group, int req, ssize_t result, mb_pdu_t *resp, void *arg)
+{
+    mb_fanout_t *fanout = (mb_fanout_t *)arg;
+    ssize_t num = 0;
+    char buf[MB_FANOUT_RESP_LEN] = {0};
+
+    if (resp != NULL)
+    {
+        num = mb_pdu_format_resp(resp, buf, sizeof(buf));
+        if (num < 0)
+        {
+            result = -EBADMSG;
+            num = 0;
+        }
+    }
+    mb_fanout_publish(fanout, poller->group[group].dev, group, req, result, buf, num);
+}
+
+/* new subscribers start at the tail, a max lag of 0 means half the ring */
+int mb_fanout_subscribe(mb_fanout_t *fanout, uint64_t max_lag)
+{
+    mb_fanout_sub_t *s = NULL;
+    int i = 0;
+
+    pthread_mutex_lock(&fanout->lock);
+    for (i = 0; i < MB_FANOUT_MAX_SUB; i++)
+    {
+        s = &fanout->sub[i];
+        if (atomic_load_explicit(&s->used, memory_order_relaxed))
+            continue;
+        s->max_lag = (max_lag != 0) ? max_lag : fanout->num_rec / 2;
+        atomic_store_explicit(&s->cursor, atomic_load_explicit(&fanout->tail, memory_order_acquire), memory_order_relaxed);
+        atomic_store_explicit(&s->num_read, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->num_lost, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->num_stale, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->used, 1, memory_order_release);
+        pthread_mutex_unlock(&fanout->lock);
+        return i;
+    }
+    pthread_mutex_unlock(&fanout->lock);
+    return -ENOSPC;
+}
+
+void mb_fanout_unsubscribe(mb_fanout_t *fanout, int sub)
+{
+    if ((sub < 0) || (sub >= MB_FANOUT_MAX_SUB))
+    {
+        return;
+    }
+    pthread_mutex_lock(&fanout->lock);
+    atomic_store_explicit(&fanout->sub[sub].used, 0, memory_order_release);
+    pthread_mutex_unlock(&fanout->lock);
+}
+
+/* returns 1 if a record and its response have not been overwritten since it was published as seq */
+static int mb_fanout_intact(mb_fanout_t *fanout, const mb_fanout_rec_t *rec, uint64_t seq)
+{
+    if (atomic_load_explicit(&rec->seq, memory_order_relaxed) != seq)
+    {
+        return 0;
+    }
+    return atomic_load_explicit(&fanout->slab_end, memory_order_relaxed) <= rec->pos + fanout->slab_size;
+}
+
+static mb_fanout_sub_t *mb_fanout_get_sub(mb_fanout_t *fanout, int sub)
+{
+    if ((sub < 0) || (sub >= MB_FANOUT_MAX_SUB) || (!atomic_load_explicit(&fanout->sub[sub].used, memory_order_acquire)))
+    {
+        return NULL;
+    }
+    return &fanout->sub[sub];
+}
+
+/* the record stays valid until mb_fanout_release, which must be called before the next call */
+int mb_fanout_next(mb_fanout_t *fanout, int sub, const mb_fanout_rec_t **rec)
+{
+    mb_fanout_sub_t *s = NULL;
+    mb_fanout_rec_t *r = NULL;
+    uint64_t cursor = 0;
+    uint64_t tail = 0;
+
+    s = mb_fanout_get_sub(fanout, sub);
+    if (s == NULL)
+    {
+        return -EINVAL;
+    }
+    cursor = atomic_load_explicit(&s->cursor, memory_order_relaxed);
+    tail = atomic_load_explicit(&fanout->tail, memory_order_acquire);
+    /* skip the records the ring has already wrapped over */
+    if (tail - cursor > fanout->num_rec)
+    {
+        atomic_fetch_add_explicit(&s->num_lost, tail - cursor - fanout->num_rec, memory_order_relaxed);
+        cursor = tail - fanout->num_rec;
+    }
+    for (; cursor != tail; cursor++)
+    {
+        r = &fanout->rec[cursor & (fanout->num_rec - 1)];
+        if (atomic_load_explicit(&r->seq, memory_order_acquire) == cursor)
+        {
+            atomic_thread_fence(memory_order_acquire);
+            if (mb_fanout_intact(fanout, r, cursor))
+            {
+                atomic_store_explicit(&s->cursor, cursor, memory_order_relaxed);
+                *rec = r;
+                return 0;
+            }
+        }
+        atomic_fetch_add_explicit(&s->num_lost, 1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&s->cursor, cursor, memory_order_relaxed);
+    return -EAGAIN;
+}
+
+const char *mb_fanout_resp(mb_fanout_t *fanout, const mb_fanout_rec_t *rec)
+{
+    return &fanout->slab[rec->pos % fanout->slab_size];
+}
+
+/* returns -ESTALE if the record returned by mb_fanout_next was overwritten while it was in use */
+int mb_fanout_release(mb_fanout_t *fanout, int sub)
+{
+    mb_fanout_sub_t *s = NULL;
+    mb_fanout_rec_t *r = NULL;
+    uint64_t cursor = 0;
+    int ret = 0;
+
+    s = mb_fanout_get_sub(fanout, sub);
+    if (s == NULL)
+    {
+        return -EINVAL;
+    }
+    cursor = atomic_load_explicit(&s->cursor, memory_order_relaxed);
+    r = &fanout->rec[cursor & (fanout->num_rec - 1)];
+    atomic_thread_fence(memory_order_acquire);
+    if (mb_fanout_intact(fanout, r, cursor))
+    {
+        atomic_fetch_add_explicit(&s->num_read, 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&s->num_stale, 1, memory_order_relaxed);
+        ret = -ESTALE;
+    }
+    atomic_store_explicit(&s->cursor, cursor + 1, memory_order_relaxed);
+    return ret;
+}
+
+/* returns 1 if there are records to read, 0 if the timeout expired first, a negative timeout waits indefinitely */
+int mb_fanout_wait(mb_fanout_t *fanout, int sub, int timeout_msec)
+{
+    mb_fanout_sub_t *s = NULL;
+    struct timespec ts = {0};
+    uint64_t cursor = 0;
+    unsigned wake = 0;
+
+    s = mb_fanout_get_sub(fanout, sub);
+    if (s == NULL)
+    {
+        return -EINVAL;
+    }
+    cursor = atomic_load_explicit(&s->cursor, memory_order_relaxed);
+    wake = atomic_load_explicit(&fanout->wake, memory_order_seq_cst);
+    if ((atomic_load_explicit(&fanout->tail, memory_order_seq_cst) != cursor) || (timeout_msec == 0))
+    {
+        return atomic_load_explicit(&fanout->tail, memory_order_relaxed) != cursor;
+    }
+    /* the publisher checks for waiters after advancing the tail, so check the tail again once counted */
+    atomic_fetch_add_explicit(&fanout->num_wait, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&fanout->tail, memory_order_seq_cst) == cursor)
+    {
+        ts.tv_sec = timeout_msec / 1000;
+        ts.tv_nsec = (timeout_msec % 1000) * 1000000L;
+        syscall(SYS_futex, &fanout->wake, FUTEX_WAIT_PRIVATE, wake, timeout_msec > 0 ? &ts : NULL, NULL, 0);
+    }
+    atomic_fetch_sub_explicit(&fanout->num_wait, 1, memory_order_seq_cst);
+    return atomic_load_explicit(&fanout->tail, memory_order_acquire) != cursor;
+}
+
+void mb_fanout_get_sub_stats(mb_fanout_t *fanout, int sub, mb_fanout_sub_stats_t *stats)
+{
+    mb_fanout_sub_t *s = NULL;
+
+    memset(stats, 0, sizeof(mb_fanout_sub_stats_t));
+    s = mb_fanout_get_sub(fanout, sub);
+    if (s == NULL)
+    {
+        return;
+    }
+    stats->lag = atomic_load_explicit(&fanout->tail, memory_order_acquire) - atomic_load_explicit(&s->cursor, memory_order_relaxed);
+    stats->num_read = atomic_load_explicit(&s->num_read, memory_order_relaxed);
+    stats->num_lost = atomic_load_explicit(&s->num_lost, memory_order_relaxed);
+    stats->num_stale = atomic_load_explicit(&s->num_stale, memory_order_relaxed);
+    stats->slow = stats->lag > s->max_lag;
+}
@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "mb_gateway.h"
+#include "mb_log.h"
+
+/* returns 1 if the request is a read that can be coalesced with others */
+static int mb_gateway_rd_range(mb_pdu_t *pdu, uint16_t *start_addr, uint16_t *quant, uint16_t *max_quant)
+{
+    switch (pdu->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        *start_addr = pdu->rd_coils_req.start_addr;
+        *quant = pdu->rd_coils_req.quant_coils;
+        *max_quant = MB_PDU_RD_COILS_MAX_QUANT_COILS;
+        return 1;
+    case MB_PDU_RD_DISC_IPS:
+        *start_addr = pdu->rd_disc_ips_req.start_addr;
+        *quant = pdu->rd_disc_ips_req.quant_ips;
+        *max_quant = MB_PDU_RD_DISC_IPS_MAX_QUANT_IPS;
+        return 1;
+    case MB_PDU_RD_HOLD_REGS:
+        *start_addr = pdu->rd_hold_regs_req.start_addr;
+        *quant = pdu->rd_hold_regs_req.quant_regs;
+        *max_quant = MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS;
+        return 1;
+    case MB_PDU_RD_IP_REGS:
+        *start_addr = pdu->rd_ip_regs_req.start_addr;
+        *quant = pdu->rd_ip_regs_req.quant_ip_regs;
+        *max_quant = MB_PDU_RD_IP_REGS_MAX_BYTE_COUNT / 2;
+        return 1;
+    }
+    return 0;
+}
+
+static int mb_gateway_set_rd_req(mb_pdu_t *pdu, uint8_t func_code, uint16_t start_addr, uint16_t quant)
+{
+    switch (func_code)
+    {
+    case MB_PDU_RD_COILS:
+        return mb_pdu_set_rd_coils_req(pdu, start_addr, quant);
+    case MB_PDU_RD_DISC_IPS:
+        return mb_pdu_set_rd_disc_ips_req(pdu, start_addr, quant);
+    case MB_PDU_RD_HOLD_REGS:
+        return mb_pdu_set_rd_hold_regs_req(pdu, start_addr, quant);
+    case MB_PDU_RD_IP_REGS:
+        return mb_pdu_set_rd_ip_regs_req(pdu, start_addr, quant);
+    }
+    return -EINVAL;
+}
+
+/* called with the bus lock held,
+ * returns 1 if the request was attached to an existing transaction
+ */
+static int mb_gateway_coalesce(mb_gateway_bus_t *bus, int addr, mb_gateway_waiter_t *waiter)
+{
+    mb_gateway_trans_t *cand = NULL;
+    mb_gateway_trans_t *trans = NULL;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    uint16_t start_addr = 0;
+    uint16_t max_quant = 0;
+    uint16_t quant = 0;
+    int barrier = 0;
+
+    if (!mb_gateway_rd_range(&waiter->req, &start_addr, &quant, &max_quant))
+        return 0;
+    for (trans = bus->head; trans != NULL; trans = trans->next)
+    {
+        if (trans->req.addr != addr)
+            continue;
+        if (!trans->merge)
+        {
+            cand = NULL;  /* reads must not overtake this request */
+            barrier = 1;
+            continue;
+        }
+        if (trans->req.pdu.func_code != waiter->req.func_code)
+            continue;
+        start = (start_addr < trans->start_addr) ? start_addr : trans->start_addr;
+        end = ((uint32_t)start_addr + quant > (uint32_t)trans->start_addr + trans->quant) ? (uint32_t)start_addr + quant : (uint32_t)trans->start_addr + trans->quant;
+        if ((start_addr <= (uint32_t)trans->start_addr + trans->quant)
+         && (trans->start_addr <= (uint32_t)start_addr + quant)
+         && (end - start <= max_quant))
+            cand = trans;
+    }
+    if (cand != NULL)
+    {
+        start = (start_addr < cand->start_addr) ? start_addr : cand->start_addr;
+        end = ((uint32_t)start_addr + quant > (uint32_t)cand->start_addr + cand->quant) ? (uint32_t)start_addr + quant : (uint32_t)cand->start_addr + cand->quant;
+        if (mb_gateway_set_rd_req(&cand->req.pdu, cand->req.pdu.func_code, start, end - start) < 0)
+            return 0;
+        cand->start_addr = start;
+        cand->quant = end - start;
+        waiter->next = cand->waiter;
+        cand->waiter = waiter;
+        cand->num_waiter++;
+        bus->coalesce_count++;
+        return 1;
+    }
+    trans = bus->active;
+    if ((!barrier)
+     && (trans != NULL)
+     && (trans->merge)
+     && (trans->req.addr == addr)
+     && (trans->req.pdu.func_code == waiter->req.func_code)
+     && (start_addr >= trans->start_addr)
+     && ((uint32_t)start_addr + quant <= (uint32_t)trans->start_addr + trans->quant))
+    {
+        waiter->next = trans->waiter;
+        trans->waiter = waiter;
+        trans->num_waiter++;
+        bus->coalesce_count++;
+        return 1;
+    }
+    return 0;
+}
+
+/* called with the bus lock held */
+static int mb_gateway_enqueue(mb_gateway_bus_t *bus, int addr, mb_gateway_waiter_t *waiter, int merge, int head)
+{
+    mb_gateway_trans_t *trans = NULL;
+    uint16_t max_quant = 0;
+
+    trans = calloc(1, sizeof(mb_gateway_trans_t));
+    if (trans == NULL)
+    {
+        return -ENOMEM;
+    }
+    mb_rtu_adu_set_header(&trans->req, addr);
+    memcpy(&trans->req.pdu, &waiter->req, sizeof(mb_pdu_t));
+    trans->merge = merge && mb_gateway_rd_range(&waiter->req, &trans->start_addr, &trans->quant, &max_quant);
+    waiter->next = NULL;
+    trans->waiter = waiter;
+    trans->num_waiter = 1;
+    if (head)
+    {
+        trans->next = bus->head;
+        bus->head = trans;
+        if (bus->tail == NULL)
+            bus->tail = trans;
+    }
+    else
+    {
+        if (bus->tail == NULL)
+            bus->head = trans;
+        else
+            bus->tail->next = trans;
+        bus->tail = trans;
+    }
+    bus->num_queued++;
+    return 0;
+}
+
+static void mb_gateway_set_err_resp(mb_gateway_waiter_t *waiter, int error)
+{
+    mb_pdu_set_err_resp(&waiter->resp.pdu, waiter->req.func_code + 0x80, error);
+}
+
+/* build the response to one request from the response to the bus transaction */
+static void mb_gateway_set_resp(mb_gateway_trans_t *trans, mb_gateway_waiter_t *waiter, mb_rtu_adu_t *resp)
+{
+    uint16_t start_addr = 0;
+    uint16_t max_quant = 0;
+    uint16_t quant = 0;
+    uint8_t val[MB_PDU_RD_COILS_MAX_BYTE_COUNT] = {0};
+    uint8_t *bits = NULL;
+    unsigned off = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    mb_tcp_adu_set_header(&waiter->resp, waiter->trans_id, waiter->proto_id, waiter->unit_id);
+    if ((resp->pdu.func_code & 0x80) || (!trans->merge))
+    {
+        memcpy(&waiter->resp.pdu, &resp->pdu, sizeof(mb_pdu_t));
+        return;
+    }
+    mb_gateway_rd_range(&waiter->req, &start_addr, &quant, &max_quant);
+    off = start_addr - trans->start_addr;
+    switch (resp->pdu.func_code)
+    {
+    case MB_PDU_RD_COILS:
+    case MB_PDU_RD_DISC_IPS:
+        if (resp->pdu.rd_coils_resp.byte_count != ((trans->quant + 7) >> 3))
+            break;
+        bits = (resp->pdu.func_code == MB_PDU_RD_COILS) ? resp->pdu.rd_coils_resp.coil_stat : resp->pdu.rd_disc_ips_resp.ip_stat;
+        for (i = 0; i < quant; i++)
+        {
+            if ((bits[(off + i) >> 3] >> ((off + i) & 0x07)) & 0x01)
+                val[i >> 3] |= 1 << (i & 0x07);
+        }
+        if (resp->pdu.func_code == MB_PDU_RD_COILS)
+            ret = mb_pdu_set_rd_coils_resp(&waiter->resp.pdu, (quant + 7) >> 3, val);
+        else
+            ret = mb_pdu_set_rd_disc_ips_resp(&waiter->resp.pdu, (quant + 7) >> 3, val);
+        if (ret == 0)
+            return;
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        if (resp->pdu.rd_hold_regs_resp.byte_count != 2 * trans->quant)
+            break;
+        ret = mb_pdu_set_rd_hold_regs_resp(&waiter->resp.pdu, 2 * quant, resp->pdu.rd_hold_regs_resp.reg_val + off);
+        if (ret == 0)
+            return;
+        break;
+    case MB_PDU_RD_IP_REGS:
+        if (resp->pdu.rd_ip_regs_resp.byte_count != 2 * trans->quant)
+            break;
+        ret = mb_pdu_set_rd_ip_regs_resp(&waiter->resp.pdu, 2 * quant, resp->pdu.rd_ip_regs_resp.ip_reg + off);
+        if (ret == 0)
+            return;
+        break;
+    }
+    mb_gateway_set_err_resp(waiter, MB_PDU_EXCEPT_SERVER_DEV_FAIL);
+}
+
+static void mb_gateway_complete(mb_gateway_t *gateway, mb_gateway_waiter_t *waiter)
+{
+    mb_gateway_waiter_t *next = NULL;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&gateway->lock);
+    while (waiter != NULL)
+    {
+        next = waiter->next;
+        waiter->next = NULL;
+        if (gateway->done_tail == NULL)
+            gateway->done_head = waiter;
+        else
+            gateway->done_tail->next = waiter;
+        gateway->done_tail = waiter;
+        waiter = next;
+    }
+    pthread_mutex_unlock(&gateway->lock);
+    if (write(gateway->efd, &one, sizeof(one)) < 0)
+        mb_log_warn("failed to signal gateway completion: %s", strerror(errno));
+}
+
+static void *mb_gateway_bus_thread(void *arg)
+{
+    mb_gateway_bus_t *bus = (mb_gateway_bus_t *)arg;
+    mb_gateway_waiter_t *waiter = NULL;
+    mb_gateway_waiter_t *next = NULL;
+    mb_gateway_trans_t *trans = NULL;
+    mb_rtu_adu_t resp = {0};
+    int ret = 0;
+
+    pthread_mutex_lock(&bus->lock);
+    while (1)
+    {
+        while ((bus->head == NULL) && (!bus->stop))
+            pthread_cond_wait(&bus->cond, &bus->lock);
+        if (bus->stop)
+            break;
+        trans = bus->head;
+        bus->head = trans->next;
+        if (bus->head == NULL)
+            bus->tail = NULL;
+        bus->num_queued--;
+        bus->active = trans;
+        pthread_mutex_unlock(&bus->lock);
+
+        memset(&resp, 0, sizeof(resp));
+        ret = mb_rtu_master_exchange(&bus->master, &trans->req, &resp);
+
+        pthread_mutex_lock(&bus->lock);
+        bus->active = NULL;
+        bus->trans_count++;
+        waiter = trans->waiter;
+        if ((ret == 0) && (resp.pdu.func_code & 0x80) && (trans->num_waiter > 1))
+        {
+            /* the coalesced range may include addresses that some of
+             * the requests did not ask for so retry them one by one
+             */
+            mb_log_debug("retrying %d coalesced requests separately", trans->num_waiter);
+            while (waiter != NULL)
+            {
+                next = waiter->next;
+                bus->coalesce_count--;
+                if (mb_gateway_enqueue(bus, trans->req.addr, waiter, 0, 1) < 0)
+                {
+                    mb_tcp_adu_set_header(&waiter->resp, waiter->trans_id, waiter->proto_id, waiter->unit_id);
+                    mb_gateway_set_err_resp(waiter, MB_PDU_EXCEPT_SERVER_DEV_FAIL);
+                    waiter->next = NULL;
+                    mb_gateway_complete(bus->gateway, waiter);
+                }
+                waiter = next;
+            }
+            bus->coalesce_count++;  /* one of them was not coalesced */
+            free(trans);
+            continue;
+        }
+        pthread_mutex_unlock(&bus->lock);
+
+        if (ret < 0)
+            mb_log_warn("bus exchange: %s", strerror(-ret));
+        for (next = waiter; next != NULL; next = next->next)
+        {
+            if (ret < 0)
+            {
+                mb_tcp_adu_set_header(&next->resp, next->trans_id, next->proto_id, next->unit_id);
+                mb_gateway_set_err_resp(next, MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP);
+            }
+            else
+            {
+                mb_gateway_set_resp(trans, next, &resp);
+            }
+        }
+        mb_gateway_complete(bus->gateway, waiter);
+        free(trans);
+        pthread_mutex_lock(&bus->lock);
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return NULL;
+}
+
+/* called in the server thread when requests have completed */
+static void mb_gateway_send_done(mb_tcp_server_t *server, int fd, void *arg)
+{
+    mb_gateway_t *gateway = (mb_gateway_t *)arg;
+    mb_gateway_waiter_t *waiter = NULL;
+    mb_gateway_waiter_t *next = NULL;
+    uint64_t count = 0;
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        return;
+    pthread_mutex_lock(&gateway->lock);
+    waiter = gateway->done_head;
+    gateway->done_head = NULL;
+    gateway->done_tail = NULL;
+    pthread_mutex_unlock(&gateway->lock);
+    while (waiter != NULL)
+    {
+        next = waiter->next;
+        mb_tcp_server_send_deferred(server, waiter->token, &waiter->resp);
+        free(waiter);
+        waiter = next;
+    }
+}
+
+static int mb_gateway_handle(mb_tcp_server_t *server, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_gateway_waiter_t *waiter = NULL;
+    mb_gateway_route_t *route = NULL;
+    mb_gateway_bus_t *bus = NULL;
+    mb_gateway_t *gateway = NULL;
+    int ret = 0;
+
+    gateway = (mb_gateway_t *)mb_tcp_server_get_data(server);
+    route = &gateway->route[req->unit_id];
+    if (route->addr == 0)
+    {
+        return -MB_PDU_EXCEPT_GATEWAY_PATH_UNAVAIL;
+    }
+    bus = &gateway->bus[route->bus];
+    waiter = calloc(1, sizeof(mb_gateway_waiter_t));
+    if (waiter == NULL)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    waiter->token = mb_tcp_server_get_token(server);
+    waiter->trans_id = req->trans_id;
+    waiter->proto_id = req->proto_id;
+    waiter->unit_id = req->unit_id;
+    memcpy(&waiter->req, &req->pdu, sizeof(mb_pdu_t));
+    pthread_mutex_lock(&bus->lock);
+    if (mb_gateway_coalesce(bus, route->addr, waiter))
+    {
+        pthread_mutex_unlock(&bus->lock);
+        mb_log_debug("request coalesced with a pending bus transaction");
+        return MB_TCP_SERVER_DEFERRED;
+    }
+    if (bus->num_queued >= MB_GATEWAY_MAX_QUEUE)
+    {
+        pthread_mutex_unlock(&bus->lock);
+        free(waiter);
+        return -MB_PDU_EXCEPT_SERVER_DEV_BUSY;
+    }
+    ret = mb_gateway_enqueue(bus, route->addr, waiter, 1, 0);
+    if (ret < 0)
+    {
+        pthread_mutex_unlock(&bus->lock);
+        free(waiter);
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    pthread_cond_signal(&bus->cond);
+    pthread_mutex_unlock(&bus->lock);
+    return MB_TCP_SERVER_DEFERRED;
+}
+
+int mb_gateway_create(mb_gateway_t *gateway, mb_tcp_server_t *server)
+{
+    int ret = 0;
+
+    memset(gateway, 0, sizeof(mb_gateway_t));
+    gateway->server = server;
+    gateway->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (gateway->efd < 0)
+    {
+        memset(gateway, 0, sizeof(mb_gateway_t));
+        return -errno;
+    }
+    ret = pthread_mutex_init(&gateway->lock, NULL);
+    if (ret != 0)
+    {
+        close(gateway->efd);
+        memset(gateway, 0, sizeof(mb_gateway_t));
+        return -ret;
+    }
+    ret = mb_tcp_server_watch_fd(server, gateway->efd, mb_gateway_send_done, gateway);
+    if (ret < 0)
+    {
+        pthread_mutex_destroy(&gateway->lock);
+        close(gateway->efd);
+        memset(gateway, 0, sizeof(mb_gateway_t));
+        return ret;
+    }
+    return 0;
+}
+
+static void mb_gateway_free_waiters(mb_gateway_waiter_t *waiter)
+{
+    mb_gateway_waiter_t *next = NULL;
+
+    while (waiter != NULL)
+    {
+        next = waiter->next;
+        free(waiter);
+        waiter = next;
+    }
+}
+
+/* the server must no longer be running */
+void mb_gateway_destroy(mb_gateway_t *gateway)
+{
+    mb_gateway_trans_t *trans = NULL;
+    mb_gateway_bus_t *bus = NULL;
+    int i = 0;
+
+    for (i = 0; i < gateway->num_bus; i++)
+    {
+        bus = &gateway->bus[i];
+        pthread_mutex_lock(&bus->lock);
+        bus->stop = 1;
+        pthread_cond_signal(&bus->cond);
+        pthread_mutex_unlock(&bus->lock);
+        pthread_join(bus->thread, NULL);
+        while (bus->head != NULL)
+        {
+            trans = bus->head;
+            bus->head = trans->next;
+            mb_gateway_free_waiters(trans->waiter);
+            free(trans);
+        }
+        pthread_cond_destroy(&bus->cond);
+        pthread_mutex_destroy(&bus->lock);
+        mb_rtu_master_destroy(&bus->master);
+    }
+    mb_gateway_free_waiters(gateway->done_head);
+    mb_tcp_server_unwatch_fd(gateway->server, gateway->efd);
+    pthread_mutex_destroy(&gateway->lock);
+    close(gateway->efd);
+    memset(gateway, 0, sizeof(mb_gateway_t));
+}
+
+/* returns the index of the new bus */
+int mb_gateway_add_bus(mb_gateway_t *gateway, const char *dev)
+{
+    mb_gateway_bus_t *bus = NULL;
+    int ret = 0;
+
+    if (gateway->num_bus >= MB_GATEWAY_MAX_BUS)
+    {
+        return -ENOSPC;
+    }
+    bus = &gateway->bus[gateway->num_bus];
+    memset(bus, 0, sizeof(mb_gateway_bus_t));
+    bus->gateway = gateway;
+    ret = mb_rtu_master_create(&bus->master, dev);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = pthread_mutex_init(&bus->lock, NULL);
+    if (ret != 0)
+    {
+        mb_rtu_master_destroy(&bus->master);
+        return -ret;
+    }
+    ret = pthread_cond_init(&bus->cond, NULL);
+    if (ret != 0)
+    {
+        pthread_mutex_destroy(&bus->lock);
+        mb_rtu_master_destroy(&bus->master);
+        return -ret;
+    }
+    ret = pthread_create(&bus->thread, NULL, mb_gateway_bus_thread, bus);
+    if (ret != 0)
+    {
+        pthread_cond_destroy(&bus->cond);
+        pthread_mutex_destroy(&bus->lock);
+        mb_rtu_master_destroy(&bus->master);
+        return -ret;
+    }
+    mb_log_notice("gateway bus %d bound to '%s'", gateway->num_bus, dev);
+    return gateway->num_bus++;
+}
+
+int mb_gateway_add_route(mb_gateway_t *gateway, uint8_t unit_id, int bus, int addr)
+{
+    if ((bus < 0) || (bus >= gateway->num_bus)
+     || (addr < MB_RTU_ADU_MIN_UNICAST_ADDR) || (addr > MB_RTU_ADU_MAX_UNICAST_ADDR))
+    {
+        return -EINVAL;
+    }
+    gateway->route[unit_id].bus = bus;
+    gateway->route[unit_id].addr = addr;
+    mb_tcp_server_add_unit(gateway->server, unit_id, mb_gateway_handle, gateway);
+    mb_log_debug("routing unit id %d to address %d on bus %d", unit_id, addr, bus);
+    return 0;
+}
+
+void mb_gateway_get_stats(mb_gateway_t *gateway, int bus, int *trans_count, int *coalesce_count)
+{
+    pthread_mutex_lock(&gateway->bus[bus].lock);
+    *trans_count = gateway->bus[bus].trans_count;
+    *coalesce_count = gateway->bus[bus].coalesce_count;
+    pthread_mutex_unlock(&gateway->bus[bus].lock);
+}
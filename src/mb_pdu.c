@@ -647,6 +647,119 @@ int mb_pdu_set_enc_if_trans_resp(mb_pdu_t *pdu, uint8_t mei_type, const uint8_t
     return 0;
 }
 
+/* returns the number of bytes taken by the values of a range in the response, 0 if the range is not valid */
+size_t mb_pdu_rd_mult_ranges_val_len(const mb_pdu_rd_mult_ranges_sub_req_t *sub_req)
+{
+    uint32_t end_addr = 0;
+    uint16_t max_quant = 0;
+
+    switch (sub_req->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        max_quant = MB_PDU_RD_COILS_MAX_QUANT_COILS;
+        break;
+    case MB_PDU_RD_DISC_IPS:
+        max_quant = MB_PDU_RD_DISC_IPS_MAX_QUANT_IPS;
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        max_quant = MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS;
+        break;
+    case MB_PDU_RD_IP_REGS:
+        max_quant = MB_PDU_RD_IP_REGS_MAX_QUANT_IP_REGS;
+        break;
+    default:
+        return 0;
+    }
+    end_addr = (uint32_t)sub_req->start_addr + (uint32_t)sub_req->quant;
+    if ((sub_req->quant < 1) || (sub_req->quant > max_quant) || (end_addr > MB_PDU_RD_HOLD_REGS_MAX_ADDR))
+        return 0;
+    if ((sub_req->func_code == MB_PDU_RD_COILS) || (sub_req->func_code == MB_PDU_RD_DISC_IPS))
+        return (sub_req->quant + 7) / 8;
+    return 2 * sub_req->quant;
+}
+
+static int mb_pdu_check_rd_mult_ranges_sub_req(const mb_pdu_rd_mult_ranges_sub_req_t *sub_req, unsigned *byte_count)
+{
+    mb_pdu_rd_mult_ranges_sub_req_t at_zero = {0};
+    size_t val_len = 0;
+
+    /* the function code and quantity are checked with the range moved to address 0 */
+    at_zero.func_code = sub_req->func_code;
+    at_zero.quant = sub_req->quant;
+    if (mb_pdu_rd_mult_ranges_val_len(&at_zero) == 0)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    val_len = mb_pdu_rd_mult_ranges_val_len(sub_req);
+    if (val_len == 0)
+        return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+    *byte_count += val_len;
+    if (*byte_count > MB_PDU_RD_MULT_RANGES_MAX_BYTE_COUNT)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;  /* the response would not fit */
+    return 0;
+}
+
+int mb_pdu_set_rd_mult_ranges_req(mb_pdu_t *pdu, const mb_pdu_rd_mult_ranges_sub_req_t *sub_req, size_t num_sub_req)
+{
+    unsigned resp_byte_count = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    memset(pdu, 0, sizeof(mb_pdu_t));
+    if (num_sub_req > MB_PDU_RD_MULT_RANGES_MAX_NUM_SUB_REQ)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    for (i = 0; i < num_sub_req; i++)
+    {
+        ret = mb_pdu_check_rd_mult_ranges_sub_req(&sub_req[i], &resp_byte_count);
+        if (ret < 0)
+            return ret;
+    }
+    pdu->type = MB_PDU_REQ;
+    pdu->func_code = MB_PDU_RD_MULT_RANGES;
+    pdu->rd_mult_ranges_req.byte_count = num_sub_req * MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES;
+    if (num_sub_req > 0)
+        memcpy(pdu->rd_mult_ranges_req.sub_req, sub_req, num_sub_req * sizeof(mb_pdu_rd_mult_ranges_sub_req_t));
+    return 0;
+}
+
+int mb_pdu_set_rd_mult_ranges_resp(mb_pdu_t *pdu, uint8_t byte_count, const uint8_t *data)
+{
+    memset(pdu, 0, sizeof(mb_pdu_t));
+    if (byte_count > MB_PDU_RD_MULT_RANGES_MAX_BYTE_COUNT)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    pdu->type = MB_PDU_RESP;
+    pdu->func_code = MB_PDU_RD_MULT_RANGES;
+    pdu->rd_mult_ranges_resp.byte_count = byte_count;
+    memcpy(pdu->rd_mult_ranges_resp.data, data, byte_count);
+    return 0;
+}
+
+/* unpack the values of one range of a response, one value per coil or discrete input, returns the number of values */
+int mb_pdu_get_rd_mult_ranges_val(const mb_pdu_t *req, const mb_pdu_t *resp, size_t index, uint16_t *val)
+{
+    const mb_pdu_rd_mult_ranges_sub_req_t *sub_req = NULL;
+    const uint8_t *data = NULL;
+    unsigned num_sub_req = 0;
+    unsigned off = 0;
+    unsigned i = 0;
+
+    num_sub_req = req->rd_mult_ranges_req.byte_count / MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES;
+    if ((req->func_code != MB_PDU_RD_MULT_RANGES) || (resp->func_code != MB_PDU_RD_MULT_RANGES) || (index >= num_sub_req))
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    for (i = 0; i < index; i++)
+        off += mb_pdu_rd_mult_ranges_val_len(&req->rd_mult_ranges_req.sub_req[i]);
+    sub_req = &req->rd_mult_ranges_req.sub_req[index];
+    if (off + mb_pdu_rd_mult_ranges_val_len(sub_req) > resp->rd_mult_ranges_resp.byte_count)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    data = &resp->rd_mult_ranges_resp.data[off];
+    for (i = 0; i < sub_req->quant; i++)
+    {
+        if ((sub_req->func_code == MB_PDU_RD_COILS) || (sub_req->func_code == MB_PDU_RD_DISC_IPS))
+            val[i] = (data[i >> 3] >> (i & 0x07)) & 0x01;
+        else
+            val[i] = ((uint16_t)data[2 * i] << 8) | data[2 * i + 1];
+    }
+    return sub_req->quant;
+}
+
 int mb_pdu_set_err_resp(mb_pdu_t *pdu, uint8_t func_code, uint8_t except_code)
 {
     memset(pdu, 0, sizeof(mb_pdu_t));
@@ -2269,6 +2382,98 @@ static ssize_t mb_pdu_format_enc_if_trans_resp(mb_pdu_t *pdu, char *buf, size_t
     return num;
 }
 
+static ssize_t mb_pdu_format_rd_mult_ranges_req(mb_pdu_t *pdu, char *buf, size_t len)
+{
+    mb_pdu_rd_mult_ranges_sub_req_t *sub_req = NULL;
+    unsigned i = 0;
+    unsigned j = 0;
+    uint16_t val16 = 0;
+    uint8_t byte_count = 0;
+    ssize_t num = 0;
+
+    /* func_code */
+    if (len < 1)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    buf[0] = pdu->func_code;
+    num += 1;
+    buf += 1;
+    len -= 1;
+
+    /* byte_count */
+    if (len < 1)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    byte_count = pdu->rd_mult_ranges_req.byte_count;
+    buf[0] = byte_count;
+    num += 1;
+    buf += 1;
+    len -= 1;
+
+    for (i = 0, j = 0; i < byte_count; i += MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES, j++)
+    {
+        sub_req = &pdu->rd_mult_ranges_req.sub_req[j];
+
+        /* func_code */
+        if (len < 1)
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        buf[0] = sub_req->func_code;
+        num += 1;
+        buf += 1;
+        len -= 1;
+
+        /* start_addr */
+        if (len < 2)
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        val16 = htons(sub_req->start_addr);
+        memcpy(buf, &val16, 2);
+        num += 2;
+        buf += 2;
+        len -= 2;
+
+        /* quant */
+        if (len < 2)
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        val16 = htons(sub_req->quant);
+        memcpy(buf, &val16, 2);
+        num += 2;
+        buf += 2;
+        len -= 2;
+    }
+    return num;
+}
+
+static ssize_t mb_pdu_format_rd_mult_ranges_resp(mb_pdu_t *pdu, char *buf, size_t len)
+{
+    uint8_t byte_count = 0;
+    ssize_t num = 0;
+
+    /* func_code */
+    if (len < 1)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    buf[0] = pdu->func_code;
+    num += 1;
+    buf += 1;
+    len -= 1;
+
+    /* byte_count */
+    if (len < 1)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    byte_count = pdu->rd_mult_ranges_resp.byte_count;
+    buf[0] = byte_count;
+    num += 1;
+    buf += 1;
+    len -= 1;
+
+    /* data */
+    if (len < byte_count)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    memcpy(buf, pdu->rd_mult_ranges_resp.data, byte_count);
+    num += byte_count;
+    buf += byte_count;
+    len -= byte_count;
+
+    return num;
+}
+
 static ssize_t mb_pdu_format_err_resp(mb_pdu_t *pdu, char *buf, size_t len)
 {
     ssize_t num = 0;
@@ -2334,6 +2539,8 @@ ssize_t mb_pdu_format_req(mb_pdu_t *pdu, char *buf, size_t len)
         return mb_pdu_format_rd_fifo_q_req(pdu, buf, len);
     case MB_PDU_ENC_IF_TRANS:
         return mb_pdu_format_enc_if_trans_req(pdu, buf, len);
+    case MB_PDU_RD_MULT_RANGES:
+        return mb_pdu_format_rd_mult_ranges_req(pdu, buf, len);
     }
     return -MB_PDU_EXCEPT_ILLEGAL_FUNC;
 }
@@ -2380,6 +2587,8 @@ ssize_t mb_pdu_format_resp(mb_pdu_t *pdu, char *buf, size_t len)
         return mb_pdu_format_rd_fifo_q_resp(pdu, buf, len);
     case MB_PDU_ENC_IF_TRANS:
         return mb_pdu_format_enc_if_trans_resp(pdu, buf, len);
+    case MB_PDU_RD_MULT_RANGES:
+        return mb_pdu_format_rd_mult_ranges_resp(pdu, buf, len);
     default:
         if (pdu->func_code >= 0x80)
             return mb_pdu_format_err_resp(pdu, buf, len);
@@ -3380,7 +3589,7 @@ static ssize_t mb_pdu_parse_wr_file_rec_req(mb_pdu_t *pdu, const char *buf, size
 
     if (len < 1)
         return -MB_PDU_EXCEPT_ILLEGAL_VAL;
-    req_data_len = buf[0];
+    req_data_len = (uint8_t)buf[0];
     if ((req_data_len < MB_PDU_WR_FILE_REC_MIN_REQ_DATA_LEN)
      || (req_data_len > MB_PDU_WR_FILE_REC_MAX_REQ_DATA_LEN))
         return -MB_PDU_EXCEPT_ILLEGAL_VAL;
@@ -3480,7 +3689,7 @@ static ssize_t mb_pdu_parse_wr_file_rec_resp(mb_pdu_t *pdu, const char *buf, siz
 
     if (len < 1)
         return -MB_PDU_EXCEPT_ILLEGAL_VAL;
-    resp_data_len = buf[0];
+    resp_data_len = (uint8_t)buf[0];
     if ((resp_data_len < MB_PDU_WR_FILE_REC_MIN_RESP_DATA_LEN)
      || (resp_data_len > MB_PDU_WR_FILE_REC_MAX_RESP_DATA_LEN))
         return -MB_PDU_EXCEPT_ILLEGAL_VAL;
@@ -3673,7 +3882,7 @@ static ssize_t mb_pdu_parse_rd_wr_mult_regs_req(mb_pdu_t *pdu, const char *buf,
 
     /* rd_start_addr + quant_rd */
     end_addr = (uint32_t)rd_start_addr + (uint32_t)quant_rd;
-    if (end_addr > MB_PDU_RD_WR_MULT_REGS_MAX_QUANT_RD)
+    if (end_addr > MB_PDU_RD_WR_MULT_REGS_MAX_ADDR)
         return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
 
     /* wr_start_addr */
@@ -3700,7 +3909,7 @@ static ssize_t mb_pdu_parse_rd_wr_mult_regs_req(mb_pdu_t *pdu, const char *buf,
 
     /* wr_start_addr + quant_wr */
     end_addr = (uint32_t)wr_start_addr + (uint32_t)quant_wr;
-    if (end_addr > MB_PDU_RD_WR_MULT_REGS_MAX_QUANT_WR)
+    if (end_addr > MB_PDU_RD_WR_MULT_REGS_MAX_ADDR)
         return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
 
     /* wr_byte_count */
@@ -3882,6 +4091,93 @@ static ssize_t mb_pdu_parse_enc_if_tran_resp(mb_pdu_t *pdu, const char *buf, siz
     return num;
 }
 
+static ssize_t mb_pdu_parse_rd_mult_ranges_req(mb_pdu_t *pdu, const char *buf, size_t len)
+{
+    mb_pdu_rd_mult_ranges_sub_req_t *sub_req = NULL;
+    unsigned resp_byte_count = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+    uint16_t val16 = 0;
+    uint8_t byte_count = 0;
+    ssize_t num = 0;
+    int ret = 0;
+
+    /* byte_count */
+    if (len < 1)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    byte_count = buf[0];
+    if ((byte_count > MB_PDU_RD_MULT_RANGES_MAX_REQ_BYTE_COUNT)
+     || (byte_count % MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES))
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    pdu->rd_mult_ranges_req.byte_count = byte_count;
+    num += 1;
+    buf += 1;
+    len -= 1;
+
+    for (i = 0, j = 0; i < byte_count; i += MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES, j++)
+    {
+        sub_req = &pdu->rd_mult_ranges_req.sub_req[j];
+
+        /* func_code */
+        if (len < 1)
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        sub_req->func_code = buf[0];
+        num += 1;
+        buf += 1;
+        len -= 1;
+
+        /* start_addr */
+        if (len < 2)
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        memcpy(&val16, buf, 2);
+        sub_req->start_addr = ntohs(val16);
+        num += 2;
+        buf += 2;
+        len -= 2;
+
+        /* quant */
+        if (len < 2)
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        memcpy(&val16, buf, 2);
+        sub_req->quant = ntohs(val16);
+        num += 2;
+        buf += 2;
+        len -= 2;
+
+        ret = mb_pdu_check_rd_mult_ranges_sub_req(sub_req, &resp_byte_count);
+        if (ret < 0)
+            return ret;
+    }
+    return num;
+}
+
+static ssize_t mb_pdu_parse_rd_mult_ranges_resp(mb_pdu_t *pdu, const char *buf, size_t len)
+{
+    uint8_t byte_count = 0;
+    ssize_t num = 0;
+
+    /* byte_count */
+    if (len < 1)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    byte_count = buf[0];
+    if (byte_count > MB_PDU_RD_MULT_RANGES_MAX_BYTE_COUNT)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    pdu->rd_mult_ranges_resp.byte_count = byte_count;
+    num += 1;
+    buf += 1;
+    len -= 1;
+
+    /* data */
+    if (len < byte_count)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    memcpy(pdu->rd_mult_ranges_resp.data, buf, byte_count);
+    num += byte_count;
+    buf += byte_count;
+    len -= byte_count;
+
+    return num;
+}
+
 static ssize_t mb_pdu_parse_err_resp(mb_pdu_t *pdu, const char *buf, size_t len)
 {
     uint8_t except_code = 0;
@@ -3986,6 +4282,9 @@ ssize_t mb_pdu_parse_req(mb_pdu_t *pdu, const char *buf, size_t len)
     case MB_PDU_ENC_IF_TRANS:
         ret = mb_pdu_parse_enc_if_tran_req(pdu, buf, len);
         break;
+    case MB_PDU_RD_MULT_RANGES:
+        ret = mb_pdu_parse_rd_mult_ranges_req(pdu, buf, len);
+        break;
     default:
         ret = MB_PDU_EXCEPT_ILLEGAL_FUNC;
     }
@@ -4070,6 +4369,9 @@ ssize_t mb_pdu_parse_resp(mb_pdu_t *pdu, const char *buf, size_t len)
     case MB_PDU_ENC_IF_TRANS:
         ret = mb_pdu_parse_enc_if_tran_resp(pdu, buf, len);
         break;
+    case MB_PDU_RD_MULT_RANGES:
+        ret = mb_pdu_parse_rd_mult_ranges_resp(pdu, buf, len);
+        break;
     default:
         if (pdu->func_code >= 0x80)
             ret = mb_pdu_parse_err_resp(pdu, buf, len);
@@ -4080,3 +4382,39 @@ ssize_t mb_pdu_parse_resp(mb_pdu_t *pdu, const char *buf, size_t len)
         return ret;
     return num + ret;
 }
+
+/* returns the length of a normal response to a request or 0 if it varies */
+size_t mb_pdu_resp_len(const mb_pdu_t *req)
+{
+    size_t byte_count = 0;
+    unsigned i = 0;
+
+    switch (req->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        return 2 + (req->rd_coils_req.quant_coils + 7) / 8;
+    case MB_PDU_RD_DISC_IPS:
+        return 2 + (req->rd_disc_ips_req.quant_ips + 7) / 8;
+    case MB_PDU_RD_HOLD_REGS:
+        return 2 + 2 * req->rd_hold_regs_req.quant_regs;
+    case MB_PDU_RD_IP_REGS:
+        return 2 + 2 * req->rd_ip_regs_req.quant_ip_regs;
+    case MB_PDU_WR_SING_COIL:
+    case MB_PDU_WR_SING_REG:
+    case MB_PDU_GET_COM_EV_CNTR:
+    case MB_PDU_WR_MULT_COILS:
+    case MB_PDU_WR_MULT_REGS:
+        return 5;
+    case MB_PDU_RD_EXCEPT_STAT:
+        return 2;
+    case MB_PDU_MASK_WR_REG:
+        return 7;
+    case MB_PDU_RD_WR_MULT_REGS:
+        return 2 + 2 * req->rd_wr_mult_regs_req.quant_rd;
+    case MB_PDU_RD_MULT_RANGES:
+        for (i = 0; i < req->rd_mult_ranges_req.byte_count / MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES; i++)
+            byte_count += mb_pdu_rd_mult_ranges_val_len(&req->rd_mult_ranges_req.sub_req[i]);
+        return 2 + byte_count;
+    }
+    return 0;
+}
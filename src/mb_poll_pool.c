@@ -0,0 +1,696 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "mb_poll_pool.h"
+#include "mb_log.h"
+
+static int mb_poll_pool_push(mb_poll_pool_t *pool, const mb_poll_pool_result_t *result)
+{
+    mb_poll_pool_cell_t *cell = NULL;
+    intptr_t diff = 0;
+    size_t pos = 0;
+    size_t seq = 0;
+
+    pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+    while (1)
+    {
+        cell = &pool->queue[pos & (MB_POLL_POOL_QUEUE_LEN - 1)];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            /* the cell is free, claim it */
+            if (atomic_compare_exchange_weak_explicit(&pool->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return -ENOBUFS;  /* the consumer has not freed the cell yet */
+        }
+        else
+        {
+            pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+        }
+    }
+    memcpy(&cell->result, result, sizeof(mb_poll_pool_result_t));
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static void mb_poll_pool_func(mb_poller_t *poller, int group, int req, ssize_t result, mb_pdu_t *resp, void *arg)
+{
+    mb_poll_pool_shard_t *shard = (mb_poll_pool_shard_t *)arg;
+    mb_poll_pool_result_t res = {0};
+    mb_poll_pool_t *pool = shard->pool;
+    ssize_t num = 0;
+
+    res.group = shard->global_group[group];
+    res.dev = pool->group[res.group].dev;
+    res.req = req;
+    res.result = result;
+    if (resp != NULL)
+    {
+        num = mb_pdu_format_resp(resp, res.resp, sizeof(res.resp));
+        if (num < 0)
+            res.result = -EBADMSG;
+        else
+            res.resp_len = num;
+    }
+    if (mb_poll_pool_push(pool, &res) < 0)
+    {
+        atomic_fetch_add(&pool->num_dropped, 1);
+        return;
+    }
+    shard->produced = 1;
+}
+
+/* add a pool device and its groups to the poller of a shard */
+static int mb_poll_pool_shard_add_dev(mb_poll_pool_shard_t *shard, int index)
+{
+    mb_poll_pool_group_t *group = NULL;
+    mb_poll_pool_t *pool = shard->pool;
+    mb_poll_pool_dev_t *dev = NULL;
+    int *global = NULL;
+    int endpoint = 0;
+    int local = 0;
+    int ret = 0;
+    int i = 0;
+
+    dev = &pool->dev[index];
+    if (dev->type == MB_POLLER_DEV_TCP)
+    {
+        endpoint = mb_tcp_client_add_endpoint(&shard->client, dev->host, dev->port);
+        if (endpoint < 0)
+        {
+            return endpoint;
+        }
+        local = mb_poller_add_tcp_dev(&shard->poller, &shard->client, endpoint, dev->unit_id, dev->max_in_flight);
+    }
+    else
+    {
+        local = mb_poller_add_rtu_dev(&shard->poller, dev->master, dev->unit_id);
+    }
+    if (local < 0)
+    {
+        return local;
+    }
+    /* the poller reuses the indices of devices that were handed over */
+    if (local >= shard->num_local_dev)
+    {
+        global = realloc(shard->global_dev, (local + 1) * sizeof(int));
+        if (global == NULL)
+        {
+            return -ENOMEM;
+        }
+        shard->global_dev = global;
+        shard->num_local_dev = local + 1;
+    }
+    shard->global_dev[local] = index;
+    for (i = 0; i < pool->num_group; i++)
+    {
+        group = &pool->group[i];
+        if (group->dev != index)
+            continue;
+        ret = mb_poller_add_group(&shard->poller, local, group->req, group->num_req, group->period, group->deadline, group->priority, mb_poll_pool_func, shard);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        if (ret >= shard->num_local_group)
+        {
+            global = realloc(shard->global_group, (ret + 1) * sizeof(int));
+            if (global == NULL)
+            {
+                return -ENOMEM;
+            }
+            shard->global_group = global;
+            shard->num_local_group = ret + 1;
+        }
+        shard->global_group[ret] = i;
+    }
+    shard->num_dev++;
+    atomic_store(&dev->shard, shard->index);
+    return 0;
+}
+
+/* take over devices handed over by other shards */
+static void mb_poll_pool_shard_adopt(mb_poll_pool_shard_t *shard)
+{
+    int *inbox = NULL;
+    int num = 0;
+    int ret = 0;
+    int i = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    inbox = shard->inbox;
+    num = shard->num_inbox;
+    shard->inbox = NULL;
+    shard->num_inbox = 0;
+    pthread_mutex_unlock(&shard->lock);
+    for (i = 0; i < num; i++)
+    {
+        ret = mb_poll_pool_shard_add_dev(shard, inbox[i]);
+        if (ret < 0)
+            mb_log_error("[%d] failed to take over device %d: %s", shard->index, inbox[i], strerror(-ret));
+        else
+            mb_log_info("[%d] took over device %d", shard->index, inbox[i]);
+    }
+    free(inbox);
+}
+
+static int mb_poll_pool_shard_post(mb_poll_pool_shard_t *shard, int dev)
+{
+    int *inbox = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    inbox = realloc(shard->inbox, (shard->num_inbox + 1) * sizeof(int));
+    if (inbox == NULL)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return -ENOMEM;
+    }
+    shard->inbox = inbox;
+    shard->inbox[shard->num_inbox++] = dev;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+static void mb_poll_pool_shard_end_give(mb_poll_pool_shard_t *shard)
+{
+    shard->leaving = MB_POLL_POOL_NONE;
+    atomic_store(&shard->want_dev, MB_POLL_POOL_NONE);
+    atomic_store(&shard->thief, MB_POLL_POOL_NONE);
+}
+
+/* remove the endpoint of a device that left from the client unless another device uses it */
+static void mb_poll_pool_shard_drop_endpoint(mb_poll_pool_shard_t *shard, int local)
+{
+    int endpoint = 0;
+    int ret = 0;
+    int i = 0;
+
+    endpoint = shard->poller.dev[local].endpoint;
+    for (i = 0; i < shard->num_local_dev; i++)
+    {
+        if ((i != local) && (!shard->poller.dev[i].removed) && (shard->poller.dev[i].type == MB_POLLER_DEV_TCP) && (shard->poller.dev[i].endpoint == endpoint))
+            return;
+    }
+    ret = mb_tcp_client_remove_endpoint(&shard->client, endpoint);
+    if (ret < 0)
+        mb_log_warn("[%d] failed to remove endpoint %d: %s", shard->index, endpoint, strerror(-ret));
+}
+
+/* hand a device over to a shard that asked for one */
+static void mb_poll_pool_shard_give(mb_poll_pool_shard_t *shard)
+{
+    mb_poll_pool_t *pool = shard->pool;
+    mb_poller_dev_t *dev = NULL;
+    int thief = 0;
+    int want = 0;
+    int ret = 0;
+    int i = 0;
+
+    if (shard->leaving == MB_POLL_POOL_NONE)
+    {
+        thief = atomic_load(&shard->thief);
+        if ((thief == MB_POLL_POOL_NONE) || (thief == MB_POLL_POOL_CLAIMED))
+        {
+            return;
+        }
+        want = atomic_load(&shard->want_dev);
+        for (i = 0; i < shard->num_local_dev; i++)
+        {
+            dev = &shard->poller.dev[i];
+            if ((dev->removed) || (dev->type != MB_POLLER_DEV_TCP))
+                continue;
+            if ((want == MB_POLL_POOL_NONE) || (shard->global_dev[i] == want))
+                break;
+        }
+        /* a shard is not asked for its last device unless a specific device is wanted */
+        if ((i == shard->num_local_dev) || ((want == MB_POLL_POOL_NONE) && (shard->num_dev < 2)))
+        {
+            mb_poll_pool_shard_end_give(shard);
+            return;
+        }
+        mb_poller_hold_dev(&shard->poller, i);
+        shard->leaving = i;
+        shard->leaving_to = thief;
+    }
+    ret = mb_poller_remove_dev(&shard->poller, shard->leaving);
+    if (ret < 0)
+    {
+        return;  /* cycles still in progress */
+    }
+    shard->num_dev--;
+    mb_poll_pool_shard_drop_endpoint(shard, shard->leaving);
+    ret = mb_poll_pool_shard_post(&pool->shard[shard->leaving_to], shard->global_dev[shard->leaving]);
+    if (ret < 0)
+    {
+        mb_log_error("[%d] failed to hand over device %d: %s", shard->index, shard->global_dev[shard->leaving], strerror(-ret));
+    }
+    else
+    {
+        mb_log_info("[%d] handed over device %d to shard %d", shard->index, shard->global_dev[shard->leaving], shard->leaving_to);
+        atomic_fetch_add(&pool->num_migrated, 1);
+    }
+    mb_poll_pool_shard_end_give(shard);
+}
+
+/* at the end of each window an idle shard asks the shard furthest behind for a device */
+static void mb_poll_pool_shard_balance(mb_poll_pool_shard_t *shard)
+{
+    mb_poll_pool_t *pool = shard->pool;
+    struct timespec now = {0};
+    long max_lag = 0;
+    long lag = 0;
+    int victim = MB_POLL_POOL_NONE;
+    int none = MB_POLL_POOL_NONE;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec < shard->window_end.tv_sec)
+     || ((now.tv_sec == shard->window_end.tv_sec) && (now.tv_nsec < shard->window_end.tv_nsec)))
+    {
+        return;
+    }
+    shard->window_end = now;
+    shard->window_end.tv_sec += MB_POLL_POOL_WINDOW_MSEC / 1000;
+    shard->window_end.tv_nsec += (MB_POLL_POOL_WINDOW_MSEC % 1000) * 1000000;
+    if (shard->window_end.tv_nsec >= 1000000000)
+    {
+        shard->window_end.tv_sec++;
+        shard->window_end.tv_nsec -= 1000000000;
+    }
+    lag = shard->poller.lag_usec;
+    shard->poller.lag_usec = 0;
+    atomic_store(&shard->lag_usec, lag);
+    if (lag >= MB_POLL_POOL_IDLE_USEC)
+    {
+        return;
+    }
+    max_lag = MB_POLL_POOL_BEHIND_USEC;
+    for (i = 0; i < pool->num_shard; i++)
+    {
+        lag = atomic_load(&pool->shard[i].lag_usec);
+        if ((i != shard->index) && (lag > max_lag))
+        {
+            max_lag = lag;
+            victim = i;
+        }
+    }
+    if (victim != MB_POLL_POOL_NONE)
+    {
+        atomic_compare_exchange_strong(&pool->shard[victim].thief, &none, shard->index);
+    }
+}
+
+static void *mb_poll_pool_shard_run(void *arg)
+{
+    mb_poll_pool_shard_t *shard = (mb_poll_pool_shard_t *)arg;
+    mb_poll_pool_t *pool = shard->pool;
+    uint64_t val = 1;
+    ssize_t num = 0;
+    int ret = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &shard->window_end);
+    while (!atomic_load(&pool->stop))
+    {
+        ret = mb_poller_run_once(&shard->poller, MB_POLL_POOL_WAKE_MSEC);
+        if (ret < 0)
+        {
+            mb_log_error("[%d] poller: %s", shard->index, strerror(-ret));
+            break;
+        }
+        if (shard->produced)
+        {
+            shard->produced = 0;
+            num = write(pool->efd, &val, sizeof(val));
+            if (num < 0)
+                mb_log_warn("[%d] eventfd: %s", shard->index, strerror(errno));
+        }
+        mb_poll_pool_shard_adopt(shard);
+        mb_poll_pool_shard_give(shard);
+        mb_poll_pool_shard_balance(shard);
+    }
+    return NULL;
+}
+
+int mb_poll_pool_create(mb_poll_pool_t *pool, int num_shard, struct timeval timeout)
+{
+    mb_poll_pool_shard_t *shard = NULL;
+    int ret = 0;
+    int i = 0;
+
+    if ((num_shard <= 0) || (num_shard > MB_POLL_POOL_MAX_SHARD))
+    {
+        return -EINVAL;
+    }
+    memset(pool, 0, sizeof(mb_poll_pool_t));
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->efd < 0)
+    {
+        return -errno;
+    }
+    for (i = 0; i < MB_POLL_POOL_QUEUE_LEN; i++)
+        atomic_init(&pool->queue[i].seq, i);
+    for (i = 0; i < num_shard; i++)
+    {
+        shard = &pool->shard[i];
+        shard->pool = pool;
+        shard->index = i;
+        shard->leaving = MB_POLL_POOL_NONE;
+        atomic_init(&shard->thief, MB_POLL_POOL_NONE);
+        atomic_init(&shard->want_dev, MB_POLL_POOL_NONE);
+        pthread_mutex_init(&shard->lock, NULL);
+        ret = mb_poller_create(&shard->poller);
+        if (ret == 0)
+        {
+            ret = mb_tcp_client_create(&shard->client, timeout);
+            if (ret < 0)
+                mb_poller_destroy(&shard->poller);
+        }
+        if (ret < 0)
+        {
+            pthread_mutex_destroy(&shard->lock);
+            pool->num_shard = i;
+            mb_poll_pool_destroy(pool);
+            return ret;
+        }
+        /* release groups with equal periods together whichever shard they are on */
+        shard->poller.epoch = pool->shard[0].poller.epoch;
+    }
+    pool->num_shard = num_shard;
+    return 0;
+}
+
+void mb_poll_pool_destroy(mb_poll_pool_t *pool)
+{
+    mb_poll_pool_shard_t *shard = NULL;
+    int i = 0;
+
+    mb_poll_pool_stop(pool);
+    for (i = 0; i < pool->num_shard; i++)
+    {
+        shard = &pool->shard[i];
+        mb_poller_destroy(&shard->poller);
+        mb_tcp_client_destroy(&shard->client);
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->global_dev);
+        free(shard->global_group);
+        free(shard->inbox);
+    }
+    for (i = 0; i < pool->num_group; i++)
+        free(pool->group[i].req);
+    free(pool->dev);
+    free(pool->group);
+    close(pool->efd);
+    memset(pool, 0, sizeof(mb_poll_pool_t));
+}
+
+int mb_poll_pool_authorise_addr(mb_poll_pool_t *pool, const char *str)
+{
+    int ret = 0;
+    int i = 0;
+
+    for (i = 0; i < pool->num_shard; i++)
+    {
+        ret = mb_tcp_client_authorise_addr(&pool->shard[i].client, str);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int mb_poll_pool_add_dev(mb_poll_pool_t *pool, int shard)
+{
+    mb_poll_pool_dev_t *dev = NULL;
+    int max_dev = 0;
+    int i = 0;
+
+    if (pool->started)
+    {
+        return -EBUSY;
+    }
+    if (pool->num_dev == pool->max_dev)
+    {
+        max_dev = pool->max_dev ? 2 * pool->max_dev : MB_POLL_POOL_MIN_DEV;
+        dev = realloc(pool->dev, max_dev * sizeof(mb_poll_pool_dev_t));
+        if (dev == NULL)
+        {
+            return -ENOMEM;
+        }
+        pool->dev = dev;
+        pool->max_dev = max_dev;
+    }
+    if (shard == MB_POLL_POOL_NONE)
+    {
+        /* the shard with the fewest devices */
+        shard = 0;
+        for (i = 1; i < pool->num_shard; i++)
+        {
+            if (pool->shard[i].num_dev < pool->shard[shard].num_dev)
+                shard = i;
+        }
+    }
+    dev = &pool->dev[pool->num_dev];
+    memset(dev, 0, sizeof(mb_poll_pool_dev_t));
+    atomic_init(&dev->shard, shard);
+    pool->shard[shard].num_dev++;  /* devices are added to the pollers by mb_poll_pool_start */
+    return pool->num_dev++;
+}
+
+int mb_poll_pool_add_tcp_dev(mb_poll_pool_t *pool, const char *host, in_port_t port, uint8_t unit_id, int max_in_flight)
+{
+    struct in_addr addr = {0};
+    mb_poll_pool_dev_t *dev = NULL;
+    int index = 0;
+
+    if ((max_in_flight <= 0) || (inet_pton(AF_INET, host, &addr) != 1))
+    {
+        return -EINVAL;
+    }
+    index = mb_poll_pool_add_dev(pool, MB_POLL_POOL_NONE);
+    if (index < 0)
+    {
+        return index;
+    }
+    dev = &pool->dev[index];
+    dev->type = MB_POLLER_DEV_TCP;
+    strncpy(dev->host, host, sizeof(dev->host) - 1);
+    dev->port = port;
+    dev->unit_id = unit_id;
+    dev->max_in_flight = max_in_flight;
+    return index;
+}
+
+int mb_poll_pool_add_rtu_dev(mb_poll_pool_t *pool, mb_rtu_master_t *master, uint8_t addr)
+{
+    mb_poll_pool_dev_t *dev = NULL;
+    int shard = MB_POLL_POOL_NONE;
+    int index = 0;
+    int i = 0;
+
+    /* an RTU master is only used by one thread */
+    for (i = 0; i < pool->num_dev; i++)
+    {
+        if ((pool->dev[i].type == MB_POLLER_DEV_RTU) && (pool->dev[i].master == master))
+        {
+            shard = atomic_load(&pool->dev[i].shard);
+            break;
+        }
+    }
+    index = mb_poll_pool_add_dev(pool, shard);
+    if (index < 0)
+    {
+        return index;
+    }
+    dev = &pool->dev[index];
+    dev->type = MB_POLLER_DEV_RTU;
+    dev->master = master;
+    dev->unit_id = addr;
+    dev->max_in_flight = 1;
+    return index;
+}
+
+int mb_poll_pool_add_group(mb_poll_pool_t *pool, int dev, const mb_pdu_t *req, int num_req, struct timeval period, struct timeval deadline, int priority)
+{
+    mb_poll_pool_group_t *group = NULL;
+    int max_group = 0;
+
+    if (pool->started)
+    {
+        return -EBUSY;
+    }
+    if ((dev < 0) || (dev >= pool->num_dev) || (num_req <= 0))
+    {
+        return -EINVAL;
+    }
+    if (pool->num_group == pool->max_group)
+    {
+        max_group = pool->max_group ? 2 * pool->max_group : MB_POLL_POOL_MIN_GROUP;
+        group = realloc(pool->group, max_group * sizeof(mb_poll_pool_group_t));
+        if (group == NULL)
+        {
+            return -ENOMEM;
+        }
+        pool->group = group;
+        pool->max_group = max_group;
+    }
+    group = &pool->group[pool->num_group];
+    memset(group, 0, sizeof(mb_poll_pool_group_t));
+    group->req = malloc(num_req * sizeof(mb_pdu_t));
+    if (group->req == NULL)
+    {
+        return -ENOMEM;
+    }
+    memcpy(group->req, req, num_req * sizeof(mb_pdu_t));
+    group->dev = dev;
+    group->num_req = num_req;
+    group->period = period;
+    group->deadline = deadline;
+    group->priority = priority;
+    return pool->num_group++;
+}
+
+int mb_poll_pool_start(mb_poll_pool_t *pool)
+{
+    mb_poll_pool_shard_t *shard = NULL;
+    int ret = 0;
+    int i = 0;
+
+    if (pool->started)
+    {
+        return -EBUSY;
+    }
+    for (i = 0; i < pool->num_shard; i++)
+        pool->shard[i].num_dev = 0;
+    for (i = 0; i < pool->num_dev; i++)
+    {
+        shard = &pool->shard[atomic_load(&pool->dev[i].shard)];
+        ret = mb_poll_pool_shard_add_dev(shard, i);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    atomic_store(&pool->stop, 0);
+    for (i = 0; i < pool->num_shard; i++)
+    {
+        ret = pthread_create(&pool->shard[i].thread, NULL, mb_poll_pool_shard_run, &pool->shard[i]);
+        if (ret != 0)
+        {
+            mb_poll_pool_stop(pool);  /* joins the threads that were created */
+            return -ret;
+        }
+        pool->started = i + 1;
+    }
+    return 0;
+}
+
+void mb_poll_pool_stop(mb_poll_pool_t *pool)
+{
+    int i = 0;
+
+    if (!pool->started)
+    {
+        return;
+    }
+    atomic_store(&pool->stop, 1);
+    for (i = 0; i < pool->started; i++)
+        pthread_join(pool->shard[i].thread, NULL);
+    pool->started = 0;
+}
+
+int mb_poll_pool_migrate(mb_poll_pool_t *pool, int dev, int shard)
+{
+    int none = MB_POLL_POOL_NONE;
+    int from = 0;
+
+    if ((dev < 0) || (dev >= pool->num_dev) || (shard < 0) || (shard >= pool->num_shard) || (pool->dev[dev].type != MB_POLLER_DEV_TCP))
+    {
+        return -EINVAL;
+    }
+    from = atomic_load(&pool->dev[dev].shard);
+    if (from == shard)
+    {
+        return 0;
+    }
+    if (atomic_load(&pool->shard[from].thief) != MB_POLL_POOL_NONE)
+    {
+        return -EBUSY;
+    }
+    /* claim the shard before naming the device so that another request cannot change it */
+    if (!atomic_compare_exchange_strong(&pool->shard[from].thief, &none, MB_POLL_POOL_CLAIMED))
+    {
+        return -EBUSY;
+    }
+    atomic_store(&pool->shard[from].want_dev, dev);
+    atomic_store(&pool->shard[from].thief, shard);
+    return 0;
+}
+
+int mb_poll_pool_get_shard(mb_poll_pool_t *pool, int dev)
+{
+    return atomic_load(&pool->dev[dev].shard);
+}
+
+int mb_poll_pool_get_fd(mb_poll_pool_t *pool)
+{
+    return pool->efd;
+}
+
+int mb_poll_pool_next(mb_poll_pool_t *pool, mb_poll_pool_result_t *result)
+{
+    mb_poll_pool_cell_t *cell = NULL;
+    uint64_t val = 0;
+    ssize_t num = 0;
+    size_t seq = 0;
+
+    cell = &pool->queue[pool->head & (MB_POLL_POOL_QUEUE_LEN - 1)];
+    seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq != pool->head + 1)
+    {
+        /* clear the eventfd before checking again so that a result queued in between is not missed */
+        num = read(pool->efd, &val, sizeof(val));
+        (void)num;
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq != pool->head + 1)
+        {
+            return -EAGAIN;
+        }
+    }
+    memcpy(result, &cell->result, sizeof(mb_poll_pool_result_t));
+    atomic_store_explicit(&cell->seq, pool->head + MB_POLL_POOL_QUEUE_LEN, memory_order_release);
+    pool->head++;
+    return 0;
+}
@@ -0,0 +1,1046 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "mb_poller.h"
+#include "mb_log.h"
+
+typedef int (*mb_poller_cmp_t)(mb_poller_t *poller, int a, int b);
+
+static void mb_poller_timespec_add(struct timespec *a, const struct timespec *b)
+{
+    a->tv_sec += b->tv_sec;
+    a->tv_nsec += b->tv_nsec;
+    if (a->tv_nsec >= 1000000000)
+    {
+        a->tv_sec++;
+        a->tv_nsec -= 1000000000;
+    }
+}
+
+static int mb_poller_timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec)
+        return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+static long mb_poller_timespec_diff_usec(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000 + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+/* order groups by next release, then priority */
+static int mb_poller_release_cmp(mb_poller_t *poller, int a, int b)
+{
+    int ret = 0;
+
+    ret = mb_poller_timespec_cmp(&poller->group[a].release, &poller->group[b].release);
+    if (ret != 0)
+        return ret;
+    return poller->group[a].priority - poller->group[b].priority;
+}
+
+/* order groups by cycle deadline, then priority */
+static int mb_poller_ready_cmp(mb_poller_t *poller, int a, int b)
+{
+    int ret = 0;
+
+    ret = mb_poller_timespec_cmp(&poller->group[a].cycle_deadline, &poller->group[b].cycle_deadline);
+    if (ret != 0)
+        return ret;
+    return poller->group[a].priority - poller->group[b].priority;
+}
+
+static void mb_poller_heap_push(mb_poller_t *poller, int *heap, int *num, int group, mb_poller_cmp_t cmp)
+{
+    int parent = 0;
+    int i = 0;
+
+    i = (*num)++;
+    while (i > 0)
+    {
+        parent = (i - 1) / 2;
+        if (cmp(poller, heap[parent], group) <= 0)
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = group;
+}
+
+static int mb_poller_heap_pop(mb_poller_t *poller, int *heap, int *num, mb_poller_cmp_t cmp)
+{
+    int child = 0;
+    int group = 0;
+    int last = 0;
+    int i = 0;
+
+    group = heap[0];
+    last = heap[--(*num)];
+    while ((child = 2 * i + 1) < *num)
+    {
+        if ((child + 1 < *num) && (cmp(poller, heap[child + 1], heap[child]) < 0))
+            child++;
+        if (cmp(poller, last, heap[child]) <= 0)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return group;
+}
+
+int mb_poller_create(mb_poller_t *poller)
+{
+    struct epoll_event ev = {0};
+    int ret = 0;
+
+    memset(poller, 0, sizeof(mb_poller_t));
+    clock_gettime(CLOCK_MONOTONIC, &poller->epoch);
+    poller->trip = MB_POLLER_TRIP;
+    poller->min_backoff.tv_sec = MB_POLLER_MIN_BACKOFF_SEC;
+    poller->max_backoff.tv_sec = MB_POLLER_MAX_BACKOFF_SEC;
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epoll_fd < 0)
+    {
+        return -errno;
+    }
+    poller->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (poller->timer_fd < 0)
+    {
+        ret = -errno;
+        close(poller->epoll_fd);
+        return ret;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = poller;
+    ret = epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, poller->timer_fd, &ev);
+    if (ret < 0)
+    {
+        ret = -errno;
+        close(poller->timer_fd);
+        close(poller->epoll_fd);
+        return ret;
+    }
+    return 0;
+}
+
+void mb_poller_destroy(mb_poller_t *poller)
+{
+    mb_poller_bus_t *bus = NULL;
+    int i = 0;
+
+    for (i = 0; i < poller->num_bus; i++)
+    {
+        bus = &poller->bus[i];
+        pthread_mutex_lock(&bus->lock);
+        bus->stop = 1;
+        pthread_cond_signal(&bus->cond);
+        pthread_mutex_unlock(&bus->lock);
+        pthread_join(bus->thread, NULL);
+        pthread_cond_destroy(&bus->cond);
+        pthread_mutex_destroy(&bus->lock);
+        close(bus->efd);
+    }
+    for (i = 0; i < poller->num_dev; i++)
+    {
+        free(poller->dev[i].slot);
+        free(poller->dev[i].ready);
+    }
+    for (i = 0; i < poller->num_group; i++)
+    {
+        free(poller->group[i].req);
+        free(poller->group[i].tcp_prep);
+        free(poller->group[i].rtu_prep);
+    }
+    free(poller->dev);
+    free(poller->dispatch);
+    free(poller->group);
+    free(poller->release);
+    close(poller->timer_fd);
+    close(poller->epoll_fd);
+    memset(poller, 0, sizeof(mb_poller_t));
+}
+
+/* the slot of a removed device is reused so that handing devices back and forth does not grow the poller */
+static int mb_poller_add_dev(mb_poller_t *poller, int max_in_flight)
+{
+    mb_poller_slot_t *slot = NULL;
+    mb_poller_dev_t *dev = NULL;
+    int *dispatch = NULL;
+    int max_dev = 0;
+    int queued = 0;
+    int i = 0;
+
+    for (i = 0; i < poller->num_dev; i++)
+    {
+        if (poller->dev[i].removed)
+            break;
+    }
+    if (i < poller->num_dev)
+    {
+        slot = calloc(max_in_flight, sizeof(mb_poller_slot_t));
+        if (slot == NULL)
+        {
+            return -ENOMEM;
+        }
+        dev = &poller->dev[i];
+        free(dev->slot);
+        free(dev->ready);
+        queued = dev->queued;  /* the slot may still be on the dispatch list */
+        memset(dev, 0, sizeof(mb_poller_dev_t));
+        dev->queued = queued;
+        dev->slot = slot;
+        dev->max_in_flight = max_in_flight;
+        return i;
+    }
+    if (poller->num_dev == poller->max_dev)
+    {
+        max_dev = poller->max_dev ? 2 * poller->max_dev : MB_POLLER_MIN_DEV;
+        dev = realloc(poller->dev, max_dev * sizeof(mb_poller_dev_t));
+        if (dev == NULL)
+        {
+            return -ENOMEM;
+        }
+        poller->dev = dev;
+        dispatch = realloc(poller->dispatch, max_dev * sizeof(int));
+        if (dispatch == NULL)
+        {
+            return -ENOMEM;
+        }
+        poller->dispatch = dispatch;
+        poller->max_dev = max_dev;
+    }
+    dev = &poller->dev[poller->num_dev];
+    memset(dev, 0, sizeof(mb_poller_dev_t));
+    dev->slot = calloc(max_in_flight, sizeof(mb_poller_slot_t));
+    if (dev->slot == NULL)
+    {
+        return -ENOMEM;
+    }
+    dev->max_in_flight = max_in_flight;
+    return poller->num_dev++;
+}
+
+int mb_poller_add_tcp_dev(mb_poller_t *poller, mb_tcp_client_t *client, int endpoint, uint8_t unit_id, int max_in_flight)
+{
+    struct epoll_event ev = {0};
+    mb_poller_dev_t *dev = NULL;
+    int index = 0;
+    int ret = 0;
+    int i = 0;
+
+    if ((max_in_flight <= 0) || (endpoint < 0) || (endpoint >= client->num_endpoint))
+    {
+        return -EINVAL;
+    }
+    for (i = 0; i < poller->num_client; i++)
+    {
+        if (poller->client[i] == client)
+            break;
+    }
+    if (i == poller->num_client)
+    {
+        if (poller->num_client == MB_POLLER_MAX_CLIENT)
+        {
+            return -ENOSPC;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        ret = epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, mb_tcp_client_get_fd(client), &ev);
+        if (ret < 0)
+        {
+            return -errno;
+        }
+        poller->client[poller->num_client++] = client;
+    }
+    index = mb_poller_add_dev(poller, max_in_flight);
+    if (index < 0)
+    {
+        return index;
+    }
+    dev = &poller->dev[index];
+    dev->type = MB_POLLER_DEV_TCP;
+    dev->client = client;
+    dev->endpoint = endpoint;
+    dev->unit_id = unit_id;
+    return index;
+}
+
+/* worker thread, performs the exchanges of a bus one at a time */
+static void *mb_poller_bus_thread(void *arg)
+{
+    mb_poller_bus_t *bus = (mb_poller_bus_t *)arg;
+    mb_poller_slot_t *slot = NULL;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&bus->lock);
+    while (1)
+    {
+        while ((bus->head == NULL) && (!bus->stop))
+            pthread_cond_wait(&bus->cond, &bus->lock);
+        if (bus->stop)
+            break;
+        slot = bus->head;
+        bus->head = slot->next;
+        if (bus->head == NULL)
+            bus->tail = NULL;
+        pthread_mutex_unlock(&bus->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &slot->sent);
+        memset(&slot->rtu_resp, 0, sizeof(mb_rtu_adu_t));
+        slot->result = mb_rtu_master_exchange_prep(bus->master, slot->rtu_prep, &slot->rtu_resp);
+
+        pthread_mutex_lock(&bus->lock);
+        slot->next = NULL;
+        if (bus->done_tail == NULL)
+            bus->done_head = slot;
+        else
+            bus->done_tail->next = slot;
+        bus->done_tail = slot;
+        if (write(bus->efd, &one, sizeof(one)) < 0)
+            mb_log_warn("failed to signal bus completion: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return NULL;
+}
+
+/* returns the index of the bus of an RTU master, starting its worker the first time */
+static int mb_poller_add_bus(mb_poller_t *poller, mb_rtu_master_t *master)
+{
+    struct epoll_event ev = {0};
+    mb_poller_bus_t *bus = NULL;
+    int ret = 0;
+    int i = 0;
+
+    for (i = 0; i < poller->num_bus; i++)
+    {
+        if (poller->bus[i].master == master)
+            return i;
+    }
+    if (poller->num_bus == MB_POLLER_MAX_BUS)
+    {
+        return -ENOSPC;
+    }
+    bus = &poller->bus[poller->num_bus];
+    memset(bus, 0, sizeof(mb_poller_bus_t));
+    bus->master = master;
+    bus->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (bus->efd < 0)
+    {
+        return -errno;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = bus;
+    ret = epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, bus->efd, &ev);
+    if (ret < 0)
+    {
+        ret = -errno;
+        close(bus->efd);
+        return ret;
+    }
+    ret = pthread_mutex_init(&bus->lock, NULL);
+    if (ret != 0)
+    {
+        close(bus->efd);
+        return -ret;
+    }
+    ret = pthread_cond_init(&bus->cond, NULL);
+    if (ret != 0)
+    {
+        pthread_mutex_destroy(&bus->lock);
+        close(bus->efd);
+        return -ret;
+    }
+    ret = pthread_create(&bus->thread, NULL, mb_poller_bus_thread, bus);
+    if (ret != 0)
+    {
+        pthread_cond_destroy(&bus->cond);
+        pthread_mutex_destroy(&bus->lock);
+        close(bus->efd);
+        return -ret;
+    }
+    return poller->num_bus++;
+}
+
+int mb_poller_add_rtu_dev(mb_poller_t *poller, mb_rtu_master_t *master, uint8_t addr)
+{
+    mb_poller_dev_t *dev = NULL;
+    int index = 0;
+    int bus = 0;
+
+    bus = mb_poller_add_bus(poller, master);
+    if (bus < 0)
+    {
+        return bus;
+    }
+    index = mb_poller_add_dev(poller, 1);
+    if (index < 0)
+    {
+        return index;
+    }
+    dev = &poller->dev[index];
+    dev->type = MB_POLLER_DEV_RTU;
+    dev->master = master;
+    dev->bus = bus;
+    dev->unit_id = addr;
+    return index;
+}
+
+/* format the requests of a group once, only the transaction id changes between sends */
+static int mb_poller_prepare(mb_poller_t *poller, mb_poller_group_t *group)
+{
+    mb_poller_dev_t *dev = NULL;
+    mb_tcp_adu_t tcp_req = {0};
+    mb_rtu_adu_t rtu_req = {0};
+    int ret = 0;
+    int i = 0;
+
+    dev = &poller->dev[group->dev];
+    if (dev->type == MB_POLLER_DEV_RTU)
+    {
+        group->rtu_prep = malloc(group->num_req * sizeof(mb_rtu_adu_prep_t));
+        if (group->rtu_prep == NULL)
+        {
+            return -ENOMEM;
+        }
+        mb_rtu_adu_set_header(&rtu_req, dev->unit_id);
+        for (i = 0; i < group->num_req; i++)
+        {
+            memcpy(&rtu_req.pdu, &group->req[i], sizeof(mb_pdu_t));
+            ret = mb_rtu_adu_prepare(&group->rtu_prep[i], &rtu_req);
+            if (ret < 0)
+            {
+                return -EINVAL;
+            }
+        }
+        return 0;
+    }
+    group->tcp_prep = malloc(group->num_req * sizeof(mb_tcp_adu_prep_t));
+    if (group->tcp_prep == NULL)
+    {
+        return -ENOMEM;
+    }
+    mb_tcp_adu_set_header(&tcp_req, 0, 0, dev->unit_id);
+    for (i = 0; i < group->num_req; i++)
+    {
+        memcpy(&tcp_req.pdu, &group->req[i], sizeof(mb_pdu_t));
+        ret = mb_tcp_adu_prepare(&group->tcp_prep[i], &tcp_req);
+        if (ret < 0)
+        {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+int mb_poller_add_group(mb_poller_t *poller, int dev, const mb_pdu_t *req, int num_req, struct timeval period, struct timeval deadline, int priority, mb_poller_func_t func, void *arg)
+{
+    mb_poller_group_t *group = NULL;
+    struct timespec offset = {0};
+    struct timespec now = {0};
+    long long period_nsec = 0;
+    long long elapsed = 0;
+    int *release = NULL;
+    int *ready = NULL;
+    int max_group = 0;
+    int index = 0;
+    int ret = 0;
+
+    if ((dev < 0) || (dev >= poller->num_dev) || (poller->dev[dev].removed) || (num_req <= 0) || ((period.tv_sec == 0) && (period.tv_usec == 0)))
+    {
+        return -EINVAL;
+    }
+    /* reuse the slot of a removed group, it is no longer in the release heap */
+    for (index = 0; index < poller->num_group; index++)
+    {
+        if (poller->group[index].removed)
+            break;
+    }
+    if ((index == poller->num_group) && (poller->num_group == poller->max_group))
+    {
+        max_group = poller->max_group ? 2 * poller->max_group : MB_POLLER_MIN_GROUP;
+        group = realloc(poller->group, max_group * sizeof(mb_poller_group_t));
+        if (group == NULL)
+        {
+            return -ENOMEM;
+        }
+        poller->group = group;
+        release = realloc(poller->release, max_group * sizeof(int));
+        if (release == NULL)
+        {
+            return -ENOMEM;
+        }
+        poller->release = release;
+        poller->max_group = max_group;
+    }
+    /* each group waits in the queue of its device at most once */
+    ready = realloc(poller->dev[dev].ready, (poller->dev[dev].max_ready + 1) * sizeof(int));
+    if (ready == NULL)
+    {
+        return -ENOMEM;
+    }
+    poller->dev[dev].ready = ready;
+    poller->dev[dev].max_ready++;
+    group = &poller->group[index];
+    if (index < poller->num_group)
+    {
+        free(group->req);
+        free(group->tcp_prep);
+        free(group->rtu_prep);
+    }
+    memset(group, 0, sizeof(mb_poller_group_t));
+    group->req = malloc(num_req * sizeof(mb_pdu_t));
+    if (group->req == NULL)
+    {
+        return -ENOMEM;
+    }
+    memcpy(group->req, req, num_req * sizeof(mb_pdu_t));
+    group->dev = dev;
+    group->num_req = num_req;
+    ret = mb_poller_prepare(poller, group);
+    if (ret < 0)
+    {
+        free(group->req);
+        free(group->tcp_prep);
+        free(group->rtu_prep);
+        memset(group, 0, sizeof(mb_poller_group_t));
+        group->removed = 1;  /* leave the slot free */
+        return ret;
+    }
+    group->period.tv_sec = period.tv_sec;
+    group->period.tv_nsec = period.tv_usec * 1000;
+    group->deadline.tv_sec = deadline.tv_sec;
+    group->deadline.tv_nsec = deadline.tv_usec * 1000;
+    group->priority = priority;
+    group->func = func;
+    group->arg = arg;
+    /* release at whole periods since the poller was created so that groups with equal periods are released together */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - poller->epoch.tv_sec) * 1000000000LL + (now.tv_nsec - poller->epoch.tv_nsec);
+    period_nsec = group->period.tv_sec * 1000000000LL + group->period.tv_nsec;
+    elapsed -= elapsed % period_nsec;
+    group->release.tv_sec = poller->epoch.tv_sec + elapsed / 1000000000;
+    group->release.tv_nsec = poller->epoch.tv_nsec;
+    offset.tv_nsec = elapsed % 1000000000;
+    mb_poller_timespec_add(&group->release, &offset);
+    mb_poller_heap_push(poller, poller->release, &poller->num_release, index, mb_poller_release_cmp);
+    if (index == poller->num_group)
+        poller->num_group++;
+    return index;
+}
+
+void mb_poller_hold_dev(mb_poller_t *poller, int dev)
+{
+    poller->dev[dev].hold = 1;
+}
+
+int mb_poller_remove_dev(mb_poller_t *poller, int dev)
+{
+    int num = 0;
+    int i = 0;
+
+    if (poller->dev[dev].num_in_flight > 0)
+    {
+        return -EBUSY;
+    }
+    for (i = 0; i < poller->num_group; i++)
+    {
+        if ((poller->group[i].dev == dev) && (poller->group[i].active))
+            return -EBUSY;
+    }
+    for (i = 0; i < poller->num_group; i++)
+    {
+        if (poller->group[i].dev == dev)
+            poller->group[i].removed = 1;
+    }
+    poller->dev[dev].removed = 1;
+    /* rebuild the release heap without the groups of the device so that their slots can be reused */
+    num = poller->num_release;
+    poller->num_release = 0;
+    for (i = 0; i < num; i++)
+    {
+        if (!poller->group[poller->release[i]].removed)
+            mb_poller_heap_push(poller, poller->release, &poller->num_release, poller->release[i], mb_poller_release_cmp);
+    }
+    return 0;
+}
+
+void mb_poller_set_circuit(mb_poller_t *poller, unsigned trip, struct timeval min_backoff, struct timeval max_backoff)
+{
+    poller->trip = trip > 0 ? trip : 1;
+    poller->min_backoff.tv_sec = min_backoff.tv_sec;
+    poller->min_backoff.tv_nsec = min_backoff.tv_usec * 1000;
+    poller->max_backoff.tv_sec = max_backoff.tv_sec;
+    poller->max_backoff.tv_nsec = max_backoff.tv_usec * 1000;
+}
+
+void mb_poller_get_health(mb_poller_t *poller, int dev, mb_poller_health_t *health)
+{
+    memcpy(health, &poller->dev[dev].health, sizeof(mb_poller_health_t));
+}
+
+void mb_poller_get_stats(mb_poller_t *poller, int group, mb_poller_stats_t *stats)
+{
+    memcpy(stats, &poller->group[group].stats, sizeof(mb_poller_stats_t));
+}
+
+/* errors that suggest the device cannot be reached */
+static int mb_poller_unreachable(ssize_t result)
+{
+    switch (result)
+    {
+    case -ETIMEDOUT:
+    case -ECONNREFUSED:
+    case -ECONNRESET:
+    case -ECONNABORTED:
+    case -EHOSTUNREACH:
+    case -ENETUNREACH:
+    case -EPIPE:
+        return 1;
+    }
+    return 0;
+}
+
+static void mb_poller_open_circuit(mb_poller_t *poller, int index, struct timespec *now)
+{
+    mb_poller_health_t *health = NULL;
+    long long backoff = 0;
+    long long max = 0;
+
+    health = &poller->dev[index].health;
+    if (health->circuit == MB_POLLER_CIRCUIT_PROBE)
+    {
+        /* double the backoff up to the limit */
+        backoff = 2 * (health->backoff.tv_sec * 1000000000LL + health->backoff.tv_nsec);
+        max = poller->max_backoff.tv_sec * 1000000000LL + poller->max_backoff.tv_nsec;
+        if (backoff > max)
+            backoff = max;
+        health->backoff.tv_sec = backoff / 1000000000;
+        health->backoff.tv_nsec = backoff % 1000000000;
+    }
+    else
+    {
+        health->backoff = poller->min_backoff;
+    }
+    health->circuit = MB_POLLER_CIRCUIT_OPEN;
+    health->num_trip++;
+    health->retry = *now;
+    mb_poller_timespec_add(&health->retry, &health->backoff);
+    mb_log_warn("device %d is unreachable, next probe in %ld ms", index, health->backoff.tv_sec * 1000 + health->backoff.tv_nsec / 1000000);
+}
+
+static void mb_poller_health_update(mb_poller_t *poller, int index, ssize_t result, mb_pdu_t *resp, struct timespec *sent)
+{
+    mb_poller_health_t *health = NULL;
+    struct timespec now = {0};
+    long rtt = 0;
+
+    health = &poller->dev[index].health;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (result >= 0)
+    {
+        rtt = mb_poller_timespec_diff_usec(&now, sent);
+        if (health->num_ok == 0)
+            health->rtt_usec = rtt;
+        else
+            health->rtt_usec += (rtt - health->rtt_usec) / (1 << MB_POLLER_RTT_SHIFT);
+        if (rtt > health->rtt_max_usec)
+            health->rtt_max_usec = rtt;
+        health->num_ok++;
+        if ((resp != NULL) && (resp->type == MB_PDU_ERR))
+            health->num_except++;
+        if (health->circuit != MB_POLLER_CIRCUIT_CLOSED)
+            mb_log_notice("device %d is reachable again", index);
+        health->circuit = MB_POLLER_CIRCUIT_CLOSED;
+        health->num_fail_run = 0;
+        return;
+    }
+    if (!mb_poller_unreachable(result))
+    {
+        if (health->circuit == MB_POLLER_CIRCUIT_PROBE)
+            mb_poller_open_circuit(poller, index, &now);
+        return;
+    }
+    health->num_fail++;
+    health->num_fail_run++;
+    if ((health->circuit == MB_POLLER_CIRCUIT_PROBE)
+     || ((health->circuit == MB_POLLER_CIRCUIT_CLOSED) && (health->num_fail_run >= poller->trip)))
+    {
+        mb_poller_open_circuit(poller, index, &now);
+    }
+}
+
+static void mb_poller_req_done(mb_poller_t *poller, int index, int req, ssize_t result, mb_pdu_t *resp)
+{
+    mb_poller_group_t *group = NULL;
+    struct timespec now = {0};
+    long lateness = 0;
+
+    group = &poller->group[index];
+    if (result < 0)
+    {
+        group->stats.num_err++;
+    }
+    if (group->func != NULL)
+    {
+        group->func(poller, index, req, result, resp, group->arg);
+    }
+    if (++group->num_done < group->num_req)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lateness = mb_poller_timespec_diff_usec(&now, &group->cycle_deadline);
+    if (lateness > 0)
+    {
+        group->stats.num_late++;
+        if (lateness > group->stats.lateness_max_usec)
+            group->stats.lateness_max_usec = lateness;
+    }
+    group->stats.num_cycle++;
+    group->active = 0;
+}
+
+/* add a device to the list visited at the end of mb_poller_run_once */
+static void mb_poller_queue(mb_poller_t *poller, int index)
+{
+    if (!poller->dev[index].queued)
+    {
+        poller->dev[index].queued = 1;
+        poller->dispatch[poller->num_dispatch++] = index;
+    }
+}
+
+static void mb_poller_tcp_done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp, void *arg)
+{
+    mb_poller_slot_t *slot = (mb_poller_slot_t *)arg;
+    mb_poller_t *poller = slot->poller;
+
+    slot->used = 0;
+    poller->dev[poller->group[slot->group].dev].num_in_flight--;
+    mb_poller_queue(poller, poller->group[slot->group].dev);
+    mb_poller_health_update(poller, poller->group[slot->group].dev, result, resp != NULL ? &resp->pdu : NULL, &slot->sent);
+    mb_poller_req_done(poller, slot->group, slot->req, result, resp != NULL ? &resp->pdu : NULL);
+}
+
+/* complete the exchanges performed by the worker of a bus */
+static void mb_poller_bus_collect(mb_poller_t *poller, mb_poller_bus_t *bus)
+{
+    mb_poller_slot_t *slot = NULL;
+    mb_poller_slot_t *next = NULL;
+    mb_pdu_t *resp = NULL;
+    uint64_t count = 0;
+    int dev = 0;
+
+    if (read(bus->efd, &count, sizeof(count)) < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&bus->lock);
+    slot = bus->done_head;
+    bus->done_head = NULL;
+    bus->done_tail = NULL;
+    pthread_mutex_unlock(&bus->lock);
+    while (slot != NULL)
+    {
+        next = slot->next;
+        dev = poller->group[slot->group].dev;
+        resp = slot->result >= 0 ? &slot->rtu_resp.pdu : NULL;
+        slot->used = 0;
+        poller->dev[dev].num_in_flight--;
+        mb_poller_queue(poller, dev);
+        mb_poller_health_update(poller, dev, slot->result, resp, &slot->sent);
+        mb_poller_req_done(poller, slot->group, slot->req, slot->result, resp);
+        slot = next;
+    }
+}
+
+/* queue an RTU request for the worker of its bus */
+static void mb_poller_bus_submit(mb_poller_bus_t *bus, mb_poller_slot_t *slot)
+{
+    pthread_mutex_lock(&bus->lock);
+    slot->next = NULL;
+    if (bus->tail == NULL)
+        bus->head = slot;
+    else
+        bus->tail->next = slot;
+    bus->tail = slot;
+    pthread_cond_signal(&bus->cond);
+    pthread_mutex_unlock(&bus->lock);
+}
+
+/* returns -EBUSY if the request could not be sent yet */
+static int mb_poller_send(mb_poller_t *poller, int index, int req)
+{
+    mb_poller_group_t *group = NULL;
+    mb_poller_slot_t *slot = NULL;
+    mb_poller_dev_t *dev = NULL;
+    struct timespec now = {0};
+    int probe = 0;
+    int ret = 0;
+    int i = 0;
+
+    group = &poller->group[index];
+    dev = &poller->dev[group->dev];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (dev->health.circuit != MB_POLLER_CIRCUIT_CLOSED)
+    {
+        if ((dev->health.circuit == MB_POLLER_CIRCUIT_PROBE) || (mb_poller_timespec_cmp(&now, &dev->health.retry) < 0))
+        {
+            dev->health.num_skip++;
+            mb_poller_req_done(poller, index, req, -EHOSTUNREACH, NULL);
+            return 0;
+        }
+        dev->health.circuit = MB_POLLER_CIRCUIT_PROBE;
+        probe = 1;
+    }
+    if (dev->type == MB_POLLER_DEV_RTU)
+    {
+        slot = &dev->slot[0];
+        slot->poller = poller;
+        slot->group = index;
+        slot->req = req;
+        slot->rtu_prep = &group->rtu_prep[req];
+        slot->used = 1;
+        dev->num_in_flight++;
+        mb_poller_bus_submit(&poller->bus[dev->bus], slot);
+        return 0;
+    }
+    for (i = 0; i < dev->max_in_flight; i++)
+    {
+        if (!dev->slot[i].used)
+            break;
+    }
+    slot = &dev->slot[i];
+    slot->poller = poller;
+    slot->group = index;
+    slot->req = req;
+    slot->sent = now;
+    ret = mb_tcp_client_submit_prep(dev->client, dev->endpoint, &group->tcp_prep[req], NULL, mb_poller_tcp_done, slot);
+    if (ret == -EBUSY)
+    {
+        if (probe)
+            dev->health.circuit = MB_POLLER_CIRCUIT_OPEN;  /* probe again on the next attempt */
+        return ret;  /* the client has no room for another request */
+    }
+    if (ret < 0)
+    {
+        mb_poller_health_update(poller, group->dev, ret, NULL, &now);
+        mb_poller_req_done(poller, index, req, ret, NULL);
+        return 0;
+    }
+    slot->used = 1;
+    dev->num_in_flight++;
+    return 0;
+}
+
+static void mb_poller_dispatch(mb_poller_t *poller, int index)
+{
+    mb_poller_group_t *group = NULL;
+    mb_poller_dev_t *dev = NULL;
+    int ret = 0;
+
+    dev = &poller->dev[index];
+    while ((dev->num_ready > 0) && (dev->num_in_flight < dev->max_in_flight))
+    {
+        group = &poller->group[dev->ready[0]];
+        ret = mb_poller_send(poller, dev->ready[0], group->next_req);
+        if (ret < 0)
+        {
+            mb_poller_queue(poller, index);  /* try again on the next wakeup */
+            break;
+        }
+        if (++group->next_req == group->num_req)
+        {
+            mb_poller_heap_pop(poller, dev->ready, &dev->num_ready, mb_poller_ready_cmp);
+        }
+    }
+}
+
+static void mb_poller_release(mb_poller_t *poller, int index, struct timespec *now)
+{
+    mb_poller_group_t *group = NULL;
+    mb_poller_dev_t *dev = NULL;
+    long jitter = 0;
+
+    group = &poller->group[index];
+    dev = &poller->dev[group->dev];
+    if (group->removed)
+    {
+        return;
+    }
+    if (dev->hold)
+    {
+        /* skip the release */
+    }
+    else if (group->active)
+    {
+        group->stats.num_overrun++;
+        mb_log_warn("scan group %d overran its period", index);
+        if (group->func != NULL)
+            group->func(poller, index, MB_POLLER_OVERRUN, -ETIME, NULL, group->arg);
+    }
+    else
+    {
+        jitter = mb_poller_timespec_diff_usec(now, &group->release);
+        if (jitter > poller->lag_usec)
+            poller->lag_usec = jitter;
+        group->stats.num_release++;
+        group->stats.jitter_sum_usec += jitter;
+        if (jitter > group->stats.jitter_max_usec)
+            group->stats.jitter_max_usec = jitter;
+        group->active = 1;
+        group->next_req = 0;
+        group->num_done = 0;
+        group->cycle_release = group->release;
+        group->cycle_deadline = group->release;
+        mb_poller_timespec_add(&group->cycle_deadline, &group->deadline);
+        mb_poller_heap_push(poller, dev->ready, &dev->num_ready, index, mb_poller_ready_cmp);
+        mb_poller_queue(poller, group->dev);
+    }
+    mb_poller_timespec_add(&group->release, &group->period);
+    while (mb_poller_timespec_cmp(&group->release, now) <= 0)
+    {
+        /* the scheduler fell more than a period behind */
+        group->stats.num_overrun++;
+        mb_poller_timespec_add(&group->release, &group->period);
+    }
+    mb_poller_heap_push(poller, poller->release, &poller->num_release, index, mb_poller_release_cmp);
+}
+
+/* arm the timer for the next release or TCP request deadline, whichever is sooner */
+static int mb_poller_set_timer(mb_poller_t *poller)
+{
+    struct itimerspec its = {{0}};
+    struct timespec deadline = {0};
+    int ret = 0;
+    int i = 0;
+
+    if (poller->num_release > 0)
+    {
+        its.it_value = poller->group[poller->release[0]].release;
+    }
+    for (i = 0; i < poller->num_client; i++)
+    {
+        if ((mb_tcp_client_next_deadline(poller->client[i], &deadline))
+         && ((its.it_value.tv_sec == 0) || (mb_poller_timespec_cmp(&deadline, &its.it_value) < 0)))
+            its.it_value = deadline;
+    }
+    if ((its.it_value.tv_sec == 0) || (mb_poller_timespec_cmp(&its.it_value, &poller->timer) == 0))
+    {
+        return 0;
+    }
+    ret = timerfd_settime(poller->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    if (ret < 0)
+    {
+        return -errno;
+    }
+    poller->timer = its.it_value;
+    return 0;
+}
+
+int mb_poller_run_once(mb_poller_t *poller, int timeout_msec)
+{
+    struct epoll_event ev[MB_POLLER_MAX_CLIENT + MB_POLLER_MAX_BUS + 1] = {{0}};
+    struct timeval zero = {0};
+    struct timespec now = {0};
+    uint64_t num = 0;
+    int num_dispatch = 0;
+    int ret = 0;
+    int i = 0;
+
+    ret = mb_poller_set_timer(poller);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = epoll_wait(poller->epoll_fd, ev, MB_POLLER_MAX_CLIENT + MB_POLLER_MAX_BUS + 1, timeout_msec);
+    if ((ret < 0) && (errno != EINTR))
+    {
+        return -errno;
+    }
+    for (i = 0; i < ret; i++)
+    {
+        if (ev[i].data.ptr == poller)
+        {
+            read(poller->timer_fd, &num, sizeof(num));
+            poller->timer.tv_sec = 0;
+            poller->timer.tv_nsec = 0;
+        }
+    }
+    for (i = 0; i < poller->num_client; i++)
+    {
+        ret = mb_tcp_client_poll(poller->client[i], &zero);
+        if (ret < 0)
+            mb_log_warn("poll: %s", strerror(-ret));
+    }
+    for (i = 0; i < poller->num_bus; i++)
+    {
+        mb_poller_bus_collect(poller, &poller->bus[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((poller->num_release > 0) && (mb_poller_timespec_cmp(&poller->group[poller->release[0]].release, &now) <= 0))
+    {
+        i = mb_poller_heap_pop(poller, poller->release, &poller->num_release, mb_poller_release_cmp);
+        mb_poller_release(poller, i, &now);
+    }
+    /* devices queued while dispatching are visited on the next wakeup */
+    num_dispatch = poller->num_dispatch;
+    for (i = 0; i < num_dispatch; i++)
+    {
+        poller->dev[poller->dispatch[i]].queued = 0;
+        mb_poller_dispatch(poller, poller->dispatch[i]);
+    }
+    poller->num_dispatch -= num_dispatch;
+    memmove(poller->dispatch, poller->dispatch + num_dispatch, poller->num_dispatch * sizeof(int));
+    return 0;
+}
+
+int mb_poller_run(mb_poller_t *poller)
+{
+    int ret = 0;
+
+    while (1)
+    {
+        ret = mb_poller_run_once(poller, -1);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,973 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "mb_reg_bank.h"
+#include "mb_log.h"
+
+static int mb_reg_bank_check_bits(mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant)
+{
+    if ((table != MB_REG_BANK_COILS) && (table != MB_REG_BANK_DISC_IPS))
+        return -EINVAL;
+    if ((uint32_t)start_addr + (uint32_t)quant > MB_REG_BANK_NUM_ADDR)
+        return -EINVAL;
+    return 0;
+}
+
+static int mb_reg_bank_check_regs(mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant)
+{
+    if ((table != MB_REG_BANK_HOLD_REGS) && (table != MB_REG_BANK_IP_REGS))
+        return -EINVAL;
+    if ((uint32_t)start_addr + (uint32_t)quant > MB_REG_BANK_NUM_ADDR)
+        return -EINVAL;
+    return 0;
+}
+
+static uint8_t *mb_reg_bank_bits(mb_reg_bank_data_t *data, mb_reg_bank_table_t table)
+{
+    return (table == MB_REG_BANK_COILS) ? data->coil : data->disc_ip;
+}
+
+static uint16_t *mb_reg_bank_regs(mb_reg_bank_data_t *data, mb_reg_bank_table_t table)
+{
+    return (table == MB_REG_BANK_HOLD_REGS) ? data->hold_reg : data->ip_reg;
+}
+
+/* a writer in another process may have died part way through a write, so do not wait forever */
+static int mb_reg_bank_rd_begin(mb_reg_bank_t *bank, mb_reg_bank_data_t **data, unsigned *seq)
+{
+    struct timespec start = {0};
+    struct timespec now = {0};
+    unsigned i = 0;
+
+    for (i = 0; ; i++)
+    {
+        *seq = atomic_load_explicit(&bank->mem->seq, memory_order_acquire);
+        if (!(*seq & 1))
+            break;
+        /* a small write is in progress */
+        if (i < MB_REG_BANK_RD_SPIN)
+            continue;
+        if (i == MB_REG_BANK_RD_SPIN)
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= MB_REG_BANK_RD_TIMEOUT_MSEC)
+            return -EAGAIN;
+        sched_yield();
+    }
+    *data = &bank->mem->data[atomic_load_explicit(&bank->mem->cur, memory_order_acquire)];
+    return 0;
+}
+
+static int mb_reg_bank_rd_retry(mb_reg_bank_t *bank, unsigned seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&bank->mem->seq, memory_order_relaxed) != seq;
+}
+
+/* the process lock guards the subscribers, the shared lock excludes writers in other processes */
+static void mb_reg_bank_lock(mb_reg_bank_t *bank)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&bank->lock);
+    ret = pthread_mutex_lock(&bank->mem->lock);
+    if (ret == EOWNERDEAD)
+    {
+        mb_log_warn("register bank writer died holding the lock");
+        if (atomic_load(&bank->mem->seq) & 1)
+            atomic_fetch_add(&bank->mem->seq, 1);  /* the previous writer stopped part way through a write */
+        pthread_mutex_consistent(&bank->mem->lock);
+    }
+}
+
+static void mb_reg_bank_unlock(mb_reg_bank_t *bank)
+{
+    pthread_mutex_unlock(&bank->mem->lock);
+    pthread_mutex_unlock(&bank->lock);
+}
+
+static mb_reg_bank_data_t *mb_reg_bank_wr_begin(mb_reg_bank_t *bank)
+{
+    mb_reg_bank_lock(bank);
+    atomic_fetch_add_explicit(&bank->mem->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return &bank->mem->data[atomic_load_explicit(&bank->mem->cur, memory_order_relaxed)];
+}
+
+/* called with the writer lock held */
+static void mb_reg_bank_sync_periodic(mb_reg_bank_t *bank)
+{
+    time_t now = 0;
+
+    if ((!bank->shared) || (bank->sync_period == 0))
+        return;
+    now = time(NULL);
+    if (now - bank->last_sync < bank->sync_period)
+        return;
+    bank->last_sync = now;
+    if (msync(bank->mem, sizeof(mb_reg_bank_mem_t), MS_ASYNC) < 0)
+        mb_log_warn("failed to flush register bank: %s", strerror(errno));
+}
+
+static uint16_t mb_reg_bank_get(mb_reg_bank_data_t *data, mb_reg_bank_table_t table, uint32_t addr)
+{
+    switch (table)
+    {
+    case MB_REG_BANK_COILS:
+        return data->coil[addr];
+    case MB_REG_BANK_DISC_IPS:
+        return data->disc_ip[addr];
+    case MB_REG_BANK_HOLD_REGS:
+        return data->hold_reg[addr];
+    default:
+        return data->ip_reg[addr];
+    }
+}
+
+/* called with the writer lock held before the data is modified,
+ * fills in the old values in unused events without queueing them
+ */
+static void mb_reg_bank_sub_prepare(mb_reg_bank_t *bank, mb_reg_bank_data_t *data, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant)
+{
+    mb_reg_bank_sub_t *sub = NULL;
+    mb_reg_bank_ev_t *ev = NULL;
+    uint32_t end_addr = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    uint32_t addr = 0;
+    unsigned head = 0;
+    unsigned tail = 0;
+    unsigned i = 0;
+    int j = 0;
+
+    if (bank->num_sub == 0)
+        return;
+    end_addr = (uint32_t)start_addr + quant;
+    for (j = 0; j < MB_REG_BANK_MAX_SUB; j++)
+    {
+        sub = bank->sub[j];
+        if ((sub == NULL) || (sub->table != table))
+            continue;
+        start = (start_addr > sub->start_addr) ? start_addr : sub->start_addr;
+        end = (end_addr < sub->end_addr) ? end_addr : sub->end_addr;
+        head = atomic_load_explicit(&sub->head, memory_order_acquire);
+        tail = atomic_load_explicit(&sub->tail, memory_order_relaxed);
+        for (addr = start; addr < end; addr += MB_REG_BANK_EV_MAX_QUANT)
+        {
+            if (tail + sub->num_pend - head >= MB_REG_BANK_SUB_NUM_EV)
+            {
+                atomic_fetch_add_explicit(&sub->overrun, 1, memory_order_relaxed);
+                continue;
+            }
+            ev = &sub->ev[(tail + sub->num_pend) & (MB_REG_BANK_SUB_NUM_EV - 1)];
+            ev->table = table;
+            ev->start_addr = addr;
+            ev->quant = (end - addr < MB_REG_BANK_EV_MAX_QUANT) ? end - addr : MB_REG_BANK_EV_MAX_QUANT;
+            for (i = 0; i < ev->quant; i++)
+                ev->old_val[i] = mb_reg_bank_get(data, table, addr + i);
+            sub->num_pend++;
+        }
+    }
+}
+
+/* called with the writer lock held after the data has been modified */
+static void mb_reg_bank_sub_publish(mb_reg_bank_t *bank, mb_reg_bank_data_t *data)
+{
+    mb_reg_bank_sub_t *sub = NULL;
+    mb_reg_bank_ev_t *ev = NULL;
+    uint64_t one = 1;
+    unsigned tail = 0;
+    unsigned i = 0;
+    unsigned k = 0;
+    int j = 0;
+
+    if (bank->num_sub == 0)
+        return;
+    for (j = 0; j < MB_REG_BANK_MAX_SUB; j++)
+    {
+        sub = bank->sub[j];
+        if ((sub == NULL) || (sub->num_pend == 0))
+            continue;
+        tail = atomic_load_explicit(&sub->tail, memory_order_relaxed);
+        for (k = 0; k < sub->num_pend; k++)
+        {
+            ev = &sub->ev[(tail + k) & (MB_REG_BANK_SUB_NUM_EV - 1)];
+            for (i = 0; i < ev->quant; i++)
+                ev->new_val[i] = mb_reg_bank_get(data, ev->table, ev->start_addr + i);
+        }
+        atomic_store_explicit(&sub->tail, tail + sub->num_pend, memory_order_release);
+        sub->num_pend = 0;
+        if (write(sub->efd, &one, sizeof(one)) < 0)
+            mb_log_warn("failed to signal register bank subscriber: %s", strerror(errno));
+    }
+}
+
+static void mb_reg_bank_wr_end(mb_reg_bank_t *bank)
+{
+    atomic_fetch_add_explicit(&bank->mem->seq, 1, memory_order_release);
+    mb_reg_bank_sub_publish(bank, &bank->mem->data[atomic_load_explicit(&bank->mem->cur, memory_order_relaxed)]);
+    mb_reg_bank_sync_periodic(bank);
+    mb_reg_bank_unlock(bank);
+}
+
+static int mb_reg_bank_init_lock(mb_reg_bank_mem_t *mem)
+{
+    pthread_mutexattr_t attr;
+    int ret = 0;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    ret = pthread_mutex_init(&mem->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return -ret;
+}
+
+static int mb_reg_bank_init_mem(mb_reg_bank_mem_t *mem)
+{
+    mem->magic = MB_REG_BANK_MAGIC;
+    mem->version = MB_REG_BANK_VERSION;
+    mem->size = sizeof(mb_reg_bank_mem_t);
+    atomic_init(&mem->seq, 0);
+    atomic_init(&mem->cur, 0);
+    return mb_reg_bank_init_lock(mem);
+}
+
+/* a writer that died holding the lock is reported by the robust mutex, one that is still alive is waited for */
+static int mb_reg_bank_recover_lock(mb_reg_bank_mem_t *mem)
+{
+    struct timespec ts = {0};
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += MB_REG_BANK_LOCK_TIMEOUT_SEC;
+    ret = pthread_mutex_timedlock(&mem->lock, &ts);
+    if (ret == ETIMEDOUT)
+    {
+        mb_log_warn("register bank lock is held by another writer");
+        return -ETIMEDOUT;
+    }
+    if (ret == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&mem->lock);
+    }
+    else if (ret != 0)
+    {
+        return -ret;
+    }
+    if (atomic_load(&mem->seq) & 1)
+        atomic_fetch_add(&mem->seq, 1);  /* the previous writer stopped part way through a write */
+    pthread_mutex_unlock(&mem->lock);
+    return 0;
+}
+
+static int mb_reg_bank_check_mem(mb_reg_bank_mem_t *mem)
+{
+    if ((mem->magic != MB_REG_BANK_MAGIC)
+     || (mem->version != MB_REG_BANK_VERSION)
+     || (mem->size != sizeof(mb_reg_bank_mem_t)))
+        return -EPROTO;
+    return 0;
+}
+
+int mb_reg_bank_create(mb_reg_bank_t *bank)
+{
+    int ret = 0;
+
+    memset(bank, 0, sizeof(mb_reg_bank_t));
+    bank->mem = mmap(NULL, sizeof(mb_reg_bank_mem_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bank->mem == MAP_FAILED)
+    {
+        memset(bank, 0, sizeof(mb_reg_bank_t));
+        return -errno;
+    }
+    ret = mb_reg_bank_init_mem(bank->mem);
+    if (ret < 0)
+    {
+        munmap(bank->mem, sizeof(mb_reg_bank_mem_t));
+        memset(bank, 0, sizeof(mb_reg_bank_t));
+        return ret;
+    }
+    ret = pthread_mutex_init(&bank->lock, NULL);
+    if (ret != 0)
+    {
+        pthread_mutex_destroy(&bank->mem->lock);
+        munmap(bank->mem, sizeof(mb_reg_bank_mem_t));
+        memset(bank, 0, sizeof(mb_reg_bank_t));
+        return -ret;
+    }
+    return 0;
+}
+
+int mb_reg_bank_open(mb_reg_bank_t *bank, const char *path, int flags)
+{
+    int ret = 0;
+    int fd = 0;
+
+    if (flags & MB_REG_BANK_RDONLY)
+        fd = open(path, O_RDONLY);
+    else
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        memset(bank, 0, sizeof(mb_reg_bank_t));
+        return -errno;
+    }
+    ret = mb_reg_bank_open_fd(bank, fd, flags);
+    close(fd);  /* the mapping remains valid */
+    if (ret < 0)
+    {
+        return ret;
+    }
+    mb_log_notice("register bank mapped from '%s'", path);
+    return 0;
+}
+
+/* an empty file (e.g. a new memfd) is sized and initialised, otherwise the existing contents are used */
+int mb_reg_bank_open_fd(mb_reg_bank_t *bank, int fd, int flags)
+{
+    struct stat st = {0};
+    int prot = PROT_READ;
+    int init = 0;
+    int ret = 0;
+
+    memset(bank, 0, sizeof(mb_reg_bank_t));
+    ret = fstat(fd, &st);
+    if (ret < 0)
+    {
+        return -errno;
+    }
+    if (st.st_size == 0)
+    {
+        if (flags & MB_REG_BANK_RDONLY)
+        {
+            return -ENODATA;
+        }
+        ret = ftruncate(fd, sizeof(mb_reg_bank_mem_t));
+        if (ret < 0)
+        {
+            return -errno;
+        }
+        init = 1;
+    }
+    else if (st.st_size != sizeof(mb_reg_bank_mem_t))
+    {
+        return -EPROTO;
+    }
+    if (!(flags & MB_REG_BANK_RDONLY))
+        prot |= PROT_WRITE;
+    bank->mem = mmap(NULL, sizeof(mb_reg_bank_mem_t), prot, MAP_SHARED, fd, 0);
+    if (bank->mem == MAP_FAILED)
+    {
+        memset(bank, 0, sizeof(mb_reg_bank_t));
+        return -errno;
+    }
+    if (init)
+        ret = mb_reg_bank_init_mem(bank->mem);
+    else
+        ret = mb_reg_bank_check_mem(bank->mem);
+    if ((ret == 0) && (!init) && (!(flags & MB_REG_BANK_RDONLY)))
+        ret = mb_reg_bank_recover_lock(bank->mem);
+    if (ret < 0)
+    {
+        munmap(bank->mem, sizeof(mb_reg_bank_mem_t));
+        memset(bank, 0, sizeof(mb_reg_bank_t));
+        return ret;
+    }
+    ret = pthread_mutex_init(&bank->lock, NULL);
+    if (ret != 0)
+    {
+        munmap(bank->mem, sizeof(mb_reg_bank_mem_t));
+        memset(bank, 0, sizeof(mb_reg_bank_t));
+        return -ret;
+    }
+    bank->flags = flags;
+    bank->shared = 1;
+    bank->last_sync = time(NULL);
+    return 0;
+}
+
+void mb_reg_bank_destroy(mb_reg_bank_t *bank)
+{
+    int i = 0;
+
+    for (i = 0; i < MB_REG_BANK_MAX_SUB; i++)
+    {
+        if (bank->sub[i] != NULL)
+        {
+            close(bank->sub[i]->efd);
+            free(bank->sub[i]);
+        }
+    }
+    if ((bank->shared) && (!(bank->flags & MB_REG_BANK_RDONLY)))
+        msync(bank->mem, sizeof(mb_reg_bank_mem_t), MS_SYNC);
+    if (!bank->shared)
+        pthread_mutex_destroy(&bank->mem->lock);  /* a shared lock outlives this process */
+    pthread_mutex_destroy(&bank->lock);
+    munmap(bank->mem, sizeof(mb_reg_bank_mem_t));
+    memset(bank, 0, sizeof(mb_reg_bank_t));
+}
+
+void mb_reg_bank_set_sync_period(mb_reg_bank_t *bank, time_t sync_period)
+{
+    pthread_mutex_lock(&bank->lock);
+    bank->sync_period = sync_period;
+    pthread_mutex_unlock(&bank->lock);
+}
+
+int mb_reg_bank_sync(mb_reg_bank_t *bank)
+{
+    int ret = 0;
+
+    if ((!bank->shared) || (bank->flags & MB_REG_BANK_RDONLY))
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&bank->lock);
+    ret = msync(bank->mem, sizeof(mb_reg_bank_mem_t), MS_SYNC);
+    bank->last_sync = time(NULL);
+    pthread_mutex_unlock(&bank->lock);
+    if (ret < 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+int mb_reg_bank_rd_bits(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, uint8_t *val)
+{
+    mb_reg_bank_data_t *data = NULL;
+    unsigned seq = 0;
+    unsigned i = 0;
+    uint8_t *bits = NULL;
+    int ret = 0;
+
+    ret = mb_reg_bank_check_bits(table, start_addr, quant);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    do
+    {
+        ret = mb_reg_bank_rd_begin(bank, &data, &seq);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        bits = mb_reg_bank_bits(data, table) + start_addr;
+        memset(val, 0, (quant + 7) >> 3);
+        for (i = 0; i < quant; i++)
+        {
+            if (bits[i])
+                val[i >> 3] |= 1 << (i & 0x07);
+        }
+    }
+    while (mb_reg_bank_rd_retry(bank, seq));
+    return 0;
+}
+
+int mb_reg_bank_wr_bits(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, const uint8_t *val)
+{
+    mb_reg_bank_data_t *data = NULL;
+    unsigned i = 0;
+    uint8_t *bits = NULL;
+    int ret = 0;
+
+    if (bank->flags & MB_REG_BANK_RDONLY)
+    {
+        return -EROFS;
+    }
+    ret = mb_reg_bank_check_bits(table, start_addr, quant);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    data = mb_reg_bank_wr_begin(bank);
+    mb_reg_bank_sub_prepare(bank, data, table, start_addr, quant);
+    bits = mb_reg_bank_bits(data, table) + start_addr;
+    for (i = 0; i < quant; i++)
+        bits[i] = (val[i >> 3] >> (i & 0x07)) & 0x01;
+    mb_reg_bank_wr_end(bank);
+    return 0;
+}
+
+int mb_reg_bank_rd_regs(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, uint16_t *val)
+{
+    mb_reg_bank_data_t *data = NULL;
+    unsigned seq = 0;
+    int ret = 0;
+
+    ret = mb_reg_bank_check_regs(table, start_addr, quant);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    do
+    {
+        ret = mb_reg_bank_rd_begin(bank, &data, &seq);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        memcpy(val, mb_reg_bank_regs(data, table) + start_addr, 2 * quant);
+    }
+    while (mb_reg_bank_rd_retry(bank, seq));
+    return 0;
+}
+
+int mb_reg_bank_wr_regs(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint16_t quant, const uint16_t *val)
+{
+    mb_reg_bank_data_t *data = NULL;
+    int ret = 0;
+
+    if (bank->flags & MB_REG_BANK_RDONLY)
+    {
+        return -EROFS;
+    }
+    ret = mb_reg_bank_check_regs(table, start_addr, quant);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    data = mb_reg_bank_wr_begin(bank);
+    mb_reg_bank_sub_prepare(bank, data, table, start_addr, quant);
+    memcpy(mb_reg_bank_regs(data, table) + start_addr, val, 2 * quant);
+    mb_reg_bank_wr_end(bank);
+    return 0;
+}
+
+/* the read and the write happen under one writer lock so no other writer can intervene */
+int mb_reg_bank_mask_wr_reg(mb_reg_bank_t *bank, uint16_t addr, uint16_t and_mask, uint16_t or_mask)
+{
+    mb_reg_bank_data_t *data = NULL;
+    uint16_t *reg = NULL;
+
+    if (bank->flags & MB_REG_BANK_RDONLY)
+    {
+        return -EROFS;
+    }
+    data = mb_reg_bank_wr_begin(bank);
+    mb_reg_bank_sub_prepare(bank, data, MB_REG_BANK_HOLD_REGS, addr, 1);
+    reg = &data->hold_reg[addr];
+    *reg = (*reg & and_mask) | (or_mask & ~and_mask);
+    mb_reg_bank_wr_end(bank);
+    return 0;
+}
+
+/* the write is performed before the read as required by the specification */
+int mb_reg_bank_rd_wr_regs(mb_reg_bank_t *bank, uint16_t rd_start_addr, uint16_t quant_rd, uint16_t *rd_val, uint16_t wr_start_addr, uint16_t quant_wr, const uint16_t *wr_val)
+{
+    mb_reg_bank_data_t *data = NULL;
+    int ret = 0;
+
+    if (bank->flags & MB_REG_BANK_RDONLY)
+    {
+        return -EROFS;
+    }
+    ret = mb_reg_bank_check_regs(MB_REG_BANK_HOLD_REGS, rd_start_addr, quant_rd);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = mb_reg_bank_check_regs(MB_REG_BANK_HOLD_REGS, wr_start_addr, quant_wr);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    data = mb_reg_bank_wr_begin(bank);
+    mb_reg_bank_sub_prepare(bank, data, MB_REG_BANK_HOLD_REGS, wr_start_addr, quant_wr);
+    memcpy(data->hold_reg + wr_start_addr, wr_val, 2 * quant_wr);
+    memcpy(rd_val, data->hold_reg + rd_start_addr, 2 * quant_rd);
+    mb_reg_bank_wr_end(bank);
+    return 0;
+}
+
+/* readers continue to use the current data until the updated copy is swapped in */
+int mb_reg_bank_update(mb_reg_bank_t *bank, mb_reg_bank_update_t func, void *arg)
+{
+    mb_reg_bank_mem_t *mem = NULL;
+    unsigned cur = 0;
+
+    if (bank->flags & MB_REG_BANK_RDONLY)
+    {
+        return -EROFS;
+    }
+    mem = bank->mem;
+    mb_reg_bank_lock(bank);
+    cur = atomic_load_explicit(&mem->cur, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);  /* order the last swap before reusing the spare copy */
+    memcpy(&mem->data[cur ^ 1], &mem->data[cur], sizeof(mb_reg_bank_data_t));
+    (*func)(&mem->data[cur ^ 1], arg);
+    atomic_store_explicit(&mem->cur, cur ^ 1, memory_order_release);
+    atomic_fetch_add_explicit(&mem->seq, 2, memory_order_release);
+    mb_reg_bank_sync_periodic(bank);
+    mb_reg_bank_unlock(bank);
+    return 0;
+}
+
+int mb_reg_bank_subscribe(mb_reg_bank_t *bank, mb_reg_bank_table_t table, uint16_t start_addr, uint32_t quant)
+{
+    mb_reg_bank_sub_t *sub = NULL;
+    int i = 0;
+
+    if ((table > MB_REG_BANK_IP_REGS)
+     || (quant == 0)
+     || ((uint32_t)start_addr + quant > MB_REG_BANK_NUM_ADDR))
+    {
+        return -EINVAL;
+    }
+    sub = calloc(1, sizeof(mb_reg_bank_sub_t));
+    if (sub == NULL)
+    {
+        return -ENOMEM;
+    }
+    sub->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sub->efd < 0)
+    {
+        free(sub);
+        return -errno;
+    }
+    sub->table = table;
+    sub->start_addr = start_addr;
+    sub->end_addr = (uint32_t)start_addr + quant;
+    atomic_init(&sub->head, 0);
+    atomic_init(&sub->tail, 0);
+    atomic_init(&sub->overrun, 0);
+    pthread_mutex_lock(&bank->lock);
+    for (i = 0; i < MB_REG_BANK_MAX_SUB; i++)
+    {
+        if (bank->sub[i] == NULL)
+        {
+            bank->sub[i] = sub;
+            bank->num_sub++;
+            pthread_mutex_unlock(&bank->lock);
+            return i;
+        }
+    }
+    pthread_mutex_unlock(&bank->lock);
+    close(sub->efd);
+    free(sub);
+    return -ENOSPC;
+}
+
+/* the consumer must not be using the subscription */
+void mb_reg_bank_unsubscribe(mb_reg_bank_t *bank, int sub)
+{
+    mb_reg_bank_sub_t *s = NULL;
+
+    if ((sub < 0) || (sub >= MB_REG_BANK_MAX_SUB))
+        return;
+    pthread_mutex_lock(&bank->lock);
+    s = bank->sub[sub];
+    if (s != NULL)
+    {
+        bank->sub[sub] = NULL;
+        bank->num_sub--;
+    }
+    pthread_mutex_unlock(&bank->lock);
+    if (s != NULL)
+    {
+        close(s->efd);
+        free(s);
+    }
+}
+
+int mb_reg_bank_sub_fd(mb_reg_bank_t *bank, int sub)
+{
+    if ((sub < 0) || (sub >= MB_REG_BANK_MAX_SUB) || (bank->sub[sub] == NULL))
+    {
+        return -EINVAL;
+    }
+    return bank->sub[sub]->efd;
+}
+
+/* returns -EAGAIN when the queue is empty, the eventfd is cleared
+ * before the queue is checked a second time so that an event queued
+ * in between is never missed
+ */
+int mb_reg_bank_next_ev(mb_reg_bank_t *bank, int sub, mb_reg_bank_ev_t *ev)
+{
+    mb_reg_bank_sub_t *s = NULL;
+    uint64_t count = 0;
+    unsigned head = 0;
+    unsigned tail = 0;
+
+    if ((sub < 0) || (sub >= MB_REG_BANK_MAX_SUB) || (bank->sub[sub] == NULL))
+    {
+        return -EINVAL;
+    }
+    s = bank->sub[sub];
+    head = atomic_load_explicit(&s->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+    if (head == tail)
+    {
+        if (read(s->efd, &count, sizeof(count)) < 0)
+            count = 0;  /* EAGAIN, already clear */
+        tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+        if (head == tail)
+        {
+            return -EAGAIN;
+        }
+    }
+    memcpy(ev, &s->ev[head & (MB_REG_BANK_SUB_NUM_EV - 1)], sizeof(mb_reg_bank_ev_t));
+    atomic_store_explicit(&s->head, head + 1, memory_order_release);
+    return 0;
+}
+
+unsigned mb_reg_bank_sub_overrun(mb_reg_bank_t *bank, int sub)
+{
+    if ((sub < 0) || (sub >= MB_REG_BANK_MAX_SUB) || (bank->sub[sub] == NULL))
+        return 0;
+    return atomic_load_explicit(&bank->sub[sub]->overrun, memory_order_relaxed);
+}
+
+/* a write to a read-only bank is not allowed and a stalled writer makes the bank busy,
+ * any other error is a bad address
+ */
+static int mb_reg_bank_except(int ret)
+{
+    if (ret == -EROFS)
+        return -MB_PDU_EXCEPT_ILLEGAL_FUNC;
+    if (ret == -EAGAIN)
+        return -MB_PDU_EXCEPT_SERVER_DEV_BUSY;
+    return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+}
+
+static int mb_reg_bank_handle_rd_bits(mb_reg_bank_t *bank, mb_reg_bank_table_t table, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    uint16_t start_addr = 0;
+    uint16_t quant = 0;
+    uint8_t val[MB_PDU_RD_COILS_MAX_BYTE_COUNT] = {0};
+    uint8_t byte_count = 0;
+    int ret = 0;
+
+    if (table == MB_REG_BANK_COILS)
+    {
+        start_addr = req->rd_coils_req.start_addr;
+        quant = req->rd_coils_req.quant_coils;
+    }
+    else
+    {
+        start_addr = req->rd_disc_ips_req.start_addr;
+        quant = req->rd_disc_ips_req.quant_ips;
+    }
+    ret = mb_reg_bank_rd_bits(bank, table, start_addr, quant, val);
+    if (ret < 0)
+    {
+        return mb_reg_bank_except(ret);
+    }
+    byte_count = (quant + 7) >> 3;
+    if (table == MB_REG_BANK_COILS)
+        ret = mb_pdu_set_rd_coils_resp(resp, byte_count, val);
+    else
+        ret = mb_pdu_set_rd_disc_ips_resp(resp, byte_count, val);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+static int mb_reg_bank_handle_rd_regs(mb_reg_bank_t *bank, mb_reg_bank_table_t table, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    uint16_t val[MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS] = {0};
+    uint16_t start_addr = 0;
+    uint16_t quant = 0;
+    int ret = 0;
+
+    if (table == MB_REG_BANK_HOLD_REGS)
+    {
+        start_addr = req->rd_hold_regs_req.start_addr;
+        quant = req->rd_hold_regs_req.quant_regs;
+    }
+    else
+    {
+        start_addr = req->rd_ip_regs_req.start_addr;
+        quant = req->rd_ip_regs_req.quant_ip_regs;
+    }
+    ret = mb_reg_bank_rd_regs(bank, table, start_addr, quant, val);
+    if (ret < 0)
+    {
+        return mb_reg_bank_except(ret);
+    }
+    if (table == MB_REG_BANK_HOLD_REGS)
+        ret = mb_pdu_set_rd_hold_regs_resp(resp, 2 * quant, val);
+    else
+        ret = mb_pdu_set_rd_ip_regs_resp(resp, 2 * quant, val);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+static int mb_reg_bank_handle_rd_mult_ranges(mb_reg_bank_t *bank, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_pdu_rd_mult_ranges_sub_req_t *sub_req = NULL;
+    mb_reg_bank_table_t table = MB_REG_BANK_COILS;
+    uint16_t val[MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS] = {0};
+    uint8_t data[MB_PDU_RD_MULT_RANGES_MAX_BYTE_COUNT] = {0};
+    unsigned num_sub_req = 0;
+    unsigned byte_count = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+    int ret = 0;
+
+    /* each range is read separately, ranges in different tables are not read at a single instant */
+    num_sub_req = req->rd_mult_ranges_req.byte_count / MB_PDU_RD_MULT_RANGES_SUB_REQ_NUM_BYTES;
+    for (i = 0; i < num_sub_req; i++)
+    {
+        sub_req = &req->rd_mult_ranges_req.sub_req[i];
+        if (byte_count + mb_pdu_rd_mult_ranges_val_len(sub_req) > sizeof(data))
+        {
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        }
+        switch (sub_req->func_code)
+        {
+        case MB_PDU_RD_COILS:
+        case MB_PDU_RD_DISC_IPS:
+            table = (sub_req->func_code == MB_PDU_RD_COILS) ? MB_REG_BANK_COILS : MB_REG_BANK_DISC_IPS;
+            ret = mb_reg_bank_rd_bits(bank, table, sub_req->start_addr, sub_req->quant, &data[byte_count]);
+            if (ret < 0)
+            {
+                return mb_reg_bank_except(ret);
+            }
+            byte_count += (sub_req->quant + 7) >> 3;
+            break;
+        case MB_PDU_RD_HOLD_REGS:
+        case MB_PDU_RD_IP_REGS:
+            table = (sub_req->func_code == MB_PDU_RD_HOLD_REGS) ? MB_REG_BANK_HOLD_REGS : MB_REG_BANK_IP_REGS;
+            ret = mb_reg_bank_rd_regs(bank, table, sub_req->start_addr, sub_req->quant, val);
+            if (ret < 0)
+            {
+                return mb_reg_bank_except(ret);
+            }
+            for (j = 0; j < sub_req->quant; j++)
+            {
+                data[byte_count++] = val[j] >> 8;
+                data[byte_count++] = val[j] & 0xff;
+            }
+            break;
+        default:
+            return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+        }
+    }
+    ret = mb_pdu_set_rd_mult_ranges_resp(resp, byte_count, data);
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
+
+int mb_reg_bank_handle(mb_reg_bank_t *bank, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    mb_pdu_rd_wr_mult_regs_req_t *rd_wr = NULL;
+    uint16_t val[MB_PDU_RD_WR_MULT_REGS_MAX_QUANT_RD] = {0};
+    uint8_t bit = 0;
+    int ret = 0;
+
+    switch (req->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        return mb_reg_bank_handle_rd_bits(bank, MB_REG_BANK_COILS, req, resp);
+    case MB_PDU_RD_DISC_IPS:
+        return mb_reg_bank_handle_rd_bits(bank, MB_REG_BANK_DISC_IPS, req, resp);
+    case MB_PDU_RD_HOLD_REGS:
+        return mb_reg_bank_handle_rd_regs(bank, MB_REG_BANK_HOLD_REGS, req, resp);
+    case MB_PDU_RD_IP_REGS:
+        return mb_reg_bank_handle_rd_regs(bank, MB_REG_BANK_IP_REGS, req, resp);
+    case MB_PDU_WR_SING_COIL:
+        bit = req->wr_sing_coil_req.op_val ? 1 : 0;
+        ret = mb_reg_bank_wr_bits(bank, MB_REG_BANK_COILS, req->wr_sing_coil_req.op_addr, 1, &bit);
+        if (ret < 0)
+        {
+            return mb_reg_bank_except(ret);
+        }
+        mb_pdu_set_wr_sing_coil_resp(resp, req->wr_sing_coil_req.op_addr, req->wr_sing_coil_req.op_val);
+        return 0;
+    case MB_PDU_WR_SING_REG:
+        ret = mb_reg_bank_wr_regs(bank, MB_REG_BANK_HOLD_REGS, req->wr_sing_reg_req.reg_addr, 1, &req->wr_sing_reg_req.reg_val);
+        if (ret < 0)
+        {
+            return mb_reg_bank_except(ret);
+        }
+        mb_pdu_set_wr_sing_reg_resp(resp, req->wr_sing_reg_req.reg_addr, req->wr_sing_reg_req.reg_val);
+        return 0;
+    case MB_PDU_WR_MULT_COILS:
+        ret = mb_reg_bank_wr_bits(bank, MB_REG_BANK_COILS, req->wr_mult_coils_req.start_addr, req->wr_mult_coils_req.quant_ops, req->wr_mult_coils_req.op_val);
+        if (ret < 0)
+        {
+            return mb_reg_bank_except(ret);
+        }
+        ret = mb_pdu_set_wr_mult_coils_resp(resp, req->wr_mult_coils_req.start_addr, req->wr_mult_coils_req.quant_ops);
+        break;
+    case MB_PDU_WR_MULT_REGS:
+        ret = mb_reg_bank_wr_regs(bank, MB_REG_BANK_HOLD_REGS, req->wr_mult_regs_req.start_addr, req->wr_mult_regs_req.quant_regs, req->wr_mult_regs_req.reg_val);
+        if (ret < 0)
+        {
+            return mb_reg_bank_except(ret);
+        }
+        ret = mb_pdu_set_wr_mult_regs_resp(resp, req->wr_mult_regs_req.start_addr, req->wr_mult_regs_req.quant_regs);
+        break;
+    case MB_PDU_MASK_WR_REG:
+        ret = mb_reg_bank_mask_wr_reg(bank, req->mask_wr_reg_req.ref_addr, req->mask_wr_reg_req.and_mask, req->mask_wr_reg_req.or_mask);
+        if (ret < 0)
+        {
+            return mb_reg_bank_except(ret);
+        }
+        mb_pdu_set_mask_wr_reg_resp(resp, req->mask_wr_reg_req.ref_addr, req->mask_wr_reg_req.and_mask, req->mask_wr_reg_req.or_mask);
+        return 0;
+    case MB_PDU_RD_WR_MULT_REGS:
+        rd_wr = &req->rd_wr_mult_regs_req;
+        ret = mb_reg_bank_rd_wr_regs(bank, rd_wr->rd_start_addr, rd_wr->quant_rd, val, rd_wr->wr_start_addr, rd_wr->quant_wr, rd_wr->wr_reg_val);
+        if (ret < 0)
+        {
+            return mb_reg_bank_except(ret);
+        }
+        ret = mb_pdu_set_rd_wr_mult_regs_resp(resp, 2 * rd_wr->quant_rd, val);
+        break;
+    case MB_PDU_RD_MULT_RANGES:
+        return mb_reg_bank_handle_rd_mult_ranges(bank, req, resp);
+    default:
+        return -MB_PDU_EXCEPT_ILLEGAL_FUNC;
+    }
+    if (ret < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    return 0;
+}
@@ -61,12 +61,31 @@ void mb_rtu_master_destroy(mb_rtu_master_t *master)
     memset(master, 0, sizeof(mb_rtu_master_t));
 }
 
+/* sends a formatted request and waits for the response frame */
+static ssize_t mb_rtu_master_send_recv(mb_rtu_master_t *master, const char *req_buf, size_t req_len, char *buf, size_t len)
+{
+    ssize_t num = 0;
+    int ret = 0;
+
+    num = mb_rtu_con_send(&master->con, req_buf, req_len);
+    if (num < 0)
+    {
+        return num;
+    }
+    mb_log_debug("starting response timer");
+    ret = mb_rtu_con_start_timer(master->timer_fd, MB_RTU_MASTER_RESPONSE_TIMEOUT_SEC, MB_RTU_MASTER_RESPONSE_TIMEOUT_NSEC);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return mb_rtu_con_recv_timeout(&master->con, buf, len, master->timer_fd);
+}
+
 int mb_rtu_master_exchange(mb_rtu_master_t *master, mb_rtu_adu_t *req, mb_rtu_adu_t *resp)
 {
     ssize_t num = 0;
     char msg_buf[256] = {0};
     char buf[MB_RTU_ADU_MAX_LEN] = {0};
-    int ret = 0;
 
     if ((req->addr < MB_RTU_ADU_MIN_UNICAST_ADDR) || (req->addr > MB_RTU_ADU_MAX_UNICAST_ADDR))
     {
@@ -79,29 +98,47 @@ int mb_rtu_master_exchange(mb_rtu_master_t *master, mb_rtu_adu_t *req, mb_rtu_ad
     }
     mb_rtu_adu_to_str(req, msg_buf, sizeof(msg_buf));
     mb_log_info("sending unicast request: %s", msg_buf);
-    num = mb_rtu_con_send(&master->con, buf, num);
+    num = mb_rtu_master_send_recv(master, buf, num, buf, sizeof(buf));
     if (num < 0)
     {
         return num;
     }
-    mb_log_debug("starting response timer");
-    ret = mb_rtu_con_start_timer(master->timer_fd, MB_RTU_MASTER_RESPONSE_TIMEOUT_SEC, MB_RTU_MASTER_RESPONSE_TIMEOUT_NSEC);
-    if (ret < 0)
+    num = mb_rtu_adu_parse_resp(resp, buf, num);
+    if (num < 0)
     {
-        return ret;
+        return -EBADMSG;  /* convert modbus error to errno value */
     }
-    num = mb_rtu_con_recv_timeout(&master->con, buf, sizeof(buf), master->timer_fd);
+    mb_rtu_adu_to_str(resp, msg_buf, sizeof(msg_buf));
+    mb_log_info("received response: %s", msg_buf);
+    mb_log_notice("idle");
+    return 0;
+}
+
+int mb_rtu_master_exchange_prep(mb_rtu_master_t *master, const mb_rtu_adu_prep_t *prep, mb_rtu_adu_t *resp)
+{
+    ssize_t num = 0;
+    char buf[MB_RTU_ADU_MAX_LEN] = {0};
+
+    if ((prep->addr < MB_RTU_ADU_MIN_UNICAST_ADDR) || (prep->addr > MB_RTU_ADU_MAX_UNICAST_ADDR))
+    {
+        return -EINVAL;
+    }
+    mb_log_debug("sending prepared request to address %u, function code 0x%02x", prep->addr, prep->func_code);
+    num = mb_rtu_master_send_recv(master, prep->buf, prep->len, buf, sizeof(buf));
     if (num < 0)
     {
         return num;
     }
+    if (mb_rtu_adu_prep_check_resp(prep, buf, num) < 0)
+    {
+        return -EBADMSG;  /* response does not match the request */
+    }
     num = mb_rtu_adu_parse_resp(resp, buf, num);
     if (num < 0)
     {
         return -EBADMSG;  /* convert modbus error to errno value */
     }
-    mb_rtu_adu_to_str(resp, msg_buf, sizeof(msg_buf));
-    mb_log_info("received response: %s", msg_buf);
+    mb_log_debug("received response from address %u", resp->addr);
     mb_log_notice("idle");
     return 0;
 }
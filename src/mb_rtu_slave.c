@@ -51,7 +51,7 @@ static ssize_t mb_rtu_slave_send_err_resp(mb_rtu_slave_t *slave, mb_rtu_adu_t *r
 {
     int ret = 0;
 
-    mb_rtu_adu_set_header(resp, slave->addr);
+    mb_rtu_adu_set_header(resp, req->addr);
     ret = mb_pdu_set_err_resp(&resp->pdu, req->pdu.func_code + 0x80, error);
     if (ret < 0)
     {
@@ -60,15 +60,18 @@ static ssize_t mb_rtu_slave_send_err_resp(mb_rtu_slave_t *slave, mb_rtu_adu_t *r
     return mb_rtu_slave_send_resp(slave, resp);
 }
 
-static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb_rtu_adu_t *resp)
+static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, int addr, mb_rtu_adu_t *req, mb_rtu_adu_t *resp)
 {
+    mb_rtu_slave_unit_t *unit = NULL;
     uint16_t val16 = 0;
     int ret = 0;
 
+    unit = &slave->unit[addr];
+
     switch (req->pdu.diag_req.sub_func)
     {
     case MB_PDU_QUERY_DATA:
-        mb_rtu_adu_set_header(resp, slave->addr);
+        mb_rtu_adu_set_header(resp, addr);
         ret = mb_pdu_set_diag_resp(&resp->pdu, MB_PDU_QUERY_DATA, req->pdu.diag_req.data, req->pdu.diag_req.num_data);
         if (ret < 0)
         {
@@ -78,10 +81,10 @@ static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb
     case MB_PDU_CLEAR_COUNTERS:
         slave->bus_msg_count = 0;
         slave->bus_com_err_count = 0;
-        slave->slave_excep_err_count = 0;
-        slave->slave_msg_count = 0;
-        slave->slave_no_resp_count = 0;
-        mb_rtu_adu_set_header(resp, slave->addr);
+        unit->slave_excep_err_count = 0;
+        unit->slave_msg_count = 0;
+        unit->slave_no_resp_count = 0;
+        mb_rtu_adu_set_header(resp, addr);
         ret = mb_pdu_set_diag_resp(&resp->pdu, MB_PDU_CLEAR_COUNTERS, req->pdu.diag_req.data, req->pdu.diag_req.num_data);
         if (ret < 0)
         {
@@ -90,7 +93,7 @@ static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb
         return 0;
     case MB_PDU_BUS_MSG_COUNT:
         val16 = slave->bus_msg_count;
-        mb_rtu_adu_set_header(resp, slave->addr);
+        mb_rtu_adu_set_header(resp, addr);
         ret = mb_pdu_set_diag_resp(&resp->pdu, MB_PDU_BUS_MSG_COUNT, &val16, 1);
         if (ret < 0)
         {
@@ -99,7 +102,7 @@ static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb
         return 0;
     case MB_PDU_BUS_COM_ERR_COUNT:
         val16 = slave->bus_com_err_count;
-        mb_rtu_adu_set_header(resp, slave->addr);
+        mb_rtu_adu_set_header(resp, addr);
         ret = mb_pdu_set_diag_resp(&resp->pdu, MB_PDU_BUS_COM_ERR_COUNT, &val16, 1);
         if (ret < 0)
         {
@@ -107,8 +110,8 @@ static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb
         }
         return 0;
     case MB_PDU_SLAVE_EXCEP_ERR_COUNT:
-        val16 = slave->slave_excep_err_count;
-        mb_rtu_adu_set_header(resp, slave->addr);
+        val16 = unit->slave_excep_err_count;
+        mb_rtu_adu_set_header(resp, addr);
         ret = mb_pdu_set_diag_resp(&resp->pdu, MB_PDU_SLAVE_EXCEP_ERR_COUNT, &val16, 1);
         if (ret < 0)
         {
@@ -116,8 +119,8 @@ static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb
         }
         return 0;
     case MB_PDU_SLAVE_MSG_COUNT:
-        val16 = slave->slave_msg_count;
-        mb_rtu_adu_set_header(resp, slave->addr);
+        val16 = unit->slave_msg_count;
+        mb_rtu_adu_set_header(resp, addr);
         ret = mb_pdu_set_diag_resp(&resp->pdu, MB_PDU_SLAVE_MSG_COUNT, &val16, 1);
         if (ret < 0)
         {
@@ -125,8 +128,8 @@ static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb
         }
         return 0;
     case MB_PDU_SLAVE_NO_RESP_COUNT:
-        val16 = slave->slave_no_resp_count;
-        mb_rtu_adu_set_header(resp, slave->addr);
+        val16 = unit->slave_no_resp_count;
+        mb_rtu_adu_set_header(resp, addr);
         ret = mb_pdu_set_diag_resp(&resp->pdu, MB_PDU_SLAVE_NO_RESP_COUNT, &val16, 1);
         if (ret < 0)
         {
@@ -138,6 +141,55 @@ static int mb_rtu_slave_handle_diag(mb_rtu_slave_t *slave, mb_rtu_adu_t *req, mb
     }
 }
 
+static int mb_rtu_slave_handle_unit(mb_rtu_slave_t *slave, int addr, mb_rtu_adu_t *req, mb_rtu_adu_t *resp)
+{
+    mb_rtu_slave_unit_t *unit = NULL;
+    int ret = 0;
+
+    unit = &slave->unit[addr];
+    unit->slave_msg_count++;
+    mb_log_debug("[%d] slave message count: %d", addr, unit->slave_msg_count);
+    if (req->addr == MB_RTU_ADU_BROADCAST_ADDR)
+    {
+        unit->slave_no_resp_count++;
+        mb_log_debug("[%d] slave no response count: %d", addr, unit->slave_no_resp_count);
+    }
+    if (req->pdu.func_code == MB_PDU_DIAG)
+    {
+        mb_log_info("[%d] calling internal diagnostics handler", addr);
+        ret = mb_rtu_slave_handle_diag(slave, addr, req, resp);
+    }
+    else
+    {
+        mb_log_info("[%d] calling handler callback", addr);
+        slave->cur_addr = addr;
+        ret = (*unit->handler)(slave, req, resp);
+    }
+    if (ret < 0)
+    {
+        unit->slave_excep_err_count++;
+        mb_log_debug("[%d] slave exception error count: %d", addr, unit->slave_excep_err_count);
+    }
+    return ret;
+}
+
+static void mb_rtu_slave_count_excep(mb_rtu_slave_t *slave, int addr)
+{
+    int i = 0;
+
+    for (i = MB_RTU_ADU_MIN_UNICAST_ADDR; i <= MB_RTU_ADU_MAX_UNICAST_ADDR; i++)
+    {
+        if ((slave->unit[i].handler != NULL) && ((addr == MB_RTU_ADU_BROADCAST_ADDR) || (addr == i)))
+        {
+            slave->unit[i].slave_msg_count++;
+            if (addr == MB_RTU_ADU_BROADCAST_ADDR)
+                slave->unit[i].slave_no_resp_count++;
+            slave->unit[i].slave_excep_err_count++;
+            mb_log_debug("[%d] slave exception error count: %d", i, slave->unit[i].slave_excep_err_count);
+        }
+    }
+}
+
 static int mb_rtu_slave_con_exchange(mb_rtu_slave_t *slave)
 {
     mb_rtu_adu_t resp = {0};
@@ -145,7 +197,10 @@ static int mb_rtu_slave_con_exchange(mb_rtu_slave_t *slave)
     ssize_t num = 0;
     char msg_buf[256] = {0};
     char buf[MB_RTU_ADU_MAX_LEN] = {0};
+    int addr = 0;
+    int err = 0;
     int ret = 0;
+    int i = 0;
 
     num = mb_rtu_con_recv(&slave->con, buf, sizeof(buf));
     if (num < 0)
@@ -165,67 +220,49 @@ static int mb_rtu_slave_con_exchange(mb_rtu_slave_t *slave)
     }
     slave->bus_msg_count++;
     mb_log_debug("bus message count: %d", slave->bus_msg_count);
-    if ((buf[0] != slave->addr) && (buf[0] != MB_RTU_ADU_BROADCAST_ADDR))
+    addr = (uint8_t)buf[0];
+    if ((addr != MB_RTU_ADU_BROADCAST_ADDR) && (slave->unit[addr].handler == NULL))
     {
         return 0;
     }
-    slave->slave_msg_count++;
-    mb_log_debug("slave message count: %d", slave->slave_msg_count);
-    if (buf[0] == MB_RTU_ADU_BROADCAST_ADDR)
-    {
-        slave->slave_no_resp_count++;
-        mb_log_debug("slave no response count: %d", slave->slave_no_resp_count);
-        if (!mb_rtu_adu_valid_broadcast_req(&req))
-        {
-            slave->slave_excep_err_count++;
-            mb_log_debug("slave exception error count: %d", slave->slave_excep_err_count);
-            return -EBADMSG;  /* convert modbus error to errno value */
-        }
-    }
     num = mb_rtu_adu_parse_req(&req, buf, num);
     if (num < 0)
     {
-        slave->slave_excep_err_count++;
-        mb_log_debug("slave exception error count: %d", slave->slave_excep_err_count);
+        mb_rtu_slave_count_excep(slave, addr);
         return -EBADMSG;  /* convert modbus error to errno value */
     }
-    mb_rtu_adu_to_str(&req, msg_buf, sizeof(msg_buf));
-    if (req.addr == slave->addr)
-        mb_log_info("received unicast request: %s", msg_buf);
-    else
-        mb_log_info("received broadcast request: %s", msg_buf);
-    if (req.pdu.func_code == MB_PDU_DIAG)
+    if ((addr == MB_RTU_ADU_BROADCAST_ADDR) && (!mb_rtu_adu_valid_broadcast_req(&req)))
     {
-        mb_log_info("calling internal diagnostics handler");
-        ret = mb_rtu_slave_handle_diag(slave, &req, &resp);
-    }
-    else
-    {
-        mb_log_info("calling handler callback");
-        ret = (*slave->handler)(slave, &req, &resp);
-    }
-    if (ret < 0)
-    {
-        slave->slave_excep_err_count++;
-        mb_log_debug("slave exception error count: %d", slave->slave_excep_err_count);
+        mb_rtu_slave_count_excep(slave, addr);
+        return -EBADMSG;  /* convert modbus error to errno value */
     }
-    if (req.addr == MB_RTU_ADU_BROADCAST_ADDR)
+    mb_rtu_adu_to_str(&req, msg_buf, sizeof(msg_buf));
+    if (addr != MB_RTU_ADU_BROADCAST_ADDR)
     {
+        mb_log_info("received unicast request: %s", msg_buf);
+        ret = mb_rtu_slave_handle_unit(slave, addr, &req, &resp);
         if (ret < 0)
         {
+            mb_rtu_slave_send_err_resp(slave, &req, &resp, -ret);
             return -EBADMSG;  /* convert modbus error to errno value */
         }
-        return 0;
+        return mb_rtu_slave_send_resp(slave, &resp);
     }
-    else
+    mb_log_info("received broadcast request: %s", msg_buf);
+    for (i = MB_RTU_ADU_MIN_UNICAST_ADDR; i <= MB_RTU_ADU_MAX_UNICAST_ADDR; i++)
     {
-        if (ret < 0)
+        if (slave->unit[i].handler != NULL)
         {
-            mb_rtu_slave_send_err_resp(slave, &req, &resp, -ret);
-            return -EBADMSG;  /* convert modbus error to errno value */
+            ret = mb_rtu_slave_handle_unit(slave, i, &req, &resp);
+            if (ret < 0)
+                err = 1;
         }
-        return mb_rtu_slave_send_resp(slave, &resp);
     }
+    if (err)
+    {
+        return -EBADMSG;  /* convert modbus error to errno value */
+    }
+    return 0;
 }
 
 int mb_rtu_slave_create(mb_rtu_slave_t *slave, const char *dev, int addr, mb_rtu_slave_handler_t handler)
@@ -245,6 +282,7 @@ int mb_rtu_slave_create(mb_rtu_slave_t *slave, const char *dev, int addr, mb_rtu
         return ret;
     }
     slave->handler = handler;
+    slave->unit[addr].handler = handler;
     mb_log_notice("slave bound to '%s'", dev);
     mb_log_notice("idle");
     return 0;
@@ -256,6 +294,33 @@ void mb_rtu_slave_destroy(mb_rtu_slave_t *slave)
     memset(slave, 0, sizeof(mb_rtu_slave_t));
 }
 
+int mb_rtu_slave_add_unit(mb_rtu_slave_t *slave, int addr, mb_rtu_slave_handler_t handler, void *data)
+{
+    if ((addr < MB_RTU_ADU_MIN_UNICAST_ADDR) || (addr > MB_RTU_ADU_MAX_UNICAST_ADDR) || (handler == NULL))
+    {
+        return -EINVAL;
+    }
+    mb_log_debug("adding unit with address %d", addr);
+    memset(&slave->unit[addr], 0, sizeof(mb_rtu_slave_unit_t));
+    slave->unit[addr].handler = handler;
+    slave->unit[addr].data = data;
+    return 0;
+}
+
+void mb_rtu_slave_remove_unit(mb_rtu_slave_t *slave, int addr)
+{
+    if ((addr < MB_RTU_ADU_MIN_UNICAST_ADDR) || (addr > MB_RTU_ADU_MAX_UNICAST_ADDR))
+        return;
+    mb_log_debug("removing unit with address %d", addr);
+    memset(&slave->unit[addr], 0, sizeof(mb_rtu_slave_unit_t));
+}
+
+/* returns the data added with the unit whose handler is being called */
+void *mb_rtu_slave_get_data(mb_rtu_slave_t *slave)
+{
+    return slave->unit[slave->cur_addr].data;
+}
+
 int mb_rtu_slave_run(mb_rtu_slave_t *slave)
 {
     int ret = 0;
@@ -258,6 +258,46 @@ ssize_t mb_tcp_adu_parse_resp(mb_tcp_adu_t *adu, const char *buf, size_t len)
     return num;
 }
 
+int mb_tcp_adu_prepare(mb_tcp_adu_prep_t *prep, mb_tcp_adu_t *adu)
+{
+    ssize_t num = 0;
+    size_t pdu_len = 0;
+
+    memset(prep, 0, sizeof(mb_tcp_adu_prep_t));
+    num = mb_tcp_adu_format_req(adu, prep->buf, sizeof(prep->buf));
+    if (num < 0)
+        return num;
+    prep->len = num;
+    prep->unit_id = adu->unit_id;
+    prep->func_code = adu->pdu.func_code;
+    pdu_len = mb_pdu_resp_len(&adu->pdu);
+    if (pdu_len > 0)
+        prep->resp_len = MB_TCP_ADU_HEADER_LEN + pdu_len;
+    return 0;
+}
+
+void mb_tcp_adu_prep_set_trans_id(mb_tcp_adu_prep_t *prep, uint16_t trans_id)
+{
+    prep->buf[0] = (char)(trans_id >> 8);
+    prep->buf[1] = (char)(trans_id & 0xff);
+}
+
+/* checks the unit id, function code and length of a complete response */
+int mb_tcp_adu_prep_check_resp(const mb_tcp_adu_prep_t *prep, const char *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+    if ((len < MB_TCP_ADU_HEADER_LEN + 2) || (p[MB_TCP_ADU_HEADER_LEN - 1] != prep->unit_id))
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    if (p[MB_TCP_ADU_HEADER_LEN] == (prep->func_code | 0x80))
+        return len == MB_TCP_ADU_HEADER_LEN + 2 ? 0 : -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    if (p[MB_TCP_ADU_HEADER_LEN] != prep->func_code)
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    if ((prep->resp_len != 0) && (len != prep->resp_len))
+        return -MB_PDU_EXCEPT_ILLEGAL_VAL;
+    return 0;
+}
+
 int mb_tcp_adu_to_str(mb_tcp_adu_t *adu, char *buf, size_t len)
 {
     unsigned i = 0;
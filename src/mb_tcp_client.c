@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2016 Keith Cullen.
+ * Copyright (c) 2017 Keith Cullen.
  * All Rights Reserved.
  *
  * Redistribution and use in source and binary forms, with or without
@@ -25,13 +25,221 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <sys/select.h>
-#include "mb_tcp_client.h"
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include "mb_tcp_client_priv.h"
 #include "mb_log.h"
 
+void mb_tcp_client_set_deadline(struct timespec *deadline, const struct timeval *timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_usec * 1000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+int mb_tcp_client_timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec)
+        return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+static int mb_tcp_client_parse_addr(const char *host, in_port_t port, struct sockaddr_in *sin)
+{
+    int ret = 0;
+
+    memset(sin, 0, sizeof(struct sockaddr_in));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    ret = inet_pton(AF_INET, host, &sin->sin_addr);
+    if (ret < 0)
+    {
+        return -errno;
+    }
+    if (ret == 0)
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int mb_tcp_client_check_addr(mb_tcp_client_t *client, struct sockaddr_in *sin)
+{
+    char host[INET_ADDRSTRLEN] = {0};
+    int ret = 0;
+
+    inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+    ret = mb_ip_auth_list_check_addr(&client->auth, &sin->sin_addr);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (ret == 0)
+    {
+        mb_log_warn("rejecting unauthorised connection to address %s and port %u", host, ntohs(sin->sin_port));
+        return -EACCES;
+    }
+    mb_log_info("connection with address %s and port %u authorised", host, ntohs(sin->sin_port));
+    return 0;
+}
+
+static unsigned mb_tcp_client_hash(mb_tcp_client_t *client, struct sockaddr_in *sin)
+{
+    uint32_t key = 0;
+
+    key = sin->sin_addr.s_addr ^ ((uint32_t)sin->sin_port << 16);
+    return (key * 2654435761u) & client->hash_mask;  /* Knuth's multiplicative hash */
+}
+
+int mb_tcp_client_addr_eq(struct sockaddr_in *a, struct sockaddr_in *b)
+{
+    return (a->sin_addr.s_addr == b->sin_addr.s_addr) && (a->sin_port == b->sin_port);
+}
+
+int mb_tcp_client_find_con(mb_tcp_client_t *client, struct sockaddr_in *sin)
+{
+    unsigned i = 0;
+    int index = 0;
+
+    for (i = mb_tcp_client_hash(client, sin); ; i = (i + 1) & client->hash_mask)
+    {
+        index = client->hash[i];
+        if (index == MB_TCP_CLIENT_NONE)
+        {
+            mb_log_debug("no existing connection found");
+            return -1;
+        }
+        if (mb_tcp_client_addr_eq(&client->con[index].sin, sin))
+        {
+            mb_log_debug("found existing connection %d", index);
+            return index;
+        }
+    }
+}
+
+static void mb_tcp_client_hash_add(mb_tcp_client_t *client, int index)
+{
+    unsigned i = 0;
+
+    i = mb_tcp_client_hash(client, &client->con[index].sin);
+    while (client->hash[i] != MB_TCP_CLIENT_NONE)
+        i = (i + 1) & client->hash_mask;
+    client->hash[i] = index;
+}
+
+static void mb_tcp_client_hash_remove(mb_tcp_client_t *client, int index)
+{
+    unsigned home = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+
+    i = mb_tcp_client_hash(client, &client->con[index].sin);
+    while (client->hash[i] != index)
+    {
+        if (client->hash[i] == MB_TCP_CLIENT_NONE)
+            return;
+        i = (i + 1) & client->hash_mask;
+    }
+    /* shift later entries of the probe sequence back so that lookups never stop at a hole */
+    j = i;
+    while (1)
+    {
+        client->hash[i] = MB_TCP_CLIENT_NONE;
+        do
+        {
+            j = (j + 1) & client->hash_mask;
+            if (client->hash[j] == MB_TCP_CLIENT_NONE)
+                return;
+            home = mb_tcp_client_hash(client, &client->con[client->hash[j]].sin);
+        }
+        while (((j - home) & client->hash_mask) < ((j - i) & client->hash_mask));
+        client->hash[i] = client->hash[j];
+        i = j;
+    }
+}
+
+static void mb_tcp_client_idle_remove(mb_tcp_client_t *client, int index)
+{
+    mb_tcp_client_con_state_t *state = NULL;
+
+    state = &client->state[index];
+    if (!state->idle)
+        return;
+    if (state->prev != MB_TCP_CLIENT_NONE)
+        client->state[state->prev].next = state->next;
+    else
+        client->idle_head = state->next;
+    if (state->next != MB_TCP_CLIENT_NONE)
+        client->state[state->next].prev = state->prev;
+    else
+        client->idle_tail = state->prev;
+    state->idle = 0;
+}
+
+/* add a connection to the most recently used end of the idle list */
+static void mb_tcp_client_idle_add(mb_tcp_client_t *client, int index)
+{
+    mb_tcp_client_con_state_t *state = NULL;
+
+    mb_tcp_client_idle_remove(client, index);
+    state = &client->state[index];
+    state->idle = 1;
+    state->prev = client->idle_tail;
+    state->next = MB_TCP_CLIENT_NONE;
+    if (client->idle_tail != MB_TCP_CLIENT_NONE)
+        client->state[client->idle_tail].next = index;
+    else
+        client->idle_head = index;
+    client->idle_tail = index;
+}
+
+void mb_tcp_client_con_close(mb_tcp_client_t *client, int index)
+{
+    if (!mb_tcp_con_is_active(&client->con[index]))
+        return;
+    mb_tcp_client_hash_remove(client, index);
+    mb_tcp_client_idle_remove(client, index);
+    mb_tcp_con_close(&client->con[index]);
+    client->state[index].in_progress = 0;
+    client->state[index].stale = 0;
+    client->free_con[client->num_free++] = index;
+}
+
+static int mb_tcp_client_find_empty_con(mb_tcp_client_t *client)
+{
+    int index = 0;
+
+    if (client->num_free > 0)
+    {
+        index = client->free_con[--client->num_free];
+        mb_log_debug("found empty connection %d", index);
+        return index;
+    }
+    if (client->idle_head == MB_TCP_CLIENT_NONE)
+    {
+        mb_log_debug("all connections have requests in flight");
+        return -EBUSY;
+    }
+    index = client->idle_head;
+    mb_log_debug("closing least recently used connection %d", index);
+    mb_tcp_client_con_close(client, index);
+    return client->free_con[--client->num_free];
+}
+
 static ssize_t mb_tcp_client_con_exchange(mb_tcp_client_t *client, int index, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
 {
     struct timeval timeout = {0};
@@ -55,11 +263,27 @@ static ssize_t mb_tcp_client_con_exchange(mb_tcp_client_t *client, int index, mb
     {
         return num;
     }
-    FD_ZERO(&read_fds);
-    FD_SET(con->sd, &read_fds);
     timeout = client->timeout;
     while (1)
     {
+        while (mb_tcp_con_rx_complete(con))
+        {
+            num = mb_tcp_adu_parse_resp(resp, con->rx_buf, con->rx_end);
+            if (num < 0)
+            {
+                return -EBADMSG;  /* convert modbus error to errno value */
+            }
+            mb_tcp_con_consume(con, num);
+            if (resp->trans_id == req->trans_id)
+            {
+                mb_tcp_adu_to_str(resp, msg_buf, sizeof(msg_buf));
+                mb_log_info("[%d] received: %s", index, msg_buf);
+                return num;
+            }
+            mb_log_debug("[%d] discarding response with transaction id %u", index, resp->trans_id);
+        }
+        FD_ZERO(&read_fds);
+        FD_SET(con->sd, &read_fds);
         ret = select(con->sd + 1, &read_fds, NULL, NULL, &timeout);
         if (ret < 0)
         {
@@ -69,93 +293,103 @@ static ssize_t mb_tcp_client_con_exchange(mb_tcp_client_t *client, int index, mb
         {
             return -ETIMEDOUT;
         }
-        if (!FD_ISSET(con->sd, &read_fds))
-        {
-            continue;
-        }
         num = mb_tcp_con_recv(con);
-        if (num > 0)
-        {
-            break;
-        }
-        else if (num != -EAGAIN)
+        if ((num <= 0) && (num != -EAGAIN))
         {
             return num;
         }
     }
-    num = mb_tcp_adu_parse_resp(resp, con->rx_buf, con->rx_end);
-    if (num < 0)
-    {
-        return -EBADMSG;  /* convert modbus error to errno value */
-    }
-    mb_tcp_con_consume(con, num);
-    mb_tcp_adu_to_str(resp, msg_buf, sizeof(msg_buf));
-    mb_log_info("[%d] received: %s", index, msg_buf);
-    return num;
 }
 
-static int mb_tcp_client_find_con(mb_tcp_client_t *client, struct sockaddr_in *sin)
+int mb_tcp_client_create(mb_tcp_client_t *client, struct timeval timeout)
 {
-    mb_tcp_con_t *con = NULL;
-    int i = 0;
-
-    for (i = 0; i < MB_TCP_CLIENT_MAX_CON; i++)
-    {
-        con = &client->con[i];
-        if (memcmp(&con->sin, sin, sizeof(struct sockaddr_in)) == 0)
-        {
-            mb_log_debug("found existing connection %d", i);
-            return i;
-        }
-    }
-    mb_log_debug("no existing connection found");
-    return -1;
+    return mb_tcp_client_create_size(client, timeout, MB_TCP_CLIENT_MAX_CON, MB_TCP_CLIENT_MAX_PENDING);
 }
 
-static int mb_tcp_client_find_empty_con(mb_tcp_client_t *client)
+/* max_pending must be a power of 2 as the handle is in the low bits of the transaction id */
+int mb_tcp_client_create_size(mb_tcp_client_t *client, struct timeval timeout, int num_con, int max_pending)
 {
-    mb_tcp_con_t *oldest = NULL;
-    mb_tcp_con_t *con = NULL;
+    unsigned hash_size = 1;
+    int ret = 0;
     int i = 0;
-    int j = 0;
 
-    for (i = 0; i < MB_TCP_CLIENT_MAX_CON; i++)
+    if ((num_con <= 0) || (max_pending <= 0) || (max_pending > 0x8000) || ((max_pending & (max_pending - 1)) != 0))
     {
-        con = &client->con[i];
-        if (!mb_tcp_con_is_active(con))
-        {
-            mb_log_debug("found empty connection %d", i);
-            return i;
-        }
-        else if ((oldest == NULL) || (con->last_use < oldest->last_use))
-        {
-            oldest = con;
-            j = i;
-        }
+        return -EINVAL;
     }
-    mb_log_debug("closing oldest connection %d", j);
-    mb_tcp_con_close(con);
-    return j;
-}
-
-void mb_tcp_client_create(mb_tcp_client_t *client, struct timeval timeout)
-{
-    int i = 0;
-
+    while (hash_size < 2 * (unsigned)num_con)
+        hash_size <<= 1;
     memset(client, 0, sizeof(mb_tcp_client_t));
+    client->con = calloc(num_con, sizeof(mb_tcp_con_t));
+    client->state = calloc(num_con, sizeof(mb_tcp_client_con_state_t));
+    client->free_con = calloc(num_con, sizeof(int));
+    client->hash = calloc(hash_size, sizeof(int));
+    client->pending = calloc(max_pending, sizeof(mb_tcp_client_pending_t));
+    client->follower = calloc(max_pending, sizeof(int));
+    if ((client->con == NULL) || (client->state == NULL) || (client->free_con == NULL) || (client->hash == NULL)
+     || (client->pending == NULL) || (client->follower == NULL))
+    {
+        free(client->con);
+        free(client->state);
+        free(client->free_con);
+        free(client->hash);
+        free(client->pending);
+        free(client->follower);
+        memset(client, 0, sizeof(mb_tcp_client_t));
+        return -ENOMEM;
+    }
+    client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (client->epoll_fd < 0)
+    {
+        ret = -errno;
+        free(client->con);
+        free(client->state);
+        free(client->free_con);
+        free(client->hash);
+        free(client->pending);
+        free(client->follower);
+        memset(client, 0, sizeof(mb_tcp_client_t));
+        return ret;
+    }
     mb_ip_auth_list_create(&client->auth);
-    for (i = 0; i < MB_TCP_CLIENT_MAX_CON; i++)
+    client->num_con = num_con;
+    for (i = 0; i < num_con; i++)
+    {
         mb_tcp_con_create(&client->con[i], i);
+        client->free_con[i] = num_con - 1 - i;  /* hand out connection 0 first */
+    }
+    client->num_free = num_con;
+    client->hash_mask = hash_size - 1;
+    client->max_pending = max_pending;
+    for (i = 0; i < (int)hash_size; i++)
+        client->hash[i] = MB_TCP_CLIENT_NONE;
+    client->idle_head = MB_TCP_CLIENT_NONE;
+    client->idle_tail = MB_TCP_CLIENT_NONE;
     client->timeout = timeout;
+    client->connect_timeout = timeout;
+    client->reconnect_interval.tv_sec = 1;
+    client->wr_delay.tv_usec = MB_TCP_CLIENT_WR_DELAY_USEC;
+    return 0;
 }
 
 void mb_tcp_client_destroy(mb_tcp_client_t *client)
 {
     int i = 0;
 
-    for (i = 0; i < MB_TCP_CLIENT_MAX_CON; i++)
+    for (i = 0; i < client->num_con; i++)
         mb_tcp_con_destroy(&client->con[i]);
+    for (i = 0; i < client->max_pending; i++)
+        free(client->pending[i].wr);
     mb_ip_auth_list_destroy(&client->auth);
+    close(client->epoll_fd);
+    free(client->con);
+    free(client->state);
+    free(client->free_con);
+    free(client->hash);
+    free(client->pending);
+    free(client->follower);
+    free(client->endpoint);
+    free(client->cache);
     memset(client, 0, sizeof(mb_tcp_client_t));
 }
 
@@ -165,91 +399,1201 @@ int mb_tcp_client_authorise_addr(mb_tcp_client_t *client, const char *str)
     return mb_ip_auth_list_add_str(&client->auth, str);
 }
 
-static int mb_tcp_client_con_open(mb_tcp_client_t *client, int index, struct sockaddr_in *sin)
+/* start a non-blocking connect, the connection is usable once mb_tcp_client_con_finish succeeds */
+static int mb_tcp_client_con_start(mb_tcp_client_t *client, int index, struct sockaddr_in *sin)
 {
-    mb_tcp_con_t *con = NULL;
+    mb_tcp_client_con_state_t *state = NULL;
+    struct epoll_event ev = {0};
+    int in_progress = 0;
     int ret = 0;
     int sd = 0;
 
-    con = &client->con[index];
+    state = &client->state[index];
     sd = socket(PF_INET, SOCK_STREAM, 0);
     if (sd < 0)
     {
-        return -errno;
+        ret = -errno;
+        client->free_con[client->num_free++] = index;
+        return ret;
     }
-    ret = connect(sd, (struct sockaddr *)sin, sizeof(struct sockaddr_in));
-    if (ret < 0)
+    ev.events = EPOLLIN;
+    ev.data.u32 = index;
+    ret = mb_tcp_con_set_non_blocking(sd);
+    if ((ret == 0) && (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, sd, &ev) < 0))
     {
-        return -errno;
+        ret = -errno;
+    }
+    if ((ret == 0) && (connect(sd, (struct sockaddr *)sin, sizeof(struct sockaddr_in)) < 0))
+    {
+        in_progress = 1;
+        ret = errno == EINPROGRESS ? 0 : -errno;
     }
-    ret = mb_tcp_con_set_non_blocking(con->sd);
     if (ret < 0)
     {
+        close(sd);
+        client->free_con[client->num_free++] = index;
         return ret;
     }
-    mb_tcp_con_open(con, sd, sin);
+    mb_tcp_con_open(&client->con[index], sd, sin);
+    mb_tcp_client_hash_add(client, index);
+    mb_tcp_client_idle_add(client, index);
+    state->in_progress = in_progress;
+    state->num_pending = 0;
+    state->stale = 0;
+    state->wait_out = 0;
+    mb_tcp_client_set_deadline(&state->deadline, &client->connect_timeout);
     return 0;
 }
 
-int mb_tcp_client_exchange(mb_tcp_client_t *client, const char *host, in_port_t port, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+/* complete a non-blocking connect, waiting until the connect deadline if wait is set */
+static int mb_tcp_client_con_finish(mb_tcp_client_t *client, int index, int wait)
 {
-    struct sockaddr_in server_sin = {0};
-    ssize_t num = 0;
-    int index = 0;
+    mb_tcp_client_con_state_t *state = NULL;
+    struct timespec now = {0};
+    struct timeval timeout = {0};
+    socklen_t len = sizeof(int);
+    mb_tcp_con_t *con = NULL;
+    fd_set write_fds = {{0}};
+    int err = 0;
     int ret = 0;
 
-    server_sin.sin_family = AF_INET;
-    server_sin.sin_port = htons(port);
-    ret = inet_pton(AF_INET, host, &server_sin.sin_addr);
-    if (ret < 0)
+    con = &client->con[index];
+    state = &client->state[index];
+    if (!state->in_progress)
     {
-        return -errno;
+        return 0;
     }
-    if (ret == 0)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((wait) && (mb_tcp_client_timespec_cmp(&state->deadline, &now) > 0))
     {
-        return -EINVAL;
+        timeout.tv_sec = state->deadline.tv_sec - now.tv_sec;
+        timeout.tv_usec = (state->deadline.tv_nsec - now.tv_nsec) / 1000;
+        if (timeout.tv_usec < 0)
+        {
+            timeout.tv_sec--;
+            timeout.tv_usec += 1000000;
+        }
     }
-    index = mb_tcp_client_find_con(client, &server_sin);
-    if (index >= 0)
+    FD_ZERO(&write_fds);
+    FD_SET(con->sd, &write_fds);
+    ret = select(con->sd + 1, NULL, &write_fds, NULL, &timeout);
+    if ((ret < 0) && (errno != EINTR))
     {
-        num = mb_tcp_client_con_exchange(client, index, req, resp);
-        if (num > 0)
+        err = errno;
+    }
+    else if (ret > 0)
+    {
+        ret = getsockopt(con->sd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (ret < 0)
         {
-            return num;
+            err = errno;
         }
-        else if (num < 0)
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (mb_tcp_client_timespec_cmp(&state->deadline, &now) > 0)
         {
-            mb_log_warn("exchange: %s", strerror(-num));
+            return -EINPROGRESS;
         }
-        mb_tcp_con_close(&client->con[index]);
+        err = ETIMEDOUT;
     }
-    mb_log_debug("attempting to establish new connection");
-    ret = mb_ip_auth_list_check_addr(&client->auth, &server_sin.sin_addr);
+    state->in_progress = 0;
+    if (err != 0)
+    {
+        mb_log_warn("[%d] connect: %s", index, strerror(err));
+        mb_tcp_client_con_close(client, index);
+        return -err;
+    }
+    mb_log_debug("[%d] connect complete", index);
+    return 0;
+}
+
+static int mb_tcp_client_con_open(mb_tcp_client_t *client, int index, struct sockaddr_in *sin)
+{
+    int ret = 0;
+
+    ret = mb_tcp_client_con_start(client, index, sin);
     if (ret < 0)
     {
         return ret;
     }
-    if (ret == 0)
+    return mb_tcp_client_con_finish(client, index, 1);
+}
+
+void mb_tcp_client_set_connect_timeout(mb_tcp_client_t *client, struct timeval timeout)
+{
+    client->connect_timeout = timeout;
+}
+
+void mb_tcp_client_set_reconnect_interval(mb_tcp_client_t *client, struct timeval interval)
+{
+    client->reconnect_interval = interval;
+}
+
+int mb_tcp_client_add_endpoint(mb_tcp_client_t *client, const char *host, in_port_t port)
+{
+    mb_tcp_client_endpoint_t *endpoint = NULL;
+    struct sockaddr_in server_sin = {0};
+    int max_endpoint = 0;
+    int slot = MB_TCP_CLIENT_NONE;
+    int ret = 0;
+    int i = 0;
+
+    ret = mb_tcp_client_parse_addr(host, port, &server_sin);
+    if (ret < 0)
     {
-        mb_log_warn("rejecting unauthorised connection to address %s and port %u", host, port);
-        return -EACCES;
+        return ret;
     }
-    mb_log_info("connection with address %s and port %u authorised", host, port);
-    index = mb_tcp_client_find_empty_con(client);
-    ret = mb_tcp_client_con_open(client, index, &server_sin);
+    ret = mb_tcp_client_check_addr(client, &server_sin);
     if (ret < 0)
     {
         return ret;
     }
-    num = mb_tcp_client_con_exchange(client, index, req, resp);
-    if (num == 0)
+    for (i = 0; i < client->num_endpoint; i++)
     {
-        mb_log_info("[%d] connection closed remotely", index);
-        mb_tcp_con_close(&client->con[index]);
+        if ((client->endpoint[i].removed) && (slot == MB_TCP_CLIENT_NONE))
+            slot = i;
+        else if ((!client->endpoint[i].removed) && (mb_tcp_client_addr_eq(&client->endpoint[i].sin, &server_sin)))
+            return i;
     }
-    else if (num < 0)
+    if (slot != MB_TCP_CLIENT_NONE)
     {
-        mb_tcp_con_close(&client->con[index]);
+        endpoint = &client->endpoint[slot];
+        memset(endpoint, 0, sizeof(mb_tcp_client_endpoint_t));
+        memcpy(&endpoint->sin, &server_sin, sizeof(struct sockaddr_in));
+        return slot;
     }
-    return num;
+    if (client->num_endpoint == client->max_endpoint)
+    {
+        max_endpoint = client->max_endpoint ? 2 * client->max_endpoint : MB_TCP_CLIENT_MIN_ENDPOINT;
+        endpoint = realloc(client->endpoint, max_endpoint * sizeof(mb_tcp_client_endpoint_t));
+        if (endpoint == NULL)
+        {
+            return -ENOMEM;
+        }
+        client->endpoint = endpoint;
+        client->max_endpoint = max_endpoint;
+    }
+    endpoint = &client->endpoint[client->num_endpoint];
+    memset(endpoint, 0, sizeof(mb_tcp_client_endpoint_t));
+    memcpy(&endpoint->sin, &server_sin, sizeof(struct sockaddr_in));
+    return client->num_endpoint++;
+}
+
+int mb_tcp_client_remove_endpoint(mb_tcp_client_t *client, int endpoint)
+{
+    int index = 0;
+    int i = 0;
+
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint) || (client->endpoint[endpoint].removed))
+    {
+        return -EINVAL;
+    }
+    for (i = 0; i < client->num_hedge; i++)
+    {
+        if ((client->hedge[i].endpoint[0] == endpoint) || (client->hedge[i].endpoint[1] == endpoint))
+            return -EBUSY;
+    }
+    /* a connection with requests in flight is left to be closed when idle */
+    index = mb_tcp_client_find_con(client, &client->endpoint[endpoint].sin);
+    if ((index >= 0) && (client->state[index].num_pending == 0))
+    {
+        mb_tcp_client_con_close(client, index);
+    }
+    memset(&client->endpoint[endpoint], 0, sizeof(mb_tcp_client_endpoint_t));
+    client->endpoint[endpoint].removed = 1;
+    return 0;
+}
+
+/* start connecting to an address unless a connection to it exists already */
+int mb_tcp_client_start_addr(mb_tcp_client_t *client, struct sockaddr_in *sin)
+{
+    int index = 0;
+
+    index = mb_tcp_client_find_con(client, sin);
+    if (index >= 0)
+    {
+        return 0;
+    }
+    index = mb_tcp_client_find_empty_con(client);
+    if (index < 0)
+    {
+        return index;
+    }
+    return mb_tcp_client_con_start(client, index, sin);
+}
+
+static int mb_tcp_client_endpoint_connect(mb_tcp_client_t *client, mb_tcp_client_endpoint_t *endpoint)
+{
+    mb_tcp_client_set_deadline(&endpoint->next_attempt, &client->reconnect_interval);
+    return mb_tcp_client_start_addr(client, &endpoint->sin);
+}
+
+int mb_tcp_client_preconnect(mb_tcp_client_t *client, const char *host, in_port_t port)
+{
+    mb_tcp_client_endpoint_t *endpoint = NULL;
+    int handle = 0;
+    int ret = 0;
+
+    handle = mb_tcp_client_add_endpoint(client, host, port);
+    if (handle < 0)
+    {
+        return handle;
+    }
+    endpoint = &client->endpoint[handle];
+    endpoint->preconnect = 1;
+    mb_log_debug("preconnecting to address %s and port %u", host, port);
+    ret = mb_tcp_client_endpoint_connect(client, endpoint);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return handle;
+}
+
+static int mb_tcp_client_con_fail(mb_tcp_client_t *client, int index, ssize_t result);
+
+void mb_tcp_client_maintain(mb_tcp_client_t *client)
+{
+    mb_tcp_client_endpoint_t *endpoint = NULL;
+    struct timespec now = {0};
+    struct timeval timeout = {0};
+    fd_set read_fds = {{0}};
+    char c = 0;
+    int max_sd = -1;
+    int ret = 0;
+    int i = 0;
+
+    /* complete connects in progress and close idle connections that the server has closed */
+    FD_ZERO(&read_fds);
+    for (i = 0; i < client->num_con; i++)
+    {
+        if (!mb_tcp_con_is_active(&client->con[i]))
+            continue;
+        ret = mb_tcp_client_con_finish(client, i, 0);
+        if ((ret < 0) && (ret != -EINPROGRESS))
+            mb_tcp_client_con_fail(client, i, ret);  /* fail the requests waiting for the connect */
+        if (ret < 0)
+            continue;
+        if ((client->state[i].idle) && (!client->state[i].in_progress))
+        {
+            FD_SET(client->con[i].sd, &read_fds);
+            if (client->con[i].sd > max_sd)
+                max_sd = client->con[i].sd;
+        }
+    }
+    if (max_sd >= 0)
+    {
+        ret = select(max_sd + 1, &read_fds, NULL, NULL, &timeout);
+        for (i = 0; (ret > 0) && (i < client->num_con); i++)
+        {
+            if ((!mb_tcp_con_is_active(&client->con[i])) || (!FD_ISSET(client->con[i].sd, &read_fds)))
+                continue;
+            if (recv(client->con[i].sd, &c, 1, MSG_PEEK) > 0)
+                continue;
+            mb_log_info("[%d] connection closed remotely", i);
+            mb_tcp_client_con_close(client, i);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < client->num_endpoint; i++)
+    {
+        endpoint = &client->endpoint[i];
+        if ((!endpoint->preconnect) || (mb_tcp_client_timespec_cmp(&endpoint->next_attempt, &now) > 0))
+            continue;
+        ret = mb_tcp_client_endpoint_connect(client, endpoint);
+        if (ret < 0)
+            mb_log_warn("reconnect: %s", strerror(-ret));
+    }
+}
+
+static int mb_tcp_client_exchange_server(mb_tcp_client_t *client, struct sockaddr_in *sin, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    ssize_t num = 0;
+    int index = 0;
+    int ret = 0;
+
+    index = mb_tcp_client_find_con(client, sin);
+    if ((index >= 0) && (client->state[index].num_pending > 0))
+    {
+        return -EBUSY;  /* responses on this connection belong to asynchronous requests */
+    }
+    if (index >= 0)
+    {
+        ret = mb_tcp_client_con_finish(client, index, 1);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        num = mb_tcp_client_con_exchange(client, index, req, resp);
+        if (num > 0)
+        {
+            mb_tcp_client_idle_add(client, index);
+            return num;
+        }
+        else if (num < 0)
+        {
+            mb_log_warn("exchange: %s", strerror(-num));
+        }
+        mb_tcp_client_con_close(client, index);
+    }
+    mb_log_debug("attempting to establish new connection");
+    ret = mb_tcp_client_check_addr(client, sin);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    index = mb_tcp_client_find_empty_con(client);
+    if (index < 0)
+    {
+        return index;
+    }
+    ret = mb_tcp_client_con_open(client, index, sin);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    num = mb_tcp_client_con_exchange(client, index, req, resp);
+    if (num == 0)
+    {
+        mb_log_info("[%d] connection closed remotely", index);
+        mb_tcp_client_con_close(client, index);
+    }
+    else if (num < 0)
+    {
+        mb_tcp_client_con_close(client, index);
+    }
+    return num;
+}
+
+static int mb_tcp_client_exchange_addr(mb_tcp_client_t *client, struct sockaddr_in *sin, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_cache_entry_t *entry = NULL;
+    mb_tcp_client_cache_key_t key = {{0}};
+    int num = 0;
+
+    if (client->num_wr > 0)
+    {
+        /* the queued writes go first, the exchange returns -EBUSY until they complete */
+        num = mb_tcp_client_wr_flush_addr(client, sin);
+        if (num < 0)
+        {
+            return num;
+        }
+    }
+    if (client->cache == NULL)
+    {
+        return mb_tcp_client_exchange_server(client, sin, req, resp);
+    }
+    if (!mb_tcp_client_cache_key(sin, req, &key))
+    {
+        mb_tcp_client_cache_invalidate(client, sin, req);
+        return mb_tcp_client_exchange_server(client, sin, req, resp);
+    }
+    entry = mb_tcp_client_cache_find(client, &key);
+    if (entry != NULL)
+    {
+        client->cache_stats.num_hit++;
+        return mb_tcp_client_cache_slice(entry, &key, req->trans_id, resp);
+    }
+    client->cache_stats.num_miss++;
+    num = mb_tcp_client_exchange_server(client, sin, req, resp);
+    if (num > 0)
+    {
+        mb_tcp_client_cache_put(client, &key, resp);
+    }
+    return num;
+}
+
+int mb_tcp_client_exchange(mb_tcp_client_t *client, const char *host, in_port_t port, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    struct sockaddr_in server_sin = {0};
+    int ret = 0;
+
+    ret = mb_tcp_client_parse_addr(host, port, &server_sin);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return mb_tcp_client_exchange_addr(client, &server_sin, req, resp);
+}
+
+int mb_tcp_client_exchange_endpoint(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint))
+    {
+        return -EINVAL;
+    }
+    return mb_tcp_client_exchange_addr(client, &client->endpoint[endpoint].sin, req, resp);
+}
+
+/* take a request off its connection */
+void mb_tcp_client_release(mb_tcp_client_t *client, int handle)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    int index = 0;
+
+    pending = &client->pending[handle];
+    if ((!pending->used) || (pending->done) || (pending->detached))
+    {
+        return;
+    }
+    pending->detached = 1;
+    client->num_pending--;
+    index = pending->index;
+    if (index == MB_TCP_CLIENT_NONE)
+    {
+        return;  /* answered from the cache or waiting for another read */
+    }
+    if ((pending->gen != client->con[index].gen) || (--client->state[index].num_pending > 0) || (!mb_tcp_con_is_active(&client->con[index])))
+    {
+        return;
+    }
+    if (client->state[index].stale)
+    {
+        /* late responses would be taken as the responses to later requests */
+        mb_log_debug("[%d] closing connection with abandoned requests", index);
+        mb_tcp_client_con_close(client, index);
+        return;
+    }
+    mb_tcp_client_idle_add(client, index);
+}
+
+/* marks the connection of a request given up on before its response arrived */
+void mb_tcp_client_abandon(mb_tcp_client_t *client, int handle)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+
+    pending = &client->pending[handle];
+    if ((!pending->used) || (pending->done) || (pending->detached) || (pending->index == MB_TCP_CLIENT_NONE))
+    {
+        return;
+    }
+    if (pending->gen == client->con[pending->index].gen)
+    {
+        client->state[pending->index].stale = 1;
+    }
+}
+
+/* keep a request that lost a hedge on its connection, in the holder slot, until its response arrives */
+void mb_tcp_client_discard(mb_tcp_client_t *client, int handle, int holder)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    struct timespec deadline = {0};
+    uint16_t trans_id = 0;
+    unsigned gen = 0;
+    int index = 0;
+
+    pending = &client->pending[handle];
+    index = pending->index;
+    gen = pending->gen;
+    trans_id = pending->trans_id;
+    deadline = pending->deadline;
+    if (holder == handle)
+        client->num_pending--;
+    else
+        pending->index = MB_TCP_CLIENT_NONE;  /* the holder takes over its place on the connection */
+    pending = &client->pending[holder];
+    memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+    pending->used = 1;
+    pending->discard = 1;
+    pending->index = index;
+    pending->gen = gen;
+    pending->trans_id = trans_id;
+    pending->deadline = deadline;
+    pending->peer = MB_TCP_CLIENT_NONE;
+    client->num_discard++;
+}
+
+/* free a discarded request once its response has arrived or it has timed out */
+static void mb_tcp_client_drop(mb_tcp_client_t *client, int handle)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    unsigned gen = 0;
+    int index = 0;
+
+    pending = &client->pending[handle];
+    index = pending->index;
+    gen = pending->gen;
+    memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+    client->num_discard--;
+    if ((gen != client->con[index].gen) || (!mb_tcp_con_is_active(&client->con[index])) || (--client->state[index].num_pending > 0))
+    {
+        return;
+    }
+    if (client->state[index].stale)
+    {
+        mb_log_debug("[%d] closing connection with abandoned requests", index);
+        mb_tcp_client_con_close(client, index);
+        return;
+    }
+    mb_tcp_client_idle_add(client, index);
+}
+
+static int mb_tcp_client_find_discard(mb_tcp_client_t *client, int index, unsigned gen, uint16_t trans_id)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    int i = 0;
+
+    for (i = 0; i < client->max_pending; i++)
+    {
+        pending = &client->pending[i];
+        if ((pending->used) && (pending->discard) && (pending->index == index) && (pending->gen == gen) && (pending->trans_id == trans_id))
+            return i;
+    }
+    return MB_TCP_CLIENT_NONE;
+}
+
+void mb_tcp_client_complete(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_client_func_t func = NULL;
+    void *arg = NULL;
+
+    if ((client->pending[handle].wr != NULL) && (!mb_tcp_client_wr_done(client, handle, &result, resp)))
+    {
+        return;
+    }
+    if (client->pending[handle].hedged)
+    {
+        handle = mb_tcp_client_hedge_done(client, handle, result, resp);
+        if (handle == MB_TCP_CLIENT_NONE)
+        {
+            return;
+        }
+    }
+    if (client->pending[handle].cacheable)
+    {
+        mb_tcp_client_follow_done(client, handle, result, resp);
+    }
+    mb_tcp_client_release(client, handle);
+    pending = &client->pending[handle];
+    pending->done = 1;
+    pending->result = result;
+    if (pending->func == NULL)
+    {
+        if (resp != NULL)
+            memcpy(&pending->resp, resp, sizeof(mb_tcp_adu_t));
+        return;
+    }
+    /* free the slot before calling back so that the function can submit another request */
+    func = pending->func;
+    arg = pending->arg;
+    memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+    func(client, handle, result, resp, arg);
+}
+
+/* fail all requests in flight on a connection and close it */
+static int mb_tcp_client_con_fail(mb_tcp_client_t *client, int index, ssize_t result)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    unsigned gen = 0;
+    int num = 0;
+    int i = 0;
+
+    gen = client->con[index].gen;
+    mb_tcp_client_con_close(client, index);
+    for (i = 0; i < client->max_pending; i++)
+    {
+        pending = &client->pending[i];
+        if ((pending->used) && (pending->discard) && (pending->index == index) && (pending->gen == gen))
+        {
+            memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+            client->num_discard--;
+        }
+        else if ((pending->used) && (!pending->done) && (!pending->detached) && (pending->index == index) && (pending->gen == gen))
+        {
+            mb_tcp_client_complete(client, i, result, NULL);
+            num++;
+        }
+    }
+    return num;
+}
+
+/* returns a connection to the server, which may still be connecting */
+static int mb_tcp_client_get_con(mb_tcp_client_t *client, struct sockaddr_in *sin)
+{
+    int index = 0;
+    int ret = 0;
+
+    index = mb_tcp_client_find_con(client, sin);
+    if (index >= 0)
+    {
+        ret = mb_tcp_client_con_finish(client, index, 0);
+        if ((ret < 0) && (ret != -EINPROGRESS))
+        {
+            mb_tcp_client_con_fail(client, index, ret);
+            return ret;
+        }
+        return index;
+    }
+    ret = mb_tcp_client_check_addr(client, sin);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    index = mb_tcp_client_find_empty_con(client);
+    if (index < 0)
+    {
+        return index;
+    }
+    ret = mb_tcp_client_con_start(client, index, sin);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return index;
+}
+
+/* wait for EPOLLOUT only while requests are queued */
+static int mb_tcp_client_con_watch(mb_tcp_client_t *client, int index)
+{
+    struct epoll_event ev = {0};
+    int wait_out = 0;
+
+    wait_out = mb_tcp_con_tx_pending(&client->con[index]);
+    if (client->state[index].wait_out == wait_out)
+    {
+        return 0;
+    }
+    ev.events = wait_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u32 = index;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->con[index].sd, &ev) < 0)
+    {
+        return -errno;
+    }
+    client->state[index].wait_out = wait_out;
+    return 0;
+}
+
+int mb_tcp_client_alloc_pending(mb_tcp_client_t *client)
+{
+    int handle = 0;
+
+    for (handle = 0; handle < client->max_pending; handle++)
+    {
+        if (!client->pending[handle].used)
+            return handle;
+    }
+    return -EBUSY;
+}
+
+uint16_t mb_tcp_client_trans_id(mb_tcp_client_t *client, int handle)
+{
+    return (uint16_t)((client->seq++ * client->max_pending) | handle);
+}
+
+/* req is NULL for a prepared request, every request sent drops the cached ranges it writes */
+int mb_tcp_client_send_pending(mb_tcp_client_t *client, struct sockaddr_in *sin, int handle, uint16_t trans_id, char *buf, ssize_t num, mb_tcp_adu_t *req, const mb_tcp_adu_prep_t *prep, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_adu_t prep_req = {0};
+    char msg_buf[256] = {0};
+    int index = 0;
+    int retry = 0;
+    int ret = 0;
+
+    for (retry = 0; retry < 2; retry++)
+    {
+        index = mb_tcp_client_get_con(client, sin);
+        if (index < 0)
+        {
+            return index;
+        }
+        if (req != NULL)
+        {
+            mb_tcp_adu_to_str(req, msg_buf, sizeof(msg_buf));
+            mb_log_info("[%d] sending: %s", index, msg_buf);
+        }
+        else
+        {
+            mb_log_debug("[%d] sending prepared request with transaction id %u", index, trans_id);
+        }
+        /* what the socket cannot take yet, or all of it while connecting, is sent from poll */
+        if (client->state[index].in_progress)
+            ret = mb_tcp_con_queue(&client->con[index], buf, num);
+        else
+            ret = mb_tcp_con_send_queue(&client->con[index], buf, num);
+        if (ret == 0)
+        {
+            ret = mb_tcp_client_con_watch(client, index);
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+        /* the connection may have been closed by the server since it was last used */
+        mb_log_warn("[%d] submit: %s", index, strerror(-ret));
+        mb_tcp_client_con_fail(client, index, ret);
+    }
+    if (retry == 2)
+    {
+        return ret;
+    }
+    if ((client->cache != NULL) && (req == NULL) && (mb_tcp_adu_parse_req(&prep_req, buf, num) > 0))
+    {
+        req = &prep_req;
+    }
+    if ((client->cache != NULL) && (req != NULL))
+    {
+        mb_tcp_client_cache_invalidate(client, sin, req);
+    }
+    pending = &client->pending[handle];
+    memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+    pending->used = 1;
+    pending->index = index;
+    pending->gen = client->con[index].gen;
+    pending->trans_id = trans_id;
+    pending->prep = prep;
+    pending->func = func;
+    pending->arg = arg;
+    mb_tcp_client_set_deadline(&pending->deadline, timeout != NULL ? timeout : &client->timeout);
+    client->num_pending++;
+    if (client->state[index].num_pending++ == 0)
+    {
+        mb_tcp_client_idle_remove(client, index);
+    }
+    return handle;
+}
+
+int mb_tcp_client_num_free_pending(mb_tcp_client_t *client)
+{
+    int num = 0;
+    int i = 0;
+
+    for (i = 0; i < client->max_pending; i++)
+    {
+        if (!client->pending[i].used)
+            num++;
+    }
+    return num;
+}
+
+static int mb_tcp_client_submit_addr(mb_tcp_client_t *client, struct sockaddr_in *sin, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    mb_tcp_client_cache_key_t key = {{0}};
+    ssize_t num = 0;
+    char buf[MB_TCP_ADU_MAX_LEN] = {0};
+    int cacheable = 0;
+    int combined = 0;
+    int handle = 0;
+    int ret = 0;
+
+    handle = mb_tcp_client_alloc_pending(client);
+    if (handle < 0)
+    {
+        return handle;
+    }
+    req->trans_id = mb_tcp_client_trans_id(client, handle);
+    if (client->cache != NULL)
+    {
+        cacheable = mb_tcp_client_cache_key(sin, req, &key);
+        if ((cacheable) && (mb_tcp_client_cache_submit(client, handle, &key, req, timeout, func, arg)))
+            return handle;
+    }
+    if (client->num_wr > 0)
+    {
+        combined = mb_tcp_client_wr_combine(client, sin, req, timeout, func, arg, &handle);
+        if (!combined)
+        {
+            /* the queued writes go first */
+            ret = mb_tcp_client_wr_flush_addr(client, sin);
+            if (ret < 0)
+            {
+                return ret;
+            }
+            handle = mb_tcp_client_alloc_pending(client);
+            if (handle < 0)
+            {
+                return handle;
+            }
+            req->trans_id = mb_tcp_client_trans_id(client, handle);
+        }
+    }
+    if (!combined)
+    {
+        num = mb_tcp_adu_format_req(req, buf, sizeof(buf));
+        if (num < 0)
+        {
+            return -EBADMSG;  /* convert modbus error to errno value */
+        }
+        handle = mb_tcp_client_send_pending(client, sin, handle, req->trans_id, buf, num, req, NULL, timeout, func, arg);
+    }
+    if ((handle >= 0) && (cacheable))
+    {
+        client->pending[handle].cacheable = 1;
+        client->pending[handle].key = key;
+        client->cache_stats.num_miss++;
+    }
+    return handle;
+}
+
+int mb_tcp_client_submit(mb_tcp_client_t *client, const char *host, in_port_t port, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    struct sockaddr_in server_sin = {0};
+    int ret = 0;
+
+    ret = mb_tcp_client_parse_addr(host, port, &server_sin);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return mb_tcp_client_submit_addr(client, &server_sin, req, timeout, func, arg);
+}
+
+int mb_tcp_client_submit_endpoint(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint))
+    {
+        return -EINVAL;
+    }
+    return mb_tcp_client_submit_addr(client, &client->endpoint[endpoint].sin, req, timeout, func, arg);
+}
+
+int mb_tcp_client_submit_prep(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_prep_t *prep, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    uint16_t trans_id = 0;
+    int handle = 0;
+
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint))
+    {
+        return -EINVAL;
+    }
+    if (client->num_wr > 0)
+    {
+        handle = mb_tcp_client_wr_flush_addr(client, &client->endpoint[endpoint].sin);
+        if (handle < 0)
+        {
+            return handle;
+        }
+    }
+    handle = mb_tcp_client_alloc_pending(client);
+    if (handle < 0)
+    {
+        return handle;
+    }
+    trans_id = mb_tcp_client_trans_id(client, handle);
+    mb_tcp_adu_prep_set_trans_id(prep, trans_id);
+    return mb_tcp_client_send_pending(client, &client->endpoint[endpoint].sin, handle, trans_id, prep->buf, prep->len, NULL, prep, timeout, func, arg);
+}
+
+/* returns the number of requests completed */
+static int mb_tcp_client_con_recv(mb_tcp_client_t *client, int index)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_con_t *con = NULL;
+    ssize_t result = 0;
+    ssize_t num = 0;
+    char msg_buf[256] = {0};
+    int handle = 0;
+    int count = 0;
+
+    con = &client->con[index];
+    num = mb_tcp_con_recv(con);
+    if (num == -EAGAIN)
+    {
+        return 0;
+    }
+    if (num <= 0)
+    {
+        return mb_tcp_client_con_fail(client, index, num < 0 ? num : -ECONNRESET);
+    }
+    while (mb_tcp_con_rx_complete(con))
+    {
+        num = mb_tcp_adu_parse_resp(&resp, con->rx_buf, con->rx_end);
+        if (num < 0)
+        {
+            return count + mb_tcp_client_con_fail(client, index, -EBADMSG);
+        }
+        handle = MB_TCP_CLIENT_NONE;
+        if (client->num_discard > 0)
+        {
+            handle = mb_tcp_client_find_discard(client, index, con->gen, resp.trans_id);
+        }
+        if (handle != MB_TCP_CLIENT_NONE)
+        {
+            mb_tcp_con_consume(con, num);
+            mb_log_debug("[%d] dropping response to the copy that lost with transaction id %u", index, resp.trans_id);
+            mb_tcp_client_drop(client, handle);
+            continue;
+        }
+        handle = resp.trans_id & (client->max_pending - 1);
+        pending = &client->pending[handle];
+        if ((!pending->used)
+         || (pending->done)
+         || (pending->discard)
+         || (pending->detached)
+         || (pending->index != index)
+         || (pending->gen != con->gen)
+         || (pending->trans_id != resp.trans_id))
+        {
+            mb_tcp_con_consume(con, num);
+            mb_log_debug("[%d] discarding response with transaction id %u", index, resp.trans_id);
+            continue;  /* late response to a request that timed out or was cancelled */
+        }
+        result = num;
+        if (pending->prep == NULL)
+        {
+            mb_tcp_adu_to_str(&resp, msg_buf, sizeof(msg_buf));
+            mb_log_info("[%d] received: %s", index, msg_buf);
+        }
+        else if (mb_tcp_adu_prep_check_resp(pending->prep, con->rx_buf, num) < 0)
+        {
+            mb_log_warn("[%d] response with transaction id %u does not match the request", index, resp.trans_id);
+            result = -EBADMSG;
+        }
+        mb_tcp_con_consume(con, num);
+        mb_tcp_client_complete(client, handle, result, result > 0 ? &resp : NULL);
+        count++;
+    }
+    return count;
+}
+
+/* complete a connect in progress and send the requests queued on the connection */
+static int mb_tcp_client_con_writable(mb_tcp_client_t *client, int index)
+{
+    int ret = 0;
+
+    if (client->state[index].in_progress)
+    {
+        ret = mb_tcp_client_con_finish(client, index, 0);
+        if (ret == -EINPROGRESS)
+        {
+            return 0;
+        }
+        if (ret < 0)
+        {
+            return mb_tcp_client_con_fail(client, index, ret);
+        }
+    }
+    ret = mb_tcp_con_flush(&client->con[index]);
+    if (ret >= 0)
+    {
+        ret = mb_tcp_client_con_watch(client, index);
+    }
+    if (ret < 0)
+    {
+        mb_log_warn("[%d] send: %s", index, strerror(-ret));
+        return mb_tcp_client_con_fail(client, index, ret);
+    }
+    return 0;
+}
+
+static int mb_tcp_client_expire(mb_tcp_client_t *client)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    struct timespec now = {0};
+    int count = 0;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < client->num_con; i++)
+    {
+        if ((mb_tcp_con_is_active(&client->con[i])) && (client->state[i].in_progress) && (client->state[i].num_pending > 0)
+         && (mb_tcp_client_timespec_cmp(&client->state[i].deadline, &now) <= 0))
+            count += mb_tcp_client_con_writable(client, i);  /* fails the requests if the connect has not completed */
+    }
+    for (i = 0; i < client->max_pending; i++)
+    {
+        pending = &client->pending[i];
+        if ((pending->used) && (pending->discard) && (mb_tcp_client_timespec_cmp(&pending->deadline, &now) <= 0))
+        {
+            mb_tcp_client_abandon(client, i);  /* its response may still arrive */
+            mb_tcp_client_drop(client, i);
+        }
+        else if ((pending->used) && (!pending->done) && (!pending->detached) && (mb_tcp_client_timespec_cmp(&pending->deadline, &now) <= 0))
+        {
+            mb_log_debug("request %d timed out", i);
+            mb_tcp_client_abandon(client, i);
+            mb_tcp_client_complete(client, i, -ETIMEDOUT, NULL);
+            count++;
+        }
+    }
+    return count;
+}
+
+/* returns 1 and the time by which mb_tcp_client_poll must be called, or 0 if there is nothing to wait for */
+int mb_tcp_client_next_deadline(mb_tcp_client_t *client, struct timespec *deadline)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    struct timespec *next = NULL;
+    int i = 0;
+
+    for (i = 0; i < client->max_pending; i++)
+    {
+        pending = &client->pending[i];
+        if ((pending->used) && (pending->ready))
+        {
+            clock_gettime(CLOCK_MONOTONIC, deadline);  /* answered from the cache */
+            return 1;
+        }
+        if ((!pending->used) || (pending->done) || (pending->detached))
+            continue;
+        if ((next == NULL) || (mb_tcp_client_timespec_cmp(&pending->deadline, next) < 0))
+            next = &pending->deadline;
+        if ((pending->hedge_at.tv_sec != 0) && (mb_tcp_client_timespec_cmp(&pending->hedge_at, next) < 0))
+            next = &pending->hedge_at;
+    }
+    for (i = 0; i < client->num_con; i++)
+    {
+        if ((mb_tcp_con_is_active(&client->con[i])) && (client->state[i].in_progress) && (client->state[i].num_pending > 0)
+         && ((next == NULL) || (mb_tcp_client_timespec_cmp(&client->state[i].deadline, next) < 0)))
+            next = &client->state[i].deadline;
+    }
+    /* the oldest queued write is the first to be sent */
+    if ((client->num_wr > 0) && ((next == NULL) || (mb_tcp_client_timespec_cmp(&client->wr[0].deadline, next) < 0)))
+    {
+        next = &client->wr[0].deadline;
+    }
+    if (next == NULL)
+    {
+        return 0;
+    }
+    *deadline = *next;
+    return 1;
+}
+
+int mb_tcp_client_poll(mb_tcp_client_t *client, const struct timeval *timeout)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    struct epoll_event ev[MB_TCP_CLIENT_MAX_PENDING] = {{0}};
+    mb_tcp_adu_t resp = {0};
+    struct timespec deadline = {0};
+    struct timespec now = {0};
+    struct timeval wait = {0};
+    int found = 0;
+    int count = 0;
+    int index = 0;
+    int ret = 0;
+    int i = 0;
+
+    if (client->num_wr > 0)
+    {
+        mb_tcp_client_wr_flush_due(client);  /* left queued if too many requests are in flight */
+    }
+    if ((client->num_pending == 0) && (client->num_discard == 0) && (client->num_wr == 0))
+    {
+        return 0;
+    }
+    /* complete the reads answered from the cache before waiting for anything else */
+    for (i = 0; i < client->max_pending; i++)
+    {
+        pending = &client->pending[i];
+        if ((!pending->used) || (!pending->ready))
+            continue;
+        pending->ready = 0;
+        memcpy(&resp, &pending->resp, sizeof(mb_tcp_adu_t));
+        mb_tcp_client_complete(client, i, pending->result, &resp);
+        count++;
+    }
+    if (count > 0)
+    {
+        return count;
+    }
+    /* wait no longer than the nearest deadline */
+    found = mb_tcp_client_next_deadline(client, &deadline);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((found) && (mb_tcp_client_timespec_cmp(&deadline, &now) > 0))
+    {
+        wait.tv_sec = deadline.tv_sec - now.tv_sec;
+        wait.tv_usec = (deadline.tv_nsec - now.tv_nsec) / 1000;
+        if (wait.tv_usec < 0)
+        {
+            wait.tv_sec--;
+            wait.tv_usec += 1000000;
+        }
+    }
+    if ((timeout != NULL) && ((!found) || (timercmp(timeout, &wait, <))))
+    {
+        wait = *timeout;
+    }
+    ret = epoll_wait(client->epoll_fd, ev, MB_TCP_CLIENT_MAX_PENDING, wait.tv_sec * 1000 + (wait.tv_usec + 999) / 1000);
+    if ((ret < 0) && (errno != EINTR))
+    {
+        return -errno;
+    }
+    for (i = 0; i < ret; i++)
+    {
+        index = ev[i].data.u32;
+        if ((mb_tcp_con_is_active(&client->con[index])) && (ev[i].events & EPOLLOUT))
+            count += mb_tcp_client_con_writable(client, index);
+        if ((mb_tcp_con_is_active(&client->con[index])) && (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            count += mb_tcp_client_con_recv(client, index);
+    }
+    count += mb_tcp_client_expire(client);
+    mb_tcp_client_hedge_send(client);
+    if (client->num_wr > 0)
+    {
+        mb_tcp_client_wr_flush_due(client);
+    }
+    return count;
+}
+
+int mb_tcp_client_get_fd(mb_tcp_client_t *client)
+{
+    return client->epoll_fd;
+}
+
+ssize_t mb_tcp_client_result(mb_tcp_client_t *client, int handle, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    ssize_t result = 0;
+
+    if ((handle < 0) || (handle >= client->max_pending))
+    {
+        return -EINVAL;
+    }
+    pending = &client->pending[handle];
+    if ((!pending->used) || (pending->func != NULL))
+    {
+        return -EINVAL;
+    }
+    if (!pending->done)
+    {
+        return -EINPROGRESS;
+    }
+    result = pending->result;
+    if ((result > 0) && (resp != NULL))
+    {
+        memcpy(resp, &pending->resp, sizeof(mb_tcp_adu_t));
+    }
+    memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+    return result;
+}
+
+void mb_tcp_client_cancel(mb_tcp_client_t *client, int handle)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+
+    if ((handle < 0) || (handle >= client->max_pending))
+    {
+        return;
+    }
+    pending = &client->pending[handle];
+    if ((pending->used) && (!pending->done) && (pending->hedged) && (pending->peer != MB_TCP_CLIENT_NONE))
+    {
+        mb_tcp_client_abandon(client, pending->peer);
+        mb_tcp_client_release(client, pending->peer);
+        memset(&client->pending[pending->peer], 0, sizeof(mb_tcp_client_pending_t));
+    }
+    if ((pending->used) && (!pending->done) && (pending->cacheable))
+    {
+        mb_tcp_client_follow_done(client, handle, -ECANCELED, NULL);
+    }
+    if ((pending->used) && (pending->wr != NULL))
+    {
+        mb_tcp_client_wr_call(client, pending->wr, pending->num_wr, -ECANCELED, NULL);
+        free(pending->wr);
+        pending->wr = NULL;
+    }
+    mb_tcp_client_abandon(client, handle);
+    mb_tcp_client_release(client, handle);
+    memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+}
+
+int mb_tcp_client_num_pending(mb_tcp_client_t *client)
+{
+    return client->num_pending;
 }
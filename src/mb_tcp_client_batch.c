@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "mb_tcp_client_priv.h"
+#include "mb_log.h"
+
+static void mb_tcp_client_batch_done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp, void *arg)
+{
+    mb_tcp_client_item_t *item = (mb_tcp_client_item_t *)arg;
+
+    item->result = result;
+    if ((resp != NULL) && (item->resp != NULL))
+    {
+        memcpy(item->resp, resp, sizeof(mb_tcp_adu_t));
+    }
+}
+
+/* returns the number of items with a response */
+int mb_tcp_client_exchange_batch(mb_tcp_client_t *client, mb_tcp_client_item_t *item, int num_item, const struct timeval *timeout)
+{
+    struct timespec deadline = {0};
+    struct timespec now = {0};
+    struct timeval left = {0};
+    int num_started = 0;
+    int in_flight = 0;
+    int next = 0;
+    int ret = 0;
+    int i = 0;
+    int j = 0;
+
+    mb_tcp_client_set_deadline(&deadline, timeout != NULL ? timeout : &client->timeout);
+    for (i = 0; i < num_item; i++)
+    {
+        item[i].result = -EINPROGRESS;
+        if ((item[i].endpoint < 0) || (item[i].endpoint >= client->num_endpoint))
+        {
+            item[i].result = -EINVAL;
+            continue;
+        }
+        /* start the connects together so that the handshakes overlap */
+        for (j = 0; j < i; j++)
+        {
+            if (item[j].endpoint == item[i].endpoint)
+                break;
+        }
+        if ((j == i) && (num_started < client->num_con))
+        {
+            ret = mb_tcp_client_start_addr(client, &client->endpoint[item[i].endpoint].sin);
+            if (ret < 0)
+                mb_log_warn("batch: %s", strerror(-ret));
+            num_started++;
+        }
+    }
+    while (1)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = 0;
+        left.tv_usec = 0;
+        if (mb_tcp_client_timespec_cmp(&deadline, &now) > 0)
+        {
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_usec = (deadline.tv_nsec - now.tv_nsec) / 1000;
+            if (left.tv_usec < 0)
+            {
+                left.tv_sec--;
+                left.tv_usec += 1000000;
+            }
+        }
+        /* each request times out at the batch deadline at the latest */
+        if (timercmp(&client->timeout, &left, <))
+        {
+            left = client->timeout;
+        }
+        for (; (next < num_item) && (timerisset(&left)); next++)
+        {
+            if (item[next].result != -EINPROGRESS)
+                continue;
+            ret = mb_tcp_client_submit_endpoint(client, item[next].endpoint, item[next].req, &left, mb_tcp_client_batch_done, &item[next]);
+            if ((ret == -EBUSY) && (client->num_pending > 0))
+                break;  /* wait for a request to complete */
+            if (ret < 0)
+                item[next].result = ret;  /* -EBUSY if no request in flight can free a connection */
+        }
+        in_flight = 0;
+        for (i = 0; i < next; i++)
+        {
+            if (item[i].result == -EINPROGRESS)
+                in_flight++;
+        }
+        if ((in_flight == 0) && ((next == num_item) || (!timerisset(&left))))
+        {
+            break;
+        }
+        ret = mb_tcp_client_poll(client, &left);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    ret = 0;
+    for (i = 0; i < num_item; i++)
+    {
+        if (item[i].result == -EINPROGRESS)
+            item[i].result = -ETIMEDOUT;  /* never sent */
+        else if (item[i].result > 0)
+            ret++;
+    }
+    return ret;
+}
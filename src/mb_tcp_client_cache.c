@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "mb_tcp_client_priv.h"
+#include "mb_log.h"
+
+int mb_tcp_client_enable_cache(mb_tcp_client_t *client, int num_entry, struct timeval max_age)
+{
+    mb_tcp_client_cache_entry_t *cache = NULL;
+
+    if (num_entry <= 0)
+    {
+        return -EINVAL;
+    }
+    cache = calloc(num_entry, sizeof(mb_tcp_client_cache_entry_t));
+    if (cache == NULL)
+    {
+        return -ENOMEM;
+    }
+    free(client->cache);
+    client->cache = cache;
+    client->num_cache = num_entry;
+    client->max_age.tv_sec = max_age.tv_sec;
+    client->max_age.tv_nsec = max_age.tv_usec * 1000;
+    return 0;
+}
+
+int mb_tcp_client_set_max_age(mb_tcp_client_t *client, uint8_t func_code, uint16_t start_addr, uint32_t quant, struct timeval max_age)
+{
+    mb_tcp_client_max_age_t *rule = NULL;
+
+    if ((func_code < MB_PDU_RD_COILS) || (func_code > MB_PDU_RD_IP_REGS)
+     || (quant == 0) || (start_addr + quant > 0x10000))
+    {
+        return -EINVAL;
+    }
+    if (client->num_max_age_rule >= MB_TCP_CLIENT_MAX_AGE_RULE)
+    {
+        return -ENOSPC;
+    }
+    rule = &client->max_age_rule[client->num_max_age_rule++];
+    rule->func_code = func_code;
+    rule->start_addr = start_addr;
+    rule->end_addr = start_addr + quant;
+    rule->max_age.tv_sec = max_age.tv_sec;
+    rule->max_age.tv_nsec = max_age.tv_usec * 1000;
+    return 0;
+}
+
+void mb_tcp_client_flush_cache(mb_tcp_client_t *client)
+{
+    if (client->cache != NULL)
+    {
+        memset(client->cache, 0, client->num_cache * sizeof(mb_tcp_client_cache_entry_t));
+    }
+}
+
+void mb_tcp_client_get_cache_stats(mb_tcp_client_t *client, mb_tcp_client_cache_stats_t *stats)
+{
+    memcpy(stats, &client->cache_stats, sizeof(mb_tcp_client_cache_stats_t));
+}
+
+/* returns 1 if the request is a read whose response can be cached */
+int mb_tcp_client_cache_key(struct sockaddr_in *sin, mb_tcp_adu_t *req, mb_tcp_client_cache_key_t *key)
+{
+    memset(key, 0, sizeof(mb_tcp_client_cache_key_t));
+    switch (req->pdu.func_code)
+    {
+    case MB_PDU_RD_COILS:
+        key->start_addr = req->pdu.rd_coils_req.start_addr;
+        key->quant = req->pdu.rd_coils_req.quant_coils;
+        break;
+    case MB_PDU_RD_DISC_IPS:
+        key->start_addr = req->pdu.rd_disc_ips_req.start_addr;
+        key->quant = req->pdu.rd_disc_ips_req.quant_ips;
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        key->start_addr = req->pdu.rd_hold_regs_req.start_addr;
+        key->quant = req->pdu.rd_hold_regs_req.quant_regs;
+        break;
+    case MB_PDU_RD_IP_REGS:
+        key->start_addr = req->pdu.rd_ip_regs_req.start_addr;
+        key->quant = req->pdu.rd_ip_regs_req.quant_ip_regs;
+        break;
+    default:
+        return 0;
+    }
+    key->sin = *sin;
+    key->unit_id = req->unit_id;
+    key->func_code = req->pdu.func_code;
+    return 1;
+}
+
+/* returns 1 if the range of key a holds the range of key b */
+static int mb_tcp_client_cache_covers(mb_tcp_client_cache_key_t *a, mb_tcp_client_cache_key_t *b)
+{
+    return (mb_tcp_client_addr_eq(&a->sin, &b->sin))
+        && (a->unit_id == b->unit_id)
+        && (a->func_code == b->func_code)
+        && (a->start_addr <= b->start_addr)
+        && (a->start_addr + a->quant >= b->start_addr + b->quant);
+}
+
+/* returns 1 if a response holds the values for the read described by key */
+static int mb_tcp_client_cache_valid(mb_tcp_client_cache_key_t *key, mb_tcp_adu_t *resp)
+{
+    if (resp->pdu.func_code != key->func_code)
+    {
+        return 0;
+    }
+    switch (key->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        return resp->pdu.rd_coils_resp.byte_count == (key->quant + 7) / 8;
+    case MB_PDU_RD_DISC_IPS:
+        return resp->pdu.rd_disc_ips_resp.byte_count == (key->quant + 7) / 8;
+    case MB_PDU_RD_HOLD_REGS:
+        return resp->pdu.rd_hold_regs_resp.byte_count == key->quant * 2;
+    case MB_PDU_RD_IP_REGS:
+        return resp->pdu.rd_ip_regs_resp.byte_count == key->quant * 2;
+    }
+    return 0;
+}
+
+static void mb_tcp_client_cache_fill(mb_tcp_client_cache_entry_t *entry, mb_tcp_client_cache_key_t *key, mb_tcp_adu_t *resp)
+{
+    switch (key->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        memcpy(entry->bit, resp->pdu.rd_coils_resp.coil_stat, resp->pdu.rd_coils_resp.byte_count);
+        break;
+    case MB_PDU_RD_DISC_IPS:
+        memcpy(entry->bit, resp->pdu.rd_disc_ips_resp.ip_stat, resp->pdu.rd_disc_ips_resp.byte_count);
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        memcpy(entry->reg, resp->pdu.rd_hold_regs_resp.reg_val, key->quant * sizeof(uint16_t));
+        break;
+    case MB_PDU_RD_IP_REGS:
+        memcpy(entry->reg, resp->pdu.rd_ip_regs_resp.ip_reg, key->quant * sizeof(uint16_t));
+        break;
+    }
+    entry->key = *key;
+    entry->used = 1;
+    clock_gettime(CLOCK_MONOTONIC, &entry->fetched);
+}
+
+/* build the response to a read from an entry that holds its range, returns the length of the response */
+ssize_t mb_tcp_client_cache_slice(mb_tcp_client_cache_entry_t *entry, mb_tcp_client_cache_key_t *key, uint16_t trans_id, mb_tcp_adu_t *resp)
+{
+    uint8_t bit[MB_PDU_RD_COILS_MAX_BYTE_COUNT] = {0};
+    unsigned off = key->start_addr - entry->key.start_addr;
+    unsigned byte_count = 0;
+    unsigned i = 0;
+
+    memset(resp, 0, sizeof(mb_tcp_adu_t));
+    switch (key->func_code)
+    {
+    case MB_PDU_RD_COILS:
+    case MB_PDU_RD_DISC_IPS:
+        /* shift the bits down to the start of the read */
+        for (i = 0; i < key->quant; i++)
+        {
+            if ((entry->bit[(off + i) / 8] >> ((off + i) % 8)) & 1)
+                bit[i / 8] |= 1 << (i % 8);
+        }
+        byte_count = (key->quant + 7) / 8;
+        if (key->func_code == MB_PDU_RD_COILS)
+            mb_pdu_set_rd_coils_resp(&resp->pdu, byte_count, bit);
+        else
+            mb_pdu_set_rd_disc_ips_resp(&resp->pdu, byte_count, bit);
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        byte_count = key->quant * 2;
+        mb_pdu_set_rd_hold_regs_resp(&resp->pdu, byte_count, &entry->reg[off]);
+        break;
+    case MB_PDU_RD_IP_REGS:
+        byte_count = key->quant * 2;
+        mb_pdu_set_rd_ip_regs_resp(&resp->pdu, byte_count, &entry->reg[off]);
+        break;
+    }
+    mb_tcp_adu_set_header(resp, trans_id, 0, key->unit_id);
+    resp->len = 3 + byte_count;  /* unit id, function code, byte count and values */
+    return MB_TCP_ADU_HEADER_LEN + 2 + byte_count;
+}
+
+/* the shortest max-age of the ranges that overlap the read */
+static void mb_tcp_client_cache_max_age(mb_tcp_client_t *client, mb_tcp_client_cache_key_t *key, struct timespec *max_age)
+{
+    mb_tcp_client_max_age_t *rule = NULL;
+    uint32_t end_addr = key->start_addr + key->quant;
+    int i = 0;
+
+    *max_age = client->max_age;
+    for (i = 0; i < client->num_max_age_rule; i++)
+    {
+        rule = &client->max_age_rule[i];
+        if ((rule->func_code != key->func_code) || (rule->start_addr >= end_addr) || (rule->end_addr <= key->start_addr))
+            continue;
+        if (mb_tcp_client_timespec_cmp(&rule->max_age, max_age) < 0)
+            *max_age = rule->max_age;
+    }
+}
+
+/* find the newest entry that holds the range of a read and has not aged out */
+mb_tcp_client_cache_entry_t *mb_tcp_client_cache_find(mb_tcp_client_t *client, mb_tcp_client_cache_key_t *key)
+{
+    mb_tcp_client_cache_entry_t *entry = NULL;
+    mb_tcp_client_cache_entry_t *best = NULL;
+    struct timespec max_age = {0};
+    struct timespec now = {0};
+    long long age = 0;
+    int i = 0;
+
+    mb_tcp_client_cache_max_age(client, key, &max_age);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < client->num_cache; i++)
+    {
+        entry = &client->cache[i];
+        if ((!entry->used) || (!mb_tcp_client_cache_covers(&entry->key, key)))
+            continue;
+        age = (now.tv_sec - entry->fetched.tv_sec) * 1000000000LL + (now.tv_nsec - entry->fetched.tv_nsec);
+        if (age >= max_age.tv_sec * 1000000000LL + max_age.tv_nsec)
+            continue;
+        if ((best == NULL) || (mb_tcp_client_timespec_cmp(&entry->fetched, &best->fetched) > 0))
+            best = entry;
+    }
+    return best;
+}
+
+/* store a response, replacing the entry for the same read, a free entry or the oldest entry */
+void mb_tcp_client_cache_put(mb_tcp_client_t *client, mb_tcp_client_cache_key_t *key, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_cache_entry_t *entry = NULL;
+    mb_tcp_client_cache_entry_t *victim = NULL;
+    int i = 0;
+
+    if (!mb_tcp_client_cache_valid(key, resp))
+    {
+        return;
+    }
+    for (i = 0; i < client->num_cache; i++)
+    {
+        entry = &client->cache[i];
+        if ((entry->used) && (mb_tcp_client_cache_covers(&entry->key, key)) && (entry->key.start_addr == key->start_addr) && (entry->key.quant == key->quant))
+        {
+            victim = entry;
+            break;
+        }
+        if ((victim != NULL) && (!victim->used))
+            continue;
+        if ((!entry->used) || (victim == NULL) || (mb_tcp_client_timespec_cmp(&entry->fetched, &victim->fetched) < 0))
+            victim = entry;
+    }
+    mb_tcp_client_cache_fill(victim, key, resp);
+}
+
+/* drop the entries that overlap the range written by a request */
+void mb_tcp_client_cache_invalidate(mb_tcp_client_t *client, struct sockaddr_in *sin, mb_tcp_adu_t *req)
+{
+    mb_tcp_client_cache_entry_t *entry = NULL;
+    uint32_t start_addr = 0;
+    uint32_t end_addr = 0;
+    uint8_t func_code = 0;
+    int i = 0;
+
+    switch (req->pdu.func_code)
+    {
+    case MB_PDU_WR_SING_COIL:
+        func_code = MB_PDU_RD_COILS;
+        start_addr = req->pdu.wr_sing_coil_req.op_addr;
+        end_addr = start_addr + 1;
+        break;
+    case MB_PDU_WR_MULT_COILS:
+        func_code = MB_PDU_RD_COILS;
+        start_addr = req->pdu.wr_mult_coils_req.start_addr;
+        end_addr = start_addr + req->pdu.wr_mult_coils_req.quant_ops;
+        break;
+    case MB_PDU_WR_SING_REG:
+        func_code = MB_PDU_RD_HOLD_REGS;
+        start_addr = req->pdu.wr_sing_reg_req.reg_addr;
+        end_addr = start_addr + 1;
+        break;
+    case MB_PDU_WR_MULT_REGS:
+        func_code = MB_PDU_RD_HOLD_REGS;
+        start_addr = req->pdu.wr_mult_regs_req.start_addr;
+        end_addr = start_addr + req->pdu.wr_mult_regs_req.quant_regs;
+        break;
+    case MB_PDU_MASK_WR_REG:
+        func_code = MB_PDU_RD_HOLD_REGS;
+        start_addr = req->pdu.mask_wr_reg_req.ref_addr;
+        end_addr = start_addr + 1;
+        break;
+    case MB_PDU_RD_WR_MULT_REGS:
+        func_code = MB_PDU_RD_HOLD_REGS;
+        start_addr = req->pdu.rd_wr_mult_regs_req.wr_start_addr;
+        end_addr = start_addr + req->pdu.rd_wr_mult_regs_req.quant_wr;
+        break;
+    default:
+        return;
+    }
+    for (i = 0; i < client->num_cache; i++)
+    {
+        entry = &client->cache[i];
+        if ((!entry->used) || (entry->key.func_code != func_code) || (entry->key.unit_id != req->unit_id)
+         || (!mb_tcp_client_addr_eq(&entry->key.sin, sin))
+         || (entry->key.start_addr >= end_addr) || (entry->key.start_addr + entry->key.quant <= start_addr))
+            continue;
+        entry->used = 0;
+        client->cache_stats.num_invalidate++;
+    }
+}
+
+/* complete the reads waiting for a read that has completed */
+void mb_tcp_client_follow_done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_cache_entry_t entry = {0};
+    mb_tcp_client_pending_t *leader = NULL;
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_adu_t follow_resp = {0};
+    int num_follower = 0;
+    int valid = 0;
+    int i = 0;
+
+    leader = &client->pending[handle];
+    for (i = 0; i < client->max_pending; i++)
+    {
+        pending = &client->pending[i];
+        if ((pending->used) && (pending->follow) && (pending->leader == handle) && (!pending->done) && (!pending->detached))
+            client->follower[num_follower++] = i;
+    }
+    /* stop other reads from waiting for this one */
+    leader->cacheable = 0;
+    if (result > 0)
+    {
+        valid = mb_tcp_client_cache_valid(&leader->key, resp);
+        if (valid)
+        {
+            mb_tcp_client_cache_put(client, &leader->key, resp);
+            mb_tcp_client_cache_fill(&entry, &leader->key, resp);
+        }
+    }
+    for (i = 0; i < num_follower; i++)
+    {
+        pending = &client->pending[client->follower[i]];
+        if (result <= 0)
+        {
+            mb_tcp_client_complete(client, client->follower[i], result, NULL);
+        }
+        else if (valid)
+        {
+            result = mb_tcp_client_cache_slice(&entry, &pending->key, pending->trans_id, &follow_resp);
+            mb_tcp_client_complete(client, client->follower[i], result, &follow_resp);
+        }
+        else if (resp->pdu.func_code == (pending->key.func_code | 0x80))
+        {
+            /* pass the exception on */
+            memcpy(&follow_resp, resp, sizeof(mb_tcp_adu_t));
+            follow_resp.trans_id = pending->trans_id;
+            mb_tcp_client_complete(client, client->follower[i], result, &follow_resp);
+        }
+        else
+        {
+            mb_tcp_client_complete(client, client->follower[i], -EBADMSG, NULL);
+        }
+    }
+}
+
+/* returns 1 if a read is answered from the cache or waits for a read in flight */
+int mb_tcp_client_cache_submit(mb_tcp_client_t *client, int handle, mb_tcp_client_cache_key_t *key, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    mb_tcp_client_cache_entry_t *entry = NULL;
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_client_pending_t *leader = NULL;
+    int i = 0;
+
+    pending = &client->pending[handle];
+    entry = mb_tcp_client_cache_find(client, key);
+    if (entry == NULL)
+    {
+        for (i = 0; i < client->max_pending; i++)
+        {
+            leader = &client->pending[i];
+            if ((leader->used) && (leader->cacheable) && (!leader->done) && (!leader->detached) && (mb_tcp_client_cache_covers(&leader->key, key)))
+                break;
+        }
+        if (i == client->max_pending)
+        {
+            return 0;
+        }
+    }
+    memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+    pending->used = 1;
+    pending->index = MB_TCP_CLIENT_NONE;
+    pending->trans_id = req->trans_id;
+    pending->key = *key;
+    pending->func = func;
+    pending->arg = arg;
+    mb_tcp_client_set_deadline(&pending->deadline, timeout != NULL ? timeout : &client->timeout);
+    if (entry != NULL)
+    {
+        client->cache_stats.num_hit++;
+        pending->result = mb_tcp_client_cache_slice(entry, key, req->trans_id, &pending->resp);
+        if (func == NULL)
+        {
+            pending->done = 1;
+            return 1;
+        }
+        pending->ready = 1;
+    }
+    else
+    {
+        client->cache_stats.num_merge++;
+        pending->follow = 1;
+        pending->leader = i;
+    }
+    client->num_pending++;
+    return 1;
+}
@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mb_tcp_client_priv.h"
+#include "mb_log.h"
+
+typedef struct
+{
+    uint16_t file_num;                                  /* file and record of the first record of the run */
+    uint16_t rec_num;
+    size_t num_rec;                                     /* cut short at the end of the input of a write from a file descriptor */
+    int wr;
+    const uint16_t *src;                                /* records to write, NULL when streaming */
+    uint16_t *dst;                                      /* records read, NULL when streaming */
+    int fd;
+    uint16_t fd_rec[MB_PDU_WR_FILE_REC_MAX_REC_LEN];    /* records taken from fd but not sent yet */
+    size_t num_fd_rec;
+}
+mb_tcp_client_file_t;
+
+typedef struct
+{
+    int used;
+    int done;
+    int handle;
+    int wr;
+    ssize_t result;
+    size_t off;                                         /* index in the run of the first record carried */
+    size_t num_rec;
+    int num_sub_req;
+    uint16_t rec_len[MB_PDU_RD_FILE_REC_MAX_NUM_SUB_REQ];
+    uint16_t rec_data[MB_PDU_WR_FILE_REC_MAX_REC_LEN];  /* records read, passed on in order */
+}
+mb_tcp_client_file_slot_t;
+
+/* split the records from index off in the run into the sub-requests of one request, returns the number of records */
+static ssize_t mb_tcp_client_file_plan(mb_tcp_client_file_t *file, size_t off, size_t num_rec, mb_pdu_rd_file_rec_req_sub_req_t *sub_req, int *num_sub_req)
+{
+    size_t budget = 0;
+    size_t over = 0;
+    size_t max_len = 0;
+    size_t max_sub_req = 0;
+    size_t total = 0;
+    size_t pos = 0;
+    size_t num = 0;
+    int i = 0;
+
+    /* a sub-request costs over bytes plus two per record in the request (write) or the response (read) */
+    if (file->wr)
+    {
+        budget = MB_PDU_WR_FILE_REC_MAX_REQ_DATA_LEN;
+        over = 7;
+        max_len = MB_PDU_WR_FILE_REC_MAX_REC_LEN;
+        max_sub_req = MB_PDU_WR_FILE_REC_MAX_NUM_SUB_REQ;
+    }
+    else
+    {
+        budget = MB_PDU_RD_FILE_REC_MAX_RESP_DATA_LEN;
+        over = 2;
+        max_len = MB_PDU_RD_FILE_REC_MAX_NUM_REC_DATA;
+        max_sub_req = MB_PDU_RD_FILE_REC_MAX_NUM_SUB_REQ;
+    }
+    while ((total < num_rec) && (budget >= over + 2) && (i < max_sub_req))
+    {
+        pos = (size_t)file->rec_num + off + total;
+        if ((size_t)file->file_num + pos / MB_TCP_CLIENT_FILE_NUM_REC > 0xffff)
+            return -EINVAL;
+        num = num_rec - total;
+        if (num > MB_TCP_CLIENT_FILE_NUM_REC - pos % MB_TCP_CLIENT_FILE_NUM_REC)
+            num = MB_TCP_CLIENT_FILE_NUM_REC - pos % MB_TCP_CLIENT_FILE_NUM_REC;
+        if (num > (budget - over) / 2)
+            num = (budget - over) / 2;
+        if (num > max_len)
+            num = max_len;
+        sub_req[i].ref_type = MB_PDU_FILE_REC_REF_TYPE;
+        sub_req[i].file_num = file->file_num + pos / MB_TCP_CLIENT_FILE_NUM_REC;
+        sub_req[i].rec_num = pos % MB_TCP_CLIENT_FILE_NUM_REC;
+        sub_req[i].rec_len = num;
+        budget -= over + 2 * num;
+        total += num;
+        i++;
+    }
+    *num_sub_req = i;
+    return total;
+}
+
+/* read up to num_rec records from a file descriptor, returns the number read */
+static ssize_t mb_tcp_client_file_rd_fd(int fd, uint16_t *rec, size_t num_rec)
+{
+    uint8_t buf[2 * MB_PDU_WR_FILE_REC_MAX_REC_LEN] = {0};
+    size_t len = 0;
+    ssize_t num = 0;
+    size_t i = 0;
+
+    while (len < 2 * num_rec)
+    {
+        num = read(fd, buf + len, 2 * num_rec - len);
+        if ((num < 0) && (errno == EINTR))
+            continue;
+        if (num < 0)
+            return -errno;
+        if (num == 0)
+            break;
+        len += num;
+    }
+    for (i = 0; i < (len + 1) / 2; i++)
+        rec[i] = ((uint16_t)buf[2 * i] << 8) | buf[2 * i + 1];  /* the byte after an odd last byte is still 0 */
+    return (len + 1) / 2;
+}
+
+static int mb_tcp_client_file_wr_fd(int fd, const uint16_t *rec, size_t num_rec)
+{
+    uint8_t buf[2 * MB_PDU_WR_FILE_REC_MAX_REC_LEN] = {0};
+    size_t len = 0;
+    ssize_t num = 0;
+    size_t i = 0;
+
+    for (i = 0; i < num_rec; i++)
+    {
+        buf[2 * i] = rec[i] >> 8;
+        buf[2 * i + 1] = rec[i] & 0xff;
+    }
+    while (len < 2 * num_rec)
+    {
+        num = write(fd, buf + len, 2 * num_rec - len);
+        if ((num < 0) && (errno == EINTR))
+            continue;
+        if (num < 0)
+            return -errno;
+        len += num;
+    }
+    return 0;
+}
+
+static void mb_tcp_client_file_done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp, void *arg)
+{
+    mb_tcp_client_file_slot_t *slot = (mb_tcp_client_file_slot_t *)arg;
+    mb_pdu_rd_file_rec_resp_sub_req_t *sub_resp = NULL;
+    unsigned resp_data_len = 0;
+    size_t num = 0;
+    int i = 0;
+
+    slot->done = 1;
+    slot->result = result;
+    if (result <= 0)
+    {
+        return;
+    }
+    if (resp->pdu.func_code & 0x80)
+    {
+        slot->result = -EPROTO;
+        return;
+    }
+    if (resp->pdu.func_code != (slot->wr ? MB_PDU_WR_FILE_REC : MB_PDU_RD_FILE_REC))
+    {
+        slot->result = -EBADMSG;
+        return;
+    }
+    if (slot->wr)
+    {
+        return;
+    }
+    for (i = 0; i < slot->num_sub_req; i++)
+        resp_data_len += 2 + 2 * slot->rec_len[i];
+    if (resp->pdu.rd_file_rec_resp.resp_data_len != resp_data_len)
+    {
+        slot->result = -EBADMSG;
+        return;
+    }
+    for (i = 0; i < slot->num_sub_req; i++)
+    {
+        sub_resp = &resp->pdu.rd_file_rec_resp.sub_req[i];
+        if (sub_resp->file_resp_len != 1 + 2 * slot->rec_len[i])
+        {
+            slot->result = -EBADMSG;
+            return;
+        }
+        memcpy(&slot->rec_data[num], sub_resp->rec_data, 2 * slot->rec_len[i]);
+        num += slot->rec_len[i];
+    }
+}
+
+/* send the request for the records from index off in the run, returns the number of records or 0 at the end of the input */
+static ssize_t mb_tcp_client_file_submit(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, mb_tcp_client_file_t *file, size_t off, mb_tcp_client_file_slot_t *slot, const struct timeval *timeout)
+{
+    mb_pdu_rd_file_rec_req_sub_req_t sub_req[MB_PDU_RD_FILE_REC_MAX_NUM_SUB_REQ] = {{0}};
+    mb_pdu_wr_file_rec_sub_req_t wr_sub_req[MB_PDU_WR_FILE_REC_MAX_NUM_SUB_REQ] = {{0}};
+    const uint16_t *src = NULL;
+    mb_tcp_adu_t req = {0};
+    ssize_t num_rec = 0;
+    ssize_t num = 0;
+    int num_sub_req = 0;
+    int ret = 0;
+    int i = 0;
+
+    num_rec = mb_tcp_client_file_plan(file, off, file->num_rec - off, sub_req, &num_sub_req);
+    if (num_rec < 0)
+    {
+        return num_rec;
+    }
+    if ((file->wr) && (file->src == NULL) && (file->num_fd_rec == 0))
+    {
+        /* kept until the request is sent so that a retry after -EBUSY sends the same records */
+        num = mb_tcp_client_file_rd_fd(file->fd, file->fd_rec, num_rec);
+        if (num < 0)
+        {
+            return num;
+        }
+        if (num < num_rec)
+        {
+            /* the input ended, plan the records that were read */
+            file->num_rec = off + num;
+            if (num == 0)
+                return 0;
+            num_rec = mb_tcp_client_file_plan(file, off, num, sub_req, &num_sub_req);
+        }
+        file->num_fd_rec = num_rec;
+    }
+    if ((file->wr) && (file->src == NULL))
+    {
+        src = file->fd_rec;
+    }
+    else if (file->wr)
+    {
+        src = file->src + off;
+    }
+    mb_tcp_adu_set_header(&req, 0, 0, unit_id);
+    if (file->wr)
+    {
+        for (i = 0; i < num_sub_req; i++)
+        {
+            wr_sub_req[i].ref_type = sub_req[i].ref_type;
+            wr_sub_req[i].file_num = sub_req[i].file_num;
+            wr_sub_req[i].rec_num = sub_req[i].rec_num;
+            wr_sub_req[i].rec_len = sub_req[i].rec_len;
+            memcpy(wr_sub_req[i].rec_data, src, 2 * sub_req[i].rec_len);
+            src += sub_req[i].rec_len;
+        }
+        ret = mb_pdu_set_wr_file_rec_req(&req.pdu, wr_sub_req, num_sub_req);
+    }
+    else
+    {
+        ret = mb_pdu_set_rd_file_rec_req(&req.pdu, sub_req, num_sub_req);
+    }
+    if (ret < 0)
+    {
+        return -EINVAL;
+    }
+    memset(slot, 0, sizeof(mb_tcp_client_file_slot_t));
+    slot->wr = file->wr;
+    slot->off = off;
+    slot->num_rec = num_rec;
+    slot->num_sub_req = num_sub_req;
+    for (i = 0; i < num_sub_req; i++)
+        slot->rec_len[i] = sub_req[i].rec_len;
+    ret = mb_tcp_client_submit_endpoint(client, endpoint, &req, timeout, mb_tcp_client_file_done, slot);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    file->num_fd_rec = 0;
+    slot->used = 1;
+    slot->handle = ret;
+    return num_rec;
+}
+
+static void mb_tcp_client_file_cancel(mb_tcp_client_t *client, mb_tcp_client_file_slot_t *slot)
+{
+    int i = 0;
+
+    for (i = 0; i < MB_TCP_CLIENT_FILE_WINDOW; i++)
+    {
+        if ((slot[i].used) && (!slot[i].done))
+            mb_tcp_client_cancel(client, slot[i].handle);
+    }
+}
+
+/* keep a window of requests in flight and pass the records on in order */
+static ssize_t mb_tcp_client_file_run(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, mb_tcp_client_file_t *file, const struct timeval *timeout)
+{
+    mb_tcp_client_file_slot_t slot[MB_TCP_CLIENT_FILE_WINDOW] = {{0}};
+    mb_tcp_client_file_slot_t *head = NULL;
+    ssize_t num = 0;
+    size_t next = 0;
+    size_t done = 0;
+    int num_used = 0;
+    int first = 0;
+    int ret = 0;
+
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint)
+     || (file->file_num < MB_PDU_FILE_REC_MIN_FILE_NUM) || (file->rec_num >= MB_TCP_CLIENT_FILE_NUM_REC))
+    {
+        return -EINVAL;
+    }
+    while (done < file->num_rec)
+    {
+        while ((num_used < MB_TCP_CLIENT_FILE_WINDOW) && (next < file->num_rec))
+        {
+            num = mb_tcp_client_file_submit(client, endpoint, unit_id, file, next, &slot[(first + num_used) % MB_TCP_CLIENT_FILE_WINDOW], timeout);
+            if ((num == -EBUSY) && ((num_used > 0) || (client->num_pending > 0)))
+                break;  /* wait for a request to complete */
+            if (num < 0)
+            {
+                mb_tcp_client_file_cancel(client, slot);
+                return num;
+            }
+            if (num == 0)
+                break;  /* end of the input */
+            next += num;
+            num_used++;
+        }
+        if ((num_used == 0) && (next >= file->num_rec))
+        {
+            break;
+        }
+        head = &slot[first];
+        if ((num_used == 0) || (!head->done))
+        {
+            /* requests of other callers may have no deadline the client knows of */
+            ret = mb_tcp_client_poll(client, timeout != NULL ? timeout : &client->timeout);
+            if (ret < 0)
+            {
+                mb_tcp_client_file_cancel(client, slot);
+                return ret;
+            }
+            continue;
+        }
+        if (head->result < 0)
+        {
+            mb_tcp_client_file_cancel(client, slot);
+            return head->result;
+        }
+        if ((!file->wr) && (file->dst != NULL))
+        {
+            memcpy(file->dst + head->off, head->rec_data, 2 * head->num_rec);
+        }
+        else if (!file->wr)
+        {
+            ret = mb_tcp_client_file_wr_fd(file->fd, head->rec_data, head->num_rec);
+            if (ret < 0)
+            {
+                mb_tcp_client_file_cancel(client, slot);
+                return ret;
+            }
+        }
+        done += head->num_rec;
+        memset(head, 0, sizeof(mb_tcp_client_file_slot_t));
+        first = (first + 1) % MB_TCP_CLIENT_FILE_WINDOW;
+        num_used--;
+    }
+    return done;
+}
+
+ssize_t mb_tcp_client_read_file(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, uint16_t *rec, size_t num_rec, const struct timeval *timeout)
+{
+    mb_tcp_client_file_t file = {0};
+
+    file.file_num = file_num;
+    file.rec_num = rec_num;
+    file.num_rec = num_rec;
+    file.dst = rec;
+    return mb_tcp_client_file_run(client, endpoint, unit_id, &file, timeout);
+}
+
+ssize_t mb_tcp_client_write_file(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, const uint16_t *rec, size_t num_rec, const struct timeval *timeout)
+{
+    mb_tcp_client_file_t file = {0};
+
+    file.file_num = file_num;
+    file.rec_num = rec_num;
+    file.num_rec = num_rec;
+    file.wr = 1;
+    file.src = rec;
+    return mb_tcp_client_file_run(client, endpoint, unit_id, &file, timeout);
+}
+
+ssize_t mb_tcp_client_read_file_fd(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, int fd, size_t num_rec, const struct timeval *timeout)
+{
+    mb_tcp_client_file_t file = {0};
+
+    file.file_num = file_num;
+    file.rec_num = rec_num;
+    file.num_rec = num_rec;
+    file.fd = fd;
+    return mb_tcp_client_file_run(client, endpoint, unit_id, &file, timeout);
+}
+
+ssize_t mb_tcp_client_write_file_fd(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint16_t file_num, uint16_t rec_num, int fd, size_t max_rec, const struct timeval *timeout)
+{
+    mb_tcp_client_file_t file = {0};
+
+    file.file_num = file_num;
+    file.rec_num = rec_num;
+    file.num_rec = max_rec;
+    file.wr = 1;
+    file.fd = fd;
+    return mb_tcp_client_file_run(client, endpoint, unit_id, &file, timeout);
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "mb_tcp_client_priv.h"
+#include "mb_log.h"
+
+static long mb_tcp_client_elapsed_usec(const struct timespec *start)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static int mb_tcp_client_long_cmp(const void *a, const void *b)
+{
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* record a round trip time and work out the hedge delay of the endpoint */
+static void mb_tcp_client_hedge_rtt(mb_tcp_client_hedge_t *hedge, int which, long rtt)
+{
+    long sorted[MB_TCP_CLIENT_HEDGE_SAMPLES] = {0};
+    unsigned num = 0;
+
+    hedge->rtt_usec[which][hedge->next_rtt[which]] = rtt;
+    hedge->next_rtt[which] = (hedge->next_rtt[which] + 1) % MB_TCP_CLIENT_HEDGE_SAMPLES;
+    if (hedge->num_rtt[which] < MB_TCP_CLIENT_HEDGE_SAMPLES)
+        hedge->num_rtt[which]++;
+    num = hedge->num_rtt[which];
+    if (num < MB_TCP_CLIENT_HEDGE_MIN_SAMPLES)
+    {
+        return;
+    }
+    memcpy(sorted, hedge->rtt_usec[which], num * sizeof(long));
+    qsort(sorted, num, sizeof(long), mb_tcp_client_long_cmp);
+    hedge->delay_usec[which] = sorted[(num - 1) * hedge->percentile / 100];
+    if (hedge->delay_usec[which] < MB_TCP_CLIENT_HEDGE_MIN_USEC)
+        hedge->delay_usec[which] = MB_TCP_CLIENT_HEDGE_MIN_USEC;
+}
+
+/* count a request the active endpoint did not answer first and fail over if there have been too many in a row */
+static void mb_tcp_client_hedge_fail(mb_tcp_client_hedge_t *hedge, int group)
+{
+    hedge->num_fail_run++;
+    if ((hedge->fail_over > 0) && (hedge->num_fail_run >= hedge->fail_over))
+    {
+        mb_log_notice("endpoint group %d failing over to endpoint %d", group, hedge->endpoint[!hedge->active]);
+        hedge->active = !hedge->active;
+        hedge->num_fail_run = 0;
+        hedge->num_fail_over++;
+    }
+}
+
+/* returns the request to complete or MB_TCP_CLIENT_NONE while the other copy is still in flight */
+int mb_tcp_client_hedge_done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_client_hedge_t *hedge = NULL;
+    int primary = 0;
+    int copy = 0;
+    int peer = 0;
+
+    pending = &client->pending[handle];
+    hedge = &client->hedge[pending->hedge];
+    primary = pending->dup ? pending->peer : handle;
+    peer = pending->peer;
+    if ((result < 0) && (peer != MB_TCP_CLIENT_NONE) && (!client->pending[peer].detached))
+    {
+        mb_tcp_client_release(client, handle);
+        return MB_TCP_CLIENT_NONE;
+    }
+    if (result > 0)
+    {
+        mb_tcp_client_hedge_rtt(hedge, pending->which, mb_tcp_client_elapsed_usec(&pending->sent));
+    }
+    if ((pending->which == hedge->active) && (result > 0))
+    {
+        hedge->num_fail_run = 0;
+    }
+    else if (pending->which == hedge->active)
+    {
+        mb_tcp_client_hedge_fail(hedge, pending->hedge);
+    }
+    else if (peer != MB_TCP_CLIENT_NONE)
+    {
+        /* the active endpoint was beaten, count what it has taken so far as a sample */
+        if (result > 0)
+            hedge->num_win++;
+        mb_tcp_client_hedge_rtt(hedge, client->pending[primary].which, mb_tcp_client_elapsed_usec(&client->pending[primary].sent));
+        mb_tcp_client_hedge_fail(hedge, pending->hedge);
+    }
+    if (peer != MB_TCP_CLIENT_NONE)
+    {
+        /* the copy that lost is still in flight, its response is dropped when it arrives */
+        copy = pending->dup ? handle : peer;
+        if (pending->dup)
+            mb_tcp_client_release(client, handle);
+        if (!client->pending[peer].detached)
+            mb_tcp_client_discard(client, peer, copy);
+        else
+            memset(&client->pending[copy], 0, sizeof(mb_tcp_client_pending_t));
+        client->pending[primary].peer = MB_TCP_CLIENT_NONE;
+    }
+    if (resp != NULL)
+    {
+        resp->trans_id = client->pending[primary].trans_id;  /* the copy had its own */
+    }
+    return primary;
+}
+
+int mb_tcp_client_add_hedge(mb_tcp_client_t *client, int primary, int secondary, unsigned percentile, unsigned fail_over)
+{
+    mb_tcp_client_hedge_t *hedge = NULL;
+
+    if ((primary < 0) || (primary >= client->num_endpoint)
+     || (secondary < 0) || (secondary >= client->num_endpoint)
+     || (primary == secondary)
+     || (percentile == 0) || (percentile > 100))
+    {
+        return -EINVAL;
+    }
+    if (client->num_hedge == MB_TCP_CLIENT_MAX_HEDGE)
+    {
+        return -ENOSPC;
+    }
+    hedge = &client->hedge[client->num_hedge];
+    memset(hedge, 0, sizeof(mb_tcp_client_hedge_t));
+    hedge->endpoint[0] = primary;
+    hedge->endpoint[1] = secondary;
+    hedge->percentile = percentile;
+    hedge->fail_over = fail_over;
+    return client->num_hedge++;
+}
+
+int mb_tcp_client_submit_hedge(mb_tcp_client_t *client, int group, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_client_hedge_t *hedge = NULL;
+    mb_tcp_adu_prep_t prep = {{0}};
+    long delay = 0;
+    int handle = 0;
+    int which = 0;
+    int ret = 0;
+
+    if ((group < 0) || (group >= client->num_hedge))
+    {
+        return -EINVAL;
+    }
+    hedge = &client->hedge[group];
+    if (client->num_wr > 0)
+    {
+        /* either endpoint may carry the request */
+        ret = mb_tcp_client_wr_flush_addr(client, &client->endpoint[hedge->endpoint[0]].sin);
+        if (ret == 0)
+            ret = mb_tcp_client_wr_flush_addr(client, &client->endpoint[hedge->endpoint[1]].sin);
+        if (ret < 0)
+            return ret;
+    }
+    handle = mb_tcp_client_alloc_pending(client);
+    if (handle < 0)
+    {
+        return handle;
+    }
+    req->trans_id = mb_tcp_client_trans_id(client, handle);
+    ret = mb_tcp_adu_prepare(&prep, req);
+    if (ret < 0)
+    {
+        return -EBADMSG;  /* convert modbus error to errno value */
+    }
+    which = hedge->active;
+    ret = mb_tcp_client_send_pending(client, &client->endpoint[hedge->endpoint[which]].sin, handle, req->trans_id, prep.buf, prep.len, req, NULL, timeout, func, arg);
+    if ((ret < 0) && (ret != -EBUSY))
+    {
+        /* try the other endpoint straight away */
+        mb_log_warn("endpoint group %d: %s", group, strerror(-ret));
+        mb_tcp_client_hedge_fail(hedge, group);
+        which = !which;
+        ret = mb_tcp_client_send_pending(client, &client->endpoint[hedge->endpoint[which]].sin, handle, req->trans_id, prep.buf, prep.len, req, NULL, timeout, func, arg);
+    }
+    if (ret < 0)
+    {
+        return ret;
+    }
+    pending = &client->pending[handle];
+    memcpy(&pending->hedge_prep, &prep, sizeof(mb_tcp_adu_prep_t));
+    pending->prep = &pending->hedge_prep;
+    pending->hedged = 1;
+    pending->hedge = group;
+    pending->which = which;
+    pending->peer = MB_TCP_CLIENT_NONE;
+    clock_gettime(CLOCK_MONOTONIC, &pending->sent);
+    /* only reads are sent twice */
+    delay = hedge->delay_usec[which];
+    if ((req->pdu.func_code >= MB_PDU_RD_COILS) && (req->pdu.func_code <= MB_PDU_RD_IP_REGS) && (delay > 0))
+    {
+        pending->hedge_at.tv_sec = pending->sent.tv_sec + delay / 1000000;
+        pending->hedge_at.tv_nsec = pending->sent.tv_nsec + (delay % 1000000) * 1000;
+        if (pending->hedge_at.tv_nsec >= 1000000000)
+        {
+            pending->hedge_at.tv_sec++;
+            pending->hedge_at.tv_nsec -= 1000000000;
+        }
+    }
+    return handle;
+}
+
+void mb_tcp_client_get_hedge(mb_tcp_client_t *client, int group, mb_tcp_client_hedge_t *hedge)
+{
+    memcpy(hedge, &client->hedge[group], sizeof(mb_tcp_client_hedge_t));
+}
+
+/* send a copy of each hedged read that has waited longer than the hedge delay to the other endpoint */
+void mb_tcp_client_hedge_send(mb_tcp_client_t *client)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_client_hedge_t *hedge = NULL;
+    mb_tcp_client_pending_t *dup = NULL;
+    struct timespec now = {0};
+    uint16_t trans_id = 0;
+    int handle = 0;
+    int ret = 0;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < client->max_pending; i++)
+    {
+        pending = &client->pending[i];
+        if ((!pending->used) || (pending->done) || (pending->detached)
+         || (pending->hedge_at.tv_sec == 0) || (mb_tcp_client_timespec_cmp(&pending->hedge_at, &now) > 0))
+            continue;
+        memset(&pending->hedge_at, 0, sizeof(struct timespec));
+        hedge = &client->hedge[pending->hedge];
+        handle = mb_tcp_client_alloc_pending(client);
+        if (handle < 0)
+        {
+            mb_log_debug("no room to hedge request %d", i);
+            continue;
+        }
+        trans_id = mb_tcp_client_trans_id(client, handle);
+        mb_tcp_adu_prep_set_trans_id(&pending->hedge_prep, trans_id);
+        ret = mb_tcp_client_send_pending(client, &client->endpoint[hedge->endpoint[!pending->which]].sin, handle, trans_id, pending->hedge_prep.buf, pending->hedge_prep.len, NULL, &pending->hedge_prep, NULL, NULL, NULL);
+        if (ret < 0)
+        {
+            mb_log_debug("hedge request %d: %s", i, strerror(-ret));
+            continue;
+        }
+        dup = &client->pending[handle];
+        dup->deadline = pending->deadline;
+        dup->sent = now;
+        dup->hedged = 1;
+        dup->hedge = pending->hedge;
+        dup->which = !pending->which;
+        dup->dup = 1;
+        dup->peer = i;
+        pending->peer = handle;
+        hedge->num_hedge++;
+    }
+}
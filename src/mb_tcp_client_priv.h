@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MB_TCP_CLIENT_PRIV_H
+#define MB_TCP_CLIENT_PRIV_H
+
+#include "mb_tcp_client.h"
+
+/* mb_tcp_client.c */
+void mb_tcp_client_set_deadline(struct timespec *deadline, const struct timeval *timeout);
+int mb_tcp_client_timespec_cmp(const struct timespec *a, const struct timespec *b);
+int mb_tcp_client_addr_eq(struct sockaddr_in *a, struct sockaddr_in *b);
+int mb_tcp_client_find_con(mb_tcp_client_t *client, struct sockaddr_in *sin);
+void mb_tcp_client_con_close(mb_tcp_client_t *client, int index);
+int mb_tcp_client_start_addr(mb_tcp_client_t *client, struct sockaddr_in *sin);
+void mb_tcp_client_release(mb_tcp_client_t *client, int handle);
+void mb_tcp_client_abandon(mb_tcp_client_t *client, int handle);
+void mb_tcp_client_discard(mb_tcp_client_t *client, int handle, int holder);
+/* complete a request, resp is NULL if the request failed */
+void mb_tcp_client_complete(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp);
+int mb_tcp_client_alloc_pending(mb_tcp_client_t *client);
+uint16_t mb_tcp_client_trans_id(mb_tcp_client_t *client, int handle);
+int mb_tcp_client_send_pending(mb_tcp_client_t *client, struct sockaddr_in *sin, int handle, uint16_t trans_id, char *buf, ssize_t num, mb_tcp_adu_t *req, const mb_tcp_adu_prep_t *prep, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg);
+int mb_tcp_client_num_free_pending(mb_tcp_client_t *client);
+
+/* mb_tcp_client_cache.c */
+int mb_tcp_client_cache_key(struct sockaddr_in *sin, mb_tcp_adu_t *req, mb_tcp_client_cache_key_t *key);
+ssize_t mb_tcp_client_cache_slice(mb_tcp_client_cache_entry_t *entry, mb_tcp_client_cache_key_t *key, uint16_t trans_id, mb_tcp_adu_t *resp);
+mb_tcp_client_cache_entry_t *mb_tcp_client_cache_find(mb_tcp_client_t *client, mb_tcp_client_cache_key_t *key);
+void mb_tcp_client_cache_put(mb_tcp_client_t *client, mb_tcp_client_cache_key_t *key, mb_tcp_adu_t *resp);
+void mb_tcp_client_cache_invalidate(mb_tcp_client_t *client, struct sockaddr_in *sin, mb_tcp_adu_t *req);
+void mb_tcp_client_follow_done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp);
+int mb_tcp_client_cache_submit(mb_tcp_client_t *client, int handle, mb_tcp_client_cache_key_t *key, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg);
+
+/* mb_tcp_client_hedge.c */
+int mb_tcp_client_hedge_done(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp);
+void mb_tcp_client_hedge_send(mb_tcp_client_t *client);
+
+/* mb_tcp_client_wr.c */
+void mb_tcp_client_wr_call(mb_tcp_client_t *client, mb_tcp_client_wr_t *wr, int num_wr, ssize_t result, mb_tcp_adu_t *resp);
+int mb_tcp_client_wr_done(mb_tcp_client_t *client, int handle, ssize_t *result, mb_tcp_adu_t *resp);
+int mb_tcp_client_wr_flush_addr(mb_tcp_client_t *client, struct sockaddr_in *sin);
+int mb_tcp_client_wr_flush_due(mb_tcp_client_t *client);
+int mb_tcp_client_wr_combine(mb_tcp_client_t *client, struct sockaddr_in *sin, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg, int *handle);
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "mb_tcp_client_priv.h"
+#include "mb_log.h"
+
+int mb_tcp_client_set_rd_ranges(mb_tcp_client_t *client, int endpoint, int support)
+{
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint))
+    {
+        return -EINVAL;
+    }
+    client->endpoint[endpoint].rd_ranges = support > 0 ? 1 : support < 0 ? -1 : 0;
+    client->endpoint[endpoint].num_probe_timeout = 0;
+    memset(&client->endpoint[endpoint].next_probe, 0, sizeof(struct timespec));
+    return 0;
+}
+
+/* send a read multiple ranges request with no ranges to find out if an endpoint supports it */
+static void mb_tcp_client_probe_rd_ranges(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, const struct timeval *timeout)
+{
+    mb_tcp_client_endpoint_t *ep = NULL;
+    mb_tcp_client_item_t item = {0};
+    struct timeval backoff = {0};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    int index = 0;
+    int ret = 0;
+
+    ep = &client->endpoint[endpoint];
+    mb_tcp_adu_set_header(&req, 0, 0, unit_id);
+    mb_pdu_set_rd_mult_ranges_req(&req.pdu, NULL, 0);
+    item.endpoint = endpoint;
+    item.req = &req;
+    item.resp = &resp;
+    ret = mb_tcp_client_exchange_batch(client, &item, 1, timeout);
+    if (item.result == -ETIMEDOUT)
+    {
+        /* the server may drop function codes it does not know or just be slow, do not wait for it every time */
+        backoff.tv_sec = MB_TCP_CLIENT_PROBE_MAX_SEC;
+        if (ep->num_probe_timeout < 16)
+            backoff.tv_sec = (long)MB_TCP_CLIENT_PROBE_MIN_SEC << ep->num_probe_timeout;
+        if (backoff.tv_sec > MB_TCP_CLIENT_PROBE_MAX_SEC)
+            backoff.tv_sec = MB_TCP_CLIENT_PROBE_MAX_SEC;
+        ep->num_probe_timeout++;
+        mb_tcp_client_set_deadline(&ep->next_probe, &backoff);
+        mb_log_info("endpoint %d did not answer a read multiple ranges request, probing again in %ld seconds", endpoint, (long)backoff.tv_sec);
+        return;
+    }
+    if (ret <= 0)
+    {
+        return;  /* try again next time */
+    }
+    ep->num_probe_timeout = 0;
+    if (resp.pdu.func_code == MB_PDU_RD_MULT_RANGES)
+    {
+        ep->rd_ranges = 1;
+    }
+    else if ((resp.pdu.func_code == (MB_PDU_RD_MULT_RANGES | 0x80))
+          && (resp.pdu.err.except_code == MB_PDU_EXCEPT_ILLEGAL_FUNC))
+    {
+        ep->rd_ranges = -1;
+        /* a server may close the connection after an exception, start afresh rather than lose the next request */
+        index = mb_tcp_client_find_con(client, &ep->sin);
+        if ((index >= 0) && (client->state[index].num_pending == 0))
+            mb_tcp_client_con_close(client, index);
+    }
+    mb_log_info("endpoint %d read multiple ranges support: %d", endpoint, ep->rd_ranges);
+}
+
+/* returns the number of ranges carried by the request that starts at range[first] */
+static int mb_tcp_client_plan_ranges(mb_tcp_client_range_t *range, int num_range, int first, int packed)
+{
+    mb_pdu_rd_mult_ranges_sub_req_t sub_req = {0};
+    size_t byte_count = 0;
+    size_t val_len = 0;
+    int i = 0;
+
+    if (!packed)
+    {
+        return 1;
+    }
+    for (i = first; (i < num_range) && (i - first < MB_PDU_RD_MULT_RANGES_MAX_NUM_SUB_REQ); i++)
+    {
+        sub_req.func_code = range[i].func_code;
+        sub_req.start_addr = range[i].start_addr;
+        sub_req.quant = range[i].quant;
+        val_len = mb_pdu_rd_mult_ranges_val_len(&sub_req);
+        if ((val_len == 0) || (byte_count + val_len > MB_PDU_RD_MULT_RANGES_MAX_BYTE_COUNT))
+            break;
+        byte_count += val_len;
+    }
+    return i > first ? i - first : 1;
+}
+
+static int mb_tcp_client_set_range_req(mb_tcp_adu_t *req, uint8_t unit_id, mb_tcp_client_range_t *range, int num, int packed)
+{
+    mb_pdu_rd_mult_ranges_sub_req_t sub_req[MB_PDU_RD_MULT_RANGES_MAX_NUM_SUB_REQ] = {{0}};
+    int i = 0;
+
+    mb_tcp_adu_set_header(req, 0, 0, unit_id);
+    if (packed)
+    {
+        for (i = 0; i < num; i++)
+        {
+            sub_req[i].func_code = range[i].func_code;
+            sub_req[i].start_addr = range[i].start_addr;
+            sub_req[i].quant = range[i].quant;
+        }
+        return mb_pdu_set_rd_mult_ranges_req(&req->pdu, sub_req, num);
+    }
+    switch (range->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        return mb_pdu_set_rd_coils_req(&req->pdu, range->start_addr, range->quant);
+    case MB_PDU_RD_DISC_IPS:
+        return mb_pdu_set_rd_disc_ips_req(&req->pdu, range->start_addr, range->quant);
+    case MB_PDU_RD_HOLD_REGS:
+        return mb_pdu_set_rd_hold_regs_req(&req->pdu, range->start_addr, range->quant);
+    case MB_PDU_RD_IP_REGS:
+        return mb_pdu_set_rd_ip_regs_req(&req->pdu, range->start_addr, range->quant);
+    }
+    return -MB_PDU_EXCEPT_ILLEGAL_FUNC;
+}
+
+/* copy the values of the range read by a function code 1 to 4 request */
+static ssize_t mb_tcp_client_get_range_val(mb_tcp_client_range_t *range, mb_pdu_t *resp)
+{
+    const uint8_t *bits = NULL;
+    const uint16_t *regs = NULL;
+    size_t byte_count = 0;
+    int i = 0;
+
+    switch (range->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        bits = resp->rd_coils_resp.coil_stat;
+        byte_count = (range->quant + 7) >> 3;
+        break;
+    case MB_PDU_RD_DISC_IPS:
+        bits = resp->rd_disc_ips_resp.ip_stat;
+        byte_count = (range->quant + 7) >> 3;
+        break;
+    case MB_PDU_RD_HOLD_REGS:
+        regs = resp->rd_hold_regs_resp.reg_val;
+        byte_count = 2 * range->quant;
+        break;
+    case MB_PDU_RD_IP_REGS:
+        regs = resp->rd_ip_regs_resp.ip_reg;
+        byte_count = 2 * range->quant;
+        break;
+    }
+    /* the byte count is at the same place in every read response */
+    if (resp->rd_coils_resp.byte_count != byte_count)
+    {
+        return -EBADMSG;
+    }
+    for (i = 0; i < range->quant; i++)
+    {
+        if (bits != NULL)
+            range->val[i] = (bits[i >> 3] >> (i & 0x07)) & 0x01;
+        else
+            range->val[i] = regs[i];
+    }
+    return range->quant;
+}
+
+/* send the ranges in as few requests as possible and copy out the values */
+static int mb_tcp_client_exchange_ranges(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, mb_tcp_client_range_t *range, int num_range, const struct timeval *timeout,
+                                         int packed, mb_tcp_client_item_t *item, int *first, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_range_t *r = NULL;
+    ssize_t result = 0;
+    int num_req = 0;
+    int ret = 0;
+    int num = 0;
+    int i = 0;
+    int j = 0;
+
+    /* ranges that are not valid are left out of the requests */
+    for (i = 0, j = 0; i < num_range; j++)
+    {
+        for (; (i < num_range) && (range[i].result == -EINVAL); i++)
+            ;
+        if (i == num_range)
+            break;
+        num = mb_tcp_client_plan_ranges(range, num_range, i, packed);
+        ret = mb_tcp_client_set_range_req(&req[j], unit_id, &range[i], num, packed);
+        if (ret < 0)
+        {
+            return -EINVAL;
+        }
+        first[j] = i;
+        item[j].endpoint = endpoint;
+        item[j].req = &req[j];
+        item[j].resp = &resp[j];
+        i += num;
+    }
+    num_req = j;
+    ret = mb_tcp_client_exchange_batch(client, item, num_req, timeout);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = 0;
+    for (j = 0; j < num_req; j++)
+    {
+        num = (j + 1 < num_req) ? first[j + 1] - first[j] : num_range - first[j];
+        for (i = 0; i < num; i++)
+        {
+            r = &range[first[j] + i];
+            if (r->result == -EINVAL)
+                continue;
+            result = item[j].result;
+            if ((result > 0) && (resp[j].pdu.func_code & 0x80))
+            {
+                r->except_code = resp[j].pdu.err.except_code;
+                result = -EPROTO;
+            }
+            else if ((result > 0) && (packed))
+            {
+                result = mb_pdu_get_rd_mult_ranges_val(&req[j].pdu, &resp[j].pdu, i, r->val);
+                if (result < 0)
+                    result = -EBADMSG;
+            }
+            else if (result > 0)
+            {
+                result = mb_tcp_client_get_range_val(r, &resp[j].pdu);
+            }
+            r->result = result;
+            if (result > 0)
+                ret++;
+        }
+    }
+    return ret;
+}
+
+int mb_tcp_client_read_ranges(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, mb_tcp_client_range_t *range, int num_range, const struct timeval *timeout)
+{
+    struct timespec now = {0};
+    mb_pdu_rd_mult_ranges_sub_req_t sub_req = {0};
+    mb_tcp_client_item_t *item = NULL;
+    mb_tcp_adu_t *resp = NULL;
+    mb_tcp_adu_t *req = NULL;
+    int *first = NULL;
+    int ret = 0;
+    int i = 0;
+
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint) || (num_range <= 0))
+    {
+        return -EINVAL;
+    }
+    for (i = 0; i < num_range; i++)
+    {
+        sub_req.func_code = range[i].func_code;
+        sub_req.start_addr = range[i].start_addr;
+        sub_req.quant = range[i].quant;
+        range[i].result = mb_pdu_rd_mult_ranges_val_len(&sub_req) > 0 ? -EINPROGRESS : -EINVAL;
+        range[i].except_code = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((client->endpoint[endpoint].rd_ranges == 0) && (mb_tcp_client_timespec_cmp(&client->endpoint[endpoint].next_probe, &now) <= 0))
+    {
+        mb_tcp_client_probe_rd_ranges(client, endpoint, unit_id, timeout);
+    }
+    /* at worst there is one request per range */
+    item = calloc(num_range, sizeof(mb_tcp_client_item_t));
+    first = calloc(num_range, sizeof(int));
+    req = calloc(num_range, sizeof(mb_tcp_adu_t));
+    resp = calloc(num_range, sizeof(mb_tcp_adu_t));
+    if ((item != NULL) && (first != NULL) && (req != NULL) && (resp != NULL))
+        ret = mb_tcp_client_exchange_ranges(client, endpoint, unit_id, range, num_range, timeout,
+                                            client->endpoint[endpoint].rd_ranges > 0, item, first, req, resp);
+    else
+        ret = -ENOMEM;
+    free(resp);
+    free(req);
+    free(first);
+    free(item);
+    return ret;
+}
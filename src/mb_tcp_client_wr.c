@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "mb_tcp_client_priv.h"
+#include "mb_log.h"
+
+void mb_tcp_client_wr_call(mb_tcp_client_t *client, mb_tcp_client_wr_t *wr, int num_wr, ssize_t result, mb_tcp_adu_t *resp)
+{
+    int i = 0;
+
+    for (i = 0; i < num_wr; i++)
+    {
+        if (wr[i].func != NULL)
+            wr[i].func(client, result, resp, wr[i].arg);
+    }
+}
+
+/* complete the queued writes carried by a request, returns 1 if the request is also a read to be completed */
+int mb_tcp_client_wr_done(mb_tcp_client_t *client, int handle, ssize_t *result, mb_tcp_adu_t *resp)
+{
+    mb_tcp_client_pending_t *pending = NULL;
+    mb_tcp_client_wr_t *wr = NULL;
+    uint16_t reg[MB_PDU_RD_WR_MULT_REGS_MAX_QUANT_RD] = {0};
+    uint8_t byte_count = 0;
+    int num_wr = 0;
+    int rd_wr = 0;
+
+    pending = &client->pending[handle];
+    wr = pending->wr;
+    num_wr = pending->num_wr;
+    rd_wr = pending->rd_wr;
+    pending->wr = NULL;
+    pending->num_wr = 0;
+    if (!rd_wr)
+    {
+        /* free the slot before calling back so that the functions can submit other requests */
+        mb_tcp_client_release(client, handle);
+        memset(pending, 0, sizeof(mb_tcp_client_pending_t));
+    }
+    mb_tcp_client_wr_call(client, wr, num_wr, *result, resp);
+    free(wr);
+    if (!rd_wr)
+    {
+        return 0;
+    }
+    /* pass the response on as the response to the read */
+    if ((resp != NULL) && (resp->pdu.func_code == MB_PDU_RD_WR_MULT_REGS))
+    {
+        byte_count = resp->pdu.rd_wr_mult_regs_resp.byte_count;
+        memcpy(reg, resp->pdu.rd_wr_mult_regs_resp.rd_reg_val, sizeof(reg));
+        if (mb_pdu_set_rd_hold_regs_resp(&resp->pdu, byte_count, reg) < 0)
+        {
+            *result = -EBADMSG;
+        }
+    }
+    else if ((resp != NULL) && (resp->pdu.func_code == (MB_PDU_RD_WR_MULT_REGS | 0x80)))
+    {
+        resp->pdu.func_code = MB_PDU_RD_HOLD_REGS | 0x80;
+    }
+    return 1;
+}
+
+/* select the writes sent along with a queued write, those to the same server up to the first write to another unit or table */
+static int mb_tcp_client_wr_select(mb_tcp_client_t *client, int first, int *sel)
+{
+    mb_tcp_client_wr_t *wr = NULL;
+    int num = 0;
+    int i = 0;
+
+    for (i = first; i < client->num_wr; i++)
+    {
+        wr = &client->wr[i];
+        if (!mb_tcp_client_addr_eq(&wr->sin, &client->wr[first].sin))
+            continue;
+        if ((wr->unit_id != client->wr[first].unit_id) || (wr->func_code != client->wr[first].func_code))
+            break;
+        sel[num++] = i;
+    }
+    return num;
+}
+
+/* take selected writes off the queue, sel is in ascending order */
+static void mb_tcp_client_wr_remove(mb_tcp_client_t *client, const int *sel, int num_sel)
+{
+    int num = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < client->num_wr; i++)
+    {
+        if ((j < num_sel) && (sel[j] == i))
+        {
+            j++;
+            continue;
+        }
+        client->wr[num++] = client->wr[i];
+    }
+    client->num_wr = num;
+}
+
+/* keep the last value written to each address, returns the number of addresses in ascending order */
+static int mb_tcp_client_wr_collapse(const mb_tcp_client_wr_t *wr, int num_wr, uint16_t *addr, uint16_t *val)
+{
+    int num = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < num_wr; i++)
+    {
+        for (j = num; (j > 0) && (addr[j - 1] > wr[i].addr); j--)
+            ;
+        if ((j > 0) && (addr[j - 1] == wr[i].addr))
+        {
+            val[j - 1] = wr[i].val;
+            continue;
+        }
+        memmove(&addr[j + 1], &addr[j], (num - j) * sizeof(uint16_t));
+        memmove(&val[j + 1], &val[j], (num - j) * sizeof(uint16_t));
+        addr[j] = wr[i].addr;
+        val[j] = wr[i].val;
+        num++;
+    }
+    return num;
+}
+
+/* returns the end of the run of consecutive addresses that starts at start */
+static int mb_tcp_client_wr_run(const uint16_t *addr, int num_addr, int start, int max_quant)
+{
+    int i = 0;
+
+    for (i = start + 1; (i < num_addr) && (addr[i] == addr[i - 1] + 1) && (i - start < max_quant); i++)
+        ;
+    return i;
+}
+
+/* send the values for a run of consecutive addresses in one request */
+static void mb_tcp_client_wr_send(mb_tcp_client_t *client, mb_tcp_client_wr_t *batch, int num_batch, const uint16_t *addr, const uint16_t *val, int num_addr)
+{
+    mb_tcp_client_wr_t run[MB_TCP_CLIENT_MAX_WR] = {{{0}}};
+    uint8_t bit[MB_PDU_WR_MULT_COILS_MAX_BYTE_COUNT] = {0};
+    mb_tcp_client_wr_t *wr = NULL;
+    mb_tcp_adu_t req = {0};
+    uint16_t trans_id = 0;
+    ssize_t num = 0;
+    char buf[MB_TCP_ADU_MAX_LEN] = {0};
+    int num_wr = 0;
+    int handle = 0;
+    int ret = 0;
+    int i = 0;
+
+    for (i = 0; i < num_batch; i++)
+    {
+        if ((batch[i].addr >= addr[0]) && (batch[i].addr <= addr[num_addr - 1]))
+            run[num_wr++] = batch[i];
+    }
+    handle = mb_tcp_client_alloc_pending(client);
+    if (handle < 0)
+    {
+        mb_tcp_client_wr_call(client, run, num_wr, handle, NULL);
+        return;
+    }
+    trans_id = mb_tcp_client_trans_id(client, handle);
+    mb_tcp_adu_set_header(&req, trans_id, 0, batch[0].unit_id);
+    if ((num_addr == 1) && (batch[0].func_code == MB_PDU_WR_SING_REG))
+    {
+        mb_pdu_set_wr_sing_reg_req(&req.pdu, addr[0], val[0]);
+    }
+    else if (num_addr == 1)
+    {
+        mb_pdu_set_wr_sing_coil_req(&req.pdu, addr[0], val[0]);
+    }
+    else if (batch[0].func_code == MB_PDU_WR_SING_REG)
+    {
+        ret = mb_pdu_set_wr_mult_regs_req(&req.pdu, addr[0], num_addr, 2 * num_addr, val);
+    }
+    else
+    {
+        for (i = 0; i < num_addr; i++)
+        {
+            if (val[i])
+                bit[i / 8] |= 1 << (i % 8);
+        }
+        ret = mb_pdu_set_wr_mult_coils_req(&req.pdu, addr[0], num_addr, bit);
+    }
+    num = mb_tcp_adu_format_req(&req, buf, sizeof(buf));
+    if ((ret < 0) || (num < 0))
+    {
+        mb_tcp_client_wr_call(client, run, num_wr, -EBADMSG, NULL);
+        return;
+    }
+    wr = malloc(num_wr * sizeof(mb_tcp_client_wr_t));
+    if (wr == NULL)
+    {
+        mb_tcp_client_wr_call(client, run, num_wr, -ENOMEM, NULL);
+        return;
+    }
+    memcpy(wr, run, num_wr * sizeof(mb_tcp_client_wr_t));
+    handle = mb_tcp_client_send_pending(client, &batch[0].sin, handle, trans_id, buf, num, &req, NULL, NULL, NULL, NULL);
+    if (handle < 0)
+    {
+        free(wr);
+        mb_tcp_client_wr_call(client, run, num_wr, handle, NULL);
+        return;
+    }
+    client->pending[handle].wr = wr;
+    client->pending[handle].num_wr = num_wr;
+    client->wr_stats.num_req++;
+}
+
+/* send the writes queued for a server, or for all servers if sin is NULL */
+int mb_tcp_client_wr_flush_addr(mb_tcp_client_t *client, struct sockaddr_in *sin)
+{
+    mb_tcp_client_wr_t batch[MB_TCP_CLIENT_MAX_WR] = {{{0}}};
+    uint16_t addr[MB_TCP_CLIENT_MAX_WR] = {0};
+    uint16_t val[MB_TCP_CLIENT_MAX_WR] = {0};
+    int sel[MB_TCP_CLIENT_MAX_WR] = {0};
+    int max_quant = 0;
+    int num_batch = 0;
+    int num_addr = 0;
+    int num_req = 0;
+    int first = 0;
+    int start = 0;
+    int end = 0;
+    int ret = 0;
+    int i = 0;
+
+    if (client->flushing)
+    {
+        return 0;  /* called back from a request sent by the flush */
+    }
+    client->flushing = 1;
+    while (1)
+    {
+        for (first = 0; first < client->num_wr; first++)
+        {
+            if ((sin == NULL) || (mb_tcp_client_addr_eq(&client->wr[first].sin, sin)))
+                break;
+        }
+        if (first == client->num_wr)
+        {
+            break;
+        }
+        num_batch = mb_tcp_client_wr_select(client, first, sel);
+        for (i = 0; i < num_batch; i++)
+            batch[i] = client->wr[sel[i]];
+        num_addr = mb_tcp_client_wr_collapse(batch, num_batch, addr, val);
+        max_quant = batch[0].func_code == MB_PDU_WR_SING_REG ? MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS : MB_PDU_WR_MULT_COILS_MAX_QUANT_OPS;
+        /* a batch is sent as a whole or left on the queue */
+        num_req = 0;
+        for (start = 0; start < num_addr; start = end)
+        {
+            end = mb_tcp_client_wr_run(addr, num_addr, start, max_quant);
+            num_req++;
+        }
+        if (num_req > mb_tcp_client_num_free_pending(client))
+        {
+            ret = -EBUSY;
+            break;
+        }
+        mb_tcp_client_wr_remove(client, sel, num_batch);
+        for (start = 0; start < num_addr; start = end)
+        {
+            end = mb_tcp_client_wr_run(addr, num_addr, start, max_quant);
+            mb_tcp_client_wr_send(client, batch, num_batch, &addr[start], &val[start], end - start);
+        }
+    }
+    client->flushing = 0;
+    return ret;
+}
+
+/* send the writes queued for each server whose oldest write has waited long enough */
+int mb_tcp_client_wr_flush_due(mb_tcp_client_t *client)
+{
+    struct sockaddr_in sin = {0};
+    struct timespec now = {0};
+    int ret = 0;
+
+    if (client->flushing)
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((client->num_wr > 0) && (mb_tcp_client_timespec_cmp(&client->wr[0].deadline, &now) <= 0))
+    {
+        sin = client->wr[0].sin;
+        ret = mb_tcp_client_wr_flush_addr(client, &sin);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* returns 1 if a read holding registers request is combined with the register writes queued for its unit */
+int mb_tcp_client_wr_combine(mb_tcp_client_t *client, struct sockaddr_in *sin, mb_tcp_adu_t *req, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg, int *handle)
+{
+    mb_tcp_client_wr_t batch[MB_TCP_CLIENT_MAX_WR] = {{{0}}};
+    mb_tcp_client_wr_t *wr = NULL;
+    mb_tcp_adu_t rd_wr_req = {0};
+    uint16_t addr[MB_TCP_CLIENT_MAX_WR] = {0};
+    uint16_t val[MB_TCP_CLIENT_MAX_WR] = {0};
+    uint16_t trans_id = 0;
+    ssize_t num = 0;
+    char buf[MB_TCP_ADU_MAX_LEN] = {0};
+    int sel[MB_TCP_CLIENT_MAX_WR] = {0};
+    int num_batch = 0;
+    int num_addr = 0;
+    int i = 0;
+
+    if ((req->pdu.func_code != MB_PDU_RD_HOLD_REGS) || (client->flushing))
+    {
+        return 0;
+    }
+    /* writes to the server are sent in order, so they must all be register writes to the unit */
+    for (i = 0; i < client->num_wr; i++)
+    {
+        if (!mb_tcp_client_addr_eq(&client->wr[i].sin, sin))
+            continue;
+        if ((client->wr[i].unit_id != req->unit_id) || (client->wr[i].func_code != MB_PDU_WR_SING_REG))
+            return 0;
+        sel[num_batch] = i;
+        batch[num_batch++] = client->wr[i];
+    }
+    if (num_batch == 0)
+    {
+        return 0;
+    }
+    /* the writes must form one range */
+    num_addr = mb_tcp_client_wr_collapse(batch, num_batch, addr, val);
+    if ((num_addr > MB_PDU_RD_WR_MULT_REGS_MAX_QUANT_WR) || (addr[num_addr - 1] - addr[0] != num_addr - 1))
+    {
+        return 0;
+    }
+    *handle = mb_tcp_client_alloc_pending(client);
+    if (*handle < 0)
+    {
+        return 1;
+    }
+    trans_id = mb_tcp_client_trans_id(client, *handle);
+    mb_tcp_adu_set_header(&rd_wr_req, trans_id, req->proto_id, req->unit_id);
+    if (mb_pdu_set_rd_wr_mult_regs_req(&rd_wr_req.pdu, req->pdu.rd_hold_regs_req.start_addr, req->pdu.rd_hold_regs_req.quant_regs, addr[0], num_addr, val) < 0)
+    {
+        return 0;  /* let the server reject the read */
+    }
+    num = mb_tcp_adu_format_req(&rd_wr_req, buf, sizeof(buf));
+    if (num < 0)
+    {
+        return 0;
+    }
+    wr = malloc(num_batch * sizeof(mb_tcp_client_wr_t));
+    if (wr == NULL)
+    {
+        *handle = -ENOMEM;
+        return 1;
+    }
+    memcpy(wr, batch, num_batch * sizeof(mb_tcp_client_wr_t));
+    mb_tcp_client_wr_remove(client, sel, num_batch);
+    *handle = mb_tcp_client_send_pending(client, sin, *handle, trans_id, buf, num, &rd_wr_req, NULL, timeout, func, arg);
+    if (*handle < 0)
+    {
+        free(wr);
+        mb_tcp_client_wr_call(client, batch, num_batch, *handle, NULL);
+        return 1;
+    }
+    req->trans_id = trans_id;
+    client->pending[*handle].wr = wr;
+    client->pending[*handle].num_wr = num_batch;
+    client->pending[*handle].rd_wr = 1;
+    client->wr_stats.num_req++;
+    client->wr_stats.num_rd_wr++;
+    return 1;
+}
+
+int mb_tcp_client_queue_write(mb_tcp_client_t *client, int endpoint, mb_tcp_adu_t *req, mb_tcp_client_wr_func_t func, void *arg)
+{
+    mb_tcp_client_wr_t *wr = NULL;
+    int ret = 0;
+
+    if ((endpoint < 0) || (endpoint >= client->num_endpoint))
+    {
+        return -EINVAL;
+    }
+    if ((req->pdu.func_code != MB_PDU_WR_SING_COIL) && (req->pdu.func_code != MB_PDU_WR_SING_REG))
+    {
+        return -EINVAL;
+    }
+    if (client->num_wr == MB_TCP_CLIENT_MAX_WR)
+    {
+        ret = mb_tcp_client_wr_flush_addr(client, NULL);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        if (client->num_wr == MB_TCP_CLIENT_MAX_WR)
+        {
+            return -EBUSY;
+        }
+    }
+    wr = &client->wr[client->num_wr++];
+    memset(wr, 0, sizeof(mb_tcp_client_wr_t));
+    wr->sin = client->endpoint[endpoint].sin;
+    wr->unit_id = req->unit_id;
+    wr->func_code = req->pdu.func_code;
+    if (req->pdu.func_code == MB_PDU_WR_SING_COIL)
+    {
+        wr->addr = req->pdu.wr_sing_coil_req.op_addr;
+        wr->val = req->pdu.wr_sing_coil_req.op_val;
+    }
+    else
+    {
+        wr->addr = req->pdu.wr_sing_reg_req.reg_addr;
+        wr->val = req->pdu.wr_sing_reg_req.reg_val;
+    }
+    wr->func = func;
+    wr->arg = arg;
+    mb_tcp_client_set_deadline(&wr->deadline, &client->wr_delay);
+    if (client->cache != NULL)
+    {
+        mb_tcp_client_cache_invalidate(client, &wr->sin, req);
+    }
+    client->wr_stats.num_queued++;
+    return 0;
+}
+
+int mb_tcp_client_flush_writes(mb_tcp_client_t *client)
+{
+    return mb_tcp_client_wr_flush_addr(client, NULL);
+}
+
+void mb_tcp_client_set_wr_delay(mb_tcp_client_t *client, struct timeval delay)
+{
+    client->wr_delay = delay;
+}
+
+void mb_tcp_client_get_wr_stats(mb_tcp_client_t *client, mb_tcp_client_wr_stats_t *stats)
+{
+    memcpy(stats, &client->wr_stats, sizeof(mb_tcp_client_wr_stats_t));
+}
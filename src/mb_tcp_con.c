@@ -33,7 +33,7 @@
 #include "mb_tcp_con.h"
 #include "mb_log.h"
 
-static int mb_tcp_con_rx_complete(mb_tcp_con_t *con)
+int mb_tcp_con_rx_complete(mb_tcp_con_t *con)
 {
     uint16_t len = 0;
 
@@ -82,6 +82,9 @@ void mb_tcp_con_destroy(mb_tcp_con_t *con)
 void mb_tcp_con_open(mb_tcp_con_t *con, int sd, struct sockaddr_in *sin)
 {
     con->sd = sd;
+    con->gen++;
+    con->rx_end = 0;
+    con->tx_end = 0;
     con->last_use = time(NULL);
     memcpy(&con->sin, sin, sizeof(struct sockaddr_in));
     mb_log_info("[%d] connection opened", con->index);
@@ -99,7 +102,7 @@ ssize_t mb_tcp_con_send(mb_tcp_con_t *con, char *buf, size_t len)
     ssize_t num = 0;
 
     con->last_use = time(NULL);
-    num = send(con->sd, buf, len, 0);
+    num = send(con->sd, buf, len, MSG_NOSIGNAL);  /* a peer that has gone away must not raise SIGPIPE */
     if (num == 0)
     {
         mb_log_info("[%d] connection closed remotely", con->index);
@@ -113,6 +116,68 @@ ssize_t mb_tcp_con_send(mb_tcp_con_t *con, char *buf, size_t len)
     return num;
 }
 
+int mb_tcp_con_queue(mb_tcp_con_t *con, const char *buf, size_t len)
+{
+    if (len > sizeof(con->tx_buf) - con->tx_end)
+    {
+        return -ENOBUFS;
+    }
+    memcpy(con->tx_buf + con->tx_end, buf, len);
+    con->tx_end += len;
+    mb_log_debug("[%d] queued %d bytes", con->index, len);
+    return 0;
+}
+
+/* sends what the socket takes and queues the rest behind anything already queued */
+int mb_tcp_con_send_queue(mb_tcp_con_t *con, const char *buf, size_t len)
+{
+    ssize_t num = 0;
+
+    if (con->tx_end == 0)
+    {
+        con->last_use = time(NULL);
+        num = send(con->sd, buf, len, MSG_NOSIGNAL);
+        if ((num < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+        {
+            return -errno;
+        }
+        if (num < 0)
+        {
+            num = 0;
+        }
+        mb_log_debug("[%d] sent %d bytes", con->index, num);
+    }
+    if (len - num == 0)
+    {
+        return 0;
+    }
+    return mb_tcp_con_queue(con, buf + num, len - num);
+}
+
+/* returns the number of bytes still queued */
+int mb_tcp_con_flush(mb_tcp_con_t *con)
+{
+    ssize_t num = 0;
+
+    if (con->tx_end == 0)
+    {
+        return 0;
+    }
+    con->last_use = time(NULL);
+    num = send(con->sd, con->tx_buf, con->tx_end, MSG_NOSIGNAL);
+    if ((num < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+    {
+        return -errno;
+    }
+    if (num > 0)
+    {
+        memmove(con->tx_buf, con->tx_buf + num, con->tx_end - num);
+        con->tx_end -= num;
+        mb_log_debug("[%d] sent %d queued bytes", con->index, num);
+    }
+    return con->tx_end;
+}
+
 ssize_t mb_tcp_con_recv(mb_tcp_con_t *con)
 {
     ssize_t num = 0;
@@ -0,0 +1,632 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "mb_tcp_proxy.h"
+#include "mb_log.h"
+
+#define MB_TCP_PROXY_MAX_EVENTS  16
+
+/* returns 1 and the range of addresses accessed if the request has one */
+static int mb_tcp_proxy_req_range(mb_pdu_t *pdu, uint32_t *start, uint32_t *end)
+{
+    mb_pdu_rd_wr_mult_regs_req_t *rd_wr = NULL;
+
+    switch (pdu->func_code)
+    {
+    case MB_PDU_RD_COILS:
+        *start = pdu->rd_coils_req.start_addr;
+        *end = *start + pdu->rd_coils_req.quant_coils;
+        return 1;
+    case MB_PDU_RD_DISC_IPS:
+        *start = pdu->rd_disc_ips_req.start_addr;
+        *end = *start + pdu->rd_disc_ips_req.quant_ips;
+        return 1;
+    case MB_PDU_RD_HOLD_REGS:
+        *start = pdu->rd_hold_regs_req.start_addr;
+        *end = *start + pdu->rd_hold_regs_req.quant_regs;
+        return 1;
+    case MB_PDU_RD_IP_REGS:
+        *start = pdu->rd_ip_regs_req.start_addr;
+        *end = *start + pdu->rd_ip_regs_req.quant_ip_regs;
+        return 1;
+    case MB_PDU_WR_SING_COIL:
+        *start = pdu->wr_sing_coil_req.op_addr;
+        *end = *start + 1;
+        return 1;
+    case MB_PDU_WR_SING_REG:
+        *start = pdu->wr_sing_reg_req.reg_addr;
+        *end = *start + 1;
+        return 1;
+    case MB_PDU_WR_MULT_COILS:
+        *start = pdu->wr_mult_coils_req.start_addr;
+        *end = *start + pdu->wr_mult_coils_req.quant_ops;
+        return 1;
+    case MB_PDU_WR_MULT_REGS:
+        *start = pdu->wr_mult_regs_req.start_addr;
+        *end = *start + pdu->wr_mult_regs_req.quant_regs;
+        return 1;
+    case MB_PDU_MASK_WR_REG:
+        *start = pdu->mask_wr_reg_req.ref_addr;
+        *end = *start + 1;
+        return 1;
+    case MB_PDU_RD_WR_MULT_REGS:
+        rd_wr = &pdu->rd_wr_mult_regs_req;
+        *start = (rd_wr->rd_start_addr < rd_wr->wr_start_addr) ? rd_wr->rd_start_addr : rd_wr->wr_start_addr;
+        *end = (rd_wr->rd_start_addr + rd_wr->quant_rd > rd_wr->wr_start_addr + rd_wr->quant_wr) ? rd_wr->rd_start_addr + rd_wr->quant_rd : rd_wr->wr_start_addr + rd_wr->quant_wr;
+        return 1;
+    }
+    return 0;
+}
+
+/* the first matching rule wins */
+static mb_tcp_proxy_rule_t *mb_tcp_proxy_find_rule(mb_tcp_proxy_t *proxy, mb_tcp_adu_t *req)
+{
+    mb_tcp_proxy_rule_t *rule = NULL;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    int range = 0;
+    int i = 0;
+
+    range = mb_tcp_proxy_req_range(&req->pdu, &start, &end);
+    for (i = 0; i < proxy->num_rule; i++)
+    {
+        rule = &proxy->rule[i];
+        if (rule->unit_id != req->unit_id)
+            continue;
+        if ((!range) || ((start >= rule->start_addr) && (end <= rule->end_addr)))
+            return rule;
+    }
+    return NULL;
+}
+
+static int mb_tcp_proxy_timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return (a->tv_sec < b->tv_sec) ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec)
+        return (a->tv_nsec < b->tv_nsec) ? -1 : 1;
+    return 0;
+}
+
+/* the timer only runs while requests are in flight */
+static void mb_tcp_proxy_set_timer(mb_tcp_proxy_t *proxy, int on)
+{
+    struct itimerspec its = {{0}};
+
+    if (proxy->timer_on == on)
+        return;
+    if (on)
+    {
+        its.it_interval.tv_nsec = MB_TCP_PROXY_TICK_NSEC;
+        its.it_value.tv_nsec = MB_TCP_PROXY_TICK_NSEC;
+    }
+    if (timerfd_settime(proxy->timer_fd, 0, &its, NULL) < 0)
+    {
+        mb_log_warn("failed to set proxy timer: %s", strerror(errno));
+        return;
+    }
+    proxy->timer_on = on;
+}
+
+static void mb_tcp_proxy_send_err_resp(mb_tcp_proxy_t *proxy, mb_tcp_proxy_pending_t *pending, int error)
+{
+    mb_tcp_adu_t resp = {0};
+
+    mb_tcp_adu_set_header(&resp, pending->orig_trans_id, pending->orig_proto_id, pending->orig_unit_id);
+    mb_pdu_set_err_resp(&resp.pdu, pending->func_code + 0x80, error);
+    mb_tcp_server_send_deferred(proxy->server, pending->token, &resp);
+}
+
+static void mb_tcp_proxy_free_pending(mb_tcp_proxy_con_t *pcon, mb_tcp_proxy_pending_t *pending)
+{
+    pending->used = 0;
+    pcon->num_pending--;
+}
+
+/* answer every request in flight on the connection and close it */
+static void mb_tcp_proxy_con_fail(mb_tcp_proxy_t *proxy, mb_tcp_proxy_con_t *pcon)
+{
+    mb_tcp_proxy_pending_t *pending = NULL;
+    int i = 0;
+
+    for (i = 0; i < MB_TCP_PROXY_MAX_PENDING; i++)
+    {
+        pending = &pcon->pending[i];
+        if (pending->used)
+        {
+            mb_tcp_proxy_send_err_resp(proxy, pending, MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP);
+            mb_tcp_proxy_free_pending(pcon, pending);
+        }
+    }
+    if (mb_tcp_con_is_active(&pcon->con))
+    {
+        epoll_ctl(proxy->epoll_fd, EPOLL_CTL_DEL, pcon->con.sd, NULL);
+        mb_tcp_con_close(&pcon->con);
+    }
+    pcon->state = MB_TCP_PROXY_CON_CLOSED;
+}
+
+/* wait for EPOLLOUT only while requests are queued */
+static int mb_tcp_proxy_con_watch(mb_tcp_proxy_t *proxy, mb_tcp_proxy_con_t *pcon)
+{
+    struct epoll_event ev = {0};
+    int wait_out = 0;
+
+    wait_out = mb_tcp_con_tx_pending(&pcon->con);
+    if (pcon->wait_out == wait_out)
+    {
+        return 0;
+    }
+    ev.events = wait_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = pcon;
+    if (epoll_ctl(proxy->epoll_fd, EPOLL_CTL_MOD, pcon->con.sd, &ev) < 0)
+    {
+        return -errno;
+    }
+    pcon->wait_out = wait_out;
+    return 0;
+}
+
+static int mb_tcp_proxy_con_send(mb_tcp_proxy_t *proxy, mb_tcp_proxy_con_t *pcon, mb_tcp_proxy_pending_t *pending)
+{
+    int ret = 0;
+
+    ret = mb_tcp_con_send_queue(&pcon->con, pending->buf, pending->len);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    pending->sent = 1;
+    return mb_tcp_proxy_con_watch(proxy, pcon);
+}
+
+static int mb_tcp_proxy_con_connect(mb_tcp_proxy_t *proxy, mb_tcp_proxy_backend_t *backend, mb_tcp_proxy_con_t *pcon)
+{
+    struct epoll_event ev = {0};
+    int ret = 0;
+    int sd = 0;
+
+    sd = socket(PF_INET, SOCK_STREAM, 0);
+    if (sd < 0)
+    {
+        return -errno;
+    }
+    ret = mb_tcp_con_set_non_blocking(sd);
+    if (ret < 0)
+    {
+        close(sd);
+        return ret;
+    }
+    ret = connect(sd, (struct sockaddr *)&backend->sin, sizeof(struct sockaddr_in));
+    if ((ret < 0) && (errno != EINPROGRESS))
+    {
+        ret = -errno;
+        close(sd);
+        return ret;
+    }
+    ev.events = (ret == 0) ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    ev.data.ptr = pcon;
+    if (epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, sd, &ev) < 0)
+    {
+        ret = -errno;
+        close(sd);
+        return ret;
+    }
+    mb_tcp_con_open(&pcon->con, sd, &backend->sin);
+    pcon->state = (ret == 0) ? MB_TCP_PROXY_CON_OPEN : MB_TCP_PROXY_CON_CONNECTING;
+    pcon->wait_out = (ret != 0);
+    return 0;
+}
+
+/* pick the open connection with the fewest requests in flight,
+ * or one that is connecting, or open a new one
+ */
+static mb_tcp_proxy_con_t *mb_tcp_proxy_select_con(mb_tcp_proxy_t *proxy, mb_tcp_proxy_backend_t *backend)
+{
+    mb_tcp_proxy_con_t *closed = NULL;
+    mb_tcp_proxy_con_t *best = NULL;
+    mb_tcp_proxy_con_t *pcon = NULL;
+    int i = 0;
+
+    for (i = 0; i < backend->num_con; i++)
+    {
+        pcon = &backend->con[i];
+        if (pcon->state == MB_TCP_PROXY_CON_CLOSED)
+        {
+            if (closed == NULL)
+                closed = pcon;
+            continue;
+        }
+        if (pcon->num_pending >= MB_TCP_PROXY_MAX_PENDING)
+            continue;
+        if ((best == NULL)
+         || ((pcon->state == MB_TCP_PROXY_CON_OPEN) && (best->state != MB_TCP_PROXY_CON_OPEN))
+         || ((pcon->state == best->state) && (pcon->num_pending < best->num_pending)))
+            best = pcon;
+    }
+    /* open another connection rather than queue behind a busy one */
+    if ((closed != NULL) && ((best == NULL) || (best->num_pending > 0)))
+    {
+        if (mb_tcp_proxy_con_connect(proxy, backend, closed) == 0)
+            return closed;
+        mb_log_warn("[%d] failed to connect to backend", closed->con.index);
+    }
+    return best;
+}
+
+static int mb_tcp_proxy_handle(mb_tcp_server_t *server, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_tcp_proxy_backend_t *backend = NULL;
+    mb_tcp_proxy_pending_t *pending = NULL;
+    mb_tcp_proxy_rule_t *rule = NULL;
+    mb_tcp_proxy_con_t *pcon = NULL;
+    mb_tcp_proxy_t *proxy = NULL;
+    mb_tcp_adu_t fwd = {0};
+    ssize_t num = 0;
+    int slot = 0;
+    int ret = 0;
+    int i = 0;
+
+    proxy = (mb_tcp_proxy_t *)mb_tcp_server_get_data(server);
+    rule = mb_tcp_proxy_find_rule(proxy, req);
+    if (rule == NULL)
+    {
+        return -MB_PDU_EXCEPT_GATEWAY_PATH_UNAVAIL;
+    }
+    backend = &proxy->backend[rule->backend];
+    pcon = mb_tcp_proxy_select_con(proxy, backend);
+    if (pcon == NULL)
+    {
+        for (i = 0; i < backend->num_con; i++)
+        {
+            if (backend->con[i].state != MB_TCP_PROXY_CON_CLOSED)
+            {
+                return -MB_PDU_EXCEPT_SERVER_DEV_BUSY;  /* every connection is full */
+            }
+        }
+        return -MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP;
+    }
+    for (slot = 0; slot < MB_TCP_PROXY_MAX_PENDING; slot++)
+    {
+        if (!pcon->pending[slot].used)
+            break;
+    }
+    pending = &pcon->pending[slot];
+    memset(pending, 0, sizeof(mb_tcp_proxy_pending_t));
+    pending->trans_id = (uint16_t)(pcon->seq++ * MB_TCP_PROXY_MAX_PENDING + slot);
+    memcpy(&fwd, req, sizeof(mb_tcp_adu_t));
+    mb_tcp_adu_set_header(&fwd, pending->trans_id, req->proto_id, rule->backend_unit_id);
+    num = mb_tcp_adu_format_req(&fwd, pending->buf, sizeof(pending->buf));
+    if (num < 0)
+    {
+        return -MB_PDU_EXCEPT_SERVER_DEV_FAIL;
+    }
+    pending->len = num;
+    pending->used = 1;
+    pending->token = mb_tcp_server_get_token(server);
+    pending->orig_trans_id = req->trans_id;
+    pending->orig_proto_id = req->proto_id;
+    pending->orig_unit_id = req->unit_id;
+    pending->func_code = req->pdu.func_code;
+    clock_gettime(CLOCK_MONOTONIC, &pending->deadline);
+    pending->deadline.tv_sec += proxy->timeout.tv_sec;
+    pending->deadline.tv_nsec += proxy->timeout.tv_usec * 1000;
+    if (pending->deadline.tv_nsec >= 1000000000)
+    {
+        pending->deadline.tv_sec++;
+        pending->deadline.tv_nsec -= 1000000000;
+    }
+    pcon->num_pending++;
+    mb_tcp_proxy_set_timer(proxy, 1);
+    if (pcon->state == MB_TCP_PROXY_CON_OPEN)
+    {
+        ret = mb_tcp_proxy_con_send(proxy, pcon, pending);
+        if (ret < 0)
+        {
+            mb_log_warn("[%d] send: %s", pcon->con.index, strerror(-ret));
+            mb_tcp_proxy_free_pending(pcon, pending);
+            mb_tcp_proxy_con_fail(proxy, pcon);
+            return -MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP;
+        }
+    }
+    return MB_TCP_SERVER_DEFERRED;
+}
+
+static void mb_tcp_proxy_con_connected(mb_tcp_proxy_t *proxy, mb_tcp_proxy_con_t *pcon)
+{
+    socklen_t len = 0;
+    int error = 0;
+    int ret = 0;
+    int i = 0;
+
+    len = sizeof(error);
+    ret = getsockopt(pcon->con.sd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if ((ret < 0) || (error != 0))
+    {
+        mb_log_warn("[%d] connect: %s", pcon->con.index, strerror((ret < 0) ? errno : error));
+        mb_tcp_proxy_con_fail(proxy, pcon);
+        return;
+    }
+    pcon->state = MB_TCP_PROXY_CON_OPEN;
+    mb_log_info("[%d] connected to backend", pcon->con.index);
+    for (i = 0; i < MB_TCP_PROXY_MAX_PENDING; i++)
+    {
+        if ((pcon->pending[i].used) && (!pcon->pending[i].sent))
+        {
+            ret = mb_tcp_proxy_con_send(proxy, pcon, &pcon->pending[i]);
+            if (ret < 0)
+            {
+                mb_tcp_proxy_con_fail(proxy, pcon);
+                return;
+            }
+        }
+    }
+    if (mb_tcp_proxy_con_watch(proxy, pcon) < 0)
+    {
+        mb_tcp_proxy_con_fail(proxy, pcon);
+    }
+}
+
+/* send the requests queued while the socket was full */
+static void mb_tcp_proxy_con_writable(mb_tcp_proxy_t *proxy, mb_tcp_proxy_con_t *pcon)
+{
+    int ret = 0;
+
+    ret = mb_tcp_con_flush(&pcon->con);
+    if (ret >= 0)
+    {
+        ret = mb_tcp_proxy_con_watch(proxy, pcon);
+    }
+    if (ret < 0)
+    {
+        mb_log_warn("[%d] send: %s", pcon->con.index, strerror(-ret));
+        mb_tcp_proxy_con_fail(proxy, pcon);
+    }
+}
+
+static void mb_tcp_proxy_con_recv(mb_tcp_proxy_t *proxy, mb_tcp_proxy_con_t *pcon)
+{
+    mb_tcp_proxy_pending_t *pending = NULL;
+    mb_tcp_adu_t resp = {0};
+    ssize_t num = 0;
+
+    num = mb_tcp_con_recv(&pcon->con);
+    if (num == -EAGAIN)
+    {
+        return;
+    }
+    if (num <= 0)
+    {
+        mb_tcp_proxy_con_fail(proxy, pcon);
+        return;
+    }
+    while (mb_tcp_con_rx_complete(&pcon->con))
+    {
+        num = mb_tcp_adu_parse_resp(&resp, pcon->con.rx_buf, pcon->con.rx_end);
+        if (num < 0)
+        {
+            mb_log_warn("[%d] invalid response from backend", pcon->con.index);
+            mb_tcp_proxy_con_fail(proxy, pcon);
+            return;
+        }
+        mb_tcp_con_consume(&pcon->con, num);
+        pending = &pcon->pending[resp.trans_id & (MB_TCP_PROXY_MAX_PENDING - 1)];
+        if ((!pending->used) || (pending->trans_id != resp.trans_id))
+        {
+            mb_log_debug("[%d] dropping response with unknown transaction id %d", pcon->con.index, resp.trans_id);
+            continue;
+        }
+        mb_tcp_adu_set_header(&resp, pending->orig_trans_id, pending->orig_proto_id, pending->orig_unit_id);
+        mb_tcp_server_send_deferred(proxy->server, pending->token, &resp);
+        mb_tcp_proxy_free_pending(pcon, pending);
+    }
+}
+
+static void mb_tcp_proxy_expire(mb_tcp_proxy_t *proxy)
+{
+    mb_tcp_proxy_pending_t *pending = NULL;
+    mb_tcp_proxy_con_t *pcon = NULL;
+    struct timespec now = {0};
+    uint64_t count = 0;
+    int num_pending = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    if (read(proxy->timer_fd, &count, sizeof(count)) < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < proxy->num_backend; i++)
+    {
+        for (j = 0; j < proxy->backend[i].num_con; j++)
+        {
+            pcon = &proxy->backend[i].con[j];
+            if (pcon->num_pending == 0)
+                continue;
+            for (k = 0; k < MB_TCP_PROXY_MAX_PENDING; k++)
+            {
+                pending = &pcon->pending[k];
+                if ((pending->used) && (mb_tcp_proxy_timespec_cmp(&pending->deadline, &now) <= 0))
+                {
+                    mb_log_debug("[%d] request timed out", pcon->con.index);
+                    mb_tcp_proxy_send_err_resp(proxy, pending, MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP);
+                    mb_tcp_proxy_free_pending(pcon, pending);
+                }
+            }
+            num_pending += pcon->num_pending;
+        }
+    }
+    if (num_pending == 0)
+        mb_tcp_proxy_set_timer(proxy, 0);
+}
+
+/* called in the server thread when a backend socket or the timer is ready */
+static void mb_tcp_proxy_poll(mb_tcp_server_t *server, int fd, void *arg)
+{
+    struct epoll_event ev[MB_TCP_PROXY_MAX_EVENTS] = {{0}};
+    mb_tcp_proxy_t *proxy = (mb_tcp_proxy_t *)arg;
+    mb_tcp_proxy_con_t *pcon = NULL;
+    int num = 0;
+    int i = 0;
+
+    num = epoll_wait(fd, ev, MB_TCP_PROXY_MAX_EVENTS, 0);
+    for (i = 0; i < num; i++)
+    {
+        if (ev[i].data.ptr == proxy)
+        {
+            mb_tcp_proxy_expire(proxy);
+            continue;
+        }
+        pcon = (mb_tcp_proxy_con_t *)ev[i].data.ptr;
+        if (pcon->state == MB_TCP_PROXY_CON_CONNECTING)
+        {
+            mb_tcp_proxy_con_connected(proxy, pcon);
+            continue;
+        }
+        if ((pcon->state == MB_TCP_PROXY_CON_OPEN) && (ev[i].events & EPOLLOUT))
+            mb_tcp_proxy_con_writable(proxy, pcon);
+        if ((pcon->state == MB_TCP_PROXY_CON_OPEN) && (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            mb_tcp_proxy_con_recv(proxy, pcon);
+    }
+}
+
+int mb_tcp_proxy_create(mb_tcp_proxy_t *proxy, mb_tcp_server_t *server, struct timeval timeout)
+{
+    struct epoll_event ev = {0};
+    int ret = 0;
+
+    memset(proxy, 0, sizeof(mb_tcp_proxy_t));
+    proxy->server = server;
+    proxy->timeout = timeout;
+    proxy->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (proxy->epoll_fd < 0)
+    {
+        memset(proxy, 0, sizeof(mb_tcp_proxy_t));
+        return -errno;
+    }
+    proxy->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (proxy->timer_fd < 0)
+    {
+        ret = -errno;
+        close(proxy->epoll_fd);
+        memset(proxy, 0, sizeof(mb_tcp_proxy_t));
+        return ret;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = proxy;
+    ret = epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, proxy->timer_fd, &ev);
+    if (ret < 0)
+    {
+        ret = -errno;
+        mb_tcp_proxy_destroy(proxy);
+        return ret;
+    }
+    ret = mb_tcp_server_watch_fd(server, proxy->epoll_fd, mb_tcp_proxy_poll, proxy);
+    if (ret < 0)
+    {
+        mb_tcp_proxy_destroy(proxy);
+        return ret;
+    }
+    return 0;
+}
+
+/* the server must no longer be running */
+void mb_tcp_proxy_destroy(mb_tcp_proxy_t *proxy)
+{
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < proxy->num_backend; i++)
+    {
+        for (j = 0; j < proxy->backend[i].num_con; j++)
+            mb_tcp_con_destroy(&proxy->backend[i].con[j].con);
+    }
+    if (proxy->server != NULL)
+        mb_tcp_server_unwatch_fd(proxy->server, proxy->epoll_fd);
+    close(proxy->timer_fd);
+    close(proxy->epoll_fd);
+    memset(proxy, 0, sizeof(mb_tcp_proxy_t));
+}
+
+/* returns the index of the new backend */
+int mb_tcp_proxy_add_backend(mb_tcp_proxy_t *proxy, const char *host, in_port_t port, int num_con)
+{
+    mb_tcp_proxy_backend_t *backend = NULL;
+    int ret = 0;
+    int i = 0;
+
+    if ((proxy->num_backend >= MB_TCP_PROXY_MAX_BACKEND)
+     || (num_con < 1) || (num_con > MB_TCP_PROXY_MAX_BACKEND_CON))
+    {
+        return -EINVAL;
+    }
+    backend = &proxy->backend[proxy->num_backend];
+    memset(backend, 0, sizeof(mb_tcp_proxy_backend_t));
+    backend->sin.sin_family = AF_INET;
+    backend->sin.sin_port = htons(port);
+    ret = inet_pton(AF_INET, host, &backend->sin.sin_addr);
+    if (ret < 0)
+    {
+        return -errno;
+    }
+    if (ret == 0)
+    {
+        return -EINVAL;
+    }
+    backend->num_con = num_con;
+    for (i = 0; i < num_con; i++)
+        mb_tcp_con_create(&backend->con[i].con, proxy->num_backend * MB_TCP_PROXY_MAX_BACKEND_CON + i);
+    mb_log_notice("backend %d at address %s and port %u", proxy->num_backend, host, port);
+    return proxy->num_backend++;
+}
+
+int mb_tcp_proxy_add_rule(mb_tcp_proxy_t *proxy, uint8_t unit_id, uint16_t start_addr, uint32_t quant, int backend, uint8_t backend_unit_id)
+{
+    mb_tcp_proxy_rule_t *rule = NULL;
+
+    if ((proxy->num_rule >= MB_TCP_PROXY_MAX_RULE)
+     || (backend < 0) || (backend >= proxy->num_backend)
+     || ((uint32_t)start_addr + quant > 0x10000))
+    {
+        return -EINVAL;
+    }
+    rule = &proxy->rule[proxy->num_rule++];
+    rule->unit_id = unit_id;
+    rule->start_addr = start_addr;
+    rule->end_addr = (uint32_t)start_addr + quant;
+    rule->backend = backend;
+    rule->backend_unit_id = backend_unit_id;
+    mb_tcp_server_add_unit(proxy->server, unit_id, mb_tcp_proxy_handle, proxy);
+    return 0;
+}
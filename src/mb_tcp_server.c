@@ -56,7 +56,8 @@ static ssize_t mb_tcp_server_send_err_resp(mb_tcp_server_t *server, int index, m
 {
     int ret = 0;
 
-    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, MB_TCP_SERVER_UNIT_ID);
+    server->unit[req->unit_id].excep_err_count++;
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
     ret = mb_pdu_set_err_resp(&resp->pdu, req->pdu.func_code + 0x80, error);
     if (ret < 0)
     {
@@ -65,8 +66,10 @@ static ssize_t mb_tcp_server_send_err_resp(mb_tcp_server_t *server, int index, m
     return mb_tcp_server_send_resp(server, index, resp);
 }
 
-static size_t mb_tcp_server_con_exchange(mb_tcp_server_t *server, int index)
+static ssize_t mb_tcp_server_con_handle(mb_tcp_server_t *server, int index)
 {
+    mb_tcp_server_handler_t handler = NULL;
+    mb_tcp_server_unit_t *unit = NULL;
     mb_tcp_con_t *con = NULL;
     mb_tcp_adu_t resp = {0};
     mb_tcp_adu_t req = {0};
@@ -75,11 +78,6 @@ static size_t mb_tcp_server_con_exchange(mb_tcp_server_t *server, int index)
     int ret = 0;
 
     con = &server->con[index];
-    num = mb_tcp_con_recv(con);
-    if (num <= 0)
-    {
-        return num;
-    }
     num = mb_tcp_adu_parse_req(&req, con->rx_buf, con->rx_end);
     if (num < 0)
     {
@@ -89,16 +87,52 @@ static size_t mb_tcp_server_con_exchange(mb_tcp_server_t *server, int index)
     mb_tcp_adu_to_str(&req, msg_buf, sizeof(msg_buf));
     mb_log_info("[%d] received: %s", index, msg_buf);
     mb_tcp_con_consume(con, num);
+    unit = &server->unit[req.unit_id];
+    unit->msg_count++;
+    handler = (unit->handler != NULL) ? unit->handler : server->handler;
+    if (handler == NULL)
+    {
+        mb_log_info("[%d] no handler for unit id %d", index, req.unit_id);
+        mb_tcp_server_send_err_resp(server, index, &req, &resp, MB_PDU_EXCEPT_GATEWAY_PATH_UNAVAIL);
+        return -EBADMSG;
+    }
     mb_log_info("[%d] calling handler callback", index);
-    ret = (*server->handler)(server, &req, &resp);
+    server->cur_unit_id = req.unit_id;
+    server->cur_index = index;
+    ret = (*handler)(server, &req, &resp);
     if (ret < 0)
     {
         mb_tcp_server_send_err_resp(server, index, &req, &resp, -ret);
         return -EBADMSG;
     }
+    if (ret == MB_TCP_SERVER_DEFERRED)
+    {
+        mb_log_info("[%d] response deferred", index);
+        return 1;
+    }
     return mb_tcp_server_send_resp(server, index, &resp);
 }
 
+static ssize_t mb_tcp_server_con_exchange(mb_tcp_server_t *server, int index)
+{
+    mb_tcp_con_t *con = NULL;
+    ssize_t num = 0;
+
+    con = &server->con[index];
+    num = mb_tcp_con_recv(con);
+    if (num <= 0)
+    {
+        return num;
+    }
+    /* handle every complete request in the buffer as a client may pipeline requests */
+    do
+    {
+        num = mb_tcp_server_con_handle(server, index);
+    }
+    while ((num > 0) && (mb_tcp_con_rx_complete(con)));
+    return num;
+}
+
 static int mb_tcp_server_find_empty_con(mb_tcp_server_t *server)
 {
     mb_tcp_con_t *oldest = NULL;
@@ -198,6 +232,82 @@ int mb_tcp_server_authorise_addr(mb_tcp_server_t *server, const char *str)
     return mb_ip_auth_list_add_str(&server->auth, str);
 }
 
+void mb_tcp_server_add_unit(mb_tcp_server_t *server, uint8_t unit_id, mb_tcp_server_handler_t handler, void *data)
+{
+    mb_log_debug("adding unit id %d", unit_id);
+    memset(&server->unit[unit_id], 0, sizeof(mb_tcp_server_unit_t));
+    server->unit[unit_id].handler = handler;
+    server->unit[unit_id].data = data;
+}
+
+void mb_tcp_server_remove_unit(mb_tcp_server_t *server, uint8_t unit_id)
+{
+    mb_log_debug("removing unit id %d", unit_id);
+    memset(&server->unit[unit_id], 0, sizeof(mb_tcp_server_unit_t));
+}
+
+/* returns the data added with the unit whose handler is being called */
+void *mb_tcp_server_get_data(mb_tcp_server_t *server)
+{
+    return server->unit[server->cur_unit_id].data;
+}
+
+mb_tcp_server_token_t mb_tcp_server_get_token(mb_tcp_server_t *server)
+{
+    mb_tcp_server_token_t token = {0};
+
+    token.index = server->cur_index;
+    token.gen = server->con[server->cur_index].gen;
+    return token;
+}
+
+/* must be called from the thread running the server */
+ssize_t mb_tcp_server_send_deferred(mb_tcp_server_t *server, mb_tcp_server_token_t token, mb_tcp_adu_t *resp)
+{
+    mb_tcp_con_t *con = NULL;
+
+    if ((token.index < 0) || (token.index >= MB_TCP_SERVER_MAX_CON))
+    {
+        return -EINVAL;
+    }
+    con = &server->con[token.index];
+    if ((!mb_tcp_con_is_active(con)) || (con->gen != token.gen))
+    {
+        mb_log_debug("[%d] dropping deferred response for closed connection", token.index);
+        return -ENOTCONN;
+    }
+    server->unit[resp->unit_id].excep_err_count += (resp->pdu.func_code & 0x80) ? 1 : 0;
+    return mb_tcp_server_send_resp(server, token.index, resp);
+}
+
+int mb_tcp_server_watch_fd(mb_tcp_server_t *server, int fd, mb_tcp_server_watch_func_t func, void *arg)
+{
+    int i = 0;
+
+    for (i = 0; i < MB_TCP_SERVER_MAX_WATCH; i++)
+    {
+        if (server->watch[i].func == NULL)
+        {
+            server->watch[i].fd = fd;
+            server->watch[i].func = func;
+            server->watch[i].arg = arg;
+            return 0;
+        }
+    }
+    return -ENOSPC;
+}
+
+void mb_tcp_server_unwatch_fd(mb_tcp_server_t *server, int fd)
+{
+    int i = 0;
+
+    for (i = 0; i < MB_TCP_SERVER_MAX_WATCH; i++)
+    {
+        if ((server->watch[i].func != NULL) && (server->watch[i].fd == fd))
+            memset(&server->watch[i], 0, sizeof(mb_tcp_server_watch_t));
+    }
+}
+
 static int mb_tcp_server_handle_new_con(mb_tcp_server_t *server)
 {
     struct sockaddr_in client_sin = {0};
@@ -274,11 +384,25 @@ int mb_tcp_server_run(mb_tcp_server_t *server)
                     max_fd = con->sd;
             }
         }
+        for (i = 0; i < MB_TCP_SERVER_MAX_WATCH; i++)
+        {
+            if (server->watch[i].func != NULL)
+            {
+                FD_SET(server->watch[i].fd, &read_fds);
+                if (server->watch[i].fd > max_fd)
+                    max_fd = server->watch[i].fd;
+            }
+        }
         ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
         if (ret < 0)
         {
             return -errno;
         }
+        for (i = 0; i < MB_TCP_SERVER_MAX_WATCH; i++)
+        {
+            if ((server->watch[i].func != NULL) && (FD_ISSET(server->watch[i].fd, &read_fds)))
+                (*server->watch[i].func)(server, server->watch[i].fd, server->watch[i].arg);
+        }
         for (i = 0; i < MB_TCP_SERVER_MAX_CON; i++)
         {
             con = &server->con[i];
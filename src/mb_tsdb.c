@@ -0,0 +1,904 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mb_tsdb.h"
+#include "mb_log.h"
+
+#define MB_TSDB_SEG_HDR_LEN   ((sizeof(mb_tsdb_seg_hdr_t) + 7) & ~7)
+#define MB_TSDB_PAD           8                         /* lets a reader load 64 bits at the end of a column */
+
+static uint64_t mb_tsdb_zigzag(int64_t val)
+{
+    return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static int64_t mb_tsdb_unzigzag(uint64_t val)
+{
+    return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+static size_t mb_tsdb_num_byte(const mb_tsdb_bits_t *bits)
+{
+    return (bits->num_bit + 7) >> 3;
+}
+
+/* append the low num bits of val, num must be between 1 and 57 */
+static int mb_tsdb_put_bits(mb_tsdb_bits_t *bits, uint64_t val, unsigned num)
+{
+    uint64_t word = 0;
+    size_t byte = bits->num_bit >> 3;
+    size_t cap = 0;
+    uint8_t *buf = NULL;
+
+    if (byte + 2 * sizeof(uint64_t) > bits->cap)
+    {
+        cap = bits->cap != 0 ? 2 * bits->cap : 64;
+        buf = realloc(bits->buf, cap);
+        if (buf == NULL)
+        {
+            return -ENOMEM;
+        }
+        memset(buf + bits->cap, 0, cap - bits->cap);
+        bits->buf = buf;
+        bits->cap = cap;
+    }
+    memcpy(&word, bits->buf + byte, sizeof(word));
+    word = be64toh(word);
+    word |= (val << (64 - num)) >> (bits->num_bit & 7);
+    word = htobe64(word);
+    memcpy(bits->buf + byte, &word, sizeof(word));
+    bits->num_bit += num;
+    return 0;
+}
+
+/* Elias gamma code, run must be at least 1 */
+static int mb_tsdb_put_run(mb_tsdb_bits_t *bits, uint32_t run)
+{
+    unsigned n = 31 - __builtin_clz(run);
+    int ret = 0;
+
+    ret = mb_tsdb_put_bits(bits, 0, 1);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return mb_tsdb_put_bits(bits, run, 2 * n + 1);
+}
+
+static void mb_tsdb_clear_bits(mb_tsdb_bits_t *bits)
+{
+    if (bits->buf != NULL)
+    {
+        memset(bits->buf, 0, bits->cap);
+    }
+    bits->num_bit = 0;
+}
+
+/* change in the interval: '10' + 8 bits, '110' + 16 bits or '111' + 64 bits */
+static int mb_tsdb_put_dod(mb_tsdb_bits_t *bits, int64_t dod)
+{
+    uint64_t zz = mb_tsdb_zigzag(dod);
+    int ret = 0;
+
+    if (zz < 0x100)
+    {
+        return mb_tsdb_put_bits(bits, (0x2 << 8) | zz, 10);
+    }
+    if (zz < 0x10000)
+    {
+        return mb_tsdb_put_bits(bits, (0x6 << 16) | zz, 19);
+    }
+    ret = mb_tsdb_put_bits(bits, 0x7, 3);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = mb_tsdb_put_bits(bits, (uint64_t)dod >> 32, 32);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return mb_tsdb_put_bits(bits, (uint64_t)dod & 0xffffffff, 32);
+}
+
+/* new register value: '10' + 4 bit delta, '110' + 8 bit delta or '111' + 16 bit xor */
+static int mb_tsdb_put_val(mb_tsdb_bits_t *bits, uint16_t prev, uint16_t val)
+{
+    uint64_t zz = mb_tsdb_zigzag((int64_t)val - (int64_t)prev);
+
+    if (zz < 0x10)
+    {
+        return mb_tsdb_put_bits(bits, (0x2 << 4) | zz, 6);
+    }
+    if (zz < 0x100)
+    {
+        return mb_tsdb_put_bits(bits, (0x6 << 8) | zz, 11);
+    }
+    return mb_tsdb_put_bits(bits, (0x7 << 16) | (val ^ prev), 19);
+}
+
+typedef struct
+{
+    const uint8_t *buf;
+    uint64_t pos;
+}
+mb_tsdb_rd_t;
+
+/* num must be between 1 and 57 */
+static uint64_t mb_tsdb_get_bits(mb_tsdb_rd_t *rd, unsigned num)
+{
+    uint64_t word = 0;
+
+    memcpy(&word, rd->buf + (rd->pos >> 3), sizeof(word));
+    word = (be64toh(word) << (rd->pos & 7)) >> (64 - num);
+    rd->pos += num;
+    return word;
+}
+
+static uint32_t mb_tsdb_get_run(mb_tsdb_rd_t *rd)
+{
+    uint64_t word = 0;
+    unsigned n = 0;
+
+    memcpy(&word, rd->buf + (rd->pos >> 3), sizeof(word));
+    word = be64toh(word) << (rd->pos & 7);
+    if (word == 0)
+    {
+        return 0;  /* corrupt */
+    }
+    n = __builtin_clzll(word);
+    if (n > 24)
+    {
+        return 0;
+    }
+    rd->pos += n;
+    return mb_tsdb_get_bits(rd, n + 1);
+}
+
+/* the class of a change follows a 1 bit, returns the index of the class: 0, 1 or 2 */
+static unsigned mb_tsdb_get_class(mb_tsdb_rd_t *rd)
+{
+    if (mb_tsdb_get_bits(rd, 1) == 0)
+        return 0;
+    if (mb_tsdb_get_bits(rd, 1) == 0)
+        return 1;
+    return 2;
+}
+
+/* returns the number of timestamps decoded */
+static uint32_t mb_tsdb_get_times(const mb_tsdb_chunk_t *chunk, int64_t *time)
+{
+    mb_tsdb_rd_t rd = {0};
+    int64_t delta = 0;
+    int64_t dod = 0;
+    uint32_t run = 0;
+    uint32_t i = 1;
+
+    rd.buf = (const uint8_t *)chunk + chunk->col_off[0];
+    time[0] = chunk->first_time;
+    while (i < chunk->num_sample)
+    {
+        if (mb_tsdb_get_bits(&rd, 1) == 0)
+        {
+            run = mb_tsdb_get_run(&rd);
+            if (run == 0)
+                break;
+            for (; (run > 0) && (i < chunk->num_sample); run--, i++)
+                time[i] = time[i - 1] + delta;
+            continue;
+        }
+        switch (mb_tsdb_get_class(&rd))
+        {
+        case 0:
+            dod = mb_tsdb_unzigzag(mb_tsdb_get_bits(&rd, 8));
+            break;
+        case 1:
+            dod = mb_tsdb_unzigzag(mb_tsdb_get_bits(&rd, 16));
+            break;
+        default:
+            dod = (int64_t)((mb_tsdb_get_bits(&rd, 32) << 32) | mb_tsdb_get_bits(&rd, 32));
+            break;
+        }
+        delta += dod;
+        time[i] = time[i - 1] + delta;
+        i++;
+    }
+    return i;
+}
+
+/* returns the number of values decoded */
+static uint32_t mb_tsdb_get_vals(const mb_tsdb_chunk_t *chunk, unsigned col, uint16_t *val)
+{
+    mb_tsdb_rd_t rd = {0};
+    uint32_t run = 0;
+    uint32_t i = 1;
+
+    rd.buf = (const uint8_t *)chunk + chunk->col_off[col + 1];
+    val[0] = mb_tsdb_get_bits(&rd, 16);
+    while (i < chunk->num_sample)
+    {
+        if (mb_tsdb_get_bits(&rd, 1) == 0)
+        {
+            run = mb_tsdb_get_run(&rd);
+            if (run == 0)
+                break;
+            for (; (run > 0) && (i < chunk->num_sample); run--, i++)
+                val[i] = val[i - 1];
+            continue;
+        }
+        switch (mb_tsdb_get_class(&rd))
+        {
+        case 0:
+            val[i] = val[i - 1] + mb_tsdb_unzigzag(mb_tsdb_get_bits(&rd, 4));
+            break;
+        case 1:
+            val[i] = val[i - 1] + mb_tsdb_unzigzag(mb_tsdb_get_bits(&rd, 8));
+            break;
+        default:
+            val[i] = val[i - 1] ^ mb_tsdb_get_bits(&rd, 16);
+            break;
+        }
+        i++;
+    }
+    return i;
+}
+
+static void mb_tsdb_seg_path(mb_tsdb_t *db, int index, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/%08d.seg", db->dir, index);
+}
+
+/* find the end of the chunks in a segment */
+static size_t mb_tsdb_seg_end(mb_tsdb_seg_t *seg)
+{
+    mb_tsdb_chunk_t *chunk = NULL;
+    size_t off = MB_TSDB_SEG_HDR_LEN;
+
+    while (off + sizeof(mb_tsdb_chunk_t) <= seg->size)
+    {
+        chunk = (mb_tsdb_chunk_t *)(seg->mem + off);
+        if ((atomic_load_explicit(&chunk->magic, memory_order_acquire) != MB_TSDB_CHUNK_MAGIC)
+         || (chunk->len < sizeof(mb_tsdb_chunk_t))
+         || (chunk->len > seg->size - off))
+            break;
+        off += chunk->len;
+    }
+    return off;
+}
+
+static int mb_tsdb_add_seg(mb_tsdb_t *db, char *mem, size_t size)
+{
+    mb_tsdb_seg_t *seg = NULL;
+    int max_seg = 0;
+
+    if (db->num_seg == db->max_seg)
+    {
+        max_seg = db->max_seg != 0 ? 2 * db->max_seg : 16;
+        seg = realloc(db->seg, max_seg * sizeof(mb_tsdb_seg_t));
+        if (seg == NULL)
+        {
+            return -ENOMEM;
+        }
+        db->seg = seg;
+        db->max_seg = max_seg;
+    }
+    seg = &db->seg[db->num_seg++];
+    seg->mem = mem;
+    seg->size = size;
+    seg->end = mb_tsdb_seg_end(seg);
+    return 0;
+}
+
+/* map the segment files that are not yet mapped */
+static int mb_tsdb_map_segs(mb_tsdb_t *db)
+{
+    mb_tsdb_seg_hdr_t *hdr = NULL;
+    struct stat st = {0};
+    char path[PATH_MAX] = {0};
+    char *mem = NULL;
+    int prot = PROT_READ;
+    int ret = 0;
+    int fd = 0;
+
+    if (!(db->flags & MB_TSDB_RDONLY))
+        prot |= PROT_WRITE;
+    while (1)
+    {
+        mb_tsdb_seg_path(db, db->num_seg, path, sizeof(path));
+        fd = open(path, (db->flags & MB_TSDB_RDONLY) ? O_RDONLY : O_RDWR);
+        if (fd < 0)
+        {
+            return errno == ENOENT ? 0 : -errno;
+        }
+        ret = fstat(fd, &st);
+        if ((ret < 0) || (st.st_size < (off_t)MB_TSDB_SEG_HDR_LEN))
+        {
+            close(fd);
+            return ret < 0 ? -errno : -EPROTO;
+        }
+        mem = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+        close(fd);  /* the mapping remains valid */
+        if (mem == MAP_FAILED)
+        {
+            return -errno;
+        }
+        hdr = (mb_tsdb_seg_hdr_t *)mem;
+        if ((hdr->magic != MB_TSDB_MAGIC) || (hdr->version != MB_TSDB_VERSION) || (hdr->size != (uint64_t)st.st_size))
+        {
+            munmap(mem, st.st_size);
+            return -EPROTO;
+        }
+        ret = mb_tsdb_add_seg(db, mem, st.st_size);
+        if (ret < 0)
+        {
+            munmap(mem, st.st_size);
+            return ret;
+        }
+    }
+}
+
+/* the segment is set up under a temporary name and linked into place,
+ * so a reader never maps a segment without a complete header
+ */
+static int mb_tsdb_new_seg(mb_tsdb_t *db)
+{
+    mb_tsdb_seg_hdr_t *hdr = NULL;
+    char path[PATH_MAX] = {0};
+    char tmp[PATH_MAX] = {0};
+    char *mem = NULL;
+    int ret = 0;
+    int fd = 0;
+
+    mb_tsdb_seg_path(db, db->num_seg, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s/.seg.XXXXXX", db->dir);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        return -errno;
+    }
+    ret = fchmod(fd, 0644);
+    if (ret == 0)
+        ret = ftruncate(fd, db->seg_size);
+    if (ret < 0)
+    {
+        ret = -errno;
+        close(fd);
+        unlink(tmp);
+        return ret;
+    }
+    mem = mmap(NULL, db->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        ret = -errno;
+        unlink(tmp);
+        return ret;
+    }
+    hdr = (mb_tsdb_seg_hdr_t *)mem;
+    hdr->magic = MB_TSDB_MAGIC;
+    hdr->version = MB_TSDB_VERSION;
+    hdr->size = db->seg_size;
+    /* unlike rename, link fails if another writer created the segment first */
+    ret = link(tmp, path);
+    if (ret < 0)
+        ret = -errno;
+    unlink(tmp);
+    if (ret < 0)
+    {
+        munmap(mem, db->seg_size);
+        return ret;
+    }
+    ret = mb_tsdb_add_seg(db, mem, db->seg_size);
+    if (ret < 0)
+    {
+        munmap(mem, db->seg_size);
+        unlink(path);
+        return ret;
+    }
+    mb_log_info("created time series segment '%s'", path);
+    return 0;
+}
+
+static unsigned mb_tsdb_hash(uint32_t dev, uint16_t start_addr, uint16_t quant)
+{
+    uint64_t key = ((uint64_t)dev << 32) | ((uint32_t)start_addr << 16) | quant;
+
+    key *= 0x9e3779b97f4a7c15ULL;
+    return key >> 32;
+}
+
+static int mb_tsdb_rehash(mb_tsdb_t *db, int hash_size)
+{
+    mb_tsdb_block_t *block = NULL;
+    unsigned h = 0;
+    int *hash = NULL;
+    int i = 0;
+
+    hash = malloc(hash_size * sizeof(int));
+    if (hash == NULL)
+    {
+        return -ENOMEM;
+    }
+    for (i = 0; i < hash_size; i++)
+        hash[i] = -1;
+    for (i = 0; i < db->num_block; i++)
+    {
+        block = &db->block[i];
+        h = mb_tsdb_hash(block->dev, block->start_addr, block->quant) & (hash_size - 1);
+        while (hash[h] >= 0)
+            h = (h + 1) & (hash_size - 1);
+        hash[h] = i;
+    }
+    free(db->hash);
+    db->hash = hash;
+    db->hash_size = hash_size;
+    return 0;
+}
+
+/* returns the index of the block for a device and address range, adding it if needed */
+static int mb_tsdb_get_block(mb_tsdb_t *db, uint32_t dev, uint16_t start_addr, uint16_t quant)
+{
+    mb_tsdb_block_t *block = NULL;
+    unsigned h = 0;
+    int max_block = 0;
+    int ret = 0;
+
+    h = mb_tsdb_hash(dev, start_addr, quant) & (db->hash_size - 1);
+    while (db->hash[h] >= 0)
+    {
+        block = &db->block[db->hash[h]];
+        if ((block->dev == dev) && (block->start_addr == start_addr) && (block->quant == quant))
+            return db->hash[h];
+        h = (h + 1) & (db->hash_size - 1);
+    }
+    if (db->num_block == db->max_block)
+    {
+        max_block = 2 * db->max_block;
+        block = realloc(db->block, max_block * sizeof(mb_tsdb_block_t));
+        if (block == NULL)
+        {
+            return -ENOMEM;
+        }
+        db->block = block;
+        db->max_block = max_block;
+    }
+    block = &db->block[db->num_block];
+    memset(block, 0, sizeof(mb_tsdb_block_t));
+    block->col = calloc(quant, sizeof(mb_tsdb_col_t));
+    if (block->col == NULL)
+    {
+        return -ENOMEM;
+    }
+    block->dev = dev;
+    block->start_addr = start_addr;
+    block->quant = quant;
+    db->hash[h] = db->num_block++;
+    /* keep the table at most half full */
+    if (2 * db->num_block > db->hash_size)
+    {
+        ret = mb_tsdb_rehash(db, 2 * db->hash_size);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return db->num_block - 1;
+}
+
+int mb_tsdb_open(mb_tsdb_t *db, const char *dir, size_t seg_size, int flags)
+{
+    int ret = 0;
+
+    memset(db, 0, sizeof(mb_tsdb_t));
+    if (seg_size == 0)
+        seg_size = MB_TSDB_SEG_SIZE;
+    if (seg_size < MB_TSDB_MIN_SEG_SIZE)
+    {
+        return -EINVAL;
+    }
+    if ((!(flags & MB_TSDB_RDONLY)) && (mkdir(dir, 0755) < 0) && (errno != EEXIST))
+    {
+        return -errno;
+    }
+    db->dir = strdup(dir);
+    db->block = calloc(MB_TSDB_MIN_BLOCK, sizeof(mb_tsdb_block_t));
+    if ((db->dir == NULL) || (db->block == NULL))
+    {
+        mb_tsdb_close(db);
+        return -ENOMEM;
+    }
+    db->max_block = MB_TSDB_MIN_BLOCK;
+    db->flags = flags;
+    db->seg_size = seg_size;
+    ret = mb_tsdb_rehash(db, 2 * MB_TSDB_MIN_BLOCK);
+    if (ret == 0)
+        ret = mb_tsdb_map_segs(db);
+    if (ret < 0)
+    {
+        mb_tsdb_close(db);
+        return ret;
+    }
+    db->sync_seg = db->num_seg > 0 ? db->num_seg - 1 : 0;
+    mb_log_notice("time series store opened in '%s' with %d segments", dir, db->num_seg);
+    return 0;
+}
+
+void mb_tsdb_close(mb_tsdb_t *db)
+{
+    int i = 0;
+    int j = 0;
+
+    if (!(db->flags & MB_TSDB_RDONLY))
+        mb_tsdb_flush(db);
+    for (i = 0; i < db->num_seg; i++)
+        munmap(db->seg[i].mem, db->seg[i].size);
+    for (i = 0; i < db->num_block; i++)
+    {
+        for (j = 0; j < db->block[i].quant; j++)
+            free(db->block[i].col[j].bits.buf);
+        free(db->block[i].col);
+        free(db->block[i].time_bits.buf);
+    }
+    free(db->seg);
+    free(db->block);
+    free(db->hash);
+    free(db->dir);
+    memset(db, 0, sizeof(mb_tsdb_t));
+}
+
+/* write the samples collected by a block as a chunk and start a new one */
+static int mb_tsdb_write_chunk(mb_tsdb_t *db, mb_tsdb_block_t *block)
+{
+    mb_tsdb_chunk_t *chunk = NULL;
+    mb_tsdb_seg_t *seg = NULL;
+    size_t len = 0;
+    size_t off = 0;
+    int ret = 0;
+    int i = 0;
+
+    /* finish the runs */
+    if (block->time_run > 0)
+    {
+        ret = mb_tsdb_put_run(&block->time_bits, block->time_run);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        block->time_run = 0;
+    }
+    for (i = 0; i < block->quant; i++)
+    {
+        if (block->col[i].run > 0)
+        {
+            ret = mb_tsdb_put_run(&block->col[i].bits, block->col[i].run);
+            if (ret < 0)
+            {
+                return ret;
+            }
+            block->col[i].run = 0;
+        }
+    }
+    len = sizeof(mb_tsdb_chunk_t) + (block->quant + 1) * sizeof(uint32_t) + mb_tsdb_num_byte(&block->time_bits);
+    for (i = 0; i < block->quant; i++)
+        len += mb_tsdb_num_byte(&block->col[i].bits);
+    len = (len + MB_TSDB_PAD + 7) & ~7;
+    if ((db->num_seg == 0) || (db->seg[db->num_seg - 1].end + len > db->seg[db->num_seg - 1].size))
+    {
+        ret = mb_tsdb_new_seg(db);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    seg = &db->seg[db->num_seg - 1];
+    chunk = (mb_tsdb_chunk_t *)(seg->mem + seg->end);
+    chunk->len = len;
+    chunk->dev = block->dev;
+    chunk->start_addr = block->start_addr;
+    chunk->quant = block->quant;
+    chunk->num_sample = block->num_sample;
+    chunk->first_time = block->first_time;
+    chunk->min_time = block->min_time;
+    chunk->max_time = block->max_time;
+    off = sizeof(mb_tsdb_chunk_t) + (block->quant + 1) * sizeof(uint32_t);
+    chunk->col_off[0] = off;
+    memcpy((char *)chunk + off, block->time_bits.buf, mb_tsdb_num_byte(&block->time_bits));
+    off += mb_tsdb_num_byte(&block->time_bits);
+    for (i = 0; i < block->quant; i++)
+    {
+        chunk->col_off[i + 1] = off;
+        memcpy((char *)chunk + off, block->col[i].bits.buf, mb_tsdb_num_byte(&block->col[i].bits));
+        off += mb_tsdb_num_byte(&block->col[i].bits);
+    }
+    atomic_store_explicit(&chunk->magic, MB_TSDB_CHUNK_MAGIC, memory_order_release);
+    seg->end += len;
+    db->stats.num_sample += block->num_sample;
+    db->stats.num_chunk++;
+    db->stats.num_byte += len;
+    block->num_sample = 0;
+    mb_tsdb_clear_bits(&block->time_bits);
+    for (i = 0; i < block->quant; i++)
+        mb_tsdb_clear_bits(&block->col[i].bits);
+    return 0;
+}
+
+static int mb_tsdb_add_sample(mb_tsdb_block_t *block, int64_t time, const uint16_t *val)
+{
+    mb_tsdb_col_t *col = NULL;
+    int64_t delta = 0;
+    int ret = 0;
+    int i = 0;
+
+    if (block->num_sample == 0)
+    {
+        block->first_time = time;
+        block->min_time = time;
+        block->max_time = time;
+        block->prev_delta = 0;
+        for (i = 0; (ret == 0) && (i < block->quant); i++)
+        {
+            block->col[i].prev = val[i];
+            ret = mb_tsdb_put_bits(&block->col[i].bits, val[i], 16);
+        }
+        block->prev_time = time;
+        return ret;
+    }
+    delta = time - block->prev_time;
+    if (delta == block->prev_delta)
+    {
+        block->time_run++;
+    }
+    else
+    {
+        if (block->time_run > 0)
+            ret = mb_tsdb_put_run(&block->time_bits, block->time_run);
+        if (ret == 0)
+            ret = mb_tsdb_put_dod(&block->time_bits, delta - block->prev_delta);
+        if (ret < 0)
+            return ret;
+        block->time_run = 0;
+    }
+    for (i = 0; i < block->quant; i++)
+    {
+        col = &block->col[i];
+        if (val[i] == col->prev)
+        {
+            col->run++;
+            continue;
+        }
+        if (col->run > 0)
+            ret = mb_tsdb_put_run(&col->bits, col->run);
+        if (ret == 0)
+            ret = mb_tsdb_put_val(&col->bits, col->prev, val[i]);
+        if (ret < 0)
+            return ret;
+        col->run = 0;
+        col->prev = val[i];
+    }
+    block->prev_delta = delta;
+    block->prev_time = time;
+    if (time < block->min_time)
+        block->min_time = time;
+    if (time > block->max_time)
+        block->max_time = time;
+    return 0;
+}
+
+int mb_tsdb_write_regs(mb_tsdb_t *db, uint32_t dev, uint16_t start_addr, int64_t time, const uint16_t *val, uint16_t quant)
+{
+    mb_tsdb_block_t *block = NULL;
+    int index = 0;
+    int ret = 0;
+
+    if (db->flags & MB_TSDB_RDONLY)
+    {
+        return -EBADF;
+    }
+    if ((quant == 0) || (quant > MB_TSDB_MAX_QUANT) || ((uint32_t)start_addr + quant > 0x10000))
+    {
+        return -EINVAL;
+    }
+    index = mb_tsdb_get_block(db, dev, start_addr, quant);
+    if (index < 0)
+    {
+        return index;
+    }
+    block = &db->block[index];
+    if (block->num_sample == MB_TSDB_CHUNK_LEN)
+    {
+        /* the last attempt to write the chunk failed */
+        ret = mb_tsdb_write_chunk(db, block);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    ret = mb_tsdb_add_sample(block, time, val);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (++block->num_sample == MB_TSDB_CHUNK_LEN)
+    {
+        return mb_tsdb_write_chunk(db, block);
+    }
+    return 0;
+}
+
+/* samples of one device with the same timestamp and consecutive addresses are written as one block */
+int mb_tsdb_write(mb_tsdb_t *db, const mb_tsdb_sample_t *sample, int num)
+{
+    uint16_t val[MB_TSDB_MAX_QUANT] = {0};
+    int ret = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < num; i = j)
+    {
+        val[0] = sample[i].val;
+        for (j = i + 1; (j < num) && (j - i < MB_TSDB_MAX_QUANT); j++)
+        {
+            if ((sample[j].dev != sample[i].dev)
+             || (sample[j].time != sample[i].time)
+             || (sample[j].addr != sample[i].addr + (j - i)))
+                break;
+            val[j - i] = sample[j].val;
+        }
+        ret = mb_tsdb_write_regs(db, sample[i].dev, sample[i].addr, sample[i].time, val, j - i);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* write the samples held in memory and sync the segments written since the last flush */
+int mb_tsdb_flush(mb_tsdb_t *db)
+{
+    int ret = 0;
+    int i = 0;
+
+    if (db->flags & MB_TSDB_RDONLY)
+    {
+        return 0;
+    }
+    for (i = 0; i < db->num_block; i++)
+    {
+        if (db->block[i].num_sample == 0)
+            continue;
+        ret = mb_tsdb_write_chunk(db, &db->block[i]);
+        if (ret < 0)
+        {
+            mb_log_warn("time series flush: %s", strerror(-ret));
+            return ret;
+        }
+    }
+    for (i = db->sync_seg; i < db->num_seg; i++)
+    {
+        if (msync(db->seg[i].mem, db->seg[i].end, MS_SYNC) < 0)
+        {
+            return -errno;
+        }
+    }
+    db->sync_seg = db->num_seg > 0 ? db->num_seg - 1 : 0;
+    return 0;
+}
+
+/* returns 1 if the header of a chunk can be trusted */
+static int mb_tsdb_check_chunk(const mb_tsdb_chunk_t *chunk)
+{
+    size_t hdr_len = sizeof(mb_tsdb_chunk_t) + (chunk->quant + 1) * sizeof(uint32_t);
+    int i = 0;
+
+    if ((chunk->quant == 0) || (chunk->quant > MB_TSDB_MAX_QUANT)
+     || (chunk->num_sample == 0) || (chunk->num_sample > MB_TSDB_CHUNK_LEN)
+     || (hdr_len + MB_TSDB_PAD > chunk->len))
+    {
+        return 0;
+    }
+    for (i = 0; i <= chunk->quant; i++)
+    {
+        if ((chunk->col_off[i] < hdr_len) || (chunk->col_off[i] + MB_TSDB_PAD > chunk->len))
+            return 0;
+    }
+    return 1;
+}
+
+/* calls func for each sample of one register between start_time and end_time (exclusive), returns the number of samples */
+long long mb_tsdb_scan(mb_tsdb_t *db, uint32_t dev, uint16_t addr, int64_t start_time, int64_t end_time, mb_tsdb_func_t func, void *arg)
+{
+    const mb_tsdb_chunk_t *chunk = NULL;
+    mb_tsdb_seg_t *seg = NULL;
+    long long count = 0;
+    uint16_t val[MB_TSDB_CHUNK_LEN] = {0};
+    int64_t time[MB_TSDB_CHUNK_LEN] = {0};
+    uint32_t num = 0;
+    size_t off = 0;
+    int ret = 0;
+    int i = 0;
+    uint32_t j = 0;
+
+    if (db->flags & MB_TSDB_RDONLY)
+    {
+        /* pick up segments created by the writer since the last scan */
+        ret = mb_tsdb_map_segs(db);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    for (i = 0; i < db->num_seg; i++)
+    {
+        seg = &db->seg[i];
+        for (off = MB_TSDB_SEG_HDR_LEN; off + sizeof(mb_tsdb_chunk_t) <= seg->size; off += chunk->len)
+        {
+            chunk = (const mb_tsdb_chunk_t *)(seg->mem + off);
+            if ((atomic_load_explicit(&chunk->magic, memory_order_acquire) != MB_TSDB_CHUNK_MAGIC)
+             || (chunk->len < sizeof(mb_tsdb_chunk_t))
+             || (chunk->len > seg->size - off))
+                break;
+            if ((chunk->dev != dev)
+             || (addr < chunk->start_addr)
+             || (addr >= chunk->start_addr + chunk->quant)
+             || (chunk->max_time < start_time)
+             || (chunk->min_time >= end_time))
+                continue;
+            if (!mb_tsdb_check_chunk(chunk))
+            {
+                mb_log_warn("corrupt chunk at offset %zu of segment %d", off, i);
+                continue;
+            }
+            num = mb_tsdb_get_times(chunk, time);
+            if (mb_tsdb_get_vals(chunk, addr - chunk->start_addr, val) < num)
+                num = 0;
+            for (j = 0; j < num; j++)
+            {
+                if ((time[j] < start_time) || (time[j] >= end_time))
+                    continue;
+                func(dev, addr, time[j], val[j], arg);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+void mb_tsdb_get_stats(mb_tsdb_t *db, mb_tsdb_stats_t *stats)
+{
+    memcpy(stats, &db->stats, sizeof(mb_tsdb_stats_t));
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <thread>
+#include <pthread.h>
+#include <unistd.h>
+#include "mb_co.hpp"
+extern "C"
+{
+#include "mb_tcp_server.h"
+#include "mb_test.h"
+}
+
+#define HOST_ADDR     "127.0.0.1"
+#define SERVER_PORT   10060
+#define ECHO_UNIT     1
+#define SILENT_UNIT   99                                /* requests are never answered */
+#define NUM_SESSION   64
+#define NUM_READ      4
+#define NUM_SILENT    20                                /* more than MB_TCP_CLIENT_MAX_PENDING */
+
+using namespace std::chrono_literals;
+
+int print_cols = 93;
+
+static mb_tcp_server_t server = {};
+static pthread_t server_thread = {};
+
+static int handle_req(mb_tcp_server_t *s, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    if (req->unit_id == SILENT_UNIT)
+    {
+        return MB_TCP_SERVER_DEFERRED;  /* never answered */
+    }
+    uint16_t val[MB_PDU_RD_HOLD_REGS_MAX_QUANT_REGS] = {0};
+    uint16_t quant = req->pdu.rd_hold_regs_req.quant_regs;
+
+    /* each holding register holds 0xf000 plus its address */
+    for (int i = 0; i < quant; i++)
+        val[i] = 0xf000 + req->pdu.rd_hold_regs_req.start_addr + i;
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    return mb_pdu_set_rd_hold_regs_resp(&resp->pdu, 2 * quant, val);
+}
+
+static void *server_run(void *arg)
+{
+    mb_tcp_server_run((mb_tcp_server_t *)arg);
+    return NULL;
+}
+
+static int setup(void)
+{
+    int ret = 0;
+
+    ret = mb_tcp_server_create(&server, HOST_ADDR, SERVER_PORT, handle_req);
+    if (ret < 0)
+        return -1;
+    mb_tcp_server_authorise_addr(&server, HOST_ADDR);
+    pthread_create(&server_thread, NULL, server_run, &server);
+    usleep(100000);
+    return 0;
+}
+
+static void teardown(void)
+{
+    pthread_cancel(server_thread);
+    pthread_join(server_thread, NULL);
+    mb_tcp_server_destroy(&server);
+}
+
+static int client_create(mb_tcp_client_t *client)
+{
+    struct timeval timeout = {1, 0};
+
+    if (mb_tcp_client_create(client, timeout) < 0)
+        return -1;
+    mb_tcp_client_authorise_addr(client, HOST_ADDR);
+    return mb_tcp_client_add_endpoint(client, HOST_ADDR, SERVER_PORT);
+}
+
+static mb::task<> session(mb::tcp_client &client, int endpoint, int id, int *num_ok)
+{
+    mb_tcp_adu_t buf = {};
+    uint16_t addr = id % 90;
+
+    for (int i = 0; i < NUM_READ; i++)
+    {
+        auto regs = co_await client.read_holding(endpoint, ECHO_UNIT, addr + i, 3, buf);
+        if ((regs) && (regs.values.size() == 3) && (regs.values[0] == 0xf000 + addr + i) && (regs.values[2] == 0xf002 + addr + i))
+            (*num_ok)++;
+    }
+}
+
+mb_test_result_t test_mb_co_sessions(void)
+{
+    mb_tcp_client_t client = {};
+    mb::reactor reactor;
+    int endpoint = 0;
+    int num_ok = 0;
+    mb_test_result_t result = PASS;
+
+    printf("%-*s", print_cols, "test 1: run many device sessions on one thread");
+    endpoint = client_create(&client);
+    if (endpoint < 0)
+        return FAIL;
+    {
+        mb::tcp_client co_client(reactor, &client);
+
+        for (int i = 0; i < NUM_SESSION; i++)
+            reactor.spawn(session(co_client, endpoint, i, &num_ok));
+        if ((reactor.run() < 0) || (num_ok != NUM_SESSION * NUM_READ) || (mb_tcp_client_num_pending(&client) != 0))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static mb::task<> silent_read(mb::reactor &reactor, mb::tcp_client &client, int endpoint, ssize_t *status)
+{
+    mb_tcp_adu_t buf = {};
+
+    auto regs = co_await mb::with_timeout(reactor, 100ms, client.read_holding(endpoint, SILENT_UNIT, 0, 1, buf));
+    *status = regs.status;
+}
+
+static mb::task<> echo_read(mb::tcp_client &client, int endpoint, ssize_t *status)
+{
+    mb_tcp_adu_t buf = {};
+
+    *status = (co_await client.read_holding(endpoint, ECHO_UNIT, 0, 1, buf)).status;
+}
+
+mb_test_result_t test_mb_co_timeout(void)
+{
+    ssize_t status[NUM_SILENT + 1] = {0};
+    mb_tcp_client_t client = {};
+    mb::reactor reactor;
+    int endpoint = 0;
+    mb_test_result_t result = PASS;
+
+    printf("%-*s", print_cols, "test 2: time out exchanges in flight and waiting for the client");
+    endpoint = client_create(&client);
+    if (endpoint < 0)
+        return FAIL;
+    {
+        mb::tcp_client co_client(reactor, &client);
+        auto start = mb::clock::now();
+
+        for (int i = 0; i < NUM_SILENT; i++)
+            reactor.spawn(silent_read(reactor, co_client, endpoint, &status[i]));
+        reactor.run();
+        auto elapsed = mb::clock::now() - start;
+        for (int i = 0; i < NUM_SILENT; i++)
+        {
+            if (status[i] != -ETIMEDOUT)
+                result = FAIL;
+        }
+        if ((elapsed < 100ms) || (elapsed > 400ms) || (mb_tcp_client_num_pending(&client) != 0))
+            result = FAIL;
+        /* the client is still usable */
+        reactor.spawn(echo_read(co_client, endpoint, &status[NUM_SILENT]));
+        reactor.run();
+        if (status[NUM_SILENT] <= 0)
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static mb::task<> stoppable_read(mb::reactor &reactor, mb::tcp_client &client, int endpoint, std::stop_token token, ssize_t *status)
+{
+    mb_tcp_adu_t buf = {};
+    mb_pdu_t req = {};
+
+    mb_pdu_set_rd_hold_regs_req(&req, 0, 1);
+    *status = co_await mb::with_stop(reactor, token, client.exchange(endpoint, req, SILENT_UNIT, buf));
+}
+
+static mb::task<> stoppable_sleep(mb::reactor &reactor, std::stop_token token, int *status)
+{
+    *status = co_await mb::with_stop(reactor, token, reactor.sleep_for(10s));
+}
+
+static mb::task<> stopper(mb::reactor &reactor, std::stop_source &source)
+{
+    co_await reactor.sleep_for(50ms);
+    source.request_stop();
+}
+
+mb_test_result_t test_mb_co_stop(void)
+{
+    std::stop_source source;
+    mb_tcp_client_t client = {};
+    mb::reactor reactor;
+    ssize_t status = 0;
+    int sleep_status = 0;
+    int endpoint = 0;
+    mb_test_result_t result = PASS;
+
+    printf("%-*s", print_cols, "test 3: cancel an exchange and a sleep when a stop is requested");
+    endpoint = client_create(&client);
+    if (endpoint < 0)
+        return FAIL;
+    {
+        mb::tcp_client co_client(reactor, &client);
+        auto start = mb::clock::now();
+
+        reactor.spawn(stoppable_read(reactor, co_client, endpoint, source.get_token(), &status));
+        reactor.spawn(stoppable_sleep(reactor, source.get_token(), &sleep_status));
+        reactor.spawn(stopper(reactor, source));
+        reactor.run();
+        if ((status != -ECANCELED)
+         || (sleep_status != -ECANCELED)
+         || (mb::clock::now() - start > 500ms)
+         || (mb_tcp_client_num_pending(&client) != 0))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static mb::task<> timed_sleep(mb::reactor &reactor, int *status, int *num_done)
+{
+    *status = co_await mb::with_timeout(reactor, 20ms, reactor.sleep_for(20ms));
+    (*num_done)++;
+}
+
+static mb::task<> blocker(mb::reactor &reactor)
+{
+    co_await reactor.sleep_for(1ms);
+    /* hold the reactor so that the sleep and its timeout expire in the same pass */
+    std::this_thread::sleep_for(60ms);
+}
+
+mb_test_result_t test_mb_co_stop_thread(void)
+{
+    std::stop_source source;
+    mb::reactor reactor;
+    int sleep_status = 0;
+    int timed_status = -1;
+    int num_done = 0;
+    mb_test_result_t result = PASS;
+
+    printf("%-*s", print_cols, "test 4: request a stop from another thread and time out a fired sleep");
+    {
+        auto start = mb::clock::now();
+        std::thread stop_thread([&source] { std::this_thread::sleep_for(50ms); source.request_stop(); });
+
+        reactor.spawn(stoppable_sleep(reactor, source.get_token(), &sleep_status));
+        reactor.spawn(timed_sleep(reactor, &timed_status, &num_done));
+        reactor.spawn(blocker(reactor));
+        reactor.run();
+        stop_thread.join();
+        if ((sleep_status != -ECANCELED)
+         || (timed_status != 0)
+         || (num_done != 1)
+         || (mb::clock::now() - start > 500ms))
+            result = FAIL;
+    }
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_co_sessions,
+                             test_mb_co_timeout,
+                             test_mb_co_stop,
+                             test_mb_co_stop_thread};
+    int ret = 0;
+
+    if (setup() < 0)
+    {
+        printf("failed to set up the server\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    teardown();
+    return ret;
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "mb_delta.h"
+#include "mb_test.h"
+
+#define START_ADDR  0x0100
+#define NUM_REG     20
+
+int print_cols = 93;
+
+static void set_regs(mb_pdu_t *resp, const uint16_t *val)
+{
+    mb_pdu_set_rd_hold_regs_resp(resp, 2 * NUM_REG, val);
+}
+
+static int create(mb_delta_t *delta)
+{
+    mb_pdu_t req = {0};
+
+    mb_delta_create(delta);
+    mb_pdu_set_rd_hold_regs_req(&req, START_ADDR, NUM_REG);
+    return mb_delta_add_block(delta, &req);
+}
+
+mb_test_result_t test_mb_delta_first(void)
+{
+    mb_delta_range_t range[4] = {{0}};
+    mb_delta_t delta = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    uint16_t val[NUM_REG] = {0};
+    int result = PASS;
+    int block = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 1: report the first response in full and nothing while unchanged");
+    block = create(&delta);
+    if (block < 0)
+        return FAIL;
+    set_regs(&resp, val);
+    ret = mb_delta_update(&delta, block, &resp, range, 4);
+    if ((ret != 1) || (range[0].start_addr != START_ADDR) || (range[0].quant != NUM_REG))
+        result = FAIL;
+    ret = mb_delta_update(&delta, block, &resp, range, 4);
+    if (ret != 0)
+        result = FAIL;
+    mb_delta_reset(&delta, block);
+    ret = mb_delta_update(&delta, block, &resp, range, 4);
+    if (ret != 1)
+        result = FAIL;
+    /* a response that does not match the request */
+    mb_pdu_set_rd_ip_regs_resp(&resp, 2 * NUM_REG, val);
+    if (mb_delta_update(&delta, block, &resp, range, 4) != -EBADMSG)
+        result = FAIL;
+    mb_pdu_set_rd_hold_regs_resp(&resp, 2, val);
+    if (mb_delta_update(&delta, block, &resp, range, 4) != -EBADMSG)
+        result = FAIL;
+    mb_pdu_set_wr_sing_reg_req(&req, 0, 0);
+    if (mb_delta_add_block(&delta, &req) != -EINVAL)
+        result = FAIL;
+    mb_delta_destroy(&delta);
+    return result;
+}
+
+mb_test_result_t test_mb_delta_ranges(void)
+{
+    mb_delta_range_t range[4] = {{0}};
+    mb_delta_t delta = {0};
+    mb_pdu_t resp = {0};
+    uint16_t val[NUM_REG] = {0};
+    int result = PASS;
+    int block = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 2: report changed registers as merged ranges");
+    block = create(&delta);
+    if (block < 0)
+        return FAIL;
+    set_regs(&resp, val);
+    mb_delta_update(&delta, block, &resp, range, 4);
+    val[1] = 1;
+    val[2] = 2;
+    val[3] = 3;
+    val[4] = 4;
+    val[10] = 10;
+    val[NUM_REG - 1] = 0xffff;
+    set_regs(&resp, val);
+    ret = mb_delta_update(&delta, block, &resp, range, 4);
+    if ((ret != 3)
+     || (range[0].start_addr != START_ADDR + 1) || (range[0].quant != 4)
+     || (range[1].start_addr != START_ADDR + 10) || (range[1].quant != 1)
+     || (range[2].start_addr != START_ADDR + NUM_REG - 1) || (range[2].quant != 1))
+        result = FAIL;
+    /* when there are more changes than ranges the last range covers the rest */
+    val[1] = 0;
+    val[10] = 0;
+    val[NUM_REG - 1] = 0;
+    set_regs(&resp, val);
+    ret = mb_delta_update(&delta, block, &resp, range, 2);
+    if ((ret != 2)
+     || (range[0].start_addr != START_ADDR + 1) || (range[0].quant != 1)
+     || (range[1].start_addr != START_ADDR + 10) || (range[1].quant != NUM_REG - 10))
+        result = FAIL;
+    mb_delta_destroy(&delta);
+    return result;
+}
+
+mb_test_result_t test_mb_delta_deadband(void)
+{
+    mb_delta_range_t range[4] = {{0}};
+    mb_delta_t delta = {0};
+    mb_pdu_t resp = {0};
+    uint16_t val[NUM_REG] = {0};
+    uint32_t u = 0;
+    float f = 20.0;
+    int result = PASS;
+    int block = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 3: report values once they move outside their deadband");
+    block = create(&delta);
+    if (block < 0)
+        return FAIL;
+    if ((mb_delta_add_deadband(&delta, block, START_ADDR, MB_DELTA_S16, 5.0) < 0)
+     || (mb_delta_add_deadband(&delta, block, START_ADDR + 2, MB_DELTA_F32, 0.5) < 0)
+     || (mb_delta_add_deadband(&delta, block, START_ADDR + 3, MB_DELTA_U16, 1.0) != -EEXIST)
+     || (mb_delta_add_deadband(&delta, block, START_ADDR + NUM_REG - 1, MB_DELTA_U32, 1.0) != -EINVAL))
+    {
+        mb_delta_destroy(&delta);
+        return FAIL;
+    }
+    val[0] = (uint16_t)-2;
+    memcpy(&u, &f, sizeof(u));
+    val[2] = u >> 16;
+    val[3] = u & 0xffff;
+    set_regs(&resp, val);
+    mb_delta_update(&delta, block, &resp, range, 4);
+    /* within the deadbands */
+    val[0] = 1;
+    f = 20.3;
+    memcpy(&u, &f, sizeof(u));
+    val[2] = u >> 16;
+    val[3] = u & 0xffff;
+    set_regs(&resp, val);
+    ret = mb_delta_update(&delta, block, &resp, range, 4);
+    if (ret != 0)
+        result = FAIL;
+    /* drift is measured from the value last reported */
+    val[0] = 4;
+    f = 20.6;
+    memcpy(&u, &f, sizeof(u));
+    val[2] = u >> 16;
+    val[3] = u & 0xffff;
+    val[5] = 7;
+    set_regs(&resp, val);
+    ret = mb_delta_update(&delta, block, &resp, range, 4);
+    if ((ret != 3)
+     || (range[0].start_addr != START_ADDR) || (range[0].quant != 1)
+     || (range[1].start_addr != START_ADDR + 2) || (range[1].quant != 2)
+     || (range[2].start_addr != START_ADDR + 5) || (range[2].quant != 1))
+        result = FAIL;
+    mb_delta_destroy(&delta);
+    return result;
+}
+
+mb_test_result_t test_mb_delta_bits(void)
+{
+    mb_delta_range_t range[4] = {{0}};
+    mb_delta_t delta = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    uint8_t stat[3] = {0};
+    int result = PASS;
+    int block = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 4: report changed coils");
+    mb_delta_create(&delta);
+    mb_pdu_set_rd_coils_req(&req, 10, 20);
+    block = mb_delta_add_block(&delta, &req);
+    if (block < 0)
+        return FAIL;
+    mb_pdu_set_rd_coils_resp(&resp, 3, stat);
+    mb_delta_update(&delta, block, &resp, range, 4);
+    stat[0] = 0x80;
+    stat[1] = 0x01;
+    stat[2] = 0x08;
+    mb_pdu_set_rd_coils_resp(&resp, 3, stat);
+    ret = mb_delta_update(&delta, block, &resp, range, 4);
+    if ((ret != 2)
+     || (range[0].start_addr != 17) || (range[0].quant != 2)
+     || (range[1].start_addr != 29) || (range[1].quant != 1))
+        result = FAIL;
+    if (mb_delta_add_deadband(&delta, block, 10, MB_DELTA_U16, 1.0) != -EINVAL)
+        result = FAIL;
+    mb_delta_destroy(&delta);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_delta_first,
+                             test_mb_delta_ranges,
+                             test_mb_delta_deadband,
+                             test_mb_delta_bits};
+
+    return mb_test_run(func, sizeof(func) / sizeof(func[0]));
+}
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "mb_dispatch.h"
+#include "mb_reg_bank.h"
+#include "mb_test.h"
+
+int print_cols = 93;
+
+static int handle_bank(void *data, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    return mb_reg_bank_handle((mb_reg_bank_t *)data, req, resp);
+}
+
+static int handle_def(void *data, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    int *count = (int *)data;
+
+    (*count)++;
+    mb_pdu_set_rd_fifo_q_resp(resp, 0, NULL);
+    return 0;
+}
+
+mb_test_result_t test_mb_dispatch_add(void)
+{
+    mb_dispatch_t dispatch = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 1: add entries with overlapping and invalid ranges");
+    mb_dispatch_create(&dispatch);
+    ret = mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0100, 0x100, handle_bank, NULL);
+    if (ret < 0)
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    ret = mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x01ff, 1, handle_bank, NULL);
+    if (ret != -EEXIST)
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    ret = mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0000, 0x101, handle_bank, NULL);
+    if (ret != -EEXIST)
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    ret = mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0xff00, 0x101, handle_bank, NULL);
+    if (ret != -EINVAL)
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    /* the same range in a different class does not overlap */
+    ret = mb_dispatch_add(&dispatch, MB_DISPATCH_COILS, 0x0100, 0x100, handle_bank, NULL);
+    if (ret < 0)
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    ret = mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0000, 0x100, handle_bank, NULL);
+    if ((ret < 0) || (dispatch.num_entry != 3))
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    mb_dispatch_destroy(&dispatch);
+    return PASS;
+}
+
+mb_test_result_t test_mb_dispatch_many(void)
+{
+    mb_dispatch_t dispatch = {0};
+    mb_reg_bank_t bank = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    uint16_t val = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 2: route single register writes across many entries");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_dispatch_create(&dispatch);
+    /* add in reverse order to exercise sorted insertion */
+    for (i = 256; i > 0; i--)
+    {
+        ret = mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, (i - 1) * 0x100, 0x80, handle_bank, &bank);
+        if (ret < 0)
+        {
+            mb_dispatch_destroy(&dispatch);
+            mb_reg_bank_destroy(&bank);
+            return FAIL;
+        }
+    }
+    for (i = 0; i < 256; i++)
+    {
+        mb_pdu_set_wr_sing_reg_req(&req, i * 0x100 + 0x7f, i);
+        ret = mb_dispatch_handle(&dispatch, &req, &resp);
+        if (ret < 0)
+        {
+            mb_dispatch_destroy(&dispatch);
+            mb_reg_bank_destroy(&bank);
+            return FAIL;
+        }
+        mb_pdu_set_wr_sing_reg_req(&req, i * 0x100 + 0x80, i);
+        ret = mb_dispatch_handle(&dispatch, &req, &resp);
+        if (ret != -MB_PDU_EXCEPT_ILLEGAL_ADDR)
+        {
+            mb_dispatch_destroy(&dispatch);
+            mb_reg_bank_destroy(&bank);
+            return FAIL;
+        }
+    }
+    for (i = 0; i < 256; i++)
+    {
+        ret = mb_reg_bank_rd_regs(&bank, MB_REG_BANK_HOLD_REGS, i * 0x100 + 0x7f, 1, &val);
+        if ((ret < 0) || (val != i))
+        {
+            mb_dispatch_destroy(&dispatch);
+            mb_reg_bank_destroy(&bank);
+            return FAIL;
+        }
+    }
+    mb_dispatch_destroy(&dispatch);
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_dispatch_split_regs(void)
+{
+    mb_dispatch_t dispatch = {0};
+    mb_reg_bank_t bank[2] = {{0}};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    uint16_t wr_val[8] = {0};
+    uint16_t val = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 3: split register reads and writes that span two entries");
+    for (i = 0; i < 8; i++)
+        wr_val[i] = 0x1000 + i;
+    ret = mb_reg_bank_create(&bank[0]);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_create(&bank[1]);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_dispatch_create(&dispatch);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0000, 0x10, handle_bank, &bank[0]);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0010, 0x10, handle_bank, &bank[1]);
+    mb_pdu_set_wr_mult_regs_req(&req, 0x000c, 8, 16, wr_val);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if ((ret < 0)
+     || (resp.func_code != MB_PDU_WR_MULT_REGS)
+     || (resp.wr_mult_regs_resp.start_addr != 0x000c)
+     || (resp.wr_mult_regs_resp.quant_regs != 8))
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    /* each bank only sees the part of the write that it owns */
+    mb_reg_bank_rd_regs(&bank[0], MB_REG_BANK_HOLD_REGS, 0x0010, 1, &val);
+    if (val != 0)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_reg_bank_rd_regs(&bank[1], MB_REG_BANK_HOLD_REGS, 0x0010, 1, &val);
+    if (val != 0x1004)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_pdu_set_rd_hold_regs_req(&req, 0x000c, 8);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if ((ret < 0)
+     || (resp.func_code != MB_PDU_RD_HOLD_REGS)
+     || (resp.rd_hold_regs_resp.byte_count != 16)
+     || (memcmp(resp.rd_hold_regs_resp.reg_val, wr_val, sizeof(wr_val)) != 0))
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    /* a read that runs past the last entry */
+    mb_pdu_set_rd_hold_regs_req(&req, 0x001c, 8);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if (ret != -MB_PDU_EXCEPT_ILLEGAL_ADDR)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_dispatch_destroy(&dispatch);
+    mb_reg_bank_destroy(&bank[1]);
+    mb_reg_bank_destroy(&bank[0]);
+    return PASS;
+}
+
+mb_test_result_t test_mb_dispatch_split_coils(void)
+{
+    mb_dispatch_t dispatch = {0};
+    mb_reg_bank_t bank[2] = {{0}};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const uint8_t wr_val[] = {0xa5, 0x3c, 0x01};
+    uint8_t val = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 4: split coil reads and writes that span two entries");
+    ret = mb_reg_bank_create(&bank[0]);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_create(&bank[1]);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_dispatch_create(&dispatch);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_COILS, 0x0000, 0x0b, handle_bank, &bank[0]);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_COILS, 0x000b, 0x10, handle_bank, &bank[1]);
+    mb_pdu_set_wr_mult_coils_req(&req, 0x0003, 17, wr_val);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if ((ret < 0) || (resp.wr_mult_coils_resp.quant_ops != 17))
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    /* coil 0x000b is bit 8 of the request */
+    mb_reg_bank_rd_bits(&bank[1], MB_REG_BANK_COILS, 0x000b, 1, &val);
+    if (val != 0x00)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_reg_bank_rd_bits(&bank[1], MB_REG_BANK_COILS, 0x000d, 1, &val);
+    if (val != 0x01)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_pdu_set_rd_coils_req(&req, 0x0003, 17);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if ((ret < 0)
+     || (resp.rd_coils_resp.byte_count != 3)
+     || (memcmp(resp.rd_coils_resp.coil_stat, wr_val, sizeof(wr_val)) != 0))
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_dispatch_destroy(&dispatch);
+    mb_reg_bank_destroy(&bank[1]);
+    mb_reg_bank_destroy(&bank[0]);
+    return PASS;
+}
+
+mb_test_result_t test_mb_dispatch_rd_wr_regs(void)
+{
+    mb_dispatch_t dispatch = {0};
+    mb_reg_bank_t bank[2] = {{0}};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const uint16_t wr_val[] = {0x1111, 0x2222, 0x3333};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 5: read/write multiple registers across two entries");
+    ret = mb_reg_bank_create(&bank[0]);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_create(&bank[1]);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_dispatch_create(&dispatch);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0000, 0x10, handle_bank, &bank[0]);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0010, 0x10, handle_bank, &bank[1]);
+    mb_pdu_set_rd_wr_mult_regs_req(&req, 0x000f, 3, 0x000f, 3, wr_val);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if ((ret < 0)
+     || (resp.func_code != MB_PDU_RD_WR_MULT_REGS)
+     || (resp.rd_wr_mult_regs_resp.byte_count != 6)
+     || (memcmp(resp.rd_wr_mult_regs_resp.rd_reg_val, wr_val, sizeof(wr_val)) != 0))
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_dispatch_destroy(&dispatch);
+    mb_reg_bank_destroy(&bank[1]);
+    mb_reg_bank_destroy(&bank[0]);
+    return PASS;
+}
+
+mb_test_result_t test_mb_dispatch_default(void)
+{
+    mb_dispatch_t dispatch = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    int count = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 6: unsupported function codes go to the default handler");
+    mb_dispatch_create(&dispatch);
+    mb_pdu_set_rd_fifo_q_req(&req, 0x0000);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if (ret != -MB_PDU_EXCEPT_ILLEGAL_FUNC)
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    mb_dispatch_set_default(&dispatch, handle_def, &count);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if ((ret < 0) || (count != 1) || (resp.func_code != MB_PDU_RD_FIFO_Q))
+    {
+        mb_dispatch_destroy(&dispatch);
+        return FAIL;
+    }
+    mb_dispatch_destroy(&dispatch);
+    return PASS;
+}
+
+mb_test_result_t test_mb_dispatch_gap(void)
+{
+    mb_dispatch_t dispatch = {0};
+    mb_reg_bank_t bank[2] = {{0}};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const uint16_t wr_val[] = {0x1111, 0x2222, 0x3333, 0x4444};
+    const uint8_t op_val = 0x0f;
+    uint16_t val[2] = {0};
+    uint8_t bits = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 7: reject writes across a gap between entries without writing");
+    ret = mb_reg_bank_create(&bank[0]);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_create(&bank[1]);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    /* addresses 0x0010 and 0x0011 are not mapped */
+    mb_dispatch_create(&dispatch);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0000, 0x10, handle_bank, &bank[0]);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_HOLD_REGS, 0x0012, 0x10, handle_bank, &bank[1]);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_COILS, 0x0000, 0x10, handle_bank, &bank[0]);
+    mb_dispatch_add(&dispatch, MB_DISPATCH_COILS, 0x0012, 0x10, handle_bank, &bank[1]);
+    mb_pdu_set_wr_mult_regs_req(&req, 0x000f, 4, 8, wr_val);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if (ret != -MB_PDU_EXCEPT_ILLEGAL_ADDR)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_pdu_set_wr_mult_coils_req(&req, 0x000f, 4, &op_val);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if (ret != -MB_PDU_EXCEPT_ILLEGAL_ADDR)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    /* the write is valid but the read crosses the gap */
+    mb_pdu_set_rd_wr_mult_regs_req(&req, 0x000f, 4, 0x000e, 2, wr_val);
+    ret = mb_dispatch_handle(&dispatch, &req, &resp);
+    if (ret != -MB_PDU_EXCEPT_ILLEGAL_ADDR)
+    {
+        mb_dispatch_destroy(&dispatch);
+        mb_reg_bank_destroy(&bank[1]);
+        mb_reg_bank_destroy(&bank[0]);
+        return FAIL;
+    }
+    mb_reg_bank_rd_regs(&bank[0], MB_REG_BANK_HOLD_REGS, 0x000e, 2, val);
+    mb_reg_bank_rd_bits(&bank[0], MB_REG_BANK_COILS, 0x000f, 1, &bits);
+    mb_dispatch_destroy(&dispatch);
+    mb_reg_bank_destroy(&bank[1]);
+    mb_reg_bank_destroy(&bank[0]);
+    if ((val[0] != 0) || (val[1] != 0) || (bits != 0))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_dispatch_add,
+                             test_mb_dispatch_many,
+                             test_mb_dispatch_split_regs,
+                             test_mb_dispatch_split_coils,
+                             test_mb_dispatch_rd_wr_regs,
+                             test_mb_dispatch_default,
+                             test_mb_dispatch_gap};
+
+    return mb_test_run(func, sizeof(func) / sizeof(func[0]));
+}
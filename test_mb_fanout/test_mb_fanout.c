@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mb_fanout.h"
+#include "mb_poller.h"
+#include "mb_test.h"
+
+#define NUM_REC       8
+#define SLAB_SIZE     (2 * MB_FANOUT_RESP_LEN)
+#define NUM_CONSUMER  4
+#define NUM_PUBLISH   20000
+#define BIG_RESP_LEN  200
+
+typedef struct
+{
+    mb_fanout_t *fanout;
+    int sub;
+    int result;
+}
+consumer_t;
+
+int print_cols = 93;
+
+static ssize_t format_regs(uint16_t val, char *buf, size_t len)
+{
+    mb_pdu_t pdu = {0};
+    uint16_t reg_val[2] = {val, ~val};
+
+    mb_pdu_set_rd_hold_regs_resp(&pdu, 4, reg_val);
+    return mb_pdu_format_resp(&pdu, buf, len);
+}
+
+/* returns the first register of a record holding the response built by format_regs, -1 if it holds anything else */
+static int parse_regs(mb_fanout_t *fanout, const mb_fanout_rec_t *rec)
+{
+    mb_pdu_t pdu = {0};
+
+    if ((rec->resp_len == 0)
+     || (mb_pdu_parse_resp(&pdu, mb_fanout_resp(fanout, rec), rec->resp_len) < 0)
+     || (pdu.func_code != MB_PDU_RD_HOLD_REGS)
+     || (pdu.rd_hold_regs_resp.reg_val[1] != (uint16_t)~pdu.rd_hold_regs_resp.reg_val[0]))
+        return -1;
+    return pdu.rd_hold_regs_resp.reg_val[0];
+}
+
+mb_test_result_t test_mb_fanout_sub(void)
+{
+    const mb_fanout_rec_t *rec = NULL;
+    mb_fanout_t fanout = {0};
+    mb_pdu_t pdu = {0};
+    ssize_t num = 0;
+    char buf[MB_FANOUT_RESP_LEN] = {0};
+    int sub[3] = {0};
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 1: deliver every record to every subscriber");
+    if (mb_fanout_create(&fanout, NUM_REC, SLAB_SIZE) < 0)
+    {
+        return FAIL;
+    }
+    sub[0] = mb_fanout_subscribe(&fanout, 0);
+    sub[1] = mb_fanout_subscribe(&fanout, 0);
+    num = format_regs(0x1234, buf, sizeof(buf));
+    mb_fanout_publish(&fanout, 1, 2, 3, num, buf, num);
+    mb_pdu_set_err_resp(&pdu, MB_PDU_RD_HOLD_REGS + 0x80, MB_PDU_EXCEPT_ILLEGAL_ADDR);
+    num = mb_pdu_format_resp(&pdu, buf, sizeof(buf));
+    mb_fanout_publish(&fanout, 1, 2, 4, num, buf, num);
+    mb_fanout_publish(&fanout, 1, 2, 5, -ETIMEDOUT, NULL, 0);
+    /* a late subscriber only sees records published after it subscribed */
+    sub[2] = mb_fanout_subscribe(&fanout, 0);
+    if ((sub[0] < 0) || (sub[1] < 0) || (sub[2] < 0) || (mb_fanout_next(&fanout, sub[2], &rec) != -EAGAIN))
+        result = FAIL;
+    for (i = 0; i < 2; i++)
+    {
+        if ((mb_fanout_next(&fanout, sub[i], &rec) != 0)
+         || (rec->dev != 1) || (rec->group != 2) || (rec->req != 3)
+         || (rec->time.tv_sec == 0)
+         || (parse_regs(&fanout, rec) != 0x1234)
+         || (mb_fanout_release(&fanout, sub[i]) != 0))
+            result = FAIL;
+        if ((mb_fanout_next(&fanout, sub[i], &rec) != 0)
+         || (rec->req != 4)
+         || (mb_pdu_parse_resp(&pdu, mb_fanout_resp(&fanout, rec), rec->resp_len) < 0)
+         || (pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+         || (mb_fanout_release(&fanout, sub[i]) != 0))
+            result = FAIL;
+        if ((mb_fanout_next(&fanout, sub[i], &rec) != 0)
+         || (rec->req != 5) || (rec->result != -ETIMEDOUT) || (rec->resp_len != 0)
+         || (mb_fanout_release(&fanout, sub[i]) != 0)
+         || (mb_fanout_next(&fanout, sub[i], &rec) != -EAGAIN))
+            result = FAIL;
+    }
+    mb_fanout_unsubscribe(&fanout, sub[1]);
+    if (mb_fanout_next(&fanout, sub[1], &rec) != -EINVAL)
+        result = FAIL;
+    mb_fanout_destroy(&fanout);
+    return result;
+}
+
+mb_test_result_t test_mb_fanout_slow(void)
+{
+    mb_fanout_sub_stats_t stats = {0};
+    const mb_fanout_rec_t *rec = NULL;
+    mb_fanout_t fanout = {0};
+    ssize_t num = 0;
+    char buf[MB_FANOUT_RESP_LEN] = {0};
+    int fast = 0;
+    int slow = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 2: detect a slow subscriber and count the records it lost");
+    if (mb_fanout_create(&fanout, NUM_REC, SLAB_SIZE) < 0)
+    {
+        return FAIL;
+    }
+    fast = mb_fanout_subscribe(&fanout, 0);
+    slow = mb_fanout_subscribe(&fanout, 0);
+    for (i = 0; i < 20; i++)
+    {
+        num = format_regs(i, buf, sizeof(buf));
+        mb_fanout_publish(&fanout, 0, i, 0, num, buf, num);
+        if ((mb_fanout_next(&fanout, fast, &rec) != 0) || (parse_regs(&fanout, rec) != i) || (mb_fanout_release(&fanout, fast) != 0))
+            result = FAIL;
+    }
+    mb_fanout_get_sub_stats(&fanout, fast, &stats);
+    if ((stats.lag != 0) || (stats.slow) || (stats.num_read != 20) || (stats.num_lost != 0))
+        result = FAIL;
+    mb_fanout_get_sub_stats(&fanout, slow, &stats);
+    if ((stats.lag != 20) || (!stats.slow) || (stats.num_read != 0))
+        result = FAIL;
+    /* the slow subscriber resumes at the oldest record still in the ring */
+    for (i = 20 - NUM_REC; i < 20; i++)
+    {
+        if ((mb_fanout_next(&fanout, slow, &rec) != 0) || (rec->group != i) || (parse_regs(&fanout, rec) != i) || (mb_fanout_release(&fanout, slow) != 0))
+            result = FAIL;
+    }
+    mb_fanout_get_sub_stats(&fanout, slow, &stats);
+    if ((stats.lag != 0) || (stats.slow) || (stats.num_read != NUM_REC) || (stats.num_lost != 20 - NUM_REC))
+        result = FAIL;
+    mb_fanout_destroy(&fanout);
+    return result;
+}
+
+mb_test_result_t test_mb_fanout_slab(void)
+{
+    mb_fanout_sub_stats_t stats = {0};
+    const mb_fanout_rec_t *rec = NULL;
+    mb_fanout_t fanout = {0};
+    char buf[BIG_RESP_LEN] = {0};
+    int sub = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 3: drop records whose responses were overwritten in the slab");
+    if (mb_fanout_create(&fanout, NUM_REC, SLAB_SIZE) < 0)
+    {
+        return FAIL;
+    }
+    sub = mb_fanout_subscribe(&fanout, 0);
+    /* only two responses fit in the slab at once */
+    for (i = 0; i < 4; i++)
+    {
+        memset(buf, i, sizeof(buf));
+        mb_fanout_publish(&fanout, 0, i, 0, sizeof(buf), buf, sizeof(buf));
+    }
+    for (i = 2; i < 4; i++)
+    {
+        memset(buf, i, sizeof(buf));
+        if ((mb_fanout_next(&fanout, sub, &rec) != 0)
+         || (rec->group != i)
+         || (memcmp(mb_fanout_resp(&fanout, rec), buf, sizeof(buf)) != 0)
+         || (mb_fanout_release(&fanout, sub) != 0))
+            result = FAIL;
+    }
+    /* a record overwritten while in use is reported when released */
+    mb_fanout_publish(&fanout, 0, 4, 0, sizeof(buf), buf, sizeof(buf));
+    if (mb_fanout_next(&fanout, sub, &rec) != 0)
+        result = FAIL;
+    mb_fanout_publish(&fanout, 0, 5, 0, sizeof(buf), buf, sizeof(buf));
+    mb_fanout_publish(&fanout, 0, 6, 0, sizeof(buf), buf, sizeof(buf));
+    if (mb_fanout_release(&fanout, sub) != -ESTALE)
+        result = FAIL;
+    mb_fanout_get_sub_stats(&fanout, sub, &stats);
+    if ((stats.num_read != 2) || (stats.num_lost != 2) || (stats.num_stale != 1) || (stats.lag != 2))
+        result = FAIL;
+    mb_fanout_destroy(&fanout);
+    return result;
+}
+
+static void *consumer_run(void *arg)
+{
+    consumer_t *consumer = (consumer_t *)arg;
+    mb_fanout_sub_stats_t stats = {0};
+    const mb_fanout_rec_t *rec = NULL;
+    int group = 0;
+    int last = -1;
+    int val = 0;
+
+    while (stats.num_read + stats.num_lost + stats.num_stale < NUM_PUBLISH)
+    {
+        mb_fanout_wait(consumer->fanout, consumer->sub, 100);
+        while (mb_fanout_next(consumer->fanout, consumer->sub, &rec) == 0)
+        {
+            val = parse_regs(consumer->fanout, rec);
+            group = rec->group;
+            if (mb_fanout_release(consumer->fanout, consumer->sub) < 0)
+                continue;  /* overwritten while read, val may be anything */
+            /* records arrive in order, possibly with gaps */
+            if ((val != group) || (group <= last))
+                consumer->result = FAIL;
+            last = group;
+        }
+        mb_fanout_get_sub_stats(consumer->fanout, consumer->sub, &stats);
+    }
+    return NULL;
+}
+
+mb_test_result_t test_mb_fanout_threads(void)
+{
+    consumer_t consumer[NUM_CONSUMER] = {{0}};
+    pthread_t thread[NUM_CONSUMER] = {0};
+    mb_fanout_sub_stats_t stats = {0};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    mb_fanout_t fanout = {0};
+    ssize_t num = 0;
+    long elapsed = 0;
+    char buf[MB_FANOUT_RESP_LEN] = {0};
+    int result = PASS;
+    int sub = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 4: wake subscribers waiting in other threads");
+    if (mb_fanout_create(&fanout, 1024, 64 * MB_FANOUT_RESP_LEN) < 0)
+    {
+        return FAIL;
+    }
+    /* nothing to read */
+    sub = mb_fanout_subscribe(&fanout, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (mb_fanout_wait(&fanout, sub, 50) != 0)
+        result = FAIL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if (elapsed < 40)
+        result = FAIL;
+    mb_fanout_unsubscribe(&fanout, sub);
+    for (i = 0; i < NUM_CONSUMER; i++)
+    {
+        consumer[i].fanout = &fanout;
+        consumer[i].sub = mb_fanout_subscribe(&fanout, 0);
+        consumer[i].result = PASS;
+        pthread_create(&thread[i], NULL, consumer_run, &consumer[i]);
+    }
+    for (i = 0; i < NUM_PUBLISH; i++)
+    {
+        num = format_regs(i, buf, sizeof(buf));
+        mb_fanout_publish(&fanout, 0, i, 0, num, buf, num);
+        if ((i % 1000) == 0)
+            usleep(1000);
+    }
+    for (i = 0; i < NUM_CONSUMER; i++)
+    {
+        pthread_join(thread[i], NULL);
+        mb_fanout_get_sub_stats(&fanout, consumer[i].sub, &stats);
+        if ((consumer[i].result != PASS) || (stats.num_read == 0) || (stats.lag != 0))
+            result = FAIL;
+    }
+    mb_fanout_destroy(&fanout);
+    return result;
+}
+
+mb_test_result_t test_mb_fanout_poller(void)
+{
+    mb_poller_group_t group[2] = {{0}};
+    mb_poller_t poller = {{0}};
+    const mb_fanout_rec_t *rec = NULL;
+    mb_fanout_t fanout = {0};
+    mb_pdu_t pdu = {0};
+    uint16_t reg_val[2] = {0x5678, ~0x5678};
+    int sub = 0;
+    int result = PASS;
+
+    printf("%-*s", print_cols, "test 5: publish the results of a poller group");
+    if (mb_fanout_create(&fanout, NUM_REC, SLAB_SIZE) < 0)
+    {
+        return FAIL;
+    }
+    group[1].dev = 7;
+    poller.group = group;
+    poller.num_group = 2;
+    sub = mb_fanout_subscribe(&fanout, 0);
+    mb_pdu_set_rd_hold_regs_resp(&pdu, 4, reg_val);
+    mb_fanout_poller_func(&poller, 1, 0, 9, &pdu, &fanout);
+    mb_fanout_poller_func(&poller, 1, MB_POLLER_OVERRUN, -ETIME, NULL, &fanout);
+    if ((mb_fanout_next(&fanout, sub, &rec) != 0)
+     || (rec->dev != 7) || (rec->group != 1) || (rec->req != 0) || (rec->result != 9)
+     || (parse_regs(&fanout, rec) != 0x5678)
+     || (mb_fanout_release(&fanout, sub) != 0))
+        result = FAIL;
+    if ((mb_fanout_next(&fanout, sub, &rec) != 0)
+     || (rec->req != MB_POLLER_OVERRUN) || (rec->result != -ETIME) || (rec->resp_len != 0)
+     || (mb_fanout_release(&fanout, sub) != 0))
+        result = FAIL;
+    mb_fanout_destroy(&fanout);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_fanout_sub,
+                             test_mb_fanout_slow,
+                             test_mb_fanout_slab,
+                             test_mb_fanout_threads,
+                             test_mb_fanout_poller};
+
+    return mb_test_run(func, sizeof(func) / sizeof(func[0]));
+}
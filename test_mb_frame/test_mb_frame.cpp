@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include "mb_frame.hpp"
+extern "C"
+{
+#include "mb_test.h"
+}
+
+int print_cols = 93;
+
+/* the example from the Modbus over serial line specification */
+static_assert(mb::rtu<1, mb::rd_hold_regs<0, 10>>::frame == std::array<uint8_t, 8>{0x01, 0x03, 0x00, 0x00, 0x00, 0x0a, 0xc5, 0xcd});
+static_assert(mb::tcp<1, mb::rd_hold_regs<0x6b, 3>>::frame == std::array<uint8_t, 12>{0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x01, 0x03, 0x00, 0x6b, 0x00, 0x03});
+
+template <typename Frame>
+static int cmp_rtu(mb_rtu_adu_t *adu)
+{
+    char buf[MB_RTU_ADU_MAX_LEN] = {0};
+    ssize_t num = 0;
+
+    num = mb_rtu_adu_format_req(adu, buf, sizeof(buf));
+    if ((num != (ssize_t)Frame::frame.size())
+     || (memcmp(buf, Frame::frame.data(), num) != 0))
+        return -1;
+    return 0;
+}
+
+template <typename Frame>
+static int cmp_tcp(mb_tcp_adu_t *adu)
+{
+    typename Frame::frame_t frame = Frame::frame;
+    char buf[MB_TCP_ADU_MAX_LEN] = {0};
+    ssize_t num = 0;
+
+    Frame::set_trans_id(frame, adu->trans_id);
+    num = mb_tcp_adu_format_req(adu, buf, sizeof(buf));
+    if ((num != (ssize_t)frame.size())
+     || (memcmp(buf, frame.data(), num) != 0))
+        return -1;
+    return 0;
+}
+
+mb_test_result_t test_mb_frame_rtu(void)
+{
+    mb_rtu_adu_t adu = {};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 1: compile-time RTU frames match the formatted requests");
+    mb_rtu_adu_set_header(&adu, 17);
+    mb_pdu_set_rd_hold_regs_req(&adu.pdu, 0x100, 10);
+    ret |= cmp_rtu<mb::rtu<17, mb::rd_hold_regs<0x100, 10>>>(&adu);
+    mb_rtu_adu_set_header(&adu, 1);
+    mb_pdu_set_rd_coils_req(&adu.pdu, 0x13, 37);
+    ret |= cmp_rtu<mb::rtu<1, mb::rd_coils<0x13, 37>>>(&adu);
+    mb_rtu_adu_set_header(&adu, 2);
+    mb_pdu_set_rd_disc_ips_req(&adu.pdu, 0xc4, 22);
+    ret |= cmp_rtu<mb::rtu<2, mb::rd_disc_ips<0xc4, 22>>>(&adu);
+    mb_rtu_adu_set_header(&adu, 247);
+    mb_pdu_set_rd_ip_regs_req(&adu.pdu, 0xffe0, 16);
+    ret |= cmp_rtu<mb::rtu<247, mb::rd_ip_regs<0xffe0, 16>>>(&adu);
+    mb_rtu_adu_set_header(&adu, 5);
+    mb_pdu_set_wr_sing_coil_req(&adu.pdu, 0xac, true);
+    ret |= cmp_rtu<mb::rtu<5, mb::wr_sing_coil<0xac, true>>>(&adu);
+    mb_rtu_adu_set_header(&adu, 6);
+    mb_pdu_set_wr_sing_reg_req(&adu.pdu, 0x01, 0x1234);
+    ret |= cmp_rtu<mb::rtu<6, mb::wr_sing_reg<0x01, 0x1234>>>(&adu);
+    return ret == 0 ? PASS : FAIL;
+}
+
+mb_test_result_t test_mb_frame_tcp(void)
+{
+    mb_tcp_adu_t adu = {};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 2: compile-time TCP frames match the formatted requests");
+    mb_tcp_adu_set_header(&adu, 0x1234, 0, 1);
+    mb_pdu_set_rd_hold_regs_req(&adu.pdu, 0x6b, 3);
+    ret |= cmp_tcp<mb::tcp<1, mb::rd_hold_regs<0x6b, 3>>>(&adu);
+    mb_tcp_adu_set_header(&adu, 0xfffe, 0, 0xff);
+    mb_pdu_set_rd_coils_req(&adu.pdu, 0, 2000);
+    ret |= cmp_tcp<mb::tcp<0xff, mb::rd_coils<0, 2000>>>(&adu);
+    mb_tcp_adu_set_header(&adu, 7, 0, 9);
+    mb_pdu_set_wr_sing_coil_req(&adu.pdu, 0xffff, false);
+    ret |= cmp_tcp<mb::tcp<9, mb::wr_sing_coil<0xffff, false>>>(&adu);
+    return ret == 0 ? PASS : FAIL;
+}
+
+mb_test_result_t test_mb_frame_parse_rtu(void)
+{
+    using frame = mb::rtu<17, mb::rd_hold_regs<0x100, 3>>;
+    uint16_t reg_val[3] = {0x000a, 0x1234, 0xffff};
+    frame::values_t val = {};
+    mb_rtu_adu_t adu = {};
+    char buf[MB_RTU_ADU_MAX_LEN] = {0};
+    ssize_t num = 0;
+
+    printf("%-*s", print_cols, "test 3: parse RTU responses into typed values");
+    mb_rtu_adu_set_header(&adu, 17);
+    mb_pdu_set_rd_hold_regs_resp(&adu.pdu, sizeof(reg_val), reg_val);
+    num = mb_rtu_adu_format_resp(&adu, buf, sizeof(buf));
+    if ((num != (ssize_t)frame::resp_len)
+     || (frame::parse((uint8_t *)buf, num, val) != 0)
+     || (val[0] != 0x000a) || (val[1] != 0x1234) || (val[2] != 0xffff))
+        return FAIL;
+
+    /* corrupt CRC */
+    buf[num - 1] ^= 0x01;
+    if (frame::parse((uint8_t *)buf, num, val) != -EBADMSG)
+        return FAIL;
+
+    /* wrong slave address */
+    mb_rtu_adu_set_header(&adu, 18);
+    num = mb_rtu_adu_format_resp(&adu, buf, sizeof(buf));
+    if (frame::parse((uint8_t *)buf, num, val) != -EBADMSG)
+        return FAIL;
+
+    /* wrong byte count */
+    mb_rtu_adu_set_header(&adu, 17);
+    mb_pdu_set_rd_hold_regs_resp(&adu.pdu, 4, reg_val);
+    num = mb_rtu_adu_format_resp(&adu, buf, sizeof(buf));
+    if (frame::parse((uint8_t *)buf, num, val) != -EBADMSG)
+        return FAIL;
+
+    /* exception response */
+    mb_pdu_set_err_resp(&adu.pdu, MB_PDU_RD_HOLD_REGS + 0x80, MB_PDU_EXCEPT_ILLEGAL_ADDR);
+    num = mb_rtu_adu_format_resp(&adu, buf, sizeof(buf));
+    if (frame::parse((uint8_t *)buf, num, val) != MB_PDU_EXCEPT_ILLEGAL_ADDR)
+        return FAIL;
+    return PASS;
+}
+
+mb_test_result_t test_mb_frame_parse_tcp(void)
+{
+    using frame = mb::tcp<1, mb::rd_coils<0x13, 19>>;
+    uint8_t coil_stat[3] = {0xcd, 0x6b, 0x05};
+    frame::values_t val = {};
+    mb_tcp_adu_t adu = {};
+    char buf[MB_TCP_ADU_MAX_LEN] = {0};
+    ssize_t num = 0;
+
+    printf("%-*s", print_cols, "test 4: parse TCP responses into typed values");
+    mb_tcp_adu_set_header(&adu, 0x4321, 0, 1);
+    mb_pdu_set_rd_coils_resp(&adu.pdu, sizeof(coil_stat), coil_stat);
+    num = mb_tcp_adu_format_resp(&adu, buf, sizeof(buf));
+    if ((num != (ssize_t)frame::resp_len)
+     || (frame::parse((uint8_t *)buf, num, 0x4321, val) != 0)
+     || (memcmp(val.data(), coil_stat, sizeof(coil_stat)) != 0))
+        return FAIL;
+
+    /* wrong transaction id */
+    if (frame::parse((uint8_t *)buf, num, 0x4322, val) != -EBADMSG)
+        return FAIL;
+
+    /* wrong function code */
+    mb_pdu_set_rd_disc_ips_resp(&adu.pdu, sizeof(coil_stat), coil_stat);
+    num = mb_tcp_adu_format_resp(&adu, buf, sizeof(buf));
+    if (frame::parse((uint8_t *)buf, num, 0x4321, val) != -EBADMSG)
+        return FAIL;
+
+    /* exception response */
+    mb_pdu_set_err_resp(&adu.pdu, MB_PDU_RD_COILS + 0x80, MB_PDU_EXCEPT_SERVER_DEV_BUSY);
+    num = mb_tcp_adu_format_resp(&adu, buf, sizeof(buf));
+    if (frame::parse((uint8_t *)buf, num, 0x4321, val) != MB_PDU_EXCEPT_SERVER_DEV_BUSY)
+        return FAIL;
+    return PASS;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_frame_rtu,
+                             test_mb_frame_tcp,
+                             test_mb_frame_parse_rtu,
+                             test_mb_frame_parse_tcp};
+
+    return mb_test_run(func, sizeof(func) / sizeof(func[0]));
+}
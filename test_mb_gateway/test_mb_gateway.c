@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/select.h>
+#include "mb_gateway.h"
+#include "mb_tcp_client.h"
+#include "mb_reg_bank.h"
+#include "mb_rtu_adu.h"
+#include "mb_test.h"
+
+#define HOST_ADDR    "127.0.0.1"
+#define HOST_PORT    10010
+#define SLAVE_ADDR   7
+#define OTHER_ADDR   9                                  /* slave on the second bus */
+#define NUM_CLIENT   3
+#define RESP_DELAY   200000                             /* microseconds, keeps the bus busy */
+
+int print_cols = 93;
+
+/* simulated RTU slave on the master side of a pseudo terminal */
+typedef struct
+{
+    int fd;
+    uint8_t addr;
+    int stop;
+    int count;                                          /* requests answered */
+    mb_reg_bank_t bank;
+    pthread_t thread;
+}
+slave_t;
+
+typedef struct
+{
+    mb_tcp_client_t client;
+    mb_tcp_adu_t req;
+    mb_tcp_adu_t resp;
+    int ret;
+}
+client_t;
+
+static mb_tcp_server_t server = {0};
+static mb_gateway_t gateway = {0};
+static slave_t slave = {0};
+static slave_t other = {0};
+static pthread_t server_thread = {0};
+
+static ssize_t slave_recv(slave_t *s, char *buf, size_t len)
+{
+    struct timeval tv = {0};
+    fd_set read_fds = {{0}};
+    ssize_t total = 0;
+    ssize_t num = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        FD_ZERO(&read_fds);
+        FD_SET(s->fd, &read_fds);
+        tv.tv_sec = 0;
+        tv.tv_usec = (total == 0) ? 100000 : 20000;
+        ret = select(s->fd + 1, &read_fds, NULL, NULL, &tv);
+        if (ret < 0)
+            return -errno;
+        if (ret == 0)
+            return total;  /* end of frame or nothing received */
+        num = read(s->fd, buf + total, len - total);
+        if (num <= 0)
+            return total;
+        total += num;
+    }
+}
+
+static void *slave_run(void *arg)
+{
+    slave_t *s = (slave_t *)arg;
+    mb_rtu_adu_t resp = {0};
+    mb_rtu_adu_t req = {0};
+    ssize_t num = 0;
+    char buf[MB_RTU_ADU_MAX_LEN] = {0};
+    int ret = 0;
+
+    while (!s->stop)
+    {
+        num = slave_recv(s, buf, sizeof(buf));
+        if ((num < MB_RTU_ADU_MIN_LEN) || (!mb_rtu_adu_check_crc((const uint8_t *)buf, num)))
+            continue;
+        if ((uint8_t)buf[0] != s->addr)
+            continue;  /* no response, the gateway times out */
+        num = mb_rtu_adu_parse_req(&req, buf, num);
+        if (num < 0)
+            continue;
+        usleep(RESP_DELAY);
+        mb_rtu_adu_set_header(&resp, s->addr);
+        ret = mb_reg_bank_handle(&s->bank, &req.pdu, &resp.pdu);
+        if (ret < 0)
+            mb_pdu_set_err_resp(&resp.pdu, req.pdu.func_code + 0x80, -ret);
+        num = mb_rtu_adu_format_resp(&resp, buf, sizeof(buf));
+        if (num < 0)
+            continue;
+        __atomic_add_fetch(&s->count, 1, __ATOMIC_SEQ_CST);
+        if (write(s->fd, buf, num) < 0)
+            continue;
+    }
+    return NULL;
+}
+
+static void *server_run(void *arg)
+{
+    mb_tcp_server_run((mb_tcp_server_t *)arg);
+    return NULL;
+}
+
+static void *client_run(void *arg)
+{
+    client_t *c = (client_t *)arg;
+
+    c->ret = mb_tcp_client_exchange(&c->client, HOST_ADDR, HOST_PORT, &c->req, &c->resp);
+    return NULL;
+}
+
+static void client_create(client_t *c, uint8_t unit_id)
+{
+    struct timeval timeout = {5, 0};
+
+    memset(c, 0, sizeof(client_t));
+    mb_tcp_client_create(&c->client, timeout);
+    mb_tcp_client_authorise_addr(&c->client, HOST_ADDR);
+    mb_tcp_adu_set_header(&c->req, 1, 0, unit_id);
+}
+
+/* holding register i of a slave holds base + i */
+static int slave_open(slave_t *s, uint8_t addr, uint16_t base)
+{
+    struct termios options = {0};
+    uint16_t val[32] = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    s->addr = addr;
+    s->fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((s->fd < 0) || (grantpt(s->fd) < 0) || (unlockpt(s->fd) < 0))
+        return -1;
+    tcgetattr(s->fd, &options);
+    cfmakeraw(&options);
+    tcsetattr(s->fd, TCSANOW, &options);
+    ret = mb_reg_bank_create(&s->bank);
+    if (ret < 0)
+        return -1;
+    for (i = 0; i < 32; i++)
+        val[i] = base + i;
+    mb_reg_bank_wr_regs(&s->bank, MB_REG_BANK_HOLD_REGS, 0, 32, val);
+    return 0;
+}
+
+static void slave_close(slave_t *s)
+{
+    s->stop = 1;
+    pthread_join(s->thread, NULL);
+    mb_reg_bank_destroy(&s->bank);
+    close(s->fd);
+}
+
+static int setup(void)
+{
+    int ret = 0;
+
+    if ((slave_open(&slave, SLAVE_ADDR, 0x100) < 0) || (slave_open(&other, OTHER_ADDR, 0x200) < 0))
+        return -1;
+    ret = mb_tcp_server_create(&server, HOST_ADDR, HOST_PORT, NULL);
+    if (ret < 0)
+        return -1;
+    mb_tcp_server_authorise_addr(&server, HOST_ADDR);
+    ret = mb_gateway_create(&gateway, &server);
+    if (ret < 0)
+        return -1;
+    ret = mb_gateway_add_bus(&gateway, ptsname(slave.fd));
+    if (ret < 0)
+        return -1;
+    ret = mb_gateway_add_bus(&gateway, ptsname(other.fd));
+    if (ret < 0)
+        return -1;
+    mb_gateway_add_route(&gateway, 1, 0, SLAVE_ADDR);
+    mb_gateway_add_route(&gateway, 2, 0, SLAVE_ADDR + 1);  /* nothing answers on this address */
+    mb_gateway_add_route(&gateway, 4, 1, OTHER_ADDR);
+    mb_gateway_add_route(&gateway, 5, 1, SLAVE_ADDR);      /* the slave with this address is on the other bus */
+    pthread_create(&slave.thread, NULL, slave_run, &slave);
+    pthread_create(&other.thread, NULL, slave_run, &other);
+    pthread_create(&server_thread, NULL, server_run, &server);
+    usleep(100000);
+    return 0;
+}
+
+static void teardown(void)
+{
+    pthread_cancel(server_thread);
+    pthread_join(server_thread, NULL);
+    mb_gateway_destroy(&gateway);
+    mb_tcp_server_destroy(&server);
+    slave_close(&other);
+    slave_close(&slave);
+}
+
+mb_test_result_t test_mb_gateway_rd(void)
+{
+    client_t c = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 1: read holding registers through the gateway");
+    client_create(&c, 1);
+    mb_pdu_set_rd_hold_regs_req(&c.req.pdu, 2, 3);
+    ret = mb_tcp_client_exchange(&c.client, HOST_ADDR, HOST_PORT, &c.req, &c.resp);
+    mb_tcp_client_destroy(&c.client);
+    if ((ret < 0)
+     || (c.resp.unit_id != 1)
+     || (c.resp.pdu.func_code != MB_PDU_RD_HOLD_REGS)
+     || (c.resp.pdu.rd_hold_regs_resp.byte_count != 6)
+     || (c.resp.pdu.rd_hold_regs_resp.reg_val[0] != 0x102)
+     || (c.resp.pdu.rd_hold_regs_resp.reg_val[2] != 0x104))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_gateway_coalesce(void)
+{
+    const uint16_t start_addr[NUM_CLIENT] = {0, 5, 10};
+    const uint16_t quant[NUM_CLIENT] = {5, 10, 10};
+    pthread_t thread[NUM_CLIENT + 1] = {0};
+    client_t c[NUM_CLIENT + 1] = {{{{0}}}};
+    int coalesce_count[2] = {0};
+    int trans_count[2] = {0};
+    unsigned i = 0;
+    unsigned j = 0;
+    int result = PASS;
+
+    printf("%-*s", print_cols, "test 2: overlapping reads from several clients share bus transactions");
+    mb_gateway_get_stats(&gateway, 0, &trans_count[0], &coalesce_count[0]);
+    /* the first read occupies the bus while the others are queued */
+    client_create(&c[NUM_CLIENT], 1);
+    mb_pdu_set_rd_hold_regs_req(&c[NUM_CLIENT].req.pdu, 0, 10);
+    pthread_create(&thread[NUM_CLIENT], NULL, client_run, &c[NUM_CLIENT]);
+    usleep(RESP_DELAY / 4);
+    for (i = 0; i < NUM_CLIENT; i++)
+    {
+        client_create(&c[i], 1);
+        mb_pdu_set_rd_hold_regs_req(&c[i].req.pdu, start_addr[i], quant[i]);
+        pthread_create(&thread[i], NULL, client_run, &c[i]);
+        usleep(RESP_DELAY / 20);
+    }
+    for (i = 0; i <= NUM_CLIENT; i++)
+    {
+        pthread_join(thread[i], NULL);
+        mb_tcp_client_destroy(&c[i].client);
+    }
+    for (i = 0; i < NUM_CLIENT; i++)
+    {
+        if ((c[i].ret < 0)
+         || (c[i].resp.pdu.func_code != MB_PDU_RD_HOLD_REGS)
+         || (c[i].resp.pdu.rd_hold_regs_resp.byte_count != 2 * quant[i]))
+        {
+            result = FAIL;
+            continue;
+        }
+        for (j = 0; j < quant[i]; j++)
+        {
+            if (c[i].resp.pdu.rd_hold_regs_resp.reg_val[j] != 0x100 + start_addr[i] + j)
+                result = FAIL;
+        }
+    }
+    mb_gateway_get_stats(&gateway, 0, &trans_count[1], &coalesce_count[1]);
+    /* 0-5 joins the active 0-10 read, 5-15 and 10-20 are merged into one */
+    if ((trans_count[1] - trans_count[0] != 2) || (coalesce_count[1] - coalesce_count[0] != 2))
+    {
+        result = FAIL;
+    }
+    return result;
+}
+
+mb_test_result_t test_mb_gateway_wr_barrier(void)
+{
+    pthread_t thread[3] = {0};
+    client_t c[3] = {{{{0}}}};
+    uint16_t val = 0xbeef;
+    unsigned i = 0;
+
+    printf("%-*s", print_cols, "test 3: a read queued after a write sees the written value");
+    for (i = 0; i < 3; i++)
+        client_create(&c[i], 1);
+    mb_pdu_set_rd_hold_regs_req(&c[0].req.pdu, 20, 2);
+    mb_pdu_set_wr_mult_regs_req(&c[1].req.pdu, 21, 1, 2, &val);
+    mb_pdu_set_rd_hold_regs_req(&c[2].req.pdu, 20, 2);
+    for (i = 0; i < 3; i++)
+    {
+        pthread_create(&thread[i], NULL, client_run, &c[i]);
+        usleep(RESP_DELAY / 4);
+    }
+    for (i = 0; i < 3; i++)
+    {
+        pthread_join(thread[i], NULL);
+        mb_tcp_client_destroy(&c[i].client);
+    }
+    if ((c[0].ret < 0) || (c[1].ret < 0) || (c[2].ret < 0)
+     || (c[0].resp.pdu.rd_hold_regs_resp.reg_val[1] != 0x100 + 21)
+     || (c[1].resp.pdu.func_code != MB_PDU_WR_MULT_REGS)
+     || (c[2].resp.pdu.rd_hold_regs_resp.reg_val[1] != 0xbeef))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_gateway_err(void)
+{
+    client_t c = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 4: unrouted units and silent slaves are reported as exceptions");
+    client_create(&c, 3);
+    mb_pdu_set_rd_hold_regs_req(&c.req.pdu, 0, 1);
+    ret = mb_tcp_client_exchange(&c.client, HOST_ADDR, HOST_PORT, &c.req, &c.resp);
+    mb_tcp_client_destroy(&c.client);
+    if ((ret < 0)
+     || (c.resp.pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (c.resp.pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_PATH_UNAVAIL))
+    {
+        return FAIL;
+    }
+    client_create(&c, 2);
+    mb_pdu_set_rd_hold_regs_req(&c.req.pdu, 0, 1);
+    ret = mb_tcp_client_exchange(&c.client, HOST_ADDR, HOST_PORT, &c.req, &c.resp);
+    mb_tcp_client_destroy(&c.client);
+    if ((ret < 0)
+     || (c.resp.pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (c.resp.pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+/* read holding register 0 of a unit */
+static int rd_unit(uint8_t unit_id, mb_tcp_adu_t *resp)
+{
+    client_t c = {0};
+    int ret = 0;
+
+    client_create(&c, unit_id);
+    mb_pdu_set_rd_hold_regs_req(&c.req.pdu, 0, 1);
+    ret = mb_tcp_client_exchange(&c.client, HOST_ADDR, HOST_PORT, &c.req, &c.resp);
+    mb_tcp_client_destroy(&c.client);
+    memcpy(resp, &c.resp, sizeof(mb_tcp_adu_t));
+    return ret;
+}
+
+mb_test_result_t test_mb_gateway_route(void)
+{
+    mb_tcp_adu_t resp[4] = {{0}};
+    int coalesce_count = 0;
+    int trans_count[2][2] = {{0}};
+    int ret[4] = {0};
+
+    printf("%-*s", print_cols, "test 5: units are routed to slaves on different buses");
+    mb_gateway_get_stats(&gateway, 0, &trans_count[0][0], &coalesce_count);
+    mb_gateway_get_stats(&gateway, 1, &trans_count[1][0], &coalesce_count);
+    ret[0] = rd_unit(1, &resp[0]);
+    ret[1] = rd_unit(4, &resp[1]);
+    ret[2] = rd_unit(5, &resp[2]);
+    ret[3] = rd_unit(6, &resp[3]);
+    mb_gateway_get_stats(&gateway, 0, &trans_count[0][1], &coalesce_count);
+    mb_gateway_get_stats(&gateway, 1, &trans_count[1][1], &coalesce_count);
+    if ((ret[0] < 0) || (ret[1] < 0) || (ret[2] < 0) || (ret[3] < 0)
+     || (resp[0].unit_id != 1)
+     || (resp[0].pdu.func_code != MB_PDU_RD_HOLD_REGS)
+     || (resp[0].pdu.rd_hold_regs_resp.reg_val[0] != 0x100)
+     || (resp[1].unit_id != 4)
+     || (resp[1].pdu.func_code != MB_PDU_RD_HOLD_REGS)
+     || (resp[1].pdu.rd_hold_regs_resp.reg_val[0] != 0x200)
+     || (resp[2].unit_id != 5)
+     || (resp[2].pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (resp[2].pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP)
+     || (resp[3].unit_id != 6)
+     || (resp[3].pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (resp[3].pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_PATH_UNAVAIL))
+    {
+        return FAIL;
+    }
+    /* units 4 and 5 went to the second bus, an unrouted unit goes to neither */
+    if ((trans_count[0][1] - trans_count[0][0] != 1) || (trans_count[1][1] - trans_count[1][0] != 2))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_gateway_rd,
+                             test_mb_gateway_coalesce,
+                             test_mb_gateway_wr_barrier,
+                             test_mb_gateway_err,
+                             test_mb_gateway_route};
+    int ret = 0;
+
+    if (setup() < 0)
+    {
+        printf("failed to set up the gateway\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    teardown();
+    return ret;
+}
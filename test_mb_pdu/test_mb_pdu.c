@@ -4876,6 +4876,261 @@ mb_test_result_t test_mb_pdu_parse_err_resp_invalid_except_code(void)
     return PASS;
 }
 
+mb_test_result_t test_mb_pdu_rd_mult_ranges_req(void)
+{
+    mb_pdu_t pdu = {0};
+    const mb_pdu_rd_mult_ranges_sub_req_t sub_req[] = {{0x03, 0x0010, 0x0002},
+                                                        {0x01, 0x0100, 0x000a}};
+    ssize_t num = 0;
+    char buf[12] = {0};
+    char exp[] = {0x41, 0x0a, 0x03, 0x00, 0x10, 0x00, 0x02, 0x01, 0x01, 0x00, 0x00, 0x0a};
+
+    printf("%-*s", print_cols, "test 237: set and format 'Read Multiple Ranges' request PDU");
+    num = mb_pdu_set_rd_mult_ranges_req(&pdu, sub_req, 2);
+    if (num < 0)
+    {
+        return FAIL;
+    }
+    num = mb_pdu_format_req(&pdu, buf, sizeof(buf));
+    if (num != sizeof(exp))
+    {
+        return FAIL;
+    }
+    if (memcmp(buf, exp, sizeof(buf)) != 0)
+    {
+        return FAIL;
+    }
+    if (mb_pdu_resp_len(&pdu) != 2 + 4 + 2)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_pdu_rd_mult_ranges_req_invalid_byte_count(void)
+{
+    mb_pdu_t pdu = {0};
+    const mb_pdu_rd_mult_ranges_sub_req_t sub_req[] = {{0x03, 0x0000, 0x007d},
+                                                        {0x04, 0x0000, 0x0001}};  /* response too large */
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 238: set 'Read Multiple Ranges' request PDU with invalid byte_count");
+    ret = mb_pdu_set_rd_mult_ranges_req(&pdu, sub_req, 2);
+    if (ret != -MB_PDU_EXCEPT_ILLEGAL_VAL)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_pdu_rd_mult_ranges_resp(void)
+{
+    mb_pdu_t pdu = {0};
+    const uint8_t data[] = {0x12, 0x34, 0x56, 0x78, 0x05, 0x02};
+    ssize_t num = 0;
+    char buf[8] = {0};
+    char exp[] = {0x41, 0x06, 0x12, 0x34, 0x56, 0x78, 0x05, 0x02};
+
+    printf("%-*s", print_cols, "test 239: set and format 'Read Multiple Ranges' response PDU");
+    num = mb_pdu_set_rd_mult_ranges_resp(&pdu, sizeof(data), data);
+    if (num < 0)
+    {
+        return FAIL;
+    }
+    num = mb_pdu_format_resp(&pdu, buf, sizeof(buf));
+    if (num != sizeof(exp))
+    {
+        return FAIL;
+    }
+    if (memcmp(buf, exp, sizeof(buf)) != 0)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_pdu_parse_rd_mult_ranges_req(void)
+{
+    mb_pdu_t pdu = {0};
+    const uint8_t func_code = 0x41;
+    const uint8_t byte_count = 0x0a;
+    ssize_t num = 0;
+    char buf[] = {0x41, 0x0a, 0x03, 0x00, 0x10, 0x00, 0x02, 0x01, 0x01, 0x00, 0x00, 0x0a};
+
+    printf("%-*s", print_cols, "test 240: parse 'Read Multiple Ranges' request PDU");
+    num = mb_pdu_parse_req(&pdu, buf, sizeof(buf));
+    if (num != sizeof(buf))
+    {
+        return FAIL;
+    }
+    if (pdu.func_code != func_code)
+    {
+        return FAIL;
+    }
+    if (pdu.rd_mult_ranges_req.byte_count != byte_count)
+    {
+        return FAIL;
+    }
+    if ((pdu.rd_mult_ranges_req.sub_req[0].func_code != 0x03)
+     || (pdu.rd_mult_ranges_req.sub_req[0].start_addr != 0x0010)
+     || (pdu.rd_mult_ranges_req.sub_req[0].quant != 0x0002)
+     || (pdu.rd_mult_ranges_req.sub_req[1].func_code != 0x01)
+     || (pdu.rd_mult_ranges_req.sub_req[1].start_addr != 0x0100)
+     || (pdu.rd_mult_ranges_req.sub_req[1].quant != 0x000a))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_pdu_parse_rd_mult_ranges_req_invalid_func_code(void)
+{
+    mb_pdu_t pdu = {0};
+    ssize_t num = 0;
+    char buf[] = {0x41, 0x05, 0x05, 0x00, 0x10, 0x00, 0x01};  /* only reads may be ranges */
+
+    printf("%-*s", print_cols, "test 241: parse 'Read Multiple Ranges' request PDU with invalid func_code");
+    num = mb_pdu_parse_req(&pdu, buf, sizeof(buf));
+    if (num != -MB_PDU_EXCEPT_ILLEGAL_VAL)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_pdu_parse_rd_mult_ranges_resp(void)
+{
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const mb_pdu_rd_mult_ranges_sub_req_t sub_req[] = {{0x03, 0x0010, 0x0002},
+                                                        {0x01, 0x0100, 0x000a}};
+    const uint16_t exp_regs[] = {0x1234, 0x5678};
+    const uint16_t exp_coils[] = {1, 0, 1, 0, 0, 0, 0, 0, 0, 1};
+    uint16_t val[10] = {0};
+    ssize_t num = 0;
+    char buf[] = {0x41, 0x06, 0x12, 0x34, 0x56, 0x78, 0x05, 0x02};
+
+    printf("%-*s", print_cols, "test 242: parse 'Read Multiple Ranges' response PDU and get values");
+    num = mb_pdu_parse_resp(&resp, buf, sizeof(buf));
+    if (num != sizeof(buf))
+    {
+        return FAIL;
+    }
+    if ((resp.func_code != 0x41) || (resp.rd_mult_ranges_resp.byte_count != 6))
+    {
+        return FAIL;
+    }
+    mb_pdu_set_rd_mult_ranges_req(&req, sub_req, 2);
+    num = mb_pdu_get_rd_mult_ranges_val(&req, &resp, 0, val);
+    if ((num != 2) || (memcmp(val, exp_regs, sizeof(exp_regs)) != 0))
+    {
+        return FAIL;
+    }
+    num = mb_pdu_get_rd_mult_ranges_val(&req, &resp, 1, val);
+    if ((num != 10) || (memcmp(val, exp_coils, sizeof(exp_coils)) != 0))
+    {
+        return FAIL;
+    }
+    num = mb_pdu_get_rd_mult_ranges_val(&req, &resp, 2, val);
+    if (num != -MB_PDU_EXCEPT_ILLEGAL_VAL)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_pdu_parse_wr_file_rec_req_long(void)
+{
+    mb_pdu_wr_file_rec_sub_req_t sub_req = {0};
+    mb_pdu_t pdu = {0};
+    ssize_t num = 0;
+    unsigned i = 0;
+    char buf[MB_PDU_WR_FILE_REC_MAX_REQ_DATA_LEN + 2] = {0};
+
+    printf("%-*s", print_cols, "test 243: parse 'Write File Record' request PDU with req_data_len above 127");
+    sub_req.ref_type = MB_PDU_FILE_REC_REF_TYPE;
+    sub_req.file_num = 0x0001;
+    sub_req.rec_num = 0x0010;
+    sub_req.rec_len = MB_PDU_WR_FILE_REC_MAX_REC_LEN;
+    for (i = 0; i < sub_req.rec_len; i++)
+        sub_req.rec_data[i] = 0xa000 + i;
+    num = mb_pdu_set_wr_file_rec_req(&pdu, &sub_req, 1);
+    if (num < 0)
+    {
+        return FAIL;
+    }
+    num = mb_pdu_format_req(&pdu, buf, sizeof(buf));
+    if (num != sizeof(buf))
+    {
+        return FAIL;
+    }
+    num = mb_pdu_parse_req(&pdu, buf, sizeof(buf));
+    if (num != sizeof(buf))
+    {
+        return FAIL;
+    }
+    if ((pdu.wr_file_rec_req.req_data_len != MB_PDU_WR_FILE_REC_MAX_REQ_DATA_LEN)
+     || (memcmp(pdu.wr_file_rec_req.sub_req[0].rec_data, sub_req.rec_data, sizeof(sub_req.rec_data)) != 0))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_pdu_resp_len(void)
+{
+    typedef struct
+    {
+        char req[16];
+        size_t req_len;
+        size_t resp_len;
+    }
+    resp_len_case_t;
+
+    const resp_len_case_t cases[] = {{{0x01, 0x00, 0x13, 0x00, 0x01}, 5, 3},
+                                     {{0x01, 0x00, 0x13, 0x00, 0x08}, 5, 3},
+                                     {{0x01, 0x00, 0x13, 0x00, 0x09}, 5, 4},
+                                     {{0x01, 0x00, 0x00, 0x07, 0xd0}, 5, 252},
+                                     {{0x02, 0x00, 0xc4, 0x00, 0x16}, 5, 5},
+                                     {{0x03, 0x00, 0x6b, 0x00, 0x01}, 5, 4},
+                                     {{0x03, 0x00, 0x00, 0x00, 0x7d}, 5, 252},
+                                     {{0x04, 0x00, 0x08, 0x00, 0x0a}, 5, 22},
+                                     {{0x05, 0x00, 0xac, 0xff, 0x00}, 5, 5},
+                                     {{0x06, 0x00, 0x01, 0x00, 0x03}, 5, 5},
+                                     {{0x07}, 1, 2},
+                                     {{0x08, 0x00, 0x00, 0xa5, 0x37}, 5, 0},
+                                     {{0x0b}, 1, 5},
+                                     {{0x0c}, 1, 0},
+                                     {{0x0f, 0x00, 0x13, 0x00, 0x0a, 0x02, 0xcd, 0x01}, 8, 5},
+                                     {{0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x00, 0x0a, 0x01, 0x02}, 10, 5},
+                                     {{0x11}, 1, 0},
+                                     {{0x16, 0x00, 0x04, 0x00, 0xf2, 0x00, 0x25}, 7, 7},
+                                     {{0x17, 0x00, 0x03, 0x00, 0x06, 0x00, 0x0e, 0x00, 0x03, 0x06, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff}, 16, 14},
+                                     {{0x18, 0x04, 0xde}, 3, 0},
+                                     {{0x2b, 0x0e, 0x01, 0x00}, 4, 0},
+                                     {{0x41, 0x05, 0x03, 0x00, 0x10, 0x00, 0x02}, 7, 6},
+                                     {{0x41, 0x0a, 0x03, 0x00, 0x10, 0x00, 0x02, 0x01, 0x01, 0x00, 0x00, 0x0a}, 12, 8}};
+    mb_pdu_t pdu = {0};
+    ssize_t num = 0;
+    unsigned i = 0;
+
+    printf("%-*s", print_cols, "test 244: response lengths of parsed request PDUs");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        memset(&pdu, 0, sizeof(pdu));
+        num = mb_pdu_parse_req(&pdu, cases[i].req, cases[i].req_len);
+        if (num != cases[i].req_len)
+        {
+            return FAIL;
+        }
+        if (mb_pdu_resp_len(&pdu) != cases[i].resp_len)
+        {
+            return FAIL;
+        }
+    }
+    return PASS;
+}
+
 int main(void)
 {
     mb_test_func_t func[] = {test_mb_pdu_set,
@@ -5113,7 +5368,15 @@ int main(void)
                              test_mb_pdu_parse_enc_if_trans_req,
                              test_mb_pdu_parse_enc_if_trans_resp,
                              test_mb_pdu_parse_err_resp,
-                             test_mb_pdu_parse_err_resp_invalid_except_code};
+                             test_mb_pdu_parse_err_resp_invalid_except_code,
+                             test_mb_pdu_rd_mult_ranges_req,
+                             test_mb_pdu_rd_mult_ranges_req_invalid_byte_count,
+                             test_mb_pdu_rd_mult_ranges_resp,
+                             test_mb_pdu_parse_rd_mult_ranges_req,
+                             test_mb_pdu_parse_rd_mult_ranges_req_invalid_func_code,
+                             test_mb_pdu_parse_rd_mult_ranges_resp,
+                             test_mb_pdu_parse_wr_file_rec_req_long,
+                             test_mb_pdu_resp_len};
 
     return mb_test_run(func, sizeof(func) / sizeof(func[0]));
 }
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include "mb_poll_pool.h"
+#include "mb_tcp_server.h"
+#include "mb_reg_bank.h"
+#include "mb_test.h"
+
+#define HOST_ADDR     "127.0.0.1"
+#define SERVER_PORT   10050
+#define ECHO_UNIT     1
+#define NUM_DEV       4
+#define NUM_MOVE      20
+
+int print_cols = 93;
+
+typedef struct
+{
+    int num[NUM_DEV];
+    int num_err;
+    int num_bad;
+    int num_after[NUM_DEV];                             /* results received after a device moved */
+}
+record_t;
+
+static mb_tcp_server_t server = {0};
+static mb_reg_bank_t bank = {0};
+static pthread_t server_thread = {0};
+
+static int handle_req(mb_tcp_server_t *s, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    return mb_reg_bank_handle(&bank, &req->pdu, &resp->pdu);
+}
+
+static void *server_run(void *arg)
+{
+    mb_tcp_server_run((mb_tcp_server_t *)arg);
+    return NULL;
+}
+
+static int setup(void)
+{
+    uint16_t val[100] = {0};
+    int ret = 0;
+    int i = 0;
+
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+        return -1;
+    for (i = 0; i < 100; i++)
+        val[i] = 0xe000 + i;
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0, 100, val);
+    ret = mb_tcp_server_create(&server, HOST_ADDR, SERVER_PORT, handle_req);
+    if (ret < 0)
+        return -1;
+    mb_tcp_server_authorise_addr(&server, HOST_ADDR);
+    pthread_create(&server_thread, NULL, server_run, &server);
+    usleep(100000);
+    return 0;
+}
+
+static void teardown(void)
+{
+    pthread_cancel(server_thread);
+    pthread_join(server_thread, NULL);
+    mb_tcp_server_destroy(&server);
+    mb_reg_bank_destroy(&bank);
+}
+
+static int create(mb_poll_pool_t *pool, int *dev)
+{
+    struct timeval timeout = {0, 200000};
+    struct timeval period = {0, 50000};
+    mb_pdu_t req = {0};
+    int i = 0;
+
+    if (mb_poll_pool_create(pool, 2, timeout) < 0)
+        return -1;
+    mb_poll_pool_authorise_addr(pool, HOST_ADDR);
+    for (i = 0; i < NUM_DEV; i++)
+    {
+        dev[i] = mb_poll_pool_add_tcp_dev(pool, HOST_ADDR, SERVER_PORT, ECHO_UNIT, 2);
+        mb_pdu_set_rd_hold_regs_req(&req, i, 1);
+        if ((dev[i] < 0) || (mb_poll_pool_add_group(pool, dev[i], &req, 1, period, period, 0) < 0))
+        {
+            mb_poll_pool_destroy(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* collect results for msec milliseconds, sleeping on the pool eventfd in between */
+static void collect(mb_poll_pool_t *pool, record_t *rec, long msec, int moved)
+{
+    mb_poll_pool_result_t res = {0};
+    struct timespec start = {0};
+    struct timespec now = {0};
+    struct pollfd pfd = {0};
+    uint16_t val = 0;
+
+    pfd.fd = mb_poll_pool_get_fd(pool);
+    pfd.events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        poll(&pfd, 1, 10);
+        while (mb_poll_pool_next(pool, &res) == 0)
+        {
+            if ((res.dev < 0) || (res.dev >= NUM_DEV))
+            {
+                rec->num_bad++;
+                continue;
+            }
+            if (res.result <= 0)
+            {
+                rec->num_err++;
+                continue;
+            }
+            val = ((uint8_t)res.resp[2] << 8) | (uint8_t)res.resp[3];
+            if ((res.resp_len != 4) || (res.resp[0] != MB_PDU_RD_HOLD_REGS) || (val != 0xe000 + res.dev))
+                rec->num_bad++;
+            rec->num[res.dev]++;
+            if (mb_poll_pool_get_shard(pool, res.dev) == moved)
+                rec->num_after[res.dev]++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < msec);
+}
+
+mb_test_result_t test_mb_poll_pool_shard(void)
+{
+    mb_poll_pool_t pool = {0};
+    record_t rec = {0};
+    int dev[NUM_DEV] = {0};
+    int count[2] = {0};
+    int result = PASS;
+    int shard = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 1: spread devices across shards and queue their results");
+    if (create(&pool, dev) < 0)
+        return FAIL;
+    if (mb_poll_pool_start(&pool) < 0)
+    {
+        mb_poll_pool_destroy(&pool);
+        return FAIL;
+    }
+    collect(&pool, &rec, 1000, -1);
+    mb_poll_pool_stop(&pool);
+    for (i = 0; i < NUM_DEV; i++)
+    {
+        shard = mb_poll_pool_get_shard(&pool, dev[i]);
+        if ((shard < 0) || (shard > 1))
+        {
+            result = FAIL;
+            continue;
+        }
+        count[shard]++;
+        /* one cycle every 50 ms */
+        if ((rec.num[i] < 17) || (rec.num[i] > 21))
+            result = FAIL;
+    }
+    if ((count[0] != 2) || (count[1] != 2)
+     || (rec.num_err != 0)
+     || (rec.num_bad != 0)
+     || (atomic_load(&pool.num_dropped) != 0))
+        result = FAIL;
+    mb_poll_pool_destroy(&pool);
+    return result;
+}
+
+mb_test_result_t test_mb_poll_pool_migrate(void)
+{
+    mb_poll_pool_t pool = {0};
+    record_t rec = {0};
+    int dev[NUM_DEV] = {0};
+    int num_move = 1;
+    int result = PASS;
+    int other = 0;
+    int from = 0;
+    int to = 0;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 2: move a device to another shard while polling");
+    if (create(&pool, dev) < 0)
+        return FAIL;
+    if (mb_poll_pool_start(&pool) < 0)
+    {
+        mb_poll_pool_destroy(&pool);
+        return FAIL;
+    }
+    collect(&pool, &rec, 300, -1);
+    from = mb_poll_pool_get_shard(&pool, dev[0]);
+    to = 1 - from;
+    ret = mb_poll_pool_migrate(&pool, dev[0], to);
+    if (ret < 0)
+        result = FAIL;
+    /* a second request for the same shard waits for the first to complete */
+    other = mb_poll_pool_get_shard(&pool, dev[1]);
+    ret = mb_poll_pool_migrate(&pool, dev[1], to);
+    if ((ret < 0) && (ret != -EBUSY))
+        result = FAIL;
+    /* unless the first has already completed */
+    if ((ret == 0) && (other != to))
+        num_move = 2;
+    collect(&pool, &rec, 700, to);
+    mb_poll_pool_stop(&pool);
+    if ((mb_poll_pool_get_shard(&pool, dev[0]) != to)
+     || ((num_move == 2) && (mb_poll_pool_get_shard(&pool, dev[1]) != to))
+     || (atomic_load(&pool.num_migrated) != num_move)
+     || (rec.num_after[0] < 8)
+     || (rec.num_err != 0)
+     || (rec.num_bad != 0))
+        result = FAIL;
+    for (i = 1; i < NUM_DEV; i++)
+    {
+        if (rec.num[i] < 17)
+            result = FAIL;
+    }
+    /* the move skips at most one cycle */
+    if (rec.num[0] < 16)
+        result = FAIL;
+    mb_poll_pool_destroy(&pool);
+    return result;
+}
+
+mb_test_result_t test_mb_poll_pool_rebalance(void)
+{
+    mb_poll_pool_shard_t *shard = NULL;
+    mb_poll_pool_t pool = {0};
+    record_t rec = {0};
+    int dev[NUM_DEV] = {0};
+    int result = PASS;
+    int to = 0;
+    int i = 0;
+    int j = 0;
+
+    printf("%-*s", print_cols, "test 3: move a device back and forth without growing the shards");
+    if (create(&pool, dev) < 0)
+        return FAIL;
+    if (mb_poll_pool_start(&pool) < 0)
+    {
+        mb_poll_pool_destroy(&pool);
+        return FAIL;
+    }
+    for (i = 0; i < NUM_MOVE; i++)
+    {
+        to = 1 - mb_poll_pool_get_shard(&pool, dev[0]);
+        if (mb_poll_pool_migrate(&pool, dev[0], to) < 0)
+        {
+            result = FAIL;
+            break;
+        }
+        for (j = 0; (j < 50) && (mb_poll_pool_get_shard(&pool, dev[0]) != to); j++)
+            collect(&pool, &rec, 10, -1);
+        if (mb_poll_pool_get_shard(&pool, dev[0]) != to)
+        {
+            result = FAIL;
+            break;
+        }
+    }
+    memset(&rec, 0, sizeof(rec));
+    collect(&pool, &rec, 300, -1);
+    mb_poll_pool_stop(&pool);
+    /* without reuse each move would leave another dead device and group behind */
+    for (i = 0; i < pool.num_shard; i++)
+    {
+        shard = &pool.shard[i];
+        if ((shard->poller.num_dev > NUM_DEV)
+         || (shard->poller.num_group > NUM_DEV)
+         || (shard->num_local_dev != shard->poller.num_dev)
+         || (shard->num_local_group != shard->poller.num_group))
+            result = FAIL;
+    }
+    if ((atomic_load(&pool.num_migrated) < NUM_MOVE)
+     || (rec.num[dev[0]] < 4)
+     || (rec.num_err != 0)
+     || (rec.num_bad != 0))
+        result = FAIL;
+    mb_poll_pool_destroy(&pool);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_poll_pool_shard,
+                             test_mb_poll_pool_migrate,
+                             test_mb_poll_pool_rebalance};
+    int ret = 0;
+
+    if (setup() < 0)
+    {
+        printf("failed to set up the server\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    teardown();
+    return ret;
+}
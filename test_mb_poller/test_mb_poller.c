@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "mb_poller.h"
+#include "mb_tcp_server.h"
+#include "mb_reg_bank.h"
+#include "mb_test.h"
+
+#define HOST_ADDR     "127.0.0.1"
+#define SERVER_PORT   10040
+#define ECHO_UNIT     1
+#define SILENT_UNIT   99                                /* requests are never answered */
+#define FLAKY_UNIT    98                                /* requests are answered when flaky_up is set */
+#define MAX_RECORD    64
+#define RTU_ADDR      1
+
+int print_cols = 93;
+
+typedef struct
+{
+    int num;
+    int group[MAX_RECORD];
+    int req[MAX_RECORD];
+    ssize_t result[MAX_RECORD];
+    uint16_t val[MAX_RECORD];
+    int max_in_flight;
+    int num_overrun;
+}
+record_t;
+
+static mb_tcp_server_t server = {0};
+static mb_reg_bank_t bank = {0};
+static pthread_t server_thread = {0};
+static atomic_int flaky_up = 0;
+
+static int handle_req(mb_tcp_server_t *s, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    if ((req->unit_id == SILENT_UNIT) || ((req->unit_id == FLAKY_UNIT) && (!atomic_load(&flaky_up))))
+    {
+        return MB_TCP_SERVER_DEFERRED;  /* never answered */
+    }
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    return mb_reg_bank_handle(&bank, &req->pdu, &resp->pdu);
+}
+
+static void *server_run(void *arg)
+{
+    mb_tcp_server_run((mb_tcp_server_t *)arg);
+    return NULL;
+}
+
+static int setup(void)
+{
+    uint16_t val[100] = {0};
+    int ret = 0;
+    int i = 0;
+
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+        return -1;
+    for (i = 0; i < 100; i++)
+        val[i] = 0xd000 + i;
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0, 100, val);
+    ret = mb_tcp_server_create(&server, HOST_ADDR, SERVER_PORT, handle_req);
+    if (ret < 0)
+        return -1;
+    mb_tcp_server_authorise_addr(&server, HOST_ADDR);
+    pthread_create(&server_thread, NULL, server_run, &server);
+    usleep(100000);
+    return 0;
+}
+
+static void teardown(void)
+{
+    pthread_cancel(server_thread);
+    pthread_join(server_thread, NULL);
+    mb_tcp_server_destroy(&server);
+    mb_reg_bank_destroy(&bank);
+}
+
+static void record(mb_poller_t *poller, int group, int req, ssize_t result, mb_pdu_t *resp, void *arg)
+{
+    record_t *rec = (record_t *)arg;
+    int i = 0;
+
+    for (i = 0; i < poller->num_dev; i++)
+    {
+        if (poller->dev[i].num_in_flight > rec->max_in_flight)
+            rec->max_in_flight = poller->dev[i].num_in_flight;
+    }
+    if (req == MB_POLLER_OVERRUN)
+    {
+        rec->num_overrun++;
+        return;
+    }
+    if (rec->num == MAX_RECORD)
+        return;
+    rec->group[rec->num] = group;
+    rec->req[rec->num] = req;
+    rec->result[rec->num] = result;
+    if (resp != NULL)
+        rec->val[rec->num] = resp->rd_hold_regs_resp.reg_val[0];
+    rec->num++;
+}
+
+static int create(mb_poller_t *poller, mb_tcp_client_t *client, int *endpoint)
+{
+    struct timeval timeout = {0, 200000};
+
+    if (mb_poller_create(poller) < 0)
+        return -1;
+    mb_tcp_client_create(client, timeout);
+    mb_tcp_client_authorise_addr(client, HOST_ADDR);
+    *endpoint = mb_tcp_client_add_endpoint(client, HOST_ADDR, SERVER_PORT);
+    return *endpoint;
+}
+
+static void destroy(mb_poller_t *poller, mb_tcp_client_t *client)
+{
+    mb_poller_destroy(poller);
+    mb_tcp_client_destroy(client);
+}
+
+static void run_for(mb_poller_t *poller, long msec)
+{
+    struct timespec start = {0};
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        mb_poller_run_once(poller, 10);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < msec);
+}
+
+mb_test_result_t test_mb_poller_period(void)
+{
+    struct timeval period_a = {0, 50000};
+    struct timeval period_b = {0, 100000};
+    mb_poller_stats_t stats_a = {0};
+    mb_poller_stats_t stats_b = {0};
+    mb_tcp_client_t client = {0};
+    mb_poller_t poller = {0};
+    mb_pdu_t req[2] = {{0}};
+    record_t rec = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int dev = 0;
+    int a = 0;
+    int b = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 1: release scan groups at their periods");
+    if (create(&poller, &client, &endpoint) < 0)
+        return FAIL;
+    mb_pdu_set_rd_hold_regs_req(&req[0], 1, 1);
+    mb_pdu_set_rd_hold_regs_req(&req[1], 2, 1);
+    dev = mb_poller_add_tcp_dev(&poller, &client, endpoint, ECHO_UNIT, 4);
+    a = mb_poller_add_group(&poller, dev, req, 2, period_a, period_a, 0, record, &rec);
+    b = mb_poller_add_group(&poller, dev, req, 1, period_b, period_b, 0, NULL, NULL);
+    if ((dev < 0) || (a < 0) || (b < 0))
+    {
+        destroy(&poller, &client);
+        return FAIL;
+    }
+    run_for(&poller, 1000);
+    mb_poller_get_stats(&poller, a, &stats_a);
+    mb_poller_get_stats(&poller, b, &stats_b);
+    if ((stats_a.num_cycle < 18) || (stats_a.num_cycle > 21)
+     || (stats_b.num_cycle < 9) || (stats_b.num_cycle > 11)
+     || (stats_a.num_overrun != 0)
+     || (stats_a.num_err != 0)
+     || (stats_a.jitter_max_usec > 20000))
+        result = FAIL;
+    for (i = 0; i < rec.num; i++)
+    {
+        if ((rec.result[i] <= 0) || (rec.val[i] != 0xd001 + rec.req[i]))
+            result = FAIL;
+    }
+    destroy(&poller, &client);
+    return result;
+}
+
+mb_test_result_t test_mb_poller_order(void)
+{
+    struct timeval period = {10, 0};
+    struct timeval deadline[4] = {{0, 300000}, {0, 100000}, {0, 200000}, {0, 100000}};
+    int priority[4] = {0, 1, 0, 0};
+    int expect[4] = {3, 1, 2, 0};
+    mb_tcp_client_t client = {0};
+    mb_poller_t poller = {0};
+    mb_pdu_t req = {0};
+    record_t rec = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int dev = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 2: send in order of deadline and priority within the device limit");
+    if (create(&poller, &client, &endpoint) < 0)
+        return FAIL;
+    dev = mb_poller_add_tcp_dev(&poller, &client, endpoint, ECHO_UNIT, 1);
+    for (i = 0; i < 4; i++)
+    {
+        mb_pdu_set_rd_hold_regs_req(&req, 10 + i, 1);
+        mb_poller_add_group(&poller, dev, &req, 1, period, deadline[i], priority[i], record, &rec);
+    }
+    run_for(&poller, 200);
+    if ((rec.num != 4) || (rec.max_in_flight > 1))
+        result = FAIL;
+    for (i = 0; i < rec.num; i++)
+    {
+        if ((rec.group[i] != expect[i]) || (rec.val[i] != 0xd000 + 10 + expect[i]))
+            result = FAIL;
+    }
+    destroy(&poller, &client);
+    return result;
+}
+
+mb_test_result_t test_mb_poller_overrun(void)
+{
+    struct timeval period = {0, 50000};
+    mb_poller_stats_t stats = {0};
+    mb_tcp_client_t client = {0};
+    mb_poller_t poller = {0};
+    mb_pdu_t req = {0};
+    record_t rec = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int group = 0;
+    int dev = 0;
+
+    printf("%-*s", print_cols, "test 3: report cycles that overrun their period");
+    if (create(&poller, &client, &endpoint) < 0)
+        return FAIL;
+    mb_pdu_set_rd_hold_regs_req(&req, 0, 1);
+    dev = mb_poller_add_tcp_dev(&poller, &client, endpoint, SILENT_UNIT, 1);
+    group = mb_poller_add_group(&poller, dev, &req, 1, period, period, 0, record, &rec);
+    run_for(&poller, 500);
+    mb_poller_get_stats(&poller, group, &stats);
+    /* each request times out after 200 ms, so three of every four releases are skipped */
+    if ((stats.num_cycle < 1)
+     || (stats.num_overrun < 3)
+     || (stats.num_overrun != rec.num_overrun)
+     || (stats.num_err != stats.num_cycle)
+     || (stats.num_late != stats.num_cycle)
+     || (rec.result[0] != -ETIMEDOUT))
+        result = FAIL;
+    destroy(&poller, &client);
+    return result;
+}
+
+mb_test_result_t test_mb_poller_circuit_open(void)
+{
+    struct timeval period = {0, 50000};
+    struct timeval min_backoff = {0, 300000};
+    struct timeval max_backoff = {0, 500000};
+    mb_poller_health_t health_a = {0};
+    mb_poller_health_t health_b = {0};
+    mb_poller_stats_t stats = {0};
+    mb_tcp_client_t client = {0};
+    mb_poller_t poller = {0};
+    mb_pdu_t req = {0};
+    record_t rec = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int group = 0;
+    int a = 0;
+    int b = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 4: skip an unreachable device with increasing backoff");
+    if (create(&poller, &client, &endpoint) < 0)
+        return FAIL;
+    mb_poller_set_circuit(&poller, 2, min_backoff, max_backoff);
+    mb_pdu_set_rd_hold_regs_req(&req, 0, 1);
+    a = mb_poller_add_tcp_dev(&poller, &client, endpoint, SILENT_UNIT, 1);
+    b = mb_poller_add_tcp_dev(&poller, &client, endpoint, ECHO_UNIT, 1);
+    mb_poller_add_group(&poller, a, &req, 1, period, period, 0, record, &rec);
+    group = mb_poller_add_group(&poller, b, &req, 1, period, period, 0, NULL, NULL);
+    run_for(&poller, 2000);
+    mb_poller_get_health(&poller, a, &health_a);
+    mb_poller_get_health(&poller, b, &health_b);
+    mb_poller_get_stats(&poller, group, &stats);
+    /* two timeouts open the circuit, each failed probe doubles the backoff up to the limit */
+    if ((health_a.circuit == MB_POLLER_CIRCUIT_CLOSED)
+     || (health_a.num_trip < 2)
+     || (health_a.num_ok != 0)
+     || (health_a.num_fail < 3)
+     || (health_a.num_fail > 5)
+     || (health_a.num_skip < 8)
+     || (health_a.backoff.tv_sec != 0)
+     || (health_a.backoff.tv_nsec != 500000000))
+        result = FAIL;
+    for (i = 0; i < rec.num; i++)
+    {
+        if ((rec.result[i] != -ETIMEDOUT) && (rec.result[i] != -EHOSTUNREACH))
+            result = FAIL;
+    }
+    /* the healthy device keeps its scan rate */
+    if ((health_b.circuit != MB_POLLER_CIRCUIT_CLOSED)
+     || (health_b.num_fail != 0)
+     || (health_b.num_except != 0)
+     || (health_b.rtt_usec <= 0)
+     || (health_b.rtt_max_usec < health_b.rtt_usec)
+     || (stats.num_cycle < 38)
+     || (stats.num_err != 0))
+        result = FAIL;
+    destroy(&poller, &client);
+    return result;
+}
+
+mb_test_result_t test_mb_poller_circuit_close(void)
+{
+    struct timeval period = {0, 50000};
+    struct timeval min_backoff = {0, 200000};
+    struct timeval max_backoff = {1, 0};
+    mb_poller_health_t health = {0};
+    mb_tcp_client_t client = {0};
+    mb_poller_t poller = {0};
+    mb_pdu_t req = {0};
+    record_t rec = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int dev = 0;
+
+    printf("%-*s", print_cols, "test 5: close the circuit when a probe is answered");
+    if (create(&poller, &client, &endpoint) < 0)
+        return FAIL;
+    mb_poller_set_circuit(&poller, 2, min_backoff, max_backoff);
+    mb_pdu_set_rd_hold_regs_req(&req, 3, 1);
+    dev = mb_poller_add_tcp_dev(&poller, &client, endpoint, FLAKY_UNIT, 1);
+    mb_poller_add_group(&poller, dev, &req, 1, period, period, 0, record, &rec);
+    atomic_store(&flaky_up, 0);
+    run_for(&poller, 700);
+    mb_poller_get_health(&poller, dev, &health);
+    if ((health.circuit == MB_POLLER_CIRCUIT_CLOSED) || (health.num_trip < 1))
+        result = FAIL;
+    atomic_store(&flaky_up, 1);
+    rec.num = 0;
+    run_for(&poller, 1000);
+    mb_poller_get_health(&poller, dev, &health);
+    if ((health.circuit != MB_POLLER_CIRCUIT_CLOSED)
+     || (health.num_fail_run != 0)
+     || (health.num_ok < 5)
+     || (rec.num == 0)
+     || (rec.result[rec.num - 1] <= 0)
+     || (rec.val[rec.num - 1] != 0xd003))
+        result = FAIL;
+    atomic_store(&flaky_up, 0);
+    destroy(&poller, &client);
+    return result;
+}
+
+mb_test_result_t test_mb_poller_rtu_silent(void)
+{
+    struct timeval period = {0, 50000};
+    struct termios options = {0};
+    mb_poller_stats_t stats = {0};
+    mb_rtu_master_t master = {{0}};
+    mb_tcp_client_t client = {0};
+    mb_poller_t poller = {0};
+    mb_pdu_t req = {0};
+    record_t rec = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int group = 0;
+    int pty = 0;
+    int a = 0;
+    int b = 0;
+
+    printf("%-*s", print_cols, "test 6: keep polling TCP devices while an RTU slave is silent");
+    /* nothing answers on the other side of the pseudo terminal */
+    pty = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((pty < 0) || (grantpt(pty) < 0) || (unlockpt(pty) < 0))
+        return FAIL;
+    tcgetattr(pty, &options);
+    cfmakeraw(&options);
+    tcsetattr(pty, TCSANOW, &options);
+    if (mb_rtu_master_create(&master, ptsname(pty)) < 0)
+    {
+        close(pty);
+        return FAIL;
+    }
+    if (create(&poller, &client, &endpoint) < 0)
+    {
+        mb_rtu_master_destroy(&master);
+        close(pty);
+        return FAIL;
+    }
+    mb_pdu_set_rd_hold_regs_req(&req, 4, 1);
+    a = mb_poller_add_rtu_dev(&poller, &master, RTU_ADDR);
+    b = mb_poller_add_tcp_dev(&poller, &client, endpoint, ECHO_UNIT, 1);
+    mb_poller_add_group(&poller, a, &req, 1, period, period, 0, record, &rec);
+    group = mb_poller_add_group(&poller, b, &req, 1, period, period, 0, NULL, NULL);
+    run_for(&poller, 1500);
+    mb_poller_get_stats(&poller, group, &stats);
+    /* the RTU request times out after a second without holding up the TCP device */
+    if ((a < 0)
+     || (rec.num < 1)
+     || (rec.result[0] != -ETIMEDOUT)
+     || (stats.num_cycle < 27)
+     || (stats.num_overrun != 0)
+     || (stats.num_err != 0)
+     || (stats.jitter_max_usec > 20000))
+        result = FAIL;
+    destroy(&poller, &client);
+    mb_rtu_master_destroy(&master);
+    close(pty);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_poller_period,
+                             test_mb_poller_order,
+                             test_mb_poller_overrun,
+                             test_mb_poller_circuit_open,
+                             test_mb_poller_circuit_close,
+                             test_mb_poller_rtu_silent};
+    int ret = 0;
+
+    if (setup() < 0)
+    {
+        printf("failed to set up the server\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    teardown();
+    return ret;
+}
@@ -0,0 +1,853 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include "mb_reg_bank.h"
+#include "mb_test.h"
+
+#define NUM_ITER  2000
+#define NUM_REGS  1024
+
+int print_cols = 93;
+
+mb_test_result_t test_mb_reg_bank_regs(void)
+{
+    mb_reg_bank_t bank = {0};
+    const uint16_t wr_val[] = {0x1234, 0x5678, 0x9abc};
+    uint16_t rd_val[3] = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 1: write and read holding registers");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0100, 3, wr_val);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    ret = mb_reg_bank_rd_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0100, 3, rd_val);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    if (memcmp(rd_val, wr_val, sizeof(wr_val)) != 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_bits(void)
+{
+    mb_reg_bank_t bank = {0};
+    const uint8_t wr_val[] = {0xa5, 0x03};
+    uint8_t rd_val[2] = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 2: write and read coils");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_wr_bits(&bank, MB_REG_BANK_COILS, 0x0013, 10, wr_val);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    ret = mb_reg_bank_rd_bits(&bank, MB_REG_BANK_COILS, 0x0013, 10, rd_val);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    if (memcmp(rd_val, wr_val, sizeof(wr_val)) != 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    ret = mb_reg_bank_rd_bits(&bank, MB_REG_BANK_COILS, 0x0014, 8, rd_val);
+    if ((ret < 0) || (rd_val[0] != 0xd2))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_invalid(void)
+{
+    mb_reg_bank_t bank = {0};
+    uint16_t val[2] = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 3: access with invalid table and invalid address");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_rd_regs(&bank, MB_REG_BANK_COILS, 0x0000, 1, val);
+    if (ret != -EINVAL)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    ret = mb_reg_bank_rd_regs(&bank, MB_REG_BANK_IP_REGS, 0xffff, 2, val);
+    if (ret != -EINVAL)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_mask_wr_reg(void)
+{
+    mb_reg_bank_t bank = {0};
+    const uint16_t wr_val = 0x0012;
+    uint16_t rd_val = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 4: mask write register");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0004, 1, &wr_val);
+    mb_reg_bank_mask_wr_reg(&bank, 0x0004, 0x00f2, 0x0025);
+    mb_reg_bank_rd_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0004, 1, &rd_val);
+    if (rd_val != 0x0017)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_rd_wr_regs(void)
+{
+    mb_reg_bank_t bank = {0};
+    const uint16_t wr_val[] = {0x1111, 0x2222};
+    const uint16_t exp[] = {0x0000, 0x1111, 0x2222};
+    uint16_t rd_val[3] = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 5: read/write multiple registers with overlapping ranges");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_rd_wr_regs(&bank, 0x0009, 3, rd_val, 0x000a, 2, wr_val);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    if (memcmp(rd_val, exp, sizeof(exp)) != 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+static void set_ip_regs(mb_reg_bank_data_t *data, void *arg)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < NUM_REGS; i++)
+        data->ip_reg[i] = *(uint16_t *)arg;
+}
+
+mb_test_result_t test_mb_reg_bank_update(void)
+{
+    mb_reg_bank_t bank = {0};
+    uint16_t val = 0x4321;
+    uint16_t rd_val[2] = {0};
+    const uint16_t wr_val = 0x0001;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 6: bulk update preserves earlier writes");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0000, 1, &wr_val);
+    mb_reg_bank_update(&bank, set_ip_regs, &val);
+    mb_reg_bank_rd_regs(&bank, MB_REG_BANK_IP_REGS, NUM_REGS - 2, 2, rd_val);
+    if ((rd_val[0] != val) || (rd_val[1] != val))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_rd_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0000, 1, rd_val);
+    if (rd_val[0] != wr_val)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_handle(void)
+{
+    mb_reg_bank_t bank = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const uint16_t wr_val[] = {0xaaaa, 0xbbbb};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 7: handle write and read holding registers requests");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_pdu_set_wr_mult_regs_req(&req, 0x0020, 2, 4, wr_val);
+    ret = mb_reg_bank_handle(&bank, &req, &resp);
+    if ((ret < 0) || (resp.wr_mult_regs_resp.quant_regs != 2))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_pdu_set_rd_hold_regs_req(&req, 0x0020, 2);
+    ret = mb_reg_bank_handle(&bank, &req, &resp);
+    if ((ret < 0)
+     || (resp.rd_hold_regs_resp.byte_count != 4)
+     || (memcmp(resp.rd_hold_regs_resp.reg_val, wr_val, sizeof(wr_val)) != 0))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_pdu_set_rd_fifo_q_req(&req, 0x0000);
+    ret = mb_reg_bank_handle(&bank, &req, &resp);
+    if (ret != -MB_PDU_EXCEPT_ILLEGAL_FUNC)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+static void *update_thread(void *arg)
+{
+    mb_reg_bank_t *bank = (mb_reg_bank_t *)arg;
+    uint16_t val = 0;
+    unsigned i = 0;
+
+    for (i = 0; i < NUM_ITER; i++)
+    {
+        val = i;
+        if (i & 1)
+            mb_reg_bank_update(bank, set_ip_regs, &val);
+        else
+            mb_reg_bank_wr_regs(bank, MB_REG_BANK_IP_REGS, 0, 1, &val);
+    }
+    return NULL;
+}
+
+mb_test_result_t test_mb_reg_bank_concurrent(void)
+{
+    mb_reg_bank_t bank = {0};
+    pthread_t thread = {0};
+    uint16_t val[NUM_REGS] = {0};
+    unsigned i = 0;
+    unsigned j = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 8: concurrent bulk updates and reads");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    ret = pthread_create(&thread, NULL, update_thread, &bank);
+    if (ret != 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    for (i = 0; i < NUM_ITER; i++)
+    {
+        mb_reg_bank_rd_regs(&bank, MB_REG_BANK_IP_REGS, 1, NUM_REGS - 1, val);
+        for (j = 1; j < NUM_REGS - 1; j++)
+        {
+            if (val[j] != val[0])
+            {
+                pthread_join(thread, NULL);
+                mb_reg_bank_destroy(&bank);
+                return FAIL;
+            }
+        }
+    }
+    pthread_join(thread, NULL);
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_persist(void)
+{
+    mb_reg_bank_t bank = {0};
+    const uint16_t wr_val[] = {0xcafe, 0xf00d};
+    uint16_t rd_val[2] = {0};
+    char path[] = "/tmp/test_mb_reg_bank_XXXXXX";
+    int ret = 0;
+    int fd = 0;
+
+    printf("%-*s", print_cols, "test 9: holding registers persist in a file mapping");
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return FAIL;
+    }
+    close(fd);
+    ret = mb_reg_bank_open(&bank, path, 0);
+    if (ret < 0)
+    {
+        unlink(path);
+        return FAIL;
+    }
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x1000, 2, wr_val);
+    mb_reg_bank_destroy(&bank);
+    ret = mb_reg_bank_open(&bank, path, MB_REG_BANK_RDONLY);
+    if (ret < 0)
+    {
+        unlink(path);
+        return FAIL;
+    }
+    mb_reg_bank_rd_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x1000, 2, rd_val);
+    if (memcmp(rd_val, wr_val, sizeof(wr_val)) != 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        unlink(path);
+        return FAIL;
+    }
+    ret = mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x1000, 2, wr_val);
+    if (ret != -EROFS)
+    {
+        mb_reg_bank_destroy(&bank);
+        unlink(path);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    unlink(path);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_shared(void)
+{
+    mb_reg_bank_t writer = {0};
+    mb_reg_bank_t reader = {0};
+    const uint16_t wr_val = 0xbeef;
+    uint16_t rd_val = 0;
+    int ret = 0;
+    int fd = 0;
+
+    printf("%-*s", print_cols, "test 10: reader sees live values written through a shared memfd mapping");
+    fd = memfd_create("test_mb_reg_bank", 0);
+    if (fd < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&writer, fd, 0);
+    if (ret < 0)
+    {
+        close(fd);
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&reader, fd, MB_REG_BANK_RDONLY);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&writer);
+        close(fd);
+        return FAIL;
+    }
+    close(fd);
+    mb_reg_bank_wr_regs(&writer, MB_REG_BANK_HOLD_REGS, 0xfffe, 1, &wr_val);
+    mb_reg_bank_rd_regs(&reader, MB_REG_BANK_HOLD_REGS, 0xfffe, 1, &rd_val);
+    mb_reg_bank_destroy(&reader);
+    mb_reg_bank_destroy(&writer);
+    if (rd_val != wr_val)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_invalid_file(void)
+{
+    mb_reg_bank_t bank = {0};
+    char buf[64] = {0};
+    ssize_t num = 0;
+    int ret = 0;
+    int fd = 0;
+
+    printf("%-*s", print_cols, "test 11: reject a file that does not contain a register bank");
+    fd = memfd_create("test_mb_reg_bank", 0);
+    if (fd < 0)
+    {
+        return FAIL;
+    }
+    num = write(fd, buf, sizeof(buf));
+    if (num != sizeof(buf))
+    {
+        close(fd);
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&bank, fd, 0);
+    close(fd);
+    if (ret != -EPROTO)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_sub(void)
+{
+    mb_reg_bank_ev_t ev = {0};
+    mb_reg_bank_t bank = {0};
+    struct pollfd pfd = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const uint16_t wr_val[] = {0x0101, 0x0202, 0x0303, 0x0404};
+    int sub = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 12: subscriber receives old and new values of a write request");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0011, 1, &wr_val[3]);
+    sub = mb_reg_bank_subscribe(&bank, MB_REG_BANK_HOLD_REGS, 0x0011, 2);
+    if (sub < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    /* writes outside the range do not generate events */
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0013, 1, &wr_val[0]);
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_IP_REGS, 0x0011, 1, &wr_val[0]);
+    ret = mb_reg_bank_next_ev(&bank, sub, &ev);
+    if (ret != -EAGAIN)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_pdu_set_wr_mult_regs_req(&req, 0x0010, 4, 8, wr_val);
+    ret = mb_reg_bank_handle(&bank, &req, &resp);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    pfd.fd = mb_reg_bank_sub_fd(&bank, sub);
+    pfd.events = POLLIN;
+    ret = poll(&pfd, 1, 0);
+    if (ret != 1)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    ret = mb_reg_bank_next_ev(&bank, sub, &ev);
+    if ((ret < 0)
+     || (ev.table != MB_REG_BANK_HOLD_REGS)
+     || (ev.start_addr != 0x0011)
+     || (ev.quant != 2)
+     || (ev.old_val[0] != 0x0404)
+     || (ev.old_val[1] != 0x0000)
+     || (ev.new_val[0] != 0x0202)
+     || (ev.new_val[1] != 0x0303))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    ret = mb_reg_bank_next_ev(&bank, sub, &ev);
+    if (ret != -EAGAIN)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    /* the eventfd is cleared once the queue has been drained */
+    ret = poll(&pfd, 1, 0);
+    if (ret != 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_unsubscribe(&bank, sub);
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_sub_overrun(void)
+{
+    mb_reg_bank_ev_t ev = {0};
+    mb_reg_bank_t bank = {0};
+    uint8_t bits[0x100] = {0};
+    unsigned num = 0;
+    unsigned i = 0;
+    int sub = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 13: large writes are split into several events and overruns are counted");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    sub = mb_reg_bank_subscribe(&bank, MB_REG_BANK_COILS, 0x0000, 0x800);
+    if (sub < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    memset(bits, 0xff, sizeof(bits));
+    /* 2000 coils makes 16 events */
+    ret = mb_reg_bank_wr_bits(&bank, MB_REG_BANK_COILS, 0x0000, 2000, bits);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    while (mb_reg_bank_next_ev(&bank, sub, &ev) == 0)
+    {
+        if ((ev.start_addr != num * MB_REG_BANK_EV_MAX_QUANT)
+         || (ev.old_val[0] != 0)
+         || (ev.new_val[ev.quant - 1] != 1))
+        {
+            mb_reg_bank_destroy(&bank);
+            return FAIL;
+        }
+        num++;
+    }
+    if ((num != 16) || (mb_reg_bank_sub_overrun(&bank, sub) != 0))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    for (i = 0; i < MB_REG_BANK_SUB_NUM_EV + 3; i++)
+        mb_reg_bank_wr_bits(&bank, MB_REG_BANK_COILS, 0x0000, 1, &bits[i & 1]);
+    num = 0;
+    while (mb_reg_bank_next_ev(&bank, sub, &ev) == 0)
+        num++;
+    if ((num != MB_REG_BANK_SUB_NUM_EV) || (mb_reg_bank_sub_overrun(&bank, sub) != 3))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_handle_rd_mult_ranges(void)
+{
+    mb_reg_bank_t bank = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const mb_pdu_rd_mult_ranges_sub_req_t sub_req[] = {{MB_PDU_RD_HOLD_REGS, 0x0040, 2},
+                                                        {MB_PDU_RD_COILS, 0x0100, 3},
+                                                        {MB_PDU_RD_IP_REGS, 0x0200, 1}};
+    const uint8_t exp[] = {0x12, 0x34, 0x56, 0x78, 0x05, 0xab, 0xcd};
+    const uint16_t hold_val[] = {0x1234, 0x5678};
+    const uint8_t coil_val = 0x05;
+    const uint16_t ip_val = 0xabcd;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 14: handle read multiple ranges requests");
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0x0040, 2, hold_val);
+    mb_reg_bank_wr_bits(&bank, MB_REG_BANK_COILS, 0x0100, 3, &coil_val);
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_IP_REGS, 0x0200, 1, &ip_val);
+    mb_pdu_set_rd_mult_ranges_req(&req, sub_req, 3);
+    ret = mb_reg_bank_handle(&bank, &req, &resp);
+    if ((ret < 0)
+     || (resp.func_code != MB_PDU_RD_MULT_RANGES)
+     || (resp.rd_mult_ranges_resp.byte_count != sizeof(exp))
+     || (memcmp(resp.rd_mult_ranges_resp.data, exp, sizeof(exp)) != 0))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    /* no ranges is a valid request with an empty response */
+    mb_pdu_set_rd_mult_ranges_req(&req, NULL, 0);
+    ret = mb_reg_bank_handle(&bank, &req, &resp);
+    if ((ret < 0) || (resp.rd_mult_ranges_resp.byte_count != 0))
+    {
+        mb_reg_bank_destroy(&bank);
+        return FAIL;
+    }
+    mb_reg_bank_destroy(&bank);
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_handle_rdonly(void)
+{
+    mb_reg_bank_t writer = {0};
+    mb_reg_bank_t reader = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req[6] = {{0}};
+    const uint16_t wr_val[] = {0x1234, 0x5678};
+    const uint8_t op_val = 0x03;
+    uint16_t rd_val[2] = {0};
+    uint8_t bits = 0;
+    unsigned i = 0;
+    int ret = 0;
+    int fd = 0;
+
+    printf("%-*s", print_cols, "test 15: reject write requests to a read-only bank");
+    fd = memfd_create("test_mb_reg_bank", 0);
+    if (fd < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&writer, fd, 0);
+    if (ret < 0)
+    {
+        close(fd);
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&reader, fd, MB_REG_BANK_RDONLY);
+    close(fd);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&writer);
+        return FAIL;
+    }
+    mb_pdu_set_wr_sing_coil_req(&req[0], 0x0010, true);
+    mb_pdu_set_wr_sing_reg_req(&req[1], 0x0010, 0xffff);
+    mb_pdu_set_wr_mult_coils_req(&req[2], 0x0010, 2, &op_val);
+    mb_pdu_set_wr_mult_regs_req(&req[3], 0x0010, 2, 4, wr_val);
+    mb_pdu_set_mask_wr_reg_req(&req[4], 0x0010, 0x0000, 0xffff);
+    mb_pdu_set_rd_wr_mult_regs_req(&req[5], 0x0010, 2, 0x0010, 2, wr_val);
+    for (i = 0; i < sizeof(req) / sizeof(req[0]); i++)
+    {
+        ret = mb_reg_bank_handle(&reader, &req[i], &resp);
+        if (ret != -MB_PDU_EXCEPT_ILLEGAL_FUNC)
+        {
+            mb_reg_bank_destroy(&reader);
+            mb_reg_bank_destroy(&writer);
+            return FAIL;
+        }
+    }
+    mb_reg_bank_rd_regs(&writer, MB_REG_BANK_HOLD_REGS, 0x0010, 2, rd_val);
+    mb_reg_bank_rd_bits(&writer, MB_REG_BANK_COILS, 0x0010, 2, &bits);
+    mb_reg_bank_destroy(&reader);
+    mb_reg_bank_destroy(&writer);
+    if ((rd_val[0] != 0) || (rd_val[1] != 0) || (bits != 0))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_dead_writer(void)
+{
+    mb_reg_bank_t writer = {0};
+    mb_reg_bank_t reader = {0};
+    mb_pdu_t resp = {0};
+    mb_pdu_t req = {0};
+    const uint16_t wr_val = 0x4321;
+    uint16_t rd_val = 0;
+    pid_t pid = 0;
+    int ret = 0;
+    int fd = 0;
+
+    printf("%-*s", print_cols, "test 16: recover from a writer that dies part way through a write");
+    fd = memfd_create("test_mb_reg_bank", 0);
+    if (fd < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&writer, fd, 0);
+    if (ret < 0)
+    {
+        close(fd);
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&reader, fd, MB_REG_BANK_RDONLY);
+    close(fd);
+    if (ret < 0)
+    {
+        mb_reg_bank_destroy(&writer);
+        return FAIL;
+    }
+    pid = fork();
+    if (pid == 0)
+    {
+        /* start a small write and die holding the shared lock */
+        pthread_mutex_lock(&writer.mem->lock);
+        atomic_fetch_add(&writer.mem->seq, 1);
+        _exit(0);
+    }
+    if ((pid < 0) || (waitpid(pid, NULL, 0) != pid))
+    {
+        mb_reg_bank_destroy(&reader);
+        mb_reg_bank_destroy(&writer);
+        return FAIL;
+    }
+    ret = mb_reg_bank_rd_regs(&reader, MB_REG_BANK_HOLD_REGS, 0x0020, 1, &rd_val);
+    if (ret != -EAGAIN)
+    {
+        mb_reg_bank_destroy(&reader);
+        mb_reg_bank_destroy(&writer);
+        return FAIL;
+    }
+    mb_pdu_set_rd_hold_regs_req(&req, 0x0020, 1);
+    ret = mb_reg_bank_handle(&reader, &req, &resp);
+    if (ret != -MB_PDU_EXCEPT_SERVER_DEV_BUSY)
+    {
+        mb_reg_bank_destroy(&reader);
+        mb_reg_bank_destroy(&writer);
+        return FAIL;
+    }
+    ret = mb_reg_bank_wr_regs(&writer, MB_REG_BANK_HOLD_REGS, 0x0020, 1, &wr_val);
+    if (ret == 0)
+        ret = mb_reg_bank_rd_regs(&reader, MB_REG_BANK_HOLD_REGS, 0x0020, 1, &rd_val);
+    mb_reg_bank_destroy(&reader);
+    mb_reg_bank_destroy(&writer);
+    if ((ret < 0) || (rd_val != wr_val))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_reg_bank_live_writer(void)
+{
+    mb_reg_bank_t writer = {0};
+    mb_reg_bank_t other = {0};
+    int result = PASS;
+    int held[2] = {0};
+    int done[2] = {0};
+    pid_t pid = 0;
+    char c = 0;
+    int ret = 0;
+    int fd = 0;
+
+    printf("%-*s", print_cols, "test 17: wait for a live writer holding the lock when opening a bank");
+    fd = memfd_create("test_mb_reg_bank", 0);
+    if (fd < 0)
+    {
+        return FAIL;
+    }
+    ret = mb_reg_bank_open_fd(&writer, fd, 0);
+    if ((ret < 0) || (pipe(held) < 0) || (pipe(done) < 0))
+    {
+        close(fd);
+        return FAIL;
+    }
+    pid = fork();
+    if (pid == 0)
+    {
+        /* hold the shared lock until told to let go */
+        pthread_mutex_lock(&writer.mem->lock);
+        write(held[1], &c, 1);
+        read(done[0], &c, 1);
+        pthread_mutex_unlock(&writer.mem->lock);
+        _exit(0);
+    }
+    if ((pid < 0) || (read(held[0], &c, 1) != 1))
+        result = FAIL;
+    /* the lock must not be taken over from a writer that is still alive */
+    ret = mb_reg_bank_open_fd(&other, fd, 0);
+    if (ret != -ETIMEDOUT)
+        result = FAIL;
+    if (ret == 0)
+        mb_reg_bank_destroy(&other);
+    write(done[1], &c, 1);
+    if ((pid > 0) && (waitpid(pid, NULL, 0) != pid))
+        result = FAIL;
+    ret = mb_reg_bank_open_fd(&other, fd, 0);
+    if (ret < 0)
+        result = FAIL;
+    else
+        mb_reg_bank_destroy(&other);
+    close(held[0]);
+    close(held[1]);
+    close(done[0]);
+    close(done[1]);
+    close(fd);
+    mb_reg_bank_destroy(&writer);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_reg_bank_regs,
+                             test_mb_reg_bank_bits,
+                             test_mb_reg_bank_invalid,
+                             test_mb_reg_bank_mask_wr_reg,
+                             test_mb_reg_bank_rd_wr_regs,
+                             test_mb_reg_bank_update,
+                             test_mb_reg_bank_handle,
+                             test_mb_reg_bank_concurrent,
+                             test_mb_reg_bank_persist,
+                             test_mb_reg_bank_shared,
+                             test_mb_reg_bank_invalid_file,
+                             test_mb_reg_bank_sub,
+                             test_mb_reg_bank_sub_overrun,
+                             test_mb_reg_bank_handle_rd_mult_ranges,
+                             test_mb_reg_bank_handle_rdonly,
+                             test_mb_reg_bank_dead_writer,
+                             test_mb_reg_bank_live_writer};
+
+    return mb_test_run(func, sizeof(func) / sizeof(func[0]));
+}
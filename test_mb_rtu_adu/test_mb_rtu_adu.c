@@ -5331,6 +5331,118 @@ mb_test_result_t test_mb_rtu_adu_parse_err_resp_invalid_except_code(void)
     return PASS;
 }
 
+mb_test_result_t test_mb_rtu_adu_prepare(void)
+{
+    typedef struct
+    {
+        uint8_t addr;
+        char pdu[16];
+        size_t pdu_len;
+        size_t resp_len;
+    }
+    prepare_case_t;
+
+    const prepare_case_t cases[] = {{0x01, {0x01, 0x00, 0x13, 0x00, 0x13}, 5, 1 + 5 + 2},
+                                    {0x02, {0x03, 0x00, 0x6b, 0x00, 0x03}, 5, 1 + 8 + 2},
+                                    {0x03, {0x04, 0x00, 0x08, 0x00, 0x01}, 5, 1 + 4 + 2},
+                                    {0x04, {0x06, 0x00, 0x01, 0x00, 0x03}, 5, 1 + 5 + 2},
+                                    {0x05, {0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x00, 0x0a, 0x01, 0x02}, 10, 1 + 5 + 2},
+                                    {0x06, {0x16, 0x00, 0x04, 0x00, 0xf2, 0x00, 0x25}, 7, 1 + 7 + 2},
+                                    {0x07, {0x11}, 1, 0},
+                                    {0xf7, {0x18, 0x04, 0xde}, 3, 0}};
+    mb_rtu_adu_prep_t prep = {{0}};
+    mb_rtu_adu_t adu = {0};
+    ssize_t num = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 237: prepare request RTU ADUs");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        memset(&adu, 0, sizeof(adu));
+        mb_rtu_adu_set_header(&adu, cases[i].addr);
+        num = mb_pdu_parse_req(&adu.pdu, cases[i].pdu, cases[i].pdu_len);
+        if (num != cases[i].pdu_len)
+        {
+            return FAIL;
+        }
+        ret = mb_rtu_adu_prepare(&prep, &adu);
+        if (ret < 0)
+        {
+            return FAIL;
+        }
+        if ((prep.len != 1 + cases[i].pdu_len + 2)
+         || (prep.addr != cases[i].addr)
+         || (prep.func_code != (uint8_t)cases[i].pdu[0])
+         || (prep.resp_len != cases[i].resp_len))
+        {
+            return FAIL;
+        }
+        if (((uint8_t)prep.buf[0] != cases[i].addr)
+         || (memcmp(prep.buf + 1, cases[i].pdu, cases[i].pdu_len) != 0)
+         || (!mb_rtu_adu_check_crc((const uint8_t *)prep.buf, prep.len)))
+        {
+            return FAIL;
+        }
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_rtu_adu_prep_check_resp(void)
+{
+    typedef struct
+    {
+        unsigned prep;
+        char resp[16];
+        size_t len;
+        int ret;
+    }
+    check_resp_case_t;
+
+    const check_resp_case_t cases[] = {{0, {0x01, 0x03, 0x04, 0x00, 0x0a, 0x00, 0x0b, 0x00, 0x00}, 9, 0},
+                                       {0, {0x01, 0x83, 0x02, 0x00, 0x00}, 5, 0},
+                                       {0, {0x01, 0x83, 0x02, 0x00, 0x00, 0x00}, 6, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x01, 0x84, 0x02, 0x00, 0x00}, 5, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x02, 0x03, 0x04, 0x00, 0x0a, 0x00, 0x0b, 0x00, 0x00}, 9, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x01, 0x04, 0x04, 0x00, 0x0a, 0x00, 0x0b, 0x00, 0x00}, 9, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x01, 0x03, 0x02, 0x00, 0x0a, 0x00, 0x00}, 7, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x01, 0x03, 0x06, 0x00, 0x0a, 0x00, 0x0b, 0x00, 0x0c, 0x00, 0x00}, 11, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x01, 0x83, 0x02, 0x00}, 4, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {1, {0x07, 0x11, 0x02, 0x01, 0xff, 0x00, 0x00}, 7, 0},
+                                       {1, {0x07, 0x11, 0x03, 0x01, 0x02, 0xff, 0x00, 0x00}, 8, 0},
+                                       {1, {0x07, 0x91, 0x01, 0x00, 0x00}, 5, 0},
+                                       {1, {0x07, 0x03, 0x02, 0x01, 0xff, 0x00, 0x00}, 7, -MB_PDU_EXCEPT_ILLEGAL_VAL}};
+    mb_rtu_adu_prep_t prep[2] = {{{0}}};
+    mb_rtu_adu_t adu = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 238: check responses against prepared request RTU ADUs");
+    mb_rtu_adu_set_header(&adu, 0x01);
+    mb_pdu_set_rd_hold_regs_req(&adu.pdu, 0x0000, 2);
+    ret = mb_rtu_adu_prepare(&prep[0], &adu);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_rtu_adu_set_header(&adu, 0x07);
+    mb_pdu_set_rep_server_id_req(&adu.pdu);
+    ret = mb_rtu_adu_prepare(&prep[1], &adu);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        ret = mb_rtu_adu_prep_check_resp(&prep[cases[i].prep], cases[i].resp, cases[i].len);
+        if (ret != cases[i].ret)
+        {
+            return FAIL;
+        }
+    }
+    return PASS;
+}
+
 int main(void)
 {
     mb_test_func_t func[] = {test_mb_rtu_adu_set,
@@ -5568,7 +5680,9 @@ int main(void)
                              test_mb_rtu_adu_parse_enc_if_trans_req,
                              test_mb_rtu_adu_parse_enc_if_trans_resp,
                              test_mb_rtu_adu_parse_err_resp,
-                             test_mb_rtu_adu_parse_err_resp_invalid_except_code
+                             test_mb_rtu_adu_parse_err_resp_invalid_except_code,
+                             test_mb_rtu_adu_prepare,
+                             test_mb_rtu_adu_prep_check_resp
     };
 
     return mb_test_run(func, sizeof(func) / sizeof(func[0]));
@@ -25,33 +25,185 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
 #include "mb_rtu_master.h"
 #include "mb_rtu_adu.h"
 #include "mb_log.h"
+#include "mb_test.h"
 
 #define SLAVE_ADDR  1
 #define START_ADDR  0x0
 #define QUANT_REGS  1
 
-int main(int argc, char **argv)
+int print_cols = 93;
+
+static mb_rtu_master_t pty_master = {{0}};
+static int pty_fd = -1;
+
+/* reads whatever the master has sent to the pseudo terminal */
+static ssize_t pty_recv(char *buf, size_t len)
 {
-    mb_rtu_master_t master = {{0}};
+    struct timeval tv = {0};
+    fd_set read_fds = {{0}};
+    ssize_t total = 0;
+    ssize_t num = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        FD_ZERO(&read_fds);
+        FD_SET(pty_fd, &read_fds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 20000;
+        ret = select(pty_fd + 1, &read_fds, NULL, NULL, &tv);
+        if (ret <= 0)
+            return total;
+        num = read(pty_fd, buf + total, len - total);
+        if (num <= 0)
+            return total;
+        total += num;
+    }
+}
+
+/* queues a response frame, with a CRC, for the master to receive */
+static int pty_send(uint8_t addr, const char *pdu, size_t pdu_len, int bad_crc)
+{
+    mb_rtu_adu_t resp = {0};
+    ssize_t num = 0;
+    char buf[MB_RTU_ADU_MAX_LEN] = {0};
+
+    mb_rtu_adu_set_header(&resp, addr);
+    num = mb_pdu_parse_resp(&resp.pdu, pdu, pdu_len);
+    if (num < 0)
+        return -1;
+    num = mb_rtu_adu_format_resp(&resp, buf, sizeof(buf));
+    if (num < 0)
+        return -1;
+    if (bad_crc)
+        buf[num - 1] ^= 0xff;
+    if (write(pty_fd, buf, num) != num)
+        return -1;
+    return 0;
+}
+
+mb_test_result_t test_mb_rtu_master_exchange_prep(void)
+{
+    typedef struct
+    {
+        int resp;                                       /* 0 if there is no response */
+        uint8_t addr;
+        char pdu[8];
+        size_t pdu_len;
+        int bad_crc;
+        int ret;
+    }
+    exchange_prep_case_t;
+
+    const exchange_prep_case_t cases[] = {{1, SLAVE_ADDR, {0x03, 0x04, 0x00, 0x0a, 0x00, 0x0b}, 6, 0, 0},
+                                          {1, SLAVE_ADDR, {0x83, 0x02}, 2, 0, 0},
+                                          {1, SLAVE_ADDR + 1, {0x03, 0x04, 0x00, 0x0a, 0x00, 0x0b}, 6, 0, -EBADMSG},
+                                          {1, SLAVE_ADDR, {0x04, 0x04, 0x00, 0x0a, 0x00, 0x0b}, 6, 0, -EBADMSG},
+                                          {1, SLAVE_ADDR, {0x03, 0x02, 0x00, 0x0a}, 4, 0, -EBADMSG},
+                                          {1, SLAVE_ADDR, {0x03, 0x04, 0x00, 0x0a, 0x00, 0x0b}, 6, 1, -EBADMSG},
+                                          {0, 0, {0}, 0, 0, -ETIMEDOUT}};
+    mb_rtu_adu_prep_t prep = {{0}};
     mb_rtu_adu_t resp = {0};
     mb_rtu_adu_t req = {0};
-    const char *dev = NULL;
+    ssize_t num = 0;
+    unsigned i = 0;
+    char buf[MB_RTU_ADU_MAX_LEN] = {0};
     int ret = 0;
 
-    mb_log_set_level(MB_LOG_DEBUG);
-    if (argc != 2)
+    printf("%-*s", print_cols, "test 1: exchange prepared requests with a slave");
+    mb_rtu_adu_set_header(&req, SLAVE_ADDR);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, START_ADDR, 2);
+    ret = mb_rtu_adu_prepare(&prep, &req);
+    if (ret < 0)
+        return FAIL;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
     {
-        mb_log_info("usage: test_mb_rtu_master dev\n");
-        return EXIT_FAILURE;
+        if ((cases[i].resp) && (pty_send(cases[i].addr, cases[i].pdu, cases[i].pdu_len, cases[i].bad_crc) < 0))
+            return FAIL;
+        memset(&resp, 0, sizeof(resp));
+        ret = mb_rtu_master_exchange_prep(&pty_master, &prep, &resp);
+        num = pty_recv(buf, sizeof(buf));
+        if ((num != prep.len) || (memcmp(buf, prep.buf, prep.len) != 0))
+            return FAIL;
+        if (ret != cases[i].ret)
+            return FAIL;
+        if ((ret == 0) && ((resp.addr != SLAVE_ADDR) || (resp.pdu.func_code != (uint8_t)cases[i].pdu[0])))
+            return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_rtu_master_exchange_prep_invalid_addr(void)
+{
+    mb_rtu_adu_prep_t prep = {{0}};
+    mb_rtu_adu_t resp = {0};
+    mb_rtu_adu_t req = {0};
+    const uint8_t addr[] = {MB_RTU_ADU_BROADCAST_ADDR, MB_RTU_ADU_MAX_UNICAST_ADDR + 1};
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 2: exchange prepared requests with invalid addresses");
+    for (i = 0; i < sizeof(addr) / sizeof(addr[0]); i++)
+    {
+        mb_rtu_adu_set_header(&req, addr[i]);
+        mb_pdu_set_rd_hold_regs_req(&req.pdu, START_ADDR, 1);
+        ret = mb_rtu_adu_prepare(&prep, &req);
+        if (ret < 0)
+            return FAIL;
+        ret = mb_rtu_master_exchange_prep(&pty_master, &prep, &resp);
+        if (ret != -EINVAL)
+            return FAIL;
     }
-    dev = argv[1];
+    if (pty_recv(prep.buf, sizeof(prep.buf)) != 0)
+        return FAIL;
+    return PASS;
+}
+
+static int pty_open(void)
+{
+    struct termios options = {0};
+    int ret = 0;
+
+    pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((pty_fd < 0) || (grantpt(pty_fd) < 0) || (unlockpt(pty_fd) < 0))
+        return -1;
+    tcgetattr(pty_fd, &options);
+    cfmakeraw(&options);
+    tcsetattr(pty_fd, TCSANOW, &options);
+    ret = mb_rtu_master_create(&pty_master, ptsname(pty_fd));
+    if (ret < 0)
+        return -1;
+    return 0;
+}
+
+static void pty_close(void)
+{
+    mb_rtu_master_destroy(&pty_master);
+    close(pty_fd);
+}
+
+/* reads a holding register from a slave on a real serial device */
+static int rd_dev(const char *dev)
+{
+    mb_rtu_master_t master = {{0}};
+    mb_rtu_adu_t resp = {0};
+    mb_rtu_adu_t req = {0};
+    int ret = 0;
+
+    mb_log_set_level(MB_LOG_DEBUG);
     ret = mb_rtu_master_create(&master, dev);
     if (ret < 0)
     {
@@ -81,3 +233,29 @@ int main(int argc, char **argv)
     mb_rtu_master_destroy(&master);
     return EXIT_SUCCESS;
 }
+
+/* with a device, reads from a real slave, otherwise runs the tests over a pseudo terminal */
+int main(int argc, char **argv)
+{
+    mb_test_func_t func[] = {test_mb_rtu_master_exchange_prep,
+                             test_mb_rtu_master_exchange_prep_invalid_addr};
+    int ret = 0;
+
+    if (argc == 2)
+    {
+        return rd_dev(argv[1]);
+    }
+    if (argc != 1)
+    {
+        mb_log_info("usage: test_mb_rtu_master [dev]\n");
+        return EXIT_FAILURE;
+    }
+    if (pty_open() < 0)
+    {
+        printf("failed to open a pseudo terminal\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    pty_close();
+    return ret;
+}
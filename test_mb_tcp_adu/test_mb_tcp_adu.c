@@ -5989,6 +5989,122 @@ mb_test_result_t test_mb_tcp_adu_parse_err_resp_invalid_except_code(void)
     return PASS;
 }
 
+mb_test_result_t test_mb_tcp_adu_prepare(void)
+{
+    typedef struct
+    {
+        uint8_t unit_id;
+        char pdu[16];
+        size_t pdu_len;
+        size_t resp_len;
+    }
+    prepare_case_t;
+
+    const prepare_case_t cases[] = {{0x01, {0x01, 0x00, 0x13, 0x00, 0x13}, 5, 7 + 5},
+                                    {0x02, {0x03, 0x00, 0x6b, 0x00, 0x03}, 5, 7 + 8},
+                                    {0x03, {0x04, 0x00, 0x08, 0x00, 0x01}, 5, 7 + 4},
+                                    {0x04, {0x06, 0x00, 0x01, 0x00, 0x03}, 5, 7 + 5},
+                                    {0x05, {0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x00, 0x0a, 0x01, 0x02}, 10, 7 + 5},
+                                    {0x06, {0x16, 0x00, 0x04, 0x00, 0xf2, 0x00, 0x25}, 7, 7 + 7},
+                                    {0x07, {0x11}, 1, 0},
+                                    {0xff, {0x18, 0x04, 0xde}, 3, 0}};
+    const char exp_header[] = {0x12, 0x34, 0x00, 0x00};
+    mb_tcp_adu_prep_t prep = {{0}};
+    mb_tcp_adu_t adu = {0};
+    ssize_t num = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 237: prepare request TCP ADUs");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        memset(&adu, 0, sizeof(adu));
+        mb_tcp_adu_set_header(&adu, 0x0001, 0x0000, cases[i].unit_id);
+        num = mb_pdu_parse_req(&adu.pdu, cases[i].pdu, cases[i].pdu_len);
+        if (num != cases[i].pdu_len)
+        {
+            return FAIL;
+        }
+        ret = mb_tcp_adu_prepare(&prep, &adu);
+        if (ret < 0)
+        {
+            return FAIL;
+        }
+        if ((prep.len != MB_TCP_ADU_HEADER_LEN + cases[i].pdu_len)
+         || (prep.unit_id != cases[i].unit_id)
+         || (prep.func_code != (uint8_t)cases[i].pdu[0])
+         || (prep.resp_len != cases[i].resp_len))
+        {
+            return FAIL;
+        }
+        mb_tcp_adu_prep_set_trans_id(&prep, 0x1234);
+        if ((memcmp(prep.buf, exp_header, sizeof(exp_header)) != 0)
+         || ((uint8_t)prep.buf[4] != 0x00)
+         || ((uint8_t)prep.buf[5] != cases[i].pdu_len + 1)
+         || ((uint8_t)prep.buf[6] != cases[i].unit_id)
+         || (memcmp(prep.buf + MB_TCP_ADU_HEADER_LEN, cases[i].pdu, cases[i].pdu_len) != 0))
+        {
+            return FAIL;
+        }
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_tcp_adu_prep_check_resp(void)
+{
+    typedef struct
+    {
+        unsigned prep;
+        char resp[20];
+        size_t len;
+        int ret;
+    }
+    check_resp_case_t;
+
+    const check_resp_case_t cases[] = {{0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x07, 0x01, 0x03, 0x04, 0x00, 0x0a, 0x00, 0x0b}, 13, 0},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x01, 0x83, 0x02}, 9, 0},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x04, 0x01, 0x83, 0x02, 0x00}, 10, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x01, 0x84, 0x02}, 9, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x07, 0x02, 0x03, 0x04, 0x00, 0x0a, 0x00, 0x0b}, 13, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x07, 0x01, 0x04, 0x04, 0x00, 0x0a, 0x00, 0x0b}, 13, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x01, 0x03, 0x02, 0x00, 0x0a}, 11, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x09, 0x01, 0x03, 0x06, 0x00, 0x0a, 0x00, 0x0b, 0x00, 0x0c}, 15, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {0, {0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x01, 0x83}, 8, -MB_PDU_EXCEPT_ILLEGAL_VAL},
+                                       {1, {0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x07, 0x11, 0x02, 0x01, 0xff}, 11, 0},
+                                       {1, {0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0x07, 0x11, 0x03, 0x01, 0x02, 0xff}, 12, 0},
+                                       {1, {0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x07, 0x91, 0x01}, 9, 0},
+                                       {1, {0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x07, 0x03, 0x02, 0x01, 0xff}, 11, -MB_PDU_EXCEPT_ILLEGAL_VAL}};
+    mb_tcp_adu_prep_t prep[2] = {{{0}}};
+    mb_tcp_adu_t adu = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 238: check responses against prepared request TCP ADUs");
+    mb_tcp_adu_set_header(&adu, 0x0001, 0x0000, 0x01);
+    mb_pdu_set_rd_hold_regs_req(&adu.pdu, 0x0000, 2);
+    ret = mb_tcp_adu_prepare(&prep[0], &adu);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    mb_tcp_adu_set_header(&adu, 0x0001, 0x0000, 0x07);
+    mb_pdu_set_rep_server_id_req(&adu.pdu);
+    ret = mb_tcp_adu_prepare(&prep[1], &adu);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        ret = mb_tcp_adu_prep_check_resp(&prep[cases[i].prep], cases[i].resp, cases[i].len);
+        if (ret != cases[i].ret)
+        {
+            return FAIL;
+        }
+    }
+    return PASS;
+}
+
 int main(void)
 {
     mb_test_func_t func[] = {test_mb_tcp_adu_set,
@@ -6226,7 +6342,9 @@ int main(void)
                              test_mb_tcp_adu_parse_enc_if_trans_req,
                              test_mb_tcp_adu_parse_enc_if_trans_resp,
                              test_mb_tcp_adu_parse_err_resp,
-                             test_mb_tcp_adu_parse_err_resp_invalid_except_code
+                             test_mb_tcp_adu_parse_err_resp_invalid_except_code,
+                             test_mb_tcp_adu_prepare,
+                             test_mb_tcp_adu_prep_check_resp
     };
 
     return mb_test_run(func, sizeof(func) / sizeof(func[0]));
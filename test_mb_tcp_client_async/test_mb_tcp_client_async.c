@@ -0,0 +1,1847 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mb_tcp_client.h"
+#include "mb_tcp_server.h"
+#include "mb_reg_bank.h"
+#include "mb_test.h"
+
+#define HOST_ADDR       "127.0.0.1"
+#define SERVER_PORT     10030
+#define STALL_PORT      10031                           /* listener whose backlog is full */
+#define EXTRA_PORT      10032                           /* first of NUM_EXTRA consecutive ports */
+#define NUM_EXTRA       3
+#define SLOW_PORT       10036                           /* server that stops reading for DELAY_USEC */
+#define WIDE_PORT       10070                           /* first of NUM_WIDE_SERVER consecutive ports on every address */
+#define NUM_WIDE_SERVER 5
+#define NUM_WIDE_ADDR   4                               /* loopback addresses used with each wide server */
+#define NUM_WIDE        (NUM_WIDE_SERVER * NUM_WIDE_ADDR) /* more endpoints than MB_TCP_CLIENT_MAX_PENDING */
+#define REORDER_UNIT    1                               /* responses are held back and sent in reverse order */
+#define ECHO_UNIT       2                               /* responses are sent immediately */
+#define DELAY_UNIT      3                               /* responses are sent after DELAY_USEC */
+#define DELAY_USEC      100000
+#define SHORT_UNIT      4                               /* responses hold one register less than requested */
+#define HEDGE_UNIT      5                               /* responses from the first extra server are sent after DELAY_USEC */
+#define NUM_WARM_UP     10
+#define SILENT_UNIT     99                              /* requests are never answered */
+#define NUM_REORDER     4
+#define NUM_CALLBACK    8
+#define NUM_BATCH       20                              /* more than MB_TCP_CLIENT_MAX_PENDING */
+#define LEGACY_EXTRA    2                               /* extra server that rejects the read multiple ranges function code */
+#define NUM_RANGE       5
+#define NUM_FILE        2                               /* files held by the servers */
+#define NUM_FILE_REC    2000                            /* records in a transfer, runs from the end of file 1 into file 2 */
+#define NUM_SIZED       64                              /* pending table of a client sized at creation */
+
+int print_cols = 93;
+
+typedef struct
+{
+    mb_tcp_server_token_t token;
+    mb_tcp_adu_t resp;
+}
+held_t;
+
+typedef struct
+{
+    int num;
+    ssize_t result[NUM_CALLBACK];
+    uint16_t val[NUM_CALLBACK];
+}
+cb_data_t;
+
+static mb_tcp_server_t server = {0};
+static mb_reg_bank_t bank = {0};
+static pthread_t server_thread = {0};
+static mb_tcp_server_t extra[NUM_EXTRA] = {{0}};
+static pthread_t extra_thread[NUM_EXTRA] = {0};
+static mb_tcp_server_t wide[NUM_WIDE_SERVER] = {{0}};
+static pthread_t wide_thread[NUM_WIDE_SERVER] = {0};
+static held_t held[NUM_REORDER] = {{{0}}};
+static int num_held = 0;
+static uint16_t file_rec[NUM_FILE][MB_TCP_CLIENT_FILE_NUM_REC] = {{0}};
+
+static int handle_file_rec(mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_pdu_rd_file_rec_resp_sub_req_t rd_resp[MB_PDU_RD_FILE_REC_MAX_NUM_SUB_REQ] = {{0}};
+    mb_pdu_rd_file_rec_req_sub_req_t *rd = NULL;
+    mb_pdu_wr_file_rec_sub_req_t *wr = NULL;
+    unsigned len = 0;
+    int i = 0;
+
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    if (req->pdu.func_code == MB_PDU_RD_FILE_REC)
+    {
+        for (i = 0; i < req->pdu.rd_file_rec_req.byte_count / MB_PDU_RD_FILE_REC_REQ_SUB_REQ_NUM_BYTES; i++)
+        {
+            rd = &req->pdu.rd_file_rec_req.sub_req[i];
+            if (rd->file_num > NUM_FILE)
+                return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+            rd_resp[i].file_resp_len = 1 + 2 * rd->rec_len;
+            rd_resp[i].ref_type = MB_PDU_FILE_REC_REF_TYPE;
+            memcpy(rd_resp[i].rec_data, &file_rec[rd->file_num - 1][rd->rec_num], 2 * rd->rec_len);
+        }
+        return mb_pdu_set_rd_file_rec_resp(&resp->pdu, rd_resp, i);
+    }
+    for (i = 0; len < req->pdu.wr_file_rec_req.req_data_len; i++)
+    {
+        wr = &req->pdu.wr_file_rec_req.sub_req[i];
+        if (wr->file_num > NUM_FILE)
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        memcpy(&file_rec[wr->file_num - 1][wr->rec_num], wr->rec_data, 2 * wr->rec_len);
+        len += 7 + 2 * wr->rec_len;
+    }
+    return mb_pdu_set_wr_file_rec_resp(&resp->pdu, req->pdu.wr_file_rec_req.sub_req, i);
+}
+
+static int handle_req(mb_tcp_server_t *s, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    int ret = 0;
+    int i = 0;
+
+    if (req->unit_id == SILENT_UNIT)
+    {
+        return MB_TCP_SERVER_DEFERRED;  /* never answered */
+    }
+    if ((req->pdu.func_code == MB_PDU_RD_MULT_RANGES) && (s == &extra[LEGACY_EXTRA]))
+    {
+        return -MB_PDU_EXCEPT_ILLEGAL_FUNC;
+    }
+    if ((req->pdu.func_code == MB_PDU_RD_FILE_REC) || (req->pdu.func_code == MB_PDU_WR_FILE_REC))
+    {
+        return handle_file_rec(req, resp);
+    }
+    if ((req->unit_id == DELAY_UNIT) || ((req->unit_id == HEDGE_UNIT) && (s == &extra[0])))
+    {
+        usleep(DELAY_USEC);
+    }
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    ret = mb_reg_bank_handle(&bank, &req->pdu, &resp->pdu);
+    if ((ret >= 0) && (req->unit_id == SHORT_UNIT) && (resp->pdu.func_code == MB_PDU_RD_HOLD_REGS))
+    {
+        return mb_pdu_set_rd_hold_regs_resp(&resp->pdu, resp->pdu.rd_hold_regs_resp.byte_count - 2, resp->pdu.rd_hold_regs_resp.reg_val);
+    }
+    if ((ret < 0) || (req->unit_id != REORDER_UNIT))
+    {
+        return ret;
+    }
+    held[num_held].token = mb_tcp_server_get_token(s);
+    memcpy(&held[num_held].resp, resp, sizeof(mb_tcp_adu_t));
+    num_held++;
+    if (num_held == NUM_REORDER)
+    {
+        for (i = NUM_REORDER - 1; i >= 0; i--)
+            mb_tcp_server_send_deferred(s, held[i].token, &held[i].resp);
+        num_held = 0;
+    }
+    return MB_TCP_SERVER_DEFERRED;
+}
+
+static void *server_run(void *arg)
+{
+    mb_tcp_server_run((mb_tcp_server_t *)arg);
+    return NULL;
+}
+
+static int setup(void)
+{
+    uint16_t val[100] = {0};
+    int ret = 0;
+    int i = 0;
+
+    ret = mb_reg_bank_create(&bank);
+    if (ret < 0)
+        return -1;
+    for (i = 0; i < 100; i++)
+        val[i] = 0xc000 + i;
+    mb_reg_bank_wr_regs(&bank, MB_REG_BANK_HOLD_REGS, 0, 100, val);
+    ret = mb_tcp_server_create(&server, HOST_ADDR, SERVER_PORT, handle_req);
+    if (ret < 0)
+        return -1;
+    mb_tcp_server_authorise_addr(&server, HOST_ADDR);
+    pthread_create(&server_thread, NULL, server_run, &server);
+    for (i = 0; i < NUM_EXTRA; i++)
+    {
+        ret = mb_tcp_server_create(&extra[i], HOST_ADDR, EXTRA_PORT + i, handle_req);
+        if (ret < 0)
+            return -1;
+        mb_tcp_server_authorise_addr(&extra[i], HOST_ADDR);
+        pthread_create(&extra_thread[i], NULL, server_run, &extra[i]);
+    }
+    for (i = 0; i < NUM_WIDE_SERVER; i++)
+    {
+        ret = mb_tcp_server_create(&wide[i], "0.0.0.0", WIDE_PORT + i, handle_req);
+        if (ret < 0)
+            return -1;
+        mb_tcp_server_authorise_addr(&wide[i], HOST_ADDR);
+        pthread_create(&wide_thread[i], NULL, server_run, &wide[i]);
+    }
+    usleep(100000);
+    return 0;
+}
+
+static void teardown(void)
+{
+    int i = 0;
+
+    for (i = 0; i < NUM_WIDE_SERVER; i++)
+    {
+        pthread_cancel(wide_thread[i]);
+        pthread_join(wide_thread[i], NULL);
+        mb_tcp_server_destroy(&wide[i]);
+    }
+    for (i = 0; i < NUM_EXTRA; i++)
+    {
+        pthread_cancel(extra_thread[i]);
+        pthread_join(extra_thread[i], NULL);
+        mb_tcp_server_destroy(&extra[i]);
+    }
+    pthread_cancel(server_thread);
+    pthread_join(server_thread, NULL);
+    mb_tcp_server_destroy(&server);
+    mb_reg_bank_destroy(&bank);
+}
+
+static void client_create(mb_tcp_client_t *client)
+{
+    struct timeval timeout = {1, 0};
+
+    mb_tcp_client_create(client, timeout);
+    mb_tcp_client_authorise_addr(client, HOST_ADDR);
+}
+
+static int submit_rd(mb_tcp_client_t *client, uint8_t unit_id, uint16_t addr, const struct timeval *timeout, mb_tcp_client_func_t func, void *arg)
+{
+    mb_tcp_adu_t req = {0};
+
+    mb_tcp_adu_set_header(&req, 0, 0, unit_id);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, addr, 1);
+    return mb_tcp_client_submit(client, HOST_ADDR, SERVER_PORT, &req, timeout, func, arg);
+}
+
+static int wait_all(mb_tcp_client_t *client)
+{
+    int ret = 0;
+
+    while (mb_tcp_client_num_pending(client) > 0)
+    {
+        ret = mb_tcp_client_poll(client, NULL);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+mb_test_result_t test_mb_tcp_client_async_reorder(void)
+{
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    ssize_t num = 0;
+    int handle[NUM_REORDER] = {0};
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 1: match pipelined responses received out of order");
+    client_create(&client);
+    for (i = 0; i < NUM_REORDER; i++)
+    {
+        handle[i] = submit_rd(&client, REORDER_UNIT, 10 + i, NULL, NULL, NULL);
+        if (handle[i] < 0)
+            result = FAIL;
+    }
+    /* the server only answers once all the requests are in flight */
+    if ((result == FAIL) || (wait_all(&client) < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    for (i = 0; i < NUM_REORDER; i++)
+    {
+        num = mb_tcp_client_result(&client, handle[i], &resp);
+        if ((num <= 0)
+         || (resp.unit_id != REORDER_UNIT)
+         || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc000 + 10 + i))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static void callback(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp, void *arg)
+{
+    cb_data_t *data = (cb_data_t *)arg;
+
+    data->result[data->num] = result;
+    if (resp != NULL)
+        data->val[data->num] = resp->pdu.rd_hold_regs_resp.reg_val[0];
+    data->num++;
+}
+
+mb_test_result_t test_mb_tcp_client_async_callback(void)
+{
+    mb_tcp_client_t client = {{0}};
+    cb_data_t data = {0};
+    int result = PASS;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 2: complete requests through a callback function");
+    client_create(&client);
+    for (i = 0; i < NUM_CALLBACK; i++)
+    {
+        ret = submit_rd(&client, ECHO_UNIT, 20 + i, NULL, callback, &data);
+        if (ret < 0)
+            result = FAIL;
+    }
+    if (wait_all(&client) < 0)
+        result = FAIL;
+    if (data.num != NUM_CALLBACK)
+        result = FAIL;
+    for (i = 0; i < data.num; i++)
+    {
+        /* responses on one connection arrive in order */
+        if ((data.result[i] <= 0) || (data.val[i] != 0xc000 + 20 + i))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_timeout(void)
+{
+    struct timeval short_timeout = {0, 100000};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    long elapsed = 0;
+    int silent = 0;
+    int echo = 0;
+    int result = PASS;
+
+    printf("%-*s", print_cols, "test 3: time out requests individually");
+    client_create(&client);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    silent = submit_rd(&client, SILENT_UNIT, 0, &short_timeout, NULL, NULL);
+    echo = submit_rd(&client, ECHO_UNIT, 1, NULL, NULL, NULL);
+    if ((silent < 0) || (echo < 0) || (wait_all(&client) < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((mb_tcp_client_result(&client, silent, &resp) != -ETIMEDOUT)
+     || (mb_tcp_client_result(&client, echo, &resp) <= 0)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc001)
+     || (elapsed < 100)
+     || (elapsed >= 1000))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_cancel(void)
+{
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    int handle = 0;
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 4: cancel a request and share the connection with exchange");
+    client_create(&client);
+    handle = submit_rd(&client, SILENT_UNIT, 0, NULL, NULL, NULL);
+    mb_tcp_adu_set_header(&req, 7, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 2, 1);
+    ret = mb_tcp_client_exchange(&client, HOST_ADDR, SERVER_PORT, &req, &resp);
+    if ((handle < 0) || (ret != -EBUSY))
+        result = FAIL;
+    mb_tcp_client_cancel(&client, handle);
+    if ((mb_tcp_client_num_pending(&client) != 0)
+     || (mb_tcp_client_result(&client, handle, &resp) != -EINVAL))
+        result = FAIL;
+    ret = mb_tcp_client_exchange(&client, HOST_ADDR, SERVER_PORT, &req, &resp);
+    if ((ret <= 0)
+     || (resp.trans_id != 7)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc002))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static int listen_full(int *sd)
+{
+    struct sockaddr_in sin = {0};
+    int ret = 0;
+    int i = 0;
+
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(STALL_PORT);
+    inet_pton(AF_INET, HOST_ADDR, &sin.sin_addr);
+    sd[0] = socket(PF_INET, SOCK_STREAM, 0);
+    ret = bind(sd[0], (struct sockaddr *)&sin, sizeof(sin));
+    if (ret < 0)
+        return -1;
+    listen(sd[0], 0);
+    /* connections are never accepted, fill the backlog so that further SYNs are dropped */
+    for (i = 1; i < 3; i++)
+    {
+        sd[i] = socket(PF_INET, SOCK_STREAM, 0);
+        mb_tcp_con_set_non_blocking(sd[i]);
+        connect(sd[i], (struct sockaddr *)&sin, sizeof(sin));
+    }
+    usleep(100000);
+    return 0;
+}
+
+mb_test_result_t test_mb_tcp_client_async_connect_timeout(void)
+{
+    struct timeval connect_timeout = {0, 200000};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    long elapsed = 0;
+    int sd[3] = {0};
+    int result = PASS;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 5: abandon a connect after the connect timeout");
+    if (listen_full(sd) < 0)
+        return FAIL;
+    client_create(&client);
+    mb_tcp_client_set_connect_timeout(&client, connect_timeout);
+    mb_tcp_adu_set_header(&req, 1, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 0, 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = mb_tcp_client_exchange(&client, HOST_ADDR, STALL_PORT, &req, &resp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((ret != -ETIMEDOUT) || (elapsed < 200) || (elapsed >= 1000))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    for (i = 0; i < 3; i++)
+        close(sd[i]);
+    return result;
+}
+
+static int find_active_con(mb_tcp_client_t *client)
+{
+    int i = 0;
+
+    for (i = 0; i < client->num_con; i++)
+    {
+        if ((mb_tcp_con_is_active(&client->con[i])) && (!client->state[i].in_progress))
+            return i;
+    }
+    return -1;
+}
+
+static int maintain_until_connected(mb_tcp_client_t *client)
+{
+    int i = 0;
+
+    for (i = 0; i < 100; i++)
+    {
+        mb_tcp_client_maintain(client);
+        if (find_active_con(client) >= 0)
+            return find_active_con(client);
+        usleep(10000);
+    }
+    return -1;
+}
+
+mb_test_result_t test_mb_tcp_client_async_preconnect(void)
+{
+    struct timeval interval = {0, 50000};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    unsigned gen = 0;
+    int index = 0;
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 6: preconnect and reconnect in the background");
+    client_create(&client);
+    mb_tcp_client_set_reconnect_interval(&client, interval);
+    ret = mb_tcp_client_preconnect(&client, HOST_ADDR, SERVER_PORT);
+    index = maintain_until_connected(&client);
+    if ((ret < 0) || (index < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* the exchange uses the preconnected connection */
+    gen = client.con[index].gen;
+    mb_tcp_adu_set_header(&req, 1, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 3, 1);
+    ret = mb_tcp_client_exchange(&client, HOST_ADDR, SERVER_PORT, &req, &resp);
+    if ((ret <= 0) || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc003) || (client.con[index].gen != gen))
+        result = FAIL;
+    /* a lost connection is restored */
+    shutdown(client.con[index].sd, SHUT_RDWR);
+    usleep(100000);
+    index = maintain_until_connected(&client);
+    if ((index < 0) || (client.con[index].gen == gen))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static int is_connected(mb_tcp_client_t *client, in_port_t port)
+{
+    int i = 0;
+
+    for (i = 0; i < client->num_con; i++)
+    {
+        if ((mb_tcp_con_is_active(&client->con[i])) && (ntohs(client->con[i].sin.sin_port) == port))
+            return 1;
+    }
+    return 0;
+}
+
+static int find_con(mb_tcp_client_t *client, in_port_t port)
+{
+    int i = 0;
+
+    for (i = 0; i < client->num_con; i++)
+    {
+        if ((mb_tcp_con_is_active(&client->con[i])) && (ntohs(client->con[i].sin.sin_port) == port))
+            return i;
+    }
+    return -1;
+}
+
+static int exchange_rd(mb_tcp_client_t *client, int endpoint, uint16_t addr)
+{
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    int ret = 0;
+
+    mb_tcp_adu_set_header(&req, 1, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, addr, 1);
+    ret = mb_tcp_client_exchange_endpoint(client, endpoint, &req, &resp);
+    if (ret <= 0)
+        return ret;
+    return resp.pdu.rd_hold_regs_resp.reg_val[0] == 0xc000 + addr ? ret : -EBADMSG;
+}
+
+mb_test_result_t test_mb_tcp_client_async_lru(void)
+{
+    struct timeval timeout = {1, 0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t req = {0};
+    int ep[NUM_EXTRA] = {0};
+    int handle = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 7: evict the least recently used idle connection");
+    if (mb_tcp_client_create_size(&client, timeout, 2, MB_TCP_CLIENT_MAX_PENDING) < 0)
+        return FAIL;
+    mb_tcp_client_authorise_addr(&client, HOST_ADDR);
+    for (i = 0; i < NUM_EXTRA; i++)
+    {
+        ep[i] = mb_tcp_client_add_endpoint(&client, HOST_ADDR, EXTRA_PORT + i);
+        if (ep[i] < 0)
+            result = FAIL;
+    }
+    if ((result == FAIL) || (mb_tcp_client_add_endpoint(&client, HOST_ADDR, EXTRA_PORT) != ep[0]))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* endpoint 1 becomes the least recently used connection */
+    if ((exchange_rd(&client, ep[0], 4) <= 0)
+     || (exchange_rd(&client, ep[1], 5) <= 0)
+     || (exchange_rd(&client, ep[0], 6) <= 0)
+     || (exchange_rd(&client, ep[2], 7) <= 0)
+     || (!is_connected(&client, EXTRA_PORT))
+     || (is_connected(&client, EXTRA_PORT + 1))
+     || (!is_connected(&client, EXTRA_PORT + 2)))
+        result = FAIL;
+    /* a connection with a request in flight is never evicted */
+    mb_tcp_adu_set_header(&req, 0, 0, SILENT_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 0, 1);
+    handle = mb_tcp_client_submit_endpoint(&client, ep[0], &req, NULL, NULL, NULL);
+    if ((handle < 0)
+     || (exchange_rd(&client, ep[1], 8) <= 0)
+     || (!is_connected(&client, EXTRA_PORT))
+     || (is_connected(&client, EXTRA_PORT + 2)))
+        result = FAIL;
+    mb_tcp_client_submit_endpoint(&client, ep[1], &req, NULL, NULL, NULL);
+    if (exchange_rd(&client, ep[2], 9) != -EBUSY)
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_batch(void)
+{
+    mb_tcp_client_item_t item[NUM_BATCH] = {{0}};
+    mb_tcp_adu_t resp[NUM_BATCH] = {{0}};
+    mb_tcp_adu_t req[NUM_BATCH] = {{0}};
+    struct timeval timeout = {0, 300000};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    mb_tcp_client_t client = {{0}};
+    long elapsed = 0;
+    int result = PASS;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 8: exchange a batch of requests with several servers at once");
+    client_create(&client);
+    for (i = 0; i < NUM_BATCH; i++)
+    {
+        mb_pdu_set_rd_hold_regs_req(&req[i].pdu, i, 1);
+        item[i].req = &req[i];
+        item[i].resp = &resp[i];
+    }
+    /* one delayed request to each server costs one delay, not four */
+    for (i = 0; i <= NUM_EXTRA; i++)
+    {
+        item[i].endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, i == 0 ? SERVER_PORT : EXTRA_PORT + i - 1);
+        mb_tcp_adu_set_header(&req[i], 0, 0, DELAY_UNIT);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = mb_tcp_client_exchange_batch(&client, item, NUM_EXTRA + 1, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    if ((ret != NUM_EXTRA + 1) || (elapsed > 2 * DELAY_USEC))
+        result = FAIL;
+    for (i = 0; i <= NUM_EXTRA; i++)
+    {
+        if ((item[i].result <= 0) || (resp[i].pdu.rd_hold_regs_resp.reg_val[0] != 0xc000 + i))
+            result = FAIL;
+    }
+    /* more requests than can be in flight, with one unanswered and one invalid */
+    for (i = 0; i < NUM_BATCH; i++)
+    {
+        item[i].endpoint = item[0].endpoint;
+        mb_tcp_adu_set_header(&req[i], 0, 0, ECHO_UNIT);
+        memset(&resp[i], 0, sizeof(mb_tcp_adu_t));
+    }
+    req[5].unit_id = SILENT_UNIT;
+    item[6].endpoint = 1000;
+    ret = mb_tcp_client_exchange_batch(&client, item, NUM_BATCH, &timeout);
+    if ((ret != NUM_BATCH - 2)
+     || (item[5].result != -ETIMEDOUT)
+     || (item[6].result != -EINVAL)
+     || (mb_tcp_client_num_pending(&client) != 0))
+        result = FAIL;
+    for (i = 0; i < NUM_BATCH; i++)
+    {
+        if ((i != 5) && (i != 6) && ((item[i].result <= 0) || (resp[i].pdu.rd_hold_regs_resp.reg_val[0] != 0xc000 + i)))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_prep(void)
+{
+    mb_tcp_adu_prep_t prep = {{0}};
+    mb_tcp_adu_prep_t short_prep = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    mb_tcp_client_t client = {{0}};
+    uint16_t trans_id = 0;
+    ssize_t num = 0;
+    int endpoint = 0;
+    int handle = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 9: send prepared requests and check the responses against them");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 40, 3);
+    if ((mb_tcp_adu_prepare(&prep, &req) < 0) || (prep.resp_len != MB_TCP_ADU_HEADER_LEN + 2 + 6))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    for (i = 0; i < 3; i++)
+    {
+        handle = mb_tcp_client_submit_prep(&client, endpoint, &prep, NULL, NULL, NULL);
+        if ((handle < 0) || (wait_all(&client) < 0))
+        {
+            result = FAIL;
+            break;
+        }
+        num = mb_tcp_client_result(&client, handle, &resp);
+        /* each send gets a new transaction id */
+        if ((num != (ssize_t)prep.resp_len)
+         || ((i > 0) && (resp.trans_id == trans_id))
+         || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc000 + 40)
+         || (resp.pdu.rd_hold_regs_resp.reg_val[2] != 0xc000 + 42))
+            result = FAIL;
+        trans_id = resp.trans_id;
+    }
+    /* a response with the wrong number of registers fails the request */
+    mb_tcp_adu_set_header(&req, 0, 0, SHORT_UNIT);
+    mb_tcp_adu_prepare(&short_prep, &req);
+    handle = mb_tcp_client_submit_prep(&client, endpoint, &short_prep, NULL, NULL, NULL);
+    if ((handle < 0)
+     || (wait_all(&client) < 0)
+     || (mb_tcp_client_result(&client, handle, &resp) != -EBADMSG))
+        result = FAIL;
+    /* the connection is still usable */
+    handle = mb_tcp_client_submit_prep(&client, endpoint, &prep, NULL, NULL, NULL);
+    if ((handle < 0)
+     || (wait_all(&client) < 0)
+     || (mb_tcp_client_result(&client, handle, &resp) != (ssize_t)prep.resp_len))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static long hedged_rd(mb_tcp_client_t *client, int group, uint8_t unit_id, uint16_t addr, ssize_t *num, uint16_t *val)
+{
+    struct timespec start = {0};
+    struct timespec end = {0};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    int handle = 0;
+
+    mb_tcp_adu_set_header(&req, 0, 0, unit_id);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, addr, 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    handle = mb_tcp_client_submit_hedge(client, group, &req, NULL, NULL, NULL);
+    if ((handle < 0) || (wait_all(client) < 0))
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *num = mb_tcp_client_result(client, handle, &resp);
+    *val = resp.pdu.rd_hold_regs_resp.reg_val[0];
+    if ((*num > 0) && (resp.trans_id != req.trans_id))
+        *num = -EBADMSG;  /* answered with the transaction id of the copy */
+    return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+mb_test_result_t test_mb_tcp_client_async_hedge(void)
+{
+    mb_tcp_client_hedge_t hedge = {{0}};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    ssize_t num = 0;
+    uint16_t val = 0;
+    unsigned gen = 0;
+    long elapsed = 0;
+    int primary = 0;
+    int secondary = 0;
+    int group = 0;
+    int handle = 0;
+    int index = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 10: hedge slow reads to a second server and fail over");
+    client_create(&client);
+    primary = mb_tcp_client_preconnect(&client, HOST_ADDR, EXTRA_PORT);
+    secondary = mb_tcp_client_preconnect(&client, HOST_ADDR, SERVER_PORT);
+    group = mb_tcp_client_add_hedge(&client, primary, secondary, 90, 3);
+    if ((primary < 0) || (secondary < 0) || (group < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    for (i = 0; i < NUM_WARM_UP; i++)
+    {
+        elapsed = hedged_rd(&client, group, ECHO_UNIT, 50, &num, &val);
+        if ((elapsed < 0) || (num <= 0) || (val != 0xc000 + 50))
+            result = FAIL;
+    }
+    mb_tcp_client_get_hedge(&client, group, &hedge);
+    if ((hedge.num_hedge != 0) || (hedge.delay_usec[0] < MB_TCP_CLIENT_HEDGE_MIN_USEC) || (hedge.delay_usec[0] >= DELAY_USEC))
+        result = FAIL;
+    /* a write to the slow server is never hedged */
+    mb_tcp_adu_set_header(&req, 0, 0, HEDGE_UNIT);
+    mb_pdu_set_wr_sing_reg_req(&req.pdu, 200, 0x1234);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    handle = mb_tcp_client_submit_hedge(&client, group, &req, NULL, NULL, NULL);
+    if ((handle < 0) || (wait_all(&client) < 0) || (mb_tcp_client_result(&client, handle, &resp) <= 0))
+        result = FAIL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    mb_tcp_client_get_hedge(&client, group, &hedge);
+    if ((elapsed < DELAY_USEC) || (hedge.num_hedge != 0))
+        result = FAIL;
+    /* reads held up by the slow server are answered by the other one */
+    index = find_con(&client, EXTRA_PORT);
+    if (index >= 0)
+        gen = client.con[index].gen;
+    for (i = 0; i < 3; i++)
+    {
+        elapsed = hedged_rd(&client, group, HEDGE_UNIT, 60 + i, &num, &val);
+        if ((elapsed < 0) || (elapsed >= DELAY_USEC / 2) || (num <= 0) || (val != 0xc000 + 60 + i))
+            result = FAIL;
+    }
+    mb_tcp_client_get_hedge(&client, group, &hedge);
+    if ((hedge.num_hedge != 3) || (hedge.num_win != 3) || (hedge.num_fail_over != 1) || (hedge.active != 1))
+        result = FAIL;
+    /* after failing over reads go to the other server first */
+    elapsed = hedged_rd(&client, group, HEDGE_UNIT, 70, &num, &val);
+    mb_tcp_client_get_hedge(&client, group, &hedge);
+    if ((elapsed < 0) || (elapsed >= DELAY_USEC / 2) || (num <= 0) || (val != 0xc000 + 70) || (hedge.num_hedge != 3))
+        result = FAIL;
+    /* the late responses of the copies that lost are dropped without closing their connection */
+    while (client.num_discard > 0)
+    {
+        if (mb_tcp_client_poll(&client, NULL) < 0)
+            break;
+    }
+    if ((index < 0) || (client.num_discard != 0) || (find_con(&client, EXTRA_PORT) != index) || (client.con[index].gen != gen))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static int cached_rd(mb_tcp_client_t *client, uint8_t unit_id, uint16_t addr, uint16_t quant, mb_tcp_adu_t *resp)
+{
+    mb_tcp_adu_t req = {0};
+
+    mb_tcp_adu_set_header(&req, addr, 0, unit_id);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, addr, quant);
+    memset(resp, 0, sizeof(mb_tcp_adu_t));
+    return mb_tcp_client_exchange(client, HOST_ADDR, SERVER_PORT, &req, resp);
+}
+
+mb_test_result_t test_mb_tcp_client_async_cache(void)
+{
+    mb_tcp_client_cache_stats_t stats = {0};
+    struct timeval max_age = {1, 0};
+    struct timeval short_max_age = {0, 50000};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_prep_t prep = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    cb_data_t data = {0};
+    int handle[2] = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 11: answer reads from the response cache");
+    client_create(&client);
+    if ((mb_tcp_client_enable_cache(&client, 8, max_age) < 0)
+     || (mb_tcp_client_set_max_age(&client, MB_PDU_RD_HOLD_REGS, 30, 10, short_max_age) < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* a read within a cached range is answered with its own transaction id */
+    ret = cached_rd(&client, ECHO_UNIT, 0, 10, &resp);
+    if ((ret != MB_TCP_ADU_HEADER_LEN + 2 + 20) || (resp.pdu.rd_hold_regs_resp.reg_val[9] != 0xc009))
+        result = FAIL;
+    ret = cached_rd(&client, ECHO_UNIT, 2, 3, &resp);
+    if ((ret != MB_TCP_ADU_HEADER_LEN + 2 + 6)
+     || (resp.trans_id != 2)
+     || (resp.unit_id != ECHO_UNIT)
+     || (resp.pdu.rd_hold_regs_resp.byte_count != 6)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc002)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[2] != 0xc004))
+        result = FAIL;
+    /* a range with a shorter max-age ages out sooner */
+    cached_rd(&client, ECHO_UNIT, 30, 2, &resp);
+    cached_rd(&client, ECHO_UNIT, 30, 2, &resp);
+    mb_tcp_client_get_cache_stats(&client, &stats);
+    if ((stats.num_hit != 2) || (stats.num_miss != 2))
+        result = FAIL;
+    usleep(2 * short_max_age.tv_usec);
+    ret = cached_rd(&client, ECHO_UNIT, 30, 2, &resp);
+    mb_tcp_client_get_cache_stats(&client, &stats);
+    if ((ret <= 0) || (resp.pdu.rd_hold_regs_resp.reg_val[1] != 0xc000 + 31) || (stats.num_miss != 3))
+        result = FAIL;
+    /* asynchronous reads are answered from the cache too */
+    handle[0] = submit_rd(&client, ECHO_UNIT, 5, NULL, NULL, NULL);
+    if ((handle[0] < 0)
+     || (mb_tcp_client_num_pending(&client) != 0)
+     || (mb_tcp_client_result(&client, handle[0], &resp) <= 0)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc005))
+        result = FAIL;
+    handle[0] = submit_rd(&client, ECHO_UNIT, 6, NULL, callback, &data);
+    if ((handle[0] < 0) || (data.num != 0) || (wait_all(&client) < 0))
+        result = FAIL;
+    if ((data.num != 1) || (data.result[0] <= 0) || (data.val[0] != 0xc006))
+        result = FAIL;
+    /* a read within a read in flight waits for it */
+    mb_tcp_adu_set_header(&req, 0, 0, DELAY_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 40, 10);
+    handle[0] = mb_tcp_client_submit(&client, HOST_ADDR, SERVER_PORT, &req, NULL, NULL, NULL);
+    handle[1] = submit_rd(&client, DELAY_UNIT, 45, NULL, NULL, NULL);
+    if ((handle[0] < 0) || (handle[1] < 0) || (wait_all(&client) < 0))
+        result = FAIL;
+    if ((mb_tcp_client_result(&client, handle[0], &resp) <= 0)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[5] != 0xc000 + 45)
+     || (mb_tcp_client_result(&client, handle[1], &resp) != MB_TCP_ADU_HEADER_LEN + 2 + 2)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc000 + 45))
+        result = FAIL;
+    mb_tcp_client_get_cache_stats(&client, &stats);
+    if ((stats.num_hit != 4) || (stats.num_miss != 4) || (stats.num_merge != 1))
+        result = FAIL;
+    /* a write drops the ranges it overlaps */
+    cached_rd(&client, ECHO_UNIT, 210, 2, &resp);
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_wr_sing_reg_req(&req.pdu, 211, 0x5555);
+    if (mb_tcp_client_exchange(&client, HOST_ADDR, SERVER_PORT, &req, &resp) <= 0)
+        result = FAIL;
+    ret = cached_rd(&client, ECHO_UNIT, 210, 2, &resp);
+    mb_tcp_client_get_cache_stats(&client, &stats);
+    if ((ret <= 0)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[1] != 0x5555)
+     || (stats.num_invalidate != 1)
+     || (stats.num_miss != 6))
+        result = FAIL;
+    /* so does a prepared write */
+    cached_rd(&client, ECHO_UNIT, 212, 2, &resp);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_wr_sing_reg_req(&req.pdu, 213, 0x6666);
+    if ((endpoint < 0) || (mb_tcp_adu_prepare(&prep, &req) < 0))
+        result = FAIL;
+    handle[0] = mb_tcp_client_submit_prep(&client, endpoint, &prep, NULL, NULL, NULL);
+    if ((handle[0] < 0) || (wait_all(&client) < 0) || (mb_tcp_client_result(&client, handle[0], &resp) <= 0))
+        result = FAIL;
+    ret = cached_rd(&client, ECHO_UNIT, 212, 2, &resp);
+    mb_tcp_client_get_cache_stats(&client, &stats);
+    if ((ret <= 0)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[1] != 0x6666)
+     || (stats.num_invalidate != 2)
+     || (stats.num_miss != 8))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static void wr_callback(mb_tcp_client_t *client, ssize_t result, mb_tcp_adu_t *resp, void *arg)
+{
+    int *num = (int *)arg;
+
+    if ((result > 0) && (resp != NULL))
+        (*num)++;
+}
+
+static int queue_wr_unit(mb_tcp_client_t *client, int endpoint, uint8_t unit_id, uint8_t func_code, uint16_t addr, uint16_t val, int *num)
+{
+    mb_tcp_adu_t req = {0};
+
+    mb_tcp_adu_set_header(&req, 0, 0, unit_id);
+    if (func_code == MB_PDU_WR_SING_COIL)
+        mb_pdu_set_wr_sing_coil_req(&req.pdu, addr, val);
+    else
+        mb_pdu_set_wr_sing_reg_req(&req.pdu, addr, val);
+    return mb_tcp_client_queue_write(client, endpoint, &req, wr_callback, num);
+}
+
+static int queue_wr(mb_tcp_client_t *client, int endpoint, uint8_t func_code, uint16_t addr, uint16_t val, int *num)
+{
+    return queue_wr_unit(client, endpoint, ECHO_UNIT, func_code, addr, val, num);
+}
+
+mb_test_result_t test_mb_tcp_client_async_coalesce(void)
+{
+    mb_tcp_client_wr_stats_t stats = {0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    uint16_t expect[] = {3, 2, 4, 5, 7, 8};
+    int endpoint = 0;
+    int handle = 0;
+    int result = PASS;
+    int num = 0;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 12: coalesce queued writes");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    if (endpoint < 0)
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* repeated and adjacent writes to one table are merged, a write to the other table starts a new request */
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 300, 1, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 301, 2, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 300, 3, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 302, 4, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_COIL, 300, 1, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_COIL, 301, 1, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 303, 5, &num);
+    if ((ret != 0) || (mb_tcp_client_num_pending(&client) != 0) || (mb_tcp_client_flush_writes(&client) < 0) || (wait_all(&client) < 0))
+        result = FAIL;
+    mb_tcp_client_get_wr_stats(&client, &stats);
+    if ((num != 7) || (stats.num_queued != 7) || (stats.num_req != 3) || (stats.num_rd_wr != 0))
+        result = FAIL;
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_rd_coils_req(&req.pdu, 300, 3);
+    ret = mb_tcp_client_exchange_endpoint(&client, endpoint, &req, &resp);
+    if ((ret <= 0) || (resp.pdu.rd_coils_resp.coil_stat[0] != 0x03))
+        result = FAIL;
+    /* a read of registers is combined with the register writes queued for its unit */
+    ret = queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 304, 7, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 305, 8, &num);
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 300, 6);
+    handle = mb_tcp_client_submit_endpoint(&client, endpoint, &req, NULL, NULL, NULL);
+    if ((ret != 0) || (handle < 0) || (wait_all(&client) < 0) || (mb_tcp_client_result(&client, handle, &resp) != MB_TCP_ADU_HEADER_LEN + 2 + 12))
+        result = FAIL;
+    if ((resp.pdu.func_code != MB_PDU_RD_HOLD_REGS) || (resp.trans_id != req.trans_id) || (resp.pdu.rd_hold_regs_resp.byte_count != 12))
+        result = FAIL;
+    for (i = 0; i < 6; i++)
+    {
+        if (resp.pdu.rd_hold_regs_resp.reg_val[i] != expect[i])
+            result = FAIL;
+    }
+    mb_tcp_client_get_wr_stats(&client, &stats);
+    if ((num != 9) || (stats.num_req != 4) || (stats.num_rd_wr != 1))
+        result = FAIL;
+    /* writes that do not form one range are sent ahead of the read */
+    ret = queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 310, 10, &num);
+    ret |= queue_wr(&client, endpoint, MB_PDU_WR_SING_REG, 312, 12, &num);
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 310, 3);
+    handle = mb_tcp_client_submit_endpoint(&client, endpoint, &req, NULL, NULL, NULL);
+    if ((ret != 0) || (handle < 0) || (wait_all(&client) < 0) || (mb_tcp_client_result(&client, handle, &resp) <= 0))
+        result = FAIL;
+    mb_tcp_client_get_wr_stats(&client, &stats);
+    if ((resp.pdu.rd_hold_regs_resp.reg_val[0] != 10)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[2] != 12)
+     || (num != 11)
+     || (stats.num_req != 6)
+     || (stats.num_rd_wr != 1))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static int read_ranges(mb_tcp_client_t *client, int endpoint, uint16_t val[NUM_RANGE][100])
+{
+    mb_tcp_client_range_t range[NUM_RANGE] = {{0}};
+    int ret = 0;
+    int i = 0;
+
+    /* the two long ranges do not fit in one response */
+    range[0].func_code = MB_PDU_RD_HOLD_REGS;
+    range[0].start_addr = 0;
+    range[0].quant = 100;
+    range[1].func_code = MB_PDU_RD_COILS;
+    range[1].start_addr = 299;
+    range[1].quant = 4;
+    range[2].func_code = MB_PDU_RD_HOLD_REGS;
+    range[2].start_addr = 50;
+    range[2].quant = 100;
+    range[3].func_code = MB_PDU_RD_HOLD_REGS;
+    range[3].start_addr = 10;
+    range[3].quant = 0;                                 /* not valid */
+    range[4].func_code = MB_PDU_RD_HOLD_REGS;
+    range[4].start_addr = 302;
+    range[4].quant = 2;
+    for (i = 0; i < NUM_RANGE; i++)
+        range[i].val = val[i];
+    ret = mb_tcp_client_read_ranges(client, endpoint, ECHO_UNIT, range, NUM_RANGE, NULL);
+    if ((ret != 4)
+     || (range[0].result != 100)
+     || (range[1].result != 4)
+     || (range[2].result != 100)
+     || (range[3].result != -EINVAL)
+     || (range[4].result != 2))
+        return -1;
+    return 0;
+}
+
+static int check_ranges(uint16_t val[NUM_RANGE][100])
+{
+    int i = 0;
+
+    for (i = 0; i < 100; i++)
+    {
+        if (val[0][i] != 0xc000 + i)
+            return -1;
+    }
+    for (i = 0; i < 50; i++)
+    {
+        if (val[2][i] != 0xc000 + 50 + i)
+            return -1;
+    }
+    if ((val[1][0] != 0) || (val[1][1] != 1) || (val[1][2] != 1) || (val[1][3] != 0)
+     || (val[4][0] != 4) || (val[4][1] != 5))
+        return -1;
+    return 0;
+}
+
+mb_test_result_t test_mb_tcp_client_async_rd_ranges(void)
+{
+    uint16_t val[NUM_RANGE][100] = {{0}};
+    mb_tcp_client_t client = {{0}};
+    int legacy = 0;
+    int endpoint = 0;
+    int result = PASS;
+
+    printf("%-*s", print_cols, "test 13: read multiple ranges");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    legacy = mb_tcp_client_add_endpoint(&client, HOST_ADDR, EXTRA_PORT + LEGACY_EXTRA);
+    if ((endpoint < 0) || (legacy < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* the probe finds the function code supported and the ranges are packed */
+    if ((read_ranges(&client, endpoint, val) < 0) || (check_ranges(val) < 0) || (client.endpoint[endpoint].rd_ranges != 1))
+        result = FAIL;
+    /* a server that rejects the function code gets one read per range */
+    memset(val, 0, sizeof(val));
+    if ((read_ranges(&client, legacy, val) < 0) || (check_ranges(val) < 0) || (client.endpoint[legacy].rd_ranges != -1))
+        result = FAIL;
+    /* support set in advance is not probed */
+    memset(val, 0, sizeof(val));
+    if ((mb_tcp_client_set_rd_ranges(&client, endpoint, -1) < 0)
+     || (read_ranges(&client, endpoint, val) < 0)
+     || (check_ranges(val) < 0)
+     || (client.endpoint[endpoint].rd_ranges != -1))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_file(void)
+{
+    uint16_t rd_rec[NUM_FILE_REC] = {0};
+    uint16_t wr_rec[NUM_FILE_REC] = {0};
+    mb_tcp_client_t client = {{0}};
+    uint8_t buf[2 * NUM_FILE_REC] = {0};
+    const uint16_t start = MB_TCP_CLIENT_FILE_NUM_REC - 999;
+    ssize_t num = 0;
+    FILE *tmp = NULL;
+    int endpoint = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 14: transfer file records");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    tmp = tmpfile();
+    if ((endpoint < 0) || (tmp == NULL))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    for (i = 0; i < NUM_FILE_REC; i++)
+        wr_rec[i] = 0x5000 + i;
+    /* the run continues from the last records of file 1 into file 2 */
+    num = mb_tcp_client_write_file(&client, endpoint, ECHO_UNIT, 1, start, wr_rec, NUM_FILE_REC, NULL);
+    if ((num != NUM_FILE_REC)
+     || (file_rec[0][start] != 0x5000)
+     || (file_rec[1][0] != 0x5000 + 999)
+     || (file_rec[1][NUM_FILE_REC - 1000] != 0x5000 + NUM_FILE_REC - 1))
+        result = FAIL;
+    num = mb_tcp_client_read_file(&client, endpoint, ECHO_UNIT, 1, start, rd_rec, NUM_FILE_REC, NULL);
+    if ((num != NUM_FILE_REC) || (memcmp(rd_rec, wr_rec, sizeof(wr_rec)) != 0))
+        result = FAIL;
+    /* stream records to a file descriptor as big-endian bytes */
+    num = mb_tcp_client_read_file_fd(&client, endpoint, ECHO_UNIT, 1, start, fileno(tmp), NUM_FILE_REC, NULL);
+    rewind(tmp);
+    if ((num != NUM_FILE_REC) || (fread(buf, 1, sizeof(buf), tmp) != sizeof(buf)) || (buf[0] != 0x50) || (buf[3] != 0x01))
+        result = FAIL;
+    /* a write from a file descriptor stops at the end of the input and pads an odd last byte */
+    fclose(tmp);
+    tmp = tmpfile();
+    if ((tmp == NULL) || (fwrite("\x12\x34\x56", 1, 3, tmp) != 3))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    rewind(tmp);
+    num = mb_tcp_client_write_file_fd(&client, endpoint, ECHO_UNIT, 2, 100, fileno(tmp), NUM_FILE_REC, NULL);
+    if ((num != 2) || (file_rec[1][100] != 0x1234) || (file_rec[1][101] != 0x5600) || (file_rec[1][102] != wr_rec[1101]))
+        result = FAIL;
+    if ((mb_tcp_client_read_file(&client, endpoint, ECHO_UNIT, 0, 0, rd_rec, 1, NULL) != -EINVAL)
+     || (mb_tcp_client_read_file(&client, endpoint, ECHO_UNIT, NUM_FILE + 1, 0, rd_rec, 1, NULL) != -EPROTO))
+        result = FAIL;
+    fclose(tmp);
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static void ignore(mb_tcp_client_t *client, int handle, ssize_t result, mb_tcp_adu_t *resp, void *arg)
+{
+}
+
+mb_test_result_t test_mb_tcp_client_async_file_busy(void)
+{
+    struct timeval short_timeout = {0, 200000};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t req = {0};
+    uint8_t buf[2 * NUM_FILE_REC] = {0};
+    ssize_t num = 0;
+    FILE *tmp = NULL;
+    int endpoint = 0;
+    int result = PASS;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 15: write file records from a file descriptor with few free requests");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    tmp = tmpfile();
+    for (i = 0; i < NUM_FILE_REC; i++)
+    {
+        buf[2 * i] = 0x70 + (i >> 8);
+        buf[2 * i + 1] = i & 0xff;
+    }
+    if ((endpoint < 0) || (tmp == NULL) || (fwrite(buf, 1, sizeof(buf), tmp) != sizeof(buf)))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    rewind(tmp);
+    /* leave room for two requests so that the transfer gets -EBUSY until these time out */
+    mb_tcp_adu_set_header(&req, 0, 0, SILENT_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 0, 1);
+    for (i = 0; i < MB_TCP_CLIENT_MAX_PENDING - 2; i++)
+    {
+        ret = mb_tcp_client_submit(&client, HOST_ADDR, EXTRA_PORT + 1, &req, &short_timeout, ignore, NULL);
+        if (ret < 0)
+            result = FAIL;
+    }
+    num = mb_tcp_client_write_file_fd(&client, endpoint, ECHO_UNIT, 1, 0, fileno(tmp), NUM_FILE_REC, NULL);
+    if (num != NUM_FILE_REC)
+        result = FAIL;
+    for (i = 0; i < NUM_FILE_REC; i++)
+    {
+        if (file_rec[0][i] != ((0x70 + (i >> 8)) << 8 | (i & 0xff)))
+            result = FAIL;
+    }
+    wait_all(&client);
+    fclose(tmp);
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_rd_ranges_silent(void)
+{
+    struct timeval short_timeout = {0, 200000};
+    mb_tcp_client_range_t range = {0};
+    mb_tcp_client_t client = {{0}};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    uint16_t val[10] = {0};
+    long elapsed = 0;
+    int endpoint = 0;
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 16: read multiple ranges from a unit that never answers");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    if (endpoint < 0)
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    range.func_code = MB_PDU_RD_HOLD_REGS;
+    range.quant = 10;
+    range.val = val;
+    /* the probe times out, support stays unknown and the range is read on its own */
+    ret = mb_tcp_client_read_ranges(&client, endpoint, SILENT_UNIT, &range, 1, &short_timeout);
+    if ((ret != 0) || (range.result != -ETIMEDOUT)
+     || (client.endpoint[endpoint].rd_ranges != 0) || (client.endpoint[endpoint].num_probe_timeout != 1))
+        result = FAIL;
+    /* the second read is not held up by another probe during the backoff */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = mb_tcp_client_read_ranges(&client, endpoint, SILENT_UNIT, &range, 1, &short_timeout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((ret != 0) || (range.result != -ETIMEDOUT) || (elapsed > 350) || (client.endpoint[endpoint].num_probe_timeout != 1))
+        result = FAIL;
+    /* after the backoff the endpoint is probed again */
+    memset(&client.endpoint[endpoint].next_probe, 0, sizeof(struct timespec));
+    ret = mb_tcp_client_read_ranges(&client, endpoint, SILENT_UNIT, &range, 1, &short_timeout);
+    if ((ret != 0) || (range.result != -ETIMEDOUT)
+     || (client.endpoint[endpoint].rd_ranges != 0) || (client.endpoint[endpoint].num_probe_timeout != 2))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_late_resp(void)
+{
+    struct timeval short_timeout = {0, 20000};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    int handle = 0;
+    int result = PASS;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 17: exchange after a request is abandoned with its response in flight");
+    client_create(&client);
+    for (i = 0; i < 2; i++)
+    {
+        /* time out the first request and cancel the second */
+        handle = submit_rd(&client, DELAY_UNIT, 3, &short_timeout, NULL, NULL);
+        if (handle < 0)
+        {
+            result = FAIL;
+            break;
+        }
+        if (i == 0)
+        {
+            if ((wait_all(&client) < 0) || (mb_tcp_client_result(&client, handle, &resp) != -ETIMEDOUT))
+                result = FAIL;
+        }
+        else
+        {
+            mb_tcp_client_cancel(&client, handle);
+        }
+        mb_tcp_adu_set_header(&req, 9, 0, ECHO_UNIT);
+        mb_pdu_set_rd_hold_regs_req(&req.pdu, 4, 1);
+        ret = mb_tcp_client_exchange(&client, HOST_ADDR, SERVER_PORT, &req, &resp);
+        if ((ret <= 0)
+         || (resp.trans_id != 9)
+         || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc004))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+/* answers write requests, pausing after the first so that the client fills its socket */
+static void *slow_run(void *arg)
+{
+    int *sd = (int *)arg;
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    mb_tcp_con_t con = {0};
+    ssize_t num = 0;
+    char buf[MB_TCP_ADU_MAX_LEN] = {0};
+    int count = 0;
+
+    sd[1] = accept(sd[0], NULL, NULL);
+    if (sd[1] < 0)
+        return NULL;
+    mb_tcp_con_create(&con, 0);
+    con.sd = sd[1];
+    while (1)
+    {
+        num = mb_tcp_con_recv(&con);
+        if (num == -EAGAIN)
+            continue;
+        if (num <= 0)
+            break;
+        while (mb_tcp_con_rx_complete(&con))
+        {
+            num = mb_tcp_adu_parse_req(&req, con.rx_buf, con.rx_end);
+            if (num < 0)
+                return NULL;
+            mb_tcp_con_consume(&con, num);
+            mb_tcp_adu_set_header(&resp, req.trans_id, req.proto_id, req.unit_id);
+            mb_pdu_set_wr_mult_regs_resp(&resp.pdu, req.pdu.wr_mult_regs_req.start_addr, req.pdu.wr_mult_regs_req.quant_regs);
+            num = mb_tcp_adu_format_resp(&resp, buf, sizeof(buf));
+            if ((num < 0) || (write(sd[1], buf, num) != num))
+                return NULL;
+            if (count++ == 0)
+                usleep(DELAY_USEC);
+        }
+    }
+    return NULL;
+}
+
+static int submit_wr(mb_tcp_client_t *client, uint16_t start_addr, uint16_t quant)
+{
+    mb_tcp_adu_t req = {0};
+    uint16_t val[MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS] = {0};
+
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_wr_mult_regs_req(&req.pdu, start_addr, quant, 2 * quant, val);
+    return mb_tcp_client_submit(client, HOST_ADDR, SLOW_PORT, &req, NULL, NULL, NULL);
+}
+
+mb_test_result_t test_mb_tcp_client_async_full(void)
+{
+    struct sockaddr_in sin = {0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    pthread_t thread = {0};
+    int handle[MB_TCP_CLIENT_MAX_PENDING] = {0};
+    int sd[2] = {-1, -1};
+    int opt = 1;
+    int index = 0;
+    int result = PASS;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 18: queue requests while the socket is full");
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(SLOW_PORT);
+    inet_pton(AF_INET, HOST_ADDR, &sin.sin_addr);
+    sd[0] = socket(PF_INET, SOCK_STREAM, 0);
+    setsockopt(sd[0], SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(sd[0], SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));  /* the smallest window there is */
+    if ((bind(sd[0], (struct sockaddr *)&sin, sizeof(sin)) < 0) || (listen(sd[0], 1) < 0))
+    {
+        close(sd[0]);
+        return FAIL;
+    }
+    pthread_create(&thread, NULL, slow_run, sd);
+    client_create(&client);
+    /* open the connection, then shrink its send buffer */
+    handle[0] = submit_wr(&client, 0, 1);
+    if ((handle[0] < 0) || (wait_all(&client) < 0) || (mb_tcp_client_result(&client, handle[0], &resp) <= 0))
+        result = FAIL;
+    index = find_active_con(&client);
+    if (index < 0)
+        result = FAIL;
+    else
+        setsockopt(client.con[index].sd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+    for (i = 0; (result == PASS) && (i < MB_TCP_CLIENT_MAX_PENDING); i++)
+    {
+        handle[i] = submit_wr(&client, i * MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS, MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS);
+        if (handle[i] < 0)
+            result = FAIL;
+    }
+    if ((result == PASS) && (wait_all(&client) < 0))
+        result = FAIL;
+    for (i = 0; (result == PASS) && (i < MB_TCP_CLIENT_MAX_PENDING); i++)
+    {
+        ret = mb_tcp_client_result(&client, handle[i], &resp);
+        if ((ret <= 0)
+         || (resp.pdu.func_code != MB_PDU_WR_MULT_REGS)
+         || (resp.pdu.wr_mult_regs_resp.start_addr != i * MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    pthread_cancel(thread);
+    pthread_join(thread, NULL);
+    close(sd[1]);
+    close(sd[0]);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_connect_nb(void)
+{
+    struct timeval connect_timeout = {0, 200000};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    long elapsed[3] = {0};
+    int sd[3] = {0};
+    int stall = 0;
+    int echo = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 19: submit without waiting for a connect");
+    if (listen_full(sd) < 0)
+        return FAIL;
+    client_create(&client);
+    mb_tcp_client_set_connect_timeout(&client, connect_timeout);
+    mb_tcp_adu_set_header(&req, 1, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 0, 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stall = mb_tcp_client_submit(&client, HOST_ADDR, STALL_PORT, &req, NULL, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed[0] = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    echo = submit_rd(&client, ECHO_UNIT, 5, NULL, NULL, NULL);
+    if ((stall < 0) || (echo < 0))
+        result = FAIL;
+    /* the request to the live server is not held up by the connect */
+    while ((result == PASS) && (mb_tcp_client_result(&client, echo, &resp) == -EINPROGRESS))
+    {
+        if (mb_tcp_client_poll(&client, NULL) < 0)
+            result = FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed[1] = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((result == PASS) && (wait_all(&client) < 0))
+        result = FAIL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed[2] = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((result == PASS)
+     && ((resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc005)
+      || (mb_tcp_client_result(&client, stall, &resp) != -ETIMEDOUT)
+      || (elapsed[0] > 50)
+      || (elapsed[1] > 150)
+      || (elapsed[2] < 200)
+      || (elapsed[2] >= 1000)))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    for (i = 0; i < 3; i++)
+        close(sd[i]);
+    return result;
+}
+
+/* send two requests to each of NUM_WIDE endpoints in one batch */
+static int wide_batch(mb_tcp_client_t *client)
+{
+    mb_tcp_client_item_t item[2 * NUM_WIDE] = {{0}};
+    mb_tcp_adu_t resp[2 * NUM_WIDE] = {{0}};
+    mb_tcp_adu_t req[2 * NUM_WIDE] = {{0}};
+    int endpoint[NUM_WIDE] = {0};
+    char host[16] = {0};
+    int ret = 0;
+    int i = 0;
+
+    for (i = 0; i < NUM_WIDE; i++)
+    {
+        snprintf(host, sizeof(host), "127.0.0.%d", i % NUM_WIDE_ADDR + 1);
+        mb_tcp_client_authorise_addr(client, host);
+        endpoint[i] = mb_tcp_client_add_endpoint(client, host, WIDE_PORT + i / NUM_WIDE_ADDR);
+        if (endpoint[i] < 0)
+            return -1;
+    }
+    for (i = 0; i < 2 * NUM_WIDE; i++)
+    {
+        mb_tcp_adu_set_header(&req[i], 0, 0, ECHO_UNIT);
+        mb_pdu_set_rd_hold_regs_req(&req[i].pdu, i, 1);
+        item[i].endpoint = endpoint[i % NUM_WIDE];
+        item[i].req = &req[i];
+        item[i].resp = &resp[i];
+    }
+    ret = mb_tcp_client_exchange_batch(client, item, 2 * NUM_WIDE, NULL);
+    if (ret != 2 * NUM_WIDE)
+        return -1;
+    for (i = 0; i < 2 * NUM_WIDE; i++)
+    {
+        if ((item[i].result <= 0) || (resp[i].pdu.rd_hold_regs_resp.reg_val[0] != 0xc000 + i))
+            return -1;
+    }
+    return 0;
+}
+
+mb_test_result_t test_mb_tcp_client_async_batch_wide(void)
+{
+    struct timeval timeout = {1, 0};
+    mb_tcp_client_t client = {{0}};
+    int result = PASS;
+
+    printf("%-*s", print_cols, "test 20: exchange a batch with more endpoints than requests in flight");
+    /* a client sized for the batch connects to every endpoint at once */
+    mb_tcp_client_create_size(&client, timeout, NUM_WIDE, MB_TCP_CLIENT_MAX_PENDING);
+    if ((wide_batch(&client) < 0)
+     || (client.num_free != 0)
+     || (mb_tcp_client_num_pending(&client) != 0))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    /* a client with fewer connections than endpoints reuses them */
+    client_create(&client);
+    if ((wide_batch(&client) < 0)
+     || (mb_tcp_client_num_pending(&client) != 0))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_size(void)
+{
+    struct timeval timeout = {1, 0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    ssize_t num = 0;
+    int handle[NUM_SIZED] = {0};
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 21: size the pending table when the client is created");
+    if (mb_tcp_client_create_size(&client, timeout, 1, 24) != -EINVAL)
+        return FAIL;
+    if (mb_tcp_client_create_size(&client, timeout, 1, NUM_SIZED) < 0)
+        return FAIL;
+    mb_tcp_client_authorise_addr(&client, HOST_ADDR);
+    for (i = 0; i < NUM_SIZED; i++)
+    {
+        handle[i] = submit_rd(&client, ECHO_UNIT, 10 + i, NULL, NULL, NULL);
+        if (handle[i] < 0)
+            result = FAIL;
+    }
+    if ((result == FAIL)
+     || (submit_rd(&client, ECHO_UNIT, 10, NULL, NULL, NULL) != -EBUSY)
+     || (wait_all(&client) < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* the transaction ids carry handles above MB_TCP_CLIENT_MAX_PENDING */
+    for (i = 0; i < NUM_SIZED; i++)
+    {
+        num = mb_tcp_client_result(&client, handle[i], &resp);
+        if ((num <= 0)
+         || ((resp.trans_id & (NUM_SIZED - 1)) != handle[i])
+         || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xc000 + 10 + i))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_batch_busy(void)
+{
+    mb_tcp_client_item_t item = {0};
+    struct timeval silent_timeout = {5, 0};
+    struct timeval timeout = {0, 300000};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    struct timespec cpu_start = {0};
+    struct timespec cpu_end = {0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    long elapsed = 0;
+    long cpu = 0;
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 22: wait without spinning for a connection held by another request");
+    /* the only connection is held by a request that is never answered */
+    mb_tcp_client_create_size(&client, silent_timeout, 1, MB_TCP_CLIENT_MAX_PENDING);
+    mb_tcp_client_authorise_addr(&client, HOST_ADDR);
+    if (submit_rd(&client, SILENT_UNIT, 0, &silent_timeout, NULL, NULL) < 0)
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    item.endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, EXTRA_PORT);
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 0, 1);
+    item.req = &req;
+    item.resp = &resp;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    ret = mb_tcp_client_exchange_batch(&client, &item, 1, &timeout);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    cpu = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000 + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000000;
+    if ((ret != 0) || (item.result != -ETIMEDOUT) || (elapsed < 300) || (elapsed >= 1000) || (cpu >= 50))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_file_full(void)
+{
+    struct timespec start = {0};
+    struct timespec end = {0};
+    mb_tcp_client_t client = {{0}};
+    uint16_t rec[NUM_FILE_REC] = {0};
+    ssize_t num = 0;
+    long elapsed = 0;
+    int handle[MB_TCP_CLIENT_MAX_PENDING] = {0};
+    int endpoint = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 23: fail a file transfer when no request can complete");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    /* every request is answered but its result is never collected */
+    for (i = 0; i < MB_TCP_CLIENT_MAX_PENDING; i++)
+    {
+        handle[i] = submit_rd(&client, ECHO_UNIT, i, NULL, NULL, NULL);
+        if (handle[i] < 0)
+            result = FAIL;
+    }
+    if ((endpoint < 0) || (result == FAIL) || (wait_all(&client) < 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    num = mb_tcp_client_read_file(&client, endpoint, ECHO_UNIT, 1, 0, rec, NUM_FILE_REC, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((num != -EBUSY) || (elapsed >= 100))
+        result = FAIL;
+    for (i = 0; i < MB_TCP_CLIENT_MAX_PENDING; i++)
+    {
+        if (mb_tcp_client_result(&client, handle[i], NULL) <= 0)
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_wr_order(void)
+{
+    struct timeval delay = {0, 50000};
+    struct timeval zero = {0, 0};
+    mb_tcp_client_wr_stats_t stats = {0};
+    mb_tcp_client_t client = {{0}};
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    struct timespec deadline = {0};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    long elapsed = 0;
+    int endpoint = 0;
+    int handle = 0;
+    int result = PASS;
+    int num = 0;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 24: send queued writes in order after the write delay");
+    client_create(&client);
+    mb_tcp_client_set_wr_delay(&client, delay);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    if (endpoint < 0)
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* writes stay queued until the delay has passed, and a write to another unit is not overtaken */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret |= queue_wr_unit(&client, endpoint, ECHO_UNIT, MB_PDU_WR_SING_REG, 320, 1, &num);
+    ret |= queue_wr_unit(&client, endpoint, SHORT_UNIT, MB_PDU_WR_SING_REG, 321, 2, &num);
+    ret |= queue_wr_unit(&client, endpoint, ECHO_UNIT, MB_PDU_WR_SING_REG, 322, 3, &num);
+    if ((ret != 0) || (mb_tcp_client_poll(&client, &zero) < 0) || (mb_tcp_client_num_pending(&client) != 0)
+     || (!mb_tcp_client_next_deadline(&client, &deadline)))
+        result = FAIL;
+    while ((client.num_wr > 0) || (mb_tcp_client_num_pending(&client) > 0))
+    {
+        if (mb_tcp_client_poll(&client, NULL) < 0)
+        {
+            result = FAIL;
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    mb_tcp_client_get_wr_stats(&client, &stats);
+    if ((num != 3) || (stats.num_req != 3) || (elapsed < 40))
+        result = FAIL;
+    /* a read is not combined with writes queued behind a write to another unit */
+    ret = queue_wr_unit(&client, endpoint, SHORT_UNIT, MB_PDU_WR_SING_REG, 330, 4, &num);
+    ret |= queue_wr_unit(&client, endpoint, ECHO_UNIT, MB_PDU_WR_SING_REG, 331, 5, &num);
+    mb_tcp_adu_set_header(&req, 0, 0, ECHO_UNIT);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, 330, 2);
+    handle = mb_tcp_client_submit_endpoint(&client, endpoint, &req, NULL, NULL, NULL);
+    if ((ret != 0) || (handle < 0) || (wait_all(&client) < 0) || (mb_tcp_client_result(&client, handle, &resp) <= 0))
+        result = FAIL;
+    mb_tcp_client_get_wr_stats(&client, &stats);
+    if ((resp.pdu.rd_hold_regs_resp.reg_val[0] != 4)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[1] != 5)
+     || (num != 5)
+     || (stats.num_req != 5)
+     || (stats.num_rd_wr != 0))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_client_async_remove_endpoint(void)
+{
+    mb_tcp_client_t client = {{0}};
+    int endpoint = 0;
+    int other = 0;
+    int result = PASS;
+
+    printf("%-*s", print_cols, "test 25: remove an endpoint and reuse its slot");
+    client_create(&client);
+    endpoint = mb_tcp_client_add_endpoint(&client, HOST_ADDR, SERVER_PORT);
+    other = mb_tcp_client_add_endpoint(&client, HOST_ADDR, EXTRA_PORT);
+    if ((endpoint < 0) || (other < 0) || (exchange_rd(&client, endpoint, 1) <= 0) || (exchange_rd(&client, other, 1) <= 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    /* the idle connection to the endpoint is closed, the other is kept */
+    if ((mb_tcp_client_remove_endpoint(&client, endpoint) != 0)
+     || (mb_tcp_client_remove_endpoint(&client, endpoint) != -EINVAL)
+     || (find_con(&client, SERVER_PORT) >= 0)
+     || (find_con(&client, EXTRA_PORT) < 0))
+        result = FAIL;
+    /* the next endpoint added takes the free slot */
+    if ((mb_tcp_client_add_endpoint(&client, HOST_ADDR, EXTRA_PORT + 1) != endpoint)
+     || (mb_tcp_client_add_endpoint(&client, HOST_ADDR, EXTRA_PORT) != other)
+     || (client.num_endpoint != 2)
+     || (exchange_rd(&client, endpoint, 1) <= 0))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_tcp_client_async_reorder,
+                             test_mb_tcp_client_async_callback,
+                             test_mb_tcp_client_async_timeout,
+                             test_mb_tcp_client_async_cancel,
+                             test_mb_tcp_client_async_connect_timeout,
+                             test_mb_tcp_client_async_preconnect,
+                             test_mb_tcp_client_async_lru,
+                             test_mb_tcp_client_async_batch,
+                             test_mb_tcp_client_async_prep,
+                             test_mb_tcp_client_async_hedge,
+                             test_mb_tcp_client_async_cache,
+                             test_mb_tcp_client_async_coalesce,
+                             test_mb_tcp_client_async_rd_ranges,
+                             test_mb_tcp_client_async_file,
+                             test_mb_tcp_client_async_file_busy,
+                             test_mb_tcp_client_async_rd_ranges_silent,
+                             test_mb_tcp_client_async_late_resp,
+                             test_mb_tcp_client_async_full,
+                             test_mb_tcp_client_async_connect_nb,
+                             test_mb_tcp_client_async_batch_wide,
+                             test_mb_tcp_client_async_size,
+                             test_mb_tcp_client_async_batch_busy,
+                             test_mb_tcp_client_async_file_full,
+                             test_mb_tcp_client_async_wr_order,
+                             test_mb_tcp_client_async_remove_endpoint};
+    int ret = 0;
+
+    if (setup() < 0)
+    {
+        printf("failed to set up the server\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    teardown();
+    return ret;
+}
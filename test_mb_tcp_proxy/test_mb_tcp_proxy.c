@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "mb_tcp_proxy.h"
+#include "mb_tcp_client.h"
+#include "mb_reg_bank.h"
+#include "mb_test.h"
+
+#define HOST_ADDR     "127.0.0.1"
+#define PROXY_PORT    10020
+#define BACKEND_PORT  10021                             /* first of NUM_BACKEND consecutive ports */
+#define STALL_PORT    10028                             /* backend that stops reading for STALL_USEC */
+#define DEAD_PORT     10029                             /* nothing listens on this port */
+#define STALL_USEC    100000
+#define NUM_STALL     MB_TCP_PROXY_MAX_PENDING
+#define NUM_BACKEND   2
+#define SILENT_UNIT   99                                /* backend unit that never responds */
+#define NUM_CLIENT    4
+#define NUM_ITER      20
+
+int print_cols = 93;
+
+typedef struct
+{
+    mb_tcp_server_t server;
+    mb_reg_bank_t bank;
+    pthread_t thread;
+    int last_unit_id;
+}
+backend_t;
+
+typedef struct
+{
+    mb_tcp_client_t client;
+    int id;
+    int result;
+}
+client_t;
+
+static backend_t backend[NUM_BACKEND] = {{{0}}};
+static mb_tcp_server_t server = {0};
+static mb_tcp_proxy_t proxy = {0};
+static pthread_t server_thread = {0};
+static pthread_t stall_thread = {0};
+static int stall_listen_sd = -1;
+static int stall_sd = -1;
+
+static int handle_backend(mb_tcp_server_t *s, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    backend_t *b = (backend_t *)mb_tcp_server_get_data(s);
+
+    b->last_unit_id = req->unit_id;
+    if (req->unit_id == SILENT_UNIT)
+    {
+        return MB_TCP_SERVER_DEFERRED;  /* never answered */
+    }
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    return mb_reg_bank_handle(&b->bank, &req->pdu, &resp->pdu);
+}
+
+static void *server_run(void *arg)
+{
+    mb_tcp_server_run((mb_tcp_server_t *)arg);
+    return NULL;
+}
+
+/* answers write requests, pausing after the first so that the proxy fills its socket */
+static void *stall_run(void *arg)
+{
+    mb_tcp_adu_t resp = {0};
+    mb_tcp_adu_t req = {0};
+    mb_tcp_con_t con = {0};
+    ssize_t num = 0;
+    char buf[MB_TCP_ADU_MAX_LEN] = {0};
+    int count = 0;
+
+    stall_sd = accept(stall_listen_sd, NULL, NULL);
+    if (stall_sd < 0)
+        return NULL;
+    mb_tcp_con_create(&con, 0);
+    con.sd = stall_sd;
+    while (1)
+    {
+        num = mb_tcp_con_recv(&con);
+        if (num == -EAGAIN)
+            continue;
+        if (num <= 0)
+            break;
+        while (mb_tcp_con_rx_complete(&con))
+        {
+            num = mb_tcp_adu_parse_req(&req, con.rx_buf, con.rx_end);
+            if (num < 0)
+                return NULL;
+            mb_tcp_con_consume(&con, num);
+            mb_tcp_adu_set_header(&resp, req.trans_id, req.proto_id, req.unit_id);
+            mb_pdu_set_wr_mult_regs_resp(&resp.pdu, req.pdu.wr_mult_regs_req.start_addr, req.pdu.wr_mult_regs_req.quant_regs);
+            num = mb_tcp_adu_format_resp(&resp, buf, sizeof(buf));
+            if ((num < 0) || (write(stall_sd, buf, num) != num))
+                return NULL;
+            if (count++ == 0)
+                usleep(STALL_USEC);
+        }
+    }
+    return NULL;
+}
+
+static int stall_listen(void)
+{
+    struct sockaddr_in sin = {0};
+    int opt = 1;
+
+    stall_listen_sd = socket(PF_INET, SOCK_STREAM, 0);
+    if (stall_listen_sd < 0)
+        return -1;
+    setsockopt(stall_listen_sd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    opt = 1;
+    setsockopt(stall_listen_sd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));  /* the smallest window there is */
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(STALL_PORT);
+    inet_pton(AF_INET, HOST_ADDR, &sin.sin_addr);
+    if ((bind(stall_listen_sd, (struct sockaddr *)&sin, sizeof(sin)) < 0) || (listen(stall_listen_sd, 1) < 0))
+        return -1;
+    pthread_create(&stall_thread, NULL, stall_run, NULL);
+    return 0;
+}
+
+static int setup(void)
+{
+    struct timeval timeout = {0, 300000};
+    uint16_t val[200] = {0};
+    unsigned i = 0;
+    unsigned j = 0;
+    int ret = 0;
+
+    for (i = 0; i < NUM_BACKEND; i++)
+    {
+        ret = mb_reg_bank_create(&backend[i].bank);
+        if (ret < 0)
+            return -1;
+        for (j = 0; j < 200; j++)
+            val[j] = ((0xa + i) << 12) + j;
+        mb_reg_bank_wr_regs(&backend[i].bank, MB_REG_BANK_HOLD_REGS, 0, 200, val);
+        ret = mb_tcp_server_create(&backend[i].server, HOST_ADDR, BACKEND_PORT + i, NULL);
+        if (ret < 0)
+            return -1;
+        mb_tcp_server_authorise_addr(&backend[i].server, HOST_ADDR);
+        for (j = 0; j < MB_TCP_SERVER_NUM_UNIT; j++)
+            mb_tcp_server_add_unit(&backend[i].server, j, handle_backend, &backend[i]);
+        pthread_create(&backend[i].thread, NULL, server_run, &backend[i].server);
+    }
+    ret = mb_tcp_server_create(&server, HOST_ADDR, PROXY_PORT, NULL);
+    if (ret < 0)
+        return -1;
+    mb_tcp_server_authorise_addr(&server, HOST_ADDR);
+    ret = mb_tcp_proxy_create(&proxy, &server, timeout);
+    if (ret < 0)
+        return -1;
+    mb_tcp_proxy_add_backend(&proxy, HOST_ADDR, BACKEND_PORT, 1);
+    mb_tcp_proxy_add_backend(&proxy, HOST_ADDR, BACKEND_PORT + 1, 2);
+    mb_tcp_proxy_add_backend(&proxy, HOST_ADDR, DEAD_PORT, 1);
+    mb_tcp_proxy_add_backend(&proxy, HOST_ADDR, STALL_PORT, 1);
+    mb_tcp_proxy_add_rule(&proxy, 1, 0, 0x10000, 0, 11);
+    mb_tcp_proxy_add_rule(&proxy, 2, 0, 100, 0, 1);
+    mb_tcp_proxy_add_rule(&proxy, 2, 100, 100, 1, 1);
+    mb_tcp_proxy_add_rule(&proxy, 3, 0, 0x10000, 0, SILENT_UNIT);
+    mb_tcp_proxy_add_rule(&proxy, 4, 0, 0x10000, 2, 1);
+    mb_tcp_proxy_add_rule(&proxy, 5, 0, 0x10000, 3, 1);
+    if (stall_listen() < 0)
+        return -1;
+    pthread_create(&server_thread, NULL, server_run, &server);
+    usleep(100000);
+    return 0;
+}
+
+static void teardown(void)
+{
+    unsigned i = 0;
+
+    pthread_cancel(server_thread);
+    pthread_join(server_thread, NULL);
+    pthread_cancel(stall_thread);
+    pthread_join(stall_thread, NULL);
+    close(stall_sd);
+    close(stall_listen_sd);
+    mb_tcp_proxy_destroy(&proxy);
+    mb_tcp_server_destroy(&server);
+    for (i = 0; i < NUM_BACKEND; i++)
+    {
+        pthread_cancel(backend[i].thread);
+        pthread_join(backend[i].thread, NULL);
+        mb_tcp_server_destroy(&backend[i].server);
+        mb_reg_bank_destroy(&backend[i].bank);
+    }
+}
+
+static int rd_regs(mb_tcp_client_t *client, uint16_t trans_id, uint8_t unit_id, uint16_t start_addr, uint16_t quant, mb_tcp_adu_t *resp)
+{
+    mb_tcp_adu_t req = {0};
+
+    mb_tcp_adu_set_header(&req, trans_id, 0, unit_id);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, start_addr, quant);
+    return mb_tcp_client_exchange(client, HOST_ADDR, PROXY_PORT, &req, resp);
+}
+
+static void client_create(mb_tcp_client_t *client)
+{
+    struct timeval timeout = {5, 0};
+
+    mb_tcp_client_create(client, timeout);
+    mb_tcp_client_authorise_addr(client, HOST_ADDR);
+}
+
+mb_test_result_t test_mb_tcp_proxy_unit(void)
+{
+    mb_tcp_client_t client = {0};
+    mb_tcp_adu_t resp = {0};
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 1: forward a request and rewrite the unit id");
+    client_create(&client);
+    ret = rd_regs(&client, 0x1234, 1, 10, 2, &resp);
+    mb_tcp_client_destroy(&client);
+    if ((ret < 0)
+     || (resp.trans_id != 0x1234)
+     || (resp.unit_id != 1)
+     || (resp.pdu.func_code != MB_PDU_RD_HOLD_REGS)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xa00a)
+     || (resp.pdu.rd_hold_regs_resp.reg_val[1] != 0xa00b)
+     || (backend[0].last_unit_id != 11))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_tcp_proxy_range(void)
+{
+    mb_tcp_client_t client = {0};
+    mb_tcp_adu_t resp = {0};
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 2: select the backend by address range");
+    client_create(&client);
+    ret = rd_regs(&client, 1, 2, 50, 1, &resp);
+    if ((ret < 0) || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xa000 + 50))
+        result = FAIL;
+    ret = rd_regs(&client, 2, 2, 150, 1, &resp);
+    if ((ret < 0) || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xb000 + 150))
+        result = FAIL;
+    /* no rule covers a range that spans both backends */
+    ret = rd_regs(&client, 3, 2, 90, 20, &resp);
+    if ((ret < 0)
+     || (resp.pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (resp.pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_PATH_UNAVAIL))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static void *client_run(void *arg)
+{
+    client_t *c = (client_t *)arg;
+    mb_tcp_adu_t resp = {0};
+    uint16_t addr = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    c->result = PASS;
+    for (i = 0; i < NUM_ITER; i++)
+    {
+        addr = c->id * NUM_ITER + i;
+        ret = rd_regs(&c->client, addr, 1, addr, 1, &resp);
+        if ((ret < 0)
+         || (resp.trans_id != addr)
+         || (resp.pdu.func_code != MB_PDU_RD_HOLD_REGS)
+         || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xa000 + addr))
+            c->result = FAIL;
+    }
+    return NULL;
+}
+
+mb_test_result_t test_mb_tcp_proxy_multiplex(void)
+{
+    pthread_t thread[NUM_CLIENT] = {0};
+    client_t c[NUM_CLIENT] = {{{{0}}}};
+    int num_con = 0;
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 3: several clients share one backend connection");
+    for (i = 0; i < NUM_CLIENT; i++)
+    {
+        client_create(&c[i].client);
+        c[i].id = i;
+        pthread_create(&thread[i], NULL, client_run, &c[i]);
+    }
+    for (i = 0; i < NUM_CLIENT; i++)
+    {
+        pthread_join(thread[i], NULL);
+        mb_tcp_client_destroy(&c[i].client);
+        if (c[i].result != PASS)
+            result = FAIL;
+    }
+    for (i = 0; i < MB_TCP_SERVER_MAX_CON; i++)
+    {
+        if (mb_tcp_con_is_active(&backend[0].server.con[i]))
+            num_con++;
+    }
+    if (num_con != 1)
+        result = FAIL;
+    return result;
+}
+
+mb_test_result_t test_mb_tcp_proxy_err(void)
+{
+    mb_tcp_client_t client = {0};
+    mb_tcp_adu_t resp = {0};
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 4: silent and unreachable backends are reported as exceptions");
+    client_create(&client);
+    ret = rd_regs(&client, 1, 3, 0, 1, &resp);
+    if ((ret < 0)
+     || (resp.pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (resp.pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP))
+        result = FAIL;
+    ret = rd_regs(&client, 2, 4, 0, 1, &resp);
+    if ((ret < 0)
+     || (resp.pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (resp.pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_TARGET_NO_RESP))
+        result = FAIL;
+    /* the proxy still works after a timeout */
+    ret = rd_regs(&client, 3, 1, 5, 1, &resp);
+    if ((ret < 0) || (resp.pdu.rd_hold_regs_resp.reg_val[0] != 0xa005))
+        result = FAIL;
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+static int submit_wr(mb_tcp_client_t *client, uint16_t start_addr, uint16_t quant)
+{
+    mb_tcp_adu_t req = {0};
+    uint16_t val[MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS] = {0};
+
+    mb_tcp_adu_set_header(&req, 0, 0, 5);
+    mb_pdu_set_wr_mult_regs_req(&req.pdu, start_addr, quant, 2 * quant, val);
+    return mb_tcp_client_submit(client, HOST_ADDR, PROXY_PORT, &req, NULL, NULL, NULL);
+}
+
+mb_test_result_t test_mb_tcp_proxy_backend_full(void)
+{
+    mb_tcp_client_t client = {0};
+    mb_tcp_adu_t resp = {0};
+    int handle[NUM_STALL] = {0};
+    int opt = 1;
+    int result = PASS;
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 5: queue requests while the backend socket is full");
+    client_create(&client);
+    /* open the backend connection, then shrink its send buffer */
+    handle[0] = submit_wr(&client, 0, 1);
+    while ((handle[0] >= 0) && (mb_tcp_client_num_pending(&client) > 0))
+        mb_tcp_client_poll(&client, NULL);
+    if ((handle[0] < 0) || (mb_tcp_client_result(&client, handle[0], &resp) <= 0))
+    {
+        mb_tcp_client_destroy(&client);
+        return FAIL;
+    }
+    setsockopt(proxy.backend[3].con[0].con.sd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+    for (i = 0; i < NUM_STALL; i++)
+    {
+        handle[i] = submit_wr(&client, i * MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS, MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS);
+        if (handle[i] < 0)
+            result = FAIL;
+    }
+    while ((result == PASS) && (mb_tcp_client_num_pending(&client) > 0))
+    {
+        if (mb_tcp_client_poll(&client, NULL) < 0)
+            result = FAIL;
+    }
+    for (i = 0; (result == PASS) && (i < NUM_STALL); i++)
+    {
+        ret = mb_tcp_client_result(&client, handle[i], &resp);
+        if ((ret <= 0)
+         || (resp.pdu.func_code != MB_PDU_WR_MULT_REGS)
+         || (resp.pdu.wr_mult_regs_resp.start_addr != i * MB_PDU_WR_MULT_REGS_MAX_QUANT_REGS))
+            result = FAIL;
+    }
+    mb_tcp_client_destroy(&client);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_tcp_proxy_unit,
+                             test_mb_tcp_proxy_range,
+                             test_mb_tcp_proxy_multiplex,
+                             test_mb_tcp_proxy_err,
+                             test_mb_tcp_proxy_backend_full};
+    int ret = 0;
+
+    if (setup() < 0)
+    {
+        printf("failed to set up the proxy\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    teardown();
+    return ret;
+}
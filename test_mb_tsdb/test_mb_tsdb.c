@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "mb_tsdb.h"
+#include "mb_test.h"
+
+#define START_TIME    1500000000000LL                   /* milliseconds */
+#define PERIOD        1000
+#define NUM_REGS      125
+#define MAX_SAMPLES   (18 * MB_TSDB_CHUNK_LEN)
+
+typedef struct
+{
+    long long num;
+    int64_t time[MAX_SAMPLES];
+    uint16_t val[MAX_SAMPLES];
+}
+scan_data_t;
+
+int print_cols = 93;
+
+static scan_data_t data = {0};
+
+static void scan_func(uint32_t dev, uint16_t addr, int64_t time, uint16_t val, void *arg)
+{
+    scan_data_t *d = (scan_data_t *)arg;
+
+    if (d->num < MAX_SAMPLES)
+    {
+        d->time[d->num] = time;
+        d->val[d->num] = val;
+    }
+    d->num++;
+}
+
+static long long scan(mb_tsdb_t *db, uint32_t dev, uint16_t addr, int64_t start_time, int64_t end_time)
+{
+    memset(&data, 0, sizeof(data));
+    return mb_tsdb_scan(db, dev, addr, start_time, end_time, scan_func, &data);
+}
+
+/* poll timestamps with some jitter */
+static int64_t sample_time(int i)
+{
+    return START_TIME + (int64_t)i * PERIOD + ((i % 7 == 3) ? 2 : 0) - ((i % 11 == 5) ? 1 : 0);
+}
+
+static uint16_t sample_val(int reg, int i)
+{
+    switch (reg)
+    {
+    case 0:
+        return i;                                       /* counter */
+    case 1:
+        return 1000 + (i * 37 % 7) - 3;                 /* noisy analog value */
+    case 2:
+        return (i % 500 < 250) ? 0 : 0xffff;            /* flag */
+    case 3:
+        return i * 7919;                                /* changes a lot */
+    }
+    if (reg >= NUM_REGS / 2)
+        return (i * 7919) ^ reg;
+    return reg;                                         /* constant */
+}
+
+static void remove_dir(const char *dir)
+{
+    struct dirent *ent = NULL;
+    char path[1024] = {0};
+    DIR *d = NULL;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return;
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static int write_samples(mb_tsdb_t *db, uint32_t dev, int start, int num)
+{
+    uint16_t val[NUM_REGS] = {0};
+    int ret = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = start; i < start + num; i++)
+    {
+        for (j = 0; j < NUM_REGS; j++)
+            val[j] = sample_val(j, i);
+        ret = mb_tsdb_write_regs(db, dev, 100, sample_time(i), val, NUM_REGS);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int check_samples(int reg, int start, int num)
+{
+    int i = 0;
+
+    if (data.num != num)
+        return FAIL;
+    for (i = 0; i < num; i++)
+    {
+        if ((data.time[i] != sample_time(start + i)) || (data.val[i] != sample_val(reg, start + i)))
+            return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_tsdb_write_scan(void)
+{
+    char dir[] = "/tmp/test_mb_tsdb_XXXXXX";
+    mb_tsdb_t db = {0};
+    int result = PASS;
+    int reg = 0;
+
+    printf("%-*s", print_cols, "test 1: write register blocks and scan single registers");
+    if ((mkdtemp(dir) == NULL) || (mb_tsdb_open(&db, dir, 0, 0) < 0))
+    {
+        return FAIL;
+    }
+    /* two and a half chunks */
+    if (write_samples(&db, 1, 0, 2 * MB_TSDB_CHUNK_LEN + MB_TSDB_CHUNK_LEN / 2) < 0)
+        result = FAIL;
+    /* only whole chunks are seen before a flush */
+    if (scan(&db, 1, 100, START_TIME, START_TIME + 10000000) != 2 * MB_TSDB_CHUNK_LEN)
+        result = FAIL;
+    if (mb_tsdb_flush(&db) < 0)
+        result = FAIL;
+    for (reg = 0; reg < 5; reg++)
+    {
+        scan(&db, 1, 100 + reg, START_TIME, START_TIME + 10000000);
+        if (check_samples(reg, 0, 2 * MB_TSDB_CHUNK_LEN + MB_TSDB_CHUNK_LEN / 2) != PASS)
+            result = FAIL;
+    }
+    /* a time range within a chunk and one spanning chunks */
+    scan(&db, 1, 100, sample_time(10), sample_time(20));
+    if (check_samples(0, 10, 10) != PASS)
+        result = FAIL;
+    scan(&db, 1, 103, sample_time(1000), sample_time(2100));
+    if (check_samples(3, 1000, 1100) != PASS)
+        result = FAIL;
+    /* other devices, addresses and times */
+    if ((scan(&db, 2, 100, START_TIME, START_TIME + 10000000) != 0)
+     || (scan(&db, 1, 99, START_TIME, START_TIME + 10000000) != 0)
+     || (scan(&db, 1, 100 + NUM_REGS, START_TIME, START_TIME + 10000000) != 0)
+     || (scan(&db, 1, 100, 0, START_TIME) != 0))
+        result = FAIL;
+    mb_tsdb_close(&db);
+    remove_dir(dir);
+    return result;
+}
+
+mb_test_result_t test_mb_tsdb_size(void)
+{
+    char dir[] = "/tmp/test_mb_tsdb_XXXXXX";
+    mb_tsdb_stats_t stats = {0};
+    mb_tsdb_t db = {0};
+    uint16_t val[NUM_REGS] = {0};
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 2: store mostly unchanging registers in a fraction of a bit each");
+    if ((mkdtemp(dir) == NULL) || (mb_tsdb_open(&db, dir, 0, 0) < 0))
+    {
+        return FAIL;
+    }
+    for (i = 0; i < 8 * MB_TSDB_CHUNK_LEN; i++)
+    {
+        val[0] = sample_val(0, i);
+        val[1] = sample_val(1, i);
+        if (mb_tsdb_write_regs(&db, 1, 0, sample_time(i), val, NUM_REGS) < 0)
+            result = FAIL;
+    }
+    mb_tsdb_flush(&db);
+    mb_tsdb_get_stats(&db, &stats);
+    /* one counter, one noisy value and 123 constants take less than a quarter of a bit per value */
+    if ((stats.num_chunk != 8)
+     || (stats.num_sample != 8 * MB_TSDB_CHUNK_LEN)
+     || (stats.num_byte * 8 * 4 > stats.num_sample * NUM_REGS))
+        result = FAIL;
+    scan(&db, 1, 1, START_TIME, START_TIME + 10000000);
+    if (check_samples(1, 0, 8 * MB_TSDB_CHUNK_LEN) != PASS)
+        result = FAIL;
+    mb_tsdb_close(&db);
+    remove_dir(dir);
+    return result;
+}
+
+mb_test_result_t test_mb_tsdb_segments(void)
+{
+    char dir[] = "/tmp/test_mb_tsdb_XXXXXX";
+    mb_tsdb_t reader = {0};
+    mb_tsdb_t db = {0};
+    int result = PASS;
+
+    printf("%-*s", print_cols, "test 3: spread chunks over segments and reopen the store");
+    if ((mkdtemp(dir) == NULL) || (mb_tsdb_open(&db, dir, MB_TSDB_MIN_SEG_SIZE, 0) < 0))
+    {
+        return FAIL;
+    }
+    if (mb_tsdb_open(&reader, dir, 0, MB_TSDB_RDONLY) < 0)
+    {
+        mb_tsdb_close(&db);
+        return FAIL;
+    }
+    if (scan(&reader, 1, 103, START_TIME, START_TIME + 100000000) != 0)
+        result = FAIL;
+    /* registers that change a lot fill the segments quickly */
+    if ((write_samples(&db, 1, 0, 8 * MB_TSDB_CHUNK_LEN) < 0) || (db.num_seg < 2))
+        result = FAIL;
+    mb_tsdb_close(&db);
+    /* the reader picks up the new segments */
+    scan(&reader, 1, 103, START_TIME, START_TIME + 100000000);
+    if (check_samples(3, 0, 8 * MB_TSDB_CHUNK_LEN) != PASS)
+        result = FAIL;
+    /* the writer carries on after the chunks already written */
+    if ((mb_tsdb_open(&db, dir, MB_TSDB_MIN_SEG_SIZE, 0) < 0)
+     || (write_samples(&db, 1, 8 * MB_TSDB_CHUNK_LEN, 100) < 0)
+     || (mb_tsdb_flush(&db) < 0))
+        result = FAIL;
+    scan(&reader, 1, 100, START_TIME, START_TIME + 100000000);
+    if (check_samples(0, 0, 8 * MB_TSDB_CHUNK_LEN + 100) != PASS)
+        result = FAIL;
+    if (mb_tsdb_write_regs(&reader, 1, 0, START_TIME, (uint16_t *)data.val, 1) != -EBADF)
+        result = FAIL;
+    mb_tsdb_close(&reader);
+    mb_tsdb_close(&db);
+    remove_dir(dir);
+    return result;
+}
+
+mb_test_result_t test_mb_tsdb_samples(void)
+{
+    char dir[] = "/tmp/test_mb_tsdb_XXXXXX";
+    mb_tsdb_sample_t sample[6] = {{0}};
+    mb_tsdb_t db = {0};
+    int result = PASS;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 4: group batches of single samples into blocks");
+    if ((mkdtemp(dir) == NULL) || (mb_tsdb_open(&db, dir, 0, 0) < 0))
+    {
+        return FAIL;
+    }
+    for (i = 0; i < 10; i++)
+    {
+        /* addresses 10 to 12 of device 1, address 40 of device 1 and addresses 10 to 11 of device 2 */
+        sample[0] = (mb_tsdb_sample_t){1, 10, sample_time(i), sample_val(0, i)};
+        sample[1] = (mb_tsdb_sample_t){1, 11, sample_time(i), sample_val(1, i)};
+        sample[2] = (mb_tsdb_sample_t){1, 12, sample_time(i), sample_val(2, i)};
+        sample[3] = (mb_tsdb_sample_t){1, 40, sample_time(i), sample_val(3, i)};
+        sample[4] = (mb_tsdb_sample_t){2, 10, sample_time(i), sample_val(4, i)};
+        sample[5] = (mb_tsdb_sample_t){2, 11, sample_time(i), sample_val(3, i)};
+        if (mb_tsdb_write(&db, sample, 6) < 0)
+            result = FAIL;
+    }
+    mb_tsdb_flush(&db);
+    if (db.num_block != 3)
+        result = FAIL;
+    scan(&db, 1, 12, START_TIME, START_TIME + 100000);
+    if (check_samples(2, 0, 10) != PASS)
+        result = FAIL;
+    scan(&db, 1, 40, START_TIME, START_TIME + 100000);
+    if (check_samples(3, 0, 10) != PASS)
+        result = FAIL;
+    scan(&db, 2, 10, START_TIME, START_TIME + 100000);
+    if (check_samples(4, 0, 10) != PASS)
+        result = FAIL;
+    scan(&db, 2, 11, START_TIME, START_TIME + 100000);
+    if (check_samples(3, 0, 10) != PASS)
+        result = FAIL;
+    mb_tsdb_close(&db);
+    remove_dir(dir);
+    return result;
+}
+
+typedef struct
+{
+    mb_tsdb_t *db;
+    atomic_int done;
+    int ret;
+}
+writer_t;
+
+static void *writer_run(void *arg)
+{
+    writer_t *w = (writer_t *)arg;
+
+    w->ret = write_samples(w->db, 1, 0, 16 * MB_TSDB_CHUNK_LEN);
+    atomic_store(&w->done, 1);
+    return NULL;
+}
+
+mb_test_result_t test_mb_tsdb_concurrent(void)
+{
+    char dir[] = "/tmp/test_mb_tsdb_XXXXXX";
+    pthread_t thread = {0};
+    mb_tsdb_t reader = {0};
+    mb_tsdb_t db = {0};
+    writer_t w = {0};
+    long long num = 0;
+    int result = PASS;
+    int ret = 0;
+
+    printf("%-*s", print_cols, "test 5: open and scan the store while the writer adds segments");
+    if ((mkdtemp(dir) == NULL) || (mb_tsdb_open(&db, dir, MB_TSDB_MIN_SEG_SIZE, 0) < 0))
+    {
+        return FAIL;
+    }
+    w.db = &db;
+    atomic_init(&w.done, 0);
+    if (pthread_create(&thread, NULL, writer_run, &w) != 0)
+    {
+        mb_tsdb_close(&db);
+        remove_dir(dir);
+        return FAIL;
+    }
+    /* a reader must never see a segment before its header is written */
+    while (!atomic_load(&w.done))
+    {
+        ret = mb_tsdb_open(&reader, dir, 0, MB_TSDB_RDONLY);
+        if (ret < 0)
+        {
+            result = FAIL;
+            break;
+        }
+        num = scan(&reader, 1, 103, START_TIME, START_TIME + 100000000);
+        mb_tsdb_close(&reader);
+        if (num < 0)
+        {
+            result = FAIL;
+            break;
+        }
+    }
+    pthread_join(thread, NULL);
+    if ((w.ret < 0) || (db.num_seg < 3))
+        result = FAIL;
+    mb_tsdb_close(&db);
+    remove_dir(dir);
+    return result;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_tsdb_write_scan,
+                             test_mb_tsdb_size,
+                             test_mb_tsdb_segments,
+                             test_mb_tsdb_samples,
+                             test_mb_tsdb_concurrent};
+
+    return mb_test_run(func, sizeof(func) / sizeof(func[0]));
+}
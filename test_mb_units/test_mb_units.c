@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2017 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/select.h>
+#include "mb_tcp_server.h"
+#include "mb_tcp_client.h"
+#include "mb_rtu_slave.h"
+#include "mb_rtu_adu.h"
+#include "mb_test.h"
+
+#define HOST_ADDR    "127.0.0.1"
+#define SERVER_PORT  10080
+#define UNIT_A       1
+#define UNIT_B       2
+#define UNIT_C       3                                  /* never added */
+#define NUM_REG      4
+
+int print_cols = 93;
+
+/* holding registers of a unit */
+typedef struct
+{
+    uint16_t reg[NUM_REG];
+}
+unit_data_t;
+
+static unit_data_t data_a = {{0x100, 0x101, 0x102, 0x103}};
+static unit_data_t data_b = {{0x200, 0x201, 0x202, 0x203}};
+static unit_data_t data_def = {{0x900, 0x901, 0x902, 0x903}};
+
+static mb_tcp_server_t server = {0};
+static pthread_t server_thread = {0};
+static mb_rtu_slave_t slave = {0};
+static pthread_t slave_thread = {0};
+static int pty_fd = -1;
+
+static int handle_regs(unit_data_t *d, mb_pdu_t *req, mb_pdu_t *resp)
+{
+    uint16_t start = 0;
+    uint16_t quant = 0;
+
+    switch (req->func_code)
+    {
+    case MB_PDU_RD_HOLD_REGS:
+        start = req->rd_hold_regs_req.start_addr;
+        quant = req->rd_hold_regs_req.quant_regs;
+        if (start + quant > NUM_REG)
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        return mb_pdu_set_rd_hold_regs_resp(resp, quant * 2, &d->reg[start]);
+    case MB_PDU_WR_SING_REG:
+        start = req->wr_sing_reg_req.reg_addr;
+        if (start >= NUM_REG)
+            return -MB_PDU_EXCEPT_ILLEGAL_ADDR;
+        d->reg[start] = req->wr_sing_reg_req.reg_val;
+        mb_pdu_set_wr_sing_reg_resp(resp, start, d->reg[start]);
+        return 0;
+    default:
+        return -MB_PDU_EXCEPT_ILLEGAL_FUNC;
+    }
+}
+
+static int tcp_handle_unit(mb_tcp_server_t *s, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    return handle_regs((unit_data_t *)mb_tcp_server_get_data(s), &req->pdu, &resp->pdu);
+}
+
+static int tcp_handle_default(mb_tcp_server_t *s, mb_tcp_adu_t *req, mb_tcp_adu_t *resp)
+{
+    mb_tcp_adu_set_header(resp, req->trans_id, req->proto_id, req->unit_id);
+    return handle_regs(&data_def, &req->pdu, &resp->pdu);
+}
+
+static int rtu_handle_unit(mb_rtu_slave_t *s, mb_rtu_adu_t *req, mb_rtu_adu_t *resp)
+{
+    mb_rtu_adu_set_header(resp, req->addr);
+    return handle_regs((unit_data_t *)mb_rtu_slave_get_data(s), &req->pdu, &resp->pdu);
+}
+
+static void *server_run(void *arg)
+{
+    mb_tcp_server_run((mb_tcp_server_t *)arg);
+    return NULL;
+}
+
+static void *slave_run(void *arg)
+{
+    mb_rtu_slave_run((mb_rtu_slave_t *)arg);
+    return NULL;
+}
+
+static int setup(void)
+{
+    struct termios options = {0};
+    int ret = 0;
+
+    ret = mb_tcp_server_create(&server, HOST_ADDR, SERVER_PORT, NULL);
+    if (ret < 0)
+        return -1;
+    mb_tcp_server_authorise_addr(&server, HOST_ADDR);
+    pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((pty_fd < 0) || (grantpt(pty_fd) < 0) || (unlockpt(pty_fd) < 0))
+        return -1;
+    tcgetattr(pty_fd, &options);
+    cfmakeraw(&options);
+    tcsetattr(pty_fd, TCSANOW, &options);
+    ret = mb_rtu_slave_create(&slave, ptsname(pty_fd), UNIT_A, rtu_handle_unit);
+    if (ret < 0)
+        return -1;
+    slave.unit[UNIT_A].data = &data_a;
+    pthread_create(&server_thread, NULL, server_run, &server);
+    pthread_create(&slave_thread, NULL, slave_run, &slave);
+    usleep(100000);
+    return 0;
+}
+
+static void teardown(void)
+{
+    pthread_cancel(slave_thread);
+    pthread_join(slave_thread, NULL);
+    pthread_cancel(server_thread);
+    pthread_join(server_thread, NULL);
+    mb_rtu_slave_destroy(&slave);
+    mb_tcp_server_destroy(&server);
+    close(pty_fd);
+}
+
+/* read one holding register of a unit through the TCP server */
+static int tcp_rd(uint8_t unit_id, uint16_t addr, mb_tcp_adu_t *resp)
+{
+    struct timeval timeout = {1, 0};
+    mb_tcp_client_t client = {0};
+    mb_tcp_adu_t req = {0};
+    int ret = 0;
+
+    memset(resp, 0, sizeof(mb_tcp_adu_t));
+    ret = mb_tcp_client_create(&client, timeout);
+    if (ret < 0)
+        return ret;
+    mb_tcp_client_authorise_addr(&client, HOST_ADDR);
+    mb_tcp_adu_set_header(&req, 1, 0, unit_id);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, addr, 1);
+    ret = mb_tcp_client_exchange(&client, HOST_ADDR, SERVER_PORT, &req, resp);
+    mb_tcp_client_destroy(&client);
+    return ret;
+}
+
+/* send a request to the RTU slave and wait up to 200 ms for the response */
+static ssize_t rtu_exchange(mb_rtu_adu_t *req, mb_rtu_adu_t *resp)
+{
+    struct timeval tv = {0};
+    fd_set read_fds = {{0}};
+    ssize_t total = 0;
+    ssize_t num = 0;
+    char buf[MB_RTU_ADU_MAX_LEN] = {0};
+    int ret = 0;
+
+    memset(resp, 0, sizeof(mb_rtu_adu_t));
+    num = mb_rtu_adu_format_req(req, buf, sizeof(buf));
+    if ((num < 0) || (write(pty_fd, buf, num) != num))
+        return -EIO;
+    while (1)
+    {
+        FD_ZERO(&read_fds);
+        FD_SET(pty_fd, &read_fds);
+        tv.tv_sec = 0;
+        tv.tv_usec = (total == 0) ? 200000 : 20000;
+        ret = select(pty_fd + 1, &read_fds, NULL, NULL, &tv);
+        if (ret <= 0)
+            break;
+        num = read(pty_fd, buf + total, sizeof(buf) - total);
+        if (num <= 0)
+            break;
+        total += num;
+    }
+    if (total == 0)
+        return -ETIMEDOUT;
+    return mb_rtu_adu_parse_resp(resp, buf, total);
+}
+
+static ssize_t rtu_rd(uint8_t addr, uint16_t reg_addr, mb_rtu_adu_t *resp)
+{
+    mb_rtu_adu_t req = {0};
+
+    mb_rtu_adu_set_header(&req, addr);
+    mb_pdu_set_rd_hold_regs_req(&req.pdu, reg_addr, 1);
+    return rtu_exchange(&req, resp);
+}
+
+/* read a diagnostics counter of a unit */
+static int rtu_counter(uint8_t addr, uint16_t sub_func)
+{
+    mb_rtu_adu_t resp = {0};
+    mb_rtu_adu_t req = {0};
+    uint16_t zero = 0;
+    ssize_t ret = 0;
+
+    mb_rtu_adu_set_header(&req, addr);
+    mb_pdu_set_diag_req(&req.pdu, sub_func, &zero, 1);
+    ret = rtu_exchange(&req, &resp);
+    if ((ret < 0) || (resp.pdu.func_code != MB_PDU_DIAG))
+        return -1;
+    return resp.pdu.diag_resp.data[0];
+}
+
+mb_test_result_t test_mb_units_tcp_route(void)
+{
+    mb_tcp_adu_t resp[3] = {{0}};
+    int ret[3] = {0};
+
+    printf("%-*s", print_cols, "test 1: route TCP requests to the handler of their unit id");
+    mb_tcp_server_add_unit(&server, UNIT_A, tcp_handle_unit, &data_a);
+    mb_tcp_server_add_unit(&server, UNIT_B, tcp_handle_unit, &data_b);
+    ret[0] = tcp_rd(UNIT_A, 1, &resp[0]);
+    ret[1] = tcp_rd(UNIT_B, 2, &resp[1]);
+    /* no default handler */
+    ret[2] = tcp_rd(UNIT_C, 0, &resp[2]);
+    if ((ret[0] < 0) || (ret[1] < 0) || (ret[2] < 0)
+     || (resp[0].unit_id != UNIT_A)
+     || (resp[0].pdu.func_code != MB_PDU_RD_HOLD_REGS)
+     || (resp[0].pdu.rd_hold_regs_resp.reg_val[0] != 0x101)
+     || (resp[1].unit_id != UNIT_B)
+     || (resp[1].pdu.func_code != MB_PDU_RD_HOLD_REGS)
+     || (resp[1].pdu.rd_hold_regs_resp.reg_val[0] != 0x202)
+     || (resp[2].unit_id != UNIT_C)
+     || (resp[2].pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80)
+     || (resp[2].pdu.err.except_code != MB_PDU_EXCEPT_GATEWAY_PATH_UNAVAIL))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_units_tcp_default(void)
+{
+    mb_tcp_adu_t resp[3] = {{0}};
+    int ret[3] = {0};
+
+    printf("%-*s", print_cols, "test 2: pass TCP requests for other unit ids to the default handler");
+    server.handler = tcp_handle_default;
+    ret[0] = tcp_rd(UNIT_C, 3, &resp[0]);
+    mb_tcp_server_remove_unit(&server, UNIT_B);
+    ret[1] = tcp_rd(UNIT_B, 0, &resp[1]);
+    ret[2] = tcp_rd(UNIT_A, 0, &resp[2]);
+    server.handler = NULL;
+    if ((ret[0] < 0) || (ret[1] < 0) || (ret[2] < 0)
+     || (resp[0].unit_id != UNIT_C)
+     || (resp[0].pdu.rd_hold_regs_resp.reg_val[0] != 0x903)
+     || (resp[1].unit_id != UNIT_B)
+     || (resp[1].pdu.rd_hold_regs_resp.reg_val[0] != 0x900)
+     || (resp[2].pdu.rd_hold_regs_resp.reg_val[0] != 0x100))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_units_tcp_count(void)
+{
+    mb_tcp_adu_t resp = {0};
+    int ret = 0;
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 3: count TCP requests and exceptions per unit id");
+    mb_tcp_server_add_unit(&server, UNIT_B, tcp_handle_unit, &data_b);
+    for (i = 0; i < 3; i++)
+    {
+        ret = tcp_rd(UNIT_A, 0, &resp);
+        if (ret < 0)
+            return FAIL;
+    }
+    ret = tcp_rd(UNIT_B, NUM_REG, &resp);
+    if ((ret < 0) || (resp.pdu.func_code != MB_PDU_RD_HOLD_REGS + 0x80))
+        return FAIL;
+    ret = tcp_rd(UNIT_B, 0, &resp);
+    if (ret < 0)
+        return FAIL;
+    /* unit A has seen the reads of tests 1, 2 and 3 */
+    if ((server.unit[UNIT_A].msg_count != 5)
+     || (server.unit[UNIT_A].excep_err_count != 0)
+     || (server.unit[UNIT_B].msg_count != 2)
+     || (server.unit[UNIT_B].excep_err_count != 1))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_units_rtu_route(void)
+{
+    mb_rtu_adu_t resp[2] = {{0}};
+    ssize_t ret[3] = {0};
+
+    printf("%-*s", print_cols, "test 4: route RTU requests to the unit with their address");
+    if ((mb_rtu_slave_add_unit(&slave, UNIT_B, rtu_handle_unit, &data_b) < 0)
+     || (mb_rtu_slave_add_unit(&slave, 0, rtu_handle_unit, &data_b) != -EINVAL)
+     || (mb_rtu_slave_add_unit(&slave, UNIT_C, NULL, NULL) != -EINVAL))
+    {
+        return FAIL;
+    }
+    ret[0] = rtu_rd(UNIT_A, 2, &resp[0]);
+    ret[1] = rtu_rd(UNIT_B, 3, &resp[1]);
+    /* an address with no unit is not answered */
+    ret[2] = rtu_rd(UNIT_C, 0, &resp[1]);
+    if ((ret[0] < 0) || (ret[1] < 0) || (ret[2] != -ETIMEDOUT)
+     || (resp[0].addr != UNIT_A)
+     || (resp[0].pdu.rd_hold_regs_resp.reg_val[0] != 0x102))
+    {
+        return FAIL;
+    }
+    ret[1] = rtu_rd(UNIT_B, 3, &resp[1]);
+    if ((ret[1] < 0)
+     || (resp[1].addr != UNIT_B)
+     || (resp[1].pdu.rd_hold_regs_resp.reg_val[0] != 0x203))
+    {
+        return FAIL;
+    }
+    mb_rtu_slave_remove_unit(&slave, UNIT_B);
+    ret[1] = rtu_rd(UNIT_B, 3, &resp[1]);
+    if (ret[1] != -ETIMEDOUT)
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_units_rtu_broadcast(void)
+{
+    mb_rtu_adu_t resp = {0};
+    mb_rtu_adu_t req = {0};
+    ssize_t ret = 0;
+
+    printf("%-*s", print_cols, "test 5: pass RTU broadcasts to every unit without a response");
+    mb_rtu_slave_add_unit(&slave, UNIT_B, rtu_handle_unit, &data_b);
+    mb_rtu_adu_set_header(&req, MB_RTU_ADU_BROADCAST_ADDR);
+    mb_pdu_set_wr_sing_reg_req(&req.pdu, 0, 0x5555);
+    ret = rtu_exchange(&req, &resp);
+    if ((ret != -ETIMEDOUT)
+     || (data_a.reg[0] != 0x5555)
+     || (data_b.reg[0] != 0x5555)
+     || (data_def.reg[0] != 0x900))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+mb_test_result_t test_mb_units_rtu_count(void)
+{
+    mb_rtu_adu_t resp = {0};
+    int count[4] = {0};
+    int i = 0;
+
+    printf("%-*s", print_cols, "test 6: keep the RTU slave counters per unit");
+    rtu_counter(UNIT_A, MB_PDU_CLEAR_COUNTERS);
+    rtu_counter(UNIT_B, MB_PDU_CLEAR_COUNTERS);
+    for (i = 0; i < 3; i++)
+        rtu_rd(UNIT_A, 0, &resp);
+    rtu_rd(UNIT_B, NUM_REG, &resp);
+    /* each diagnostics request counts as a message to its own unit */
+    count[0] = rtu_counter(UNIT_A, MB_PDU_SLAVE_MSG_COUNT);
+    count[1] = rtu_counter(UNIT_B, MB_PDU_SLAVE_MSG_COUNT);
+    count[2] = rtu_counter(UNIT_A, MB_PDU_SLAVE_EXCEP_ERR_COUNT);
+    count[3] = rtu_counter(UNIT_B, MB_PDU_SLAVE_EXCEP_ERR_COUNT);
+    if ((count[0] != 4) || (count[1] != 2) || (count[2] != 0) || (count[3] != 1))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+int main(void)
+{
+    mb_test_func_t func[] = {test_mb_units_tcp_route,
+                             test_mb_units_tcp_default,
+                             test_mb_units_tcp_count,
+                             test_mb_units_rtu_route,
+                             test_mb_units_rtu_broadcast,
+                             test_mb_units_rtu_count};
+    int ret = 0;
+
+    if (setup() < 0)
+    {
+        printf("failed to set up the units\n");
+        return EXIT_FAILURE;
+    }
+    ret = mb_test_run(func, sizeof(func) / sizeof(func[0]));
+    teardown();
+    return ret;
+}